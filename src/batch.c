@@ -0,0 +1,599 @@
+/**
+ * @file batch.c
+ * @brief Batch execution for the shell lab: scripts, `-c` and piped input.
+ *
+ * When the shell is not talking to a person there is no point paying for
+ * readline. Lines are read with getline into a single buffer that is reused
+ * for every line, through a large stdio buffer so that a script costs a
+ * handful of read calls instead of one per line. No prompt is printed, no
+ * history is kept and the terminal is never touched.
+ *
+ * Script files go one step further: the file is mapped with a private
+ * writable mapping and every line is trimmed and tokenized right in the
+ * mapped bytes. The kernel copies a page the first time a terminator is
+ * written to it, and that is all the copying there is.
+ *
+ * While a line's job runs the shell has nothing to do but wait, so a mapped
+ * script is also read ahead. A reader thread, pinned to another CPU than
+ * the shell is on, trims and tokenizes the lines that follow and resolves
+ * their commands against PATH with a cache of its own. It hands them over
+ * in a ring of AHEAD_SLOTS slots, each with a parse context, that it fills
+ * and the shell empties. The two sides only share the ring's counters,
+ * which are atomics, and sleep on them with a futex when the ring is empty
+ * or full. The shell swaps its parse context with the slot's, seeds its
+ * PATH cache with what the reader found and runs the line as if it had
+ * parsed it itself.
+ *
+ * The reader can only run ahead of lines that leave the shell as it was. A
+ * line with a builtin or a NAME=value word may change the directory, PATH,
+ * the builtins turned on or the PATH cache, so it is a fence: the reader
+ * stops behind it until the shell has run it, then takes the new PATH and
+ * goes on. Builtins and the line cache are only ever used by one thread at
+ * a time this way. The reader can still be early for a program that
+ * installs a command a later line runs, but it only passes on the commands
+ * it found: one it did not find is looked up by the shell like any miss.
+ *
+ * With a single CPU the two threads would only take turns, so by default
+ * the reader is only started when the shell may run on two; -A on starts
+ * it anyway and -A off never does.
+ *
+ * References:
+ * https://man7.org/linux/man-pages/man2/mmap.2.html
+ * https://man7.org/linux/man-pages/man3/getline.3.html
+ * https://man7.org/linux/man-pages/man3/setvbuf.3.html
+ * https://man7.org/linux/man-pages/man2/futex.2.html
+ * https://man7.org/linux/man-pages/man3/pthread_setaffinity_np.3.html
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "lab.h"
+
+#define BATCH_BUFFER_SIZE (256 * 1024) // stdio buffer for script input
+#define AHEAD_SLOTS 64 // lines read ahead at most, a power of two
+
+/**
+ * @brief What a slot of the read-ahead ring holds.
+ */
+enum ahead_kind {
+    AHEAD_LINE,  // a line the reader went past
+    AHEAD_FENCE, // a line the reader waits behind, see batch.c
+    AHEAD_END    // the end of the script
+};
+
+/**
+ * @brief A command the reader resolved, to seed the shell's PATH cache.
+ */
+struct ahead_command {
+    size_t token;     // the command name's index in the slot's tokens
+    const char *path; // owned by the reader's PATH cache
+};
+
+/**
+ * @brief One line read ahead, owned by the reader until it is published and
+ * by the shell until it is given back.
+ */
+struct ahead_slot {
+    enum ahead_kind kind;
+    bool parsed;            // false after a syntax error, kept in parse.error
+    struct parse_ctx parse; // the tokens, swapped with the shell's
+    uint64_t trim_ns;
+    uint64_t parse_ns;
+    struct ahead_command *commands;
+    size_t ncommands;
+    size_t commands_cap;
+};
+
+/**
+ * @brief The read-ahead of one mapped script. The counters are the only
+ * state both threads write while the reader runs.
+ */
+struct read_ahead {
+    struct shell *sh;        // only its line cache is used by the reader, and never at the same time
+    char *cursor;            // the next line of the script, the reader's
+    char *end;
+    size_t size;
+    char *copy;              // the last line if it had to be copied
+    struct path_cache paths; // the reader's, resolved against path_value
+    struct ahead_slot slots[AHEAD_SLOTS];
+    _Atomic unsigned head;   // slots the reader published
+    _Atomic unsigned tail;   // slots the shell gave back
+    _Atomic unsigned fences; // fences the shell has run
+    _Atomic bool shell_waiting;  // the shell sleeps on head
+    _Atomic bool reader_waiting; // the reader sleeps on tail or fences
+    // Written by the shell before it lets the reader past a fence.
+    char *path_value;        // PATH, NULL if it could not be copied
+    size_t path_value_cap;
+    unsigned long path_generation; // of the shell's PATH cache, moved by hash -r
+    uint64_t cwd_generation;       // relative PATH entries depend on it
+};
+
+/**
+ * @brief Run every line read from a stream.
+ *
+ * @param sh The shell
+ * @param in The stream to read
+ * @return The exit status of the last command
+ */
+int sh_run_stream(struct shell *sh, FILE *in) {
+    setvbuf(in, NULL, _IOFBF, BATCH_BUFFER_SIZE);
+    char *input = NULL;  // line buffer reused by getline for every line
+    size_t capacity = 0;
+    while (getline(&input, &capacity, in) != -1) {
+        uint64_t start = sh_now_ns();
+        char *line = trim_white(input);
+        sh_stat_record(sh, STAT_TRIM, sh_now_ns() - start);
+        // Skip blank lines and comments, a '#!' line included.
+        if (!*line || *line == '#') {
+            continue;
+        }
+        sh_run_line(sh, line);
+    }
+    free(input);
+    return sh->last_status;
+}
+
+/**
+ * @brief Helper function to run one line of a mapped script. The line is
+ * trimmed, then taken from the line cache or tokenized in place.
+ *
+ * @param sh The shell
+ * @param line The line, null terminated inside the mapping
+ */
+static void run_mapped_line(struct shell *sh, char *line) {
+    uint64_t start = sh_now_ns();
+    line = trim_white(line);
+    sh_stat_record(sh, STAT_TRIM, sh_now_ns() - start);
+    // Skip blank lines and comments, a '#!' line included.
+    if (!*line || *line == '#') {
+        return;
+    }
+    start = sh_now_ns();
+    bool cached = line_cache_lookup(&sh->line_cache, &sh->parse, line, true);
+    if (cached || cmd_parse_inplace(&sh->parse, line)) {
+        if (!cached) {
+            line_cache_insert(&sh->line_cache, &sh->parse);
+        }
+        sh->timing.parse_ns = sh_now_ns() - start;
+        sh_stat_record(sh, STAT_PARSE, sh->timing.parse_ns);
+        sh_run_parsed(sh);
+    } else {
+        sh->last_status = sh->parse.error ? 2 : EXIT_FAILURE;
+    }
+}
+
+/**
+ * @brief Helper function to cut the next line out of a script that has
+ * been mapped into memory. Its newline is replaced with a null terminator
+ * so the line can be used as a string where it is. The byte after the end
+ * of the file is inside the last mapped page and reads as zero, unless the
+ * file ends exactly on a page boundary. Only in that case is the
+ * unterminated last line copied.
+ *
+ * @param cursor The start of the line, moved to the next one
+ * @param end The end of the script
+ * @param size Size of the script in bytes
+ * @param copy Set to the copy of the last line if one was made, for the
+ * caller to free
+ * @return The line, or NULL at the end of the script
+ */
+static char *next_line(char **cursor, char *end, size_t size, char **copy) {
+    char *line = *cursor;
+    if (line >= end) {
+        return NULL;
+    }
+    char *newline = memchr(line, '\n', (size_t)(end - line));
+    if (newline) {
+        *newline = '\0';
+        *cursor = newline + 1;
+        return line;
+    }
+    // Last line without a newline.
+    *cursor = end;
+    if (size % (size_t)sysconf(_SC_PAGESIZE) != 0) {
+        return line; // already followed by a zero byte
+    }
+    return *copy = strndup(line, (size_t)(end - line));
+}
+
+/**
+ * @brief Helper function to run a script that has been mapped into memory
+ * one line after the other.
+ *
+ * @param sh The shell
+ * @param map The private writable mapping of the script
+ * @param size Size of the script in bytes
+ */
+static void run_mapped(struct shell *sh, char *map, size_t size) {
+    char *cursor = map;
+    char *copy = NULL;
+    char *line;
+    while ((line = next_line(&cursor, map + size, size, &copy))) {
+        run_mapped_line(sh, line);
+    }
+    free(copy);
+}
+
+/**
+ * @brief Helper function to sleep until another thread moves a counter of
+ * the ring on from the value seen.
+ *
+ * @param counter The counter
+ * @param seen The value seen
+ * @param waiting The flag of the thread that waits, checked by the other
+ * one after it moves a counter
+ * @return The new value
+ */
+static unsigned wait_counter(_Atomic unsigned *counter, unsigned seen, _Atomic bool *waiting) {
+    unsigned now = atomic_load_explicit(counter, memory_order_acquire);
+    while (now == seen) {
+        // Raise the flag before looking again: either the other thread sees
+        // it and wakes us, or we see the new value. The kernel compares the
+        // counter with seen once more before it puts us to sleep.
+        atomic_store(waiting, true);
+        if (atomic_load(counter) == seen) {
+            syscall(SYS_futex, (void *)counter, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+        }
+        atomic_store_explicit(waiting, false, memory_order_relaxed);
+        now = atomic_load_explicit(counter, memory_order_acquire);
+    }
+    return now;
+}
+
+/**
+ * @brief Helper function to move a counter of the ring on, waking the
+ * other thread if it waits.
+ *
+ * @param counter The counter
+ * @param value Its new value
+ * @param waiting The flag of the other thread
+ */
+static void move_counter(_Atomic unsigned *counter, unsigned value, _Atomic bool *waiting) {
+    atomic_store(counter, value);
+    if (atomic_load(waiting)) {
+        syscall(SYS_futex, (void *)counter, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/**
+ * @brief Helper function to tell whether a token is a redirection operator
+ * or the descriptor in front of one.
+ *
+ * @param kind The kind of the token
+ * @return True for the tokens of a redirection but its target
+ */
+static bool is_redirection(enum token_kind kind) {
+    return kind == TOK_IO_NUMBER || kind == TOK_LESS || kind == TOK_GREAT || kind == TOK_APPEND ||
+           kind == TOK_LESS_AND || kind == TOK_GREAT_AND;
+}
+
+/**
+ * @brief Helper function to find the command of every stage of a line read
+ * ahead, the first word past the redirections and a leading "time" the way
+ * sh_run_parsed takes them, and resolve it against PATH.
+ *
+ * @param ahead The read-ahead
+ * @param slot The slot holding the line
+ * @return True if the line is a fence, a command is a builtin or some
+ * stage has a NAME=value word
+ */
+static bool resolve_commands(struct read_ahead *ahead, struct ahead_slot *slot) {
+    const struct parse_ctx *ctx = &slot->parse;
+    bool list_start = true; // the first stage of a command of the list
+    for (size_t i = 0; i < ctx->count; i++) {
+        if (list_start && strcmp(ctx->argv[i], "time") == 0) {
+            i++;
+        }
+        while (i < ctx->count && is_redirection(ctx->kinds[i])) {
+            i += ctx->kinds[i] == TOK_IO_NUMBER ? 1 : 2; // the operator takes its target along
+        }
+        if (i < ctx->count && ctx->kinds[i] == TOK_WORD) {
+            const char *name = ctx->argv[i];
+            if (env_assignments(ctx->argv + i) > 0 || builtin_find(name)) {
+                return true;
+            }
+            const char *path = ahead->path_value && !strchr(name, '/') ? path_cache_lookup(&ahead->paths, name) : NULL;
+            if (path && grow_buffer((void **)&slot->commands, &slot->commands_cap, slot->ncommands + 1,
+                                    sizeof(*slot->commands)) == 0) {
+                slot->commands[slot->ncommands++] = (struct ahead_command){i, path};
+            }
+        }
+        while (i < ctx->count && ctx->kinds[i] != TOK_PIPE && ctx->kinds[i] != TOK_SEMI && ctx->kinds[i] != TOK_BACKGROUND) {
+            i++;
+        }
+        list_start = i < ctx->count && ctx->kinds[i] != TOK_PIPE;
+    }
+    return false;
+}
+
+/**
+ * @brief Helper function to fill a slot with the next line of the script
+ * that is not blank or a comment, trimmed and tokenized the way
+ * run_mapped_line does it, on the reader's thread.
+ *
+ * @param ahead The read-ahead
+ * @param slot The slot, owned by the reader
+ */
+static void read_line_ahead(struct read_ahead *ahead, struct ahead_slot *slot) {
+    char *line;
+    while ((line = next_line(&ahead->cursor, ahead->end, ahead->size, &ahead->copy))) {
+        uint64_t start = sh_now_ns();
+        line = trim_white(line);
+        slot->trim_ns = sh_now_ns() - start;
+        // Skip blank lines and comments, a '#!' line included.
+        if (!*line || *line == '#') {
+            continue;
+        }
+        start = sh_now_ns();
+        slot->parse.defer_errors = true; // printed by the shell when the line's turn comes
+        slot->parse.error = NULL;
+        bool cached = line_cache_lookup(&ahead->sh->line_cache, &slot->parse, line, true);
+        slot->parsed = cached || cmd_parse_inplace(&slot->parse, line);
+        if (slot->parsed && !cached) {
+            line_cache_insert(&ahead->sh->line_cache, &slot->parse);
+        }
+        slot->parse_ns = sh_now_ns() - start;
+        slot->ncommands = 0;
+        slot->kind = slot->parsed && resolve_commands(ahead, slot) ? AHEAD_FENCE : AHEAD_LINE;
+        return;
+    }
+    slot->kind = AHEAD_END;
+}
+
+/**
+ * @brief Helper function for the reader thread: fill the ring until the
+ * end of the script, stopping behind every fence until the shell has run
+ * it.
+ *
+ * @param arg The read-ahead
+ * @return NULL
+ */
+static void *reader_main(void *arg) {
+    struct read_ahead *ahead = arg;
+    unsigned head = 0;
+    unsigned fences = 0;
+    unsigned long path_generation = ahead->path_generation;
+    uint64_t cwd_generation = ahead->cwd_generation;
+    if (ahead->path_value) {
+        path_cache_set_path(&ahead->paths, ahead->path_value);
+    }
+    for (;;) {
+        unsigned tail = atomic_load_explicit(&ahead->tail, memory_order_acquire);
+        while (head - tail == AHEAD_SLOTS) { // full
+            tail = wait_counter(&ahead->tail, tail, &ahead->reader_waiting);
+        }
+        struct ahead_slot *slot = &ahead->slots[head % AHEAD_SLOTS];
+        read_line_ahead(ahead, slot);
+        enum ahead_kind kind = slot->kind; // the slot is the shell's once published
+        move_counter(&ahead->head, ++head, &ahead->shell_waiting);
+        if (kind == AHEAD_END) {
+            return NULL;
+        }
+        if (kind == AHEAD_FENCE) {
+            unsigned done = atomic_load_explicit(&ahead->fences, memory_order_acquire);
+            while (done != fences + 1) {
+                done = wait_counter(&ahead->fences, done, &ahead->reader_waiting);
+            }
+            fences = done;
+            // The fence may have moved to another directory or told the shell to forget its commands.
+            if (ahead->path_generation != path_generation || ahead->cwd_generation != cwd_generation) {
+                path_cache_clear(&ahead->paths);
+                path_generation = ahead->path_generation;
+                cwd_generation = ahead->cwd_generation;
+            }
+            if (ahead->path_value) {
+                path_cache_set_path(&ahead->paths, ahead->path_value);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Helper function to give the reader the shell's PATH, before it
+ * starts and after every fence.
+ *
+ * @param sh The shell
+ * @param ahead The read-ahead
+ */
+static void hand_over_path(struct shell *sh, struct read_ahead *ahead) {
+    const char *path = env_get(sh_env(sh), "PATH");
+    if (!path) {
+        path = "";
+    }
+    size_t size = strlen(path) + 1;
+    if (grow_buffer((void **)&ahead->path_value, &ahead->path_value_cap, size, sizeof(char)) == 0) {
+        memcpy(ahead->path_value, path, size);
+    } else {
+        free(ahead->path_value); // better no commands resolved than some against an old PATH
+        ahead->path_value = NULL;
+        ahead->path_value_cap = 0;
+    }
+    ahead->path_generation = sh->path_cache.generation;
+    ahead->cwd_generation = sh->cwd_generation;
+}
+
+/**
+ * @brief Helper function to run the lines of the ring as the reader
+ * publishes them, until the end of the script.
+ *
+ * @param sh The shell
+ * @param ahead The read-ahead, with the reader running
+ */
+static void run_ahead(struct shell *sh, struct read_ahead *ahead) {
+    unsigned tail = 0;
+    unsigned fences = 0;
+    for (;;) {
+        unsigned head = atomic_load_explicit(&ahead->head, memory_order_acquire);
+        if (head == tail) { // empty
+            wait_counter(&ahead->head, tail, &ahead->shell_waiting);
+        }
+        struct ahead_slot *slot = &ahead->slots[tail % AHEAD_SLOTS];
+        enum ahead_kind kind = slot->kind;
+        if (kind == AHEAD_END) {
+            return;
+        }
+        bool parsed = slot->parsed;
+        const char *error = slot->parse.error;
+        sh_stat_record(sh, STAT_TRIM, slot->trim_ns);
+        if (parsed) {
+            // Take the tokens and leave the slot the buffers of the last line.
+            struct parse_ctx used = sh->parse;
+            sh->parse = slot->parse;
+            slot->parse = used;
+            sh->parse.defer_errors = false;
+            sh->path_cache.env = sh_env(sh);
+            for (size_t i = 0; i < slot->ncommands; i++) {
+                path_cache_seed(&sh->path_cache, sh->parse.argv[slot->commands[i].token], slot->commands[i].path);
+            }
+            sh->timing.parse_ns = slot->parse_ns;
+            sh_stat_record(sh, STAT_PARSE, slot->parse_ns);
+        }
+        move_counter(&ahead->tail, ++tail, &ahead->reader_waiting); // the reader may fill it again
+        if (parsed) {
+            sh_run_parsed(sh);
+        } else {
+            if (error) {
+                fprintf(stderr, "%s\n", error);
+            }
+            sh->last_status = error ? 2 : EXIT_FAILURE;
+        }
+        if (kind == AHEAD_FENCE) {
+            hand_over_path(sh, ahead);
+            move_counter(&ahead->fences, ++fences, &ahead->reader_waiting);
+        }
+    }
+}
+
+/**
+ * @brief Helper function to pick the CPU for the reader: one the shell may
+ * run on but is not on now. Only the reader is pinned, the shell and the
+ * children it starts keep the affinity they had.
+ *
+ * @param sh The shell
+ * @param cpu Filled with the reader's CPU
+ * @return True if the script should be read ahead, which with
+ * READ_AHEAD_AUTO takes a second CPU
+ */
+static bool reader_cpu(struct shell *sh, cpu_set_t *cpu) {
+    cpu_set_t allowed;
+    CPU_ZERO(cpu);
+    if (sh->read_ahead == READ_AHEAD_OFF || sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return false;
+    }
+    int current = sched_getcpu();
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &allowed) && i != current) {
+            CPU_SET(i, cpu);
+            return true;
+        }
+    }
+    return sh->read_ahead == READ_AHEAD_ON; // a single CPU, left unpinned
+}
+
+/**
+ * @brief Helper function to run a mapped script with a reader thread
+ * parsing ahead of the shell.
+ *
+ * @param sh The shell
+ * @param map The private writable mapping of the script
+ * @param size Size of the script in bytes
+ * @return True once the script has run, false if it should be run without
+ * reading ahead
+ */
+static bool run_mapped_ahead(struct shell *sh, char *map, size_t size) {
+    cpu_set_t cpu;
+    if (!reader_cpu(sh, &cpu)) {
+        return false;
+    }
+    struct read_ahead *ahead = calloc(1, sizeof(*ahead));
+    if (!ahead) {
+        return false;
+    }
+    ahead->sh = sh;
+    ahead->cursor = map;
+    ahead->end = map + size;
+    ahead->size = size;
+    path_cache_init(&ahead->paths);
+    for (size_t i = 0; i < AHEAD_SLOTS; i++) {
+        parse_ctx_init(&ahead->slots[i].parse);
+    }
+    hand_over_path(sh, ahead);
+    pthread_attr_t attr;
+    pthread_t reader;
+    pthread_attr_init(&attr);
+    if (CPU_COUNT(&cpu) > 0) {
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+    }
+    int started = pthread_create(&reader, &attr, reader_main, ahead);
+    pthread_attr_destroy(&attr);
+    if (started == 0) {
+        run_ahead(sh, ahead);
+        pthread_join(reader, NULL);
+    }
+    for (size_t i = 0; i < AHEAD_SLOTS; i++) {
+        parse_ctx_destroy(&ahead->slots[i].parse);
+        free(ahead->slots[i].commands);
+    }
+    path_cache_destroy(&ahead->paths);
+    free(ahead->path_value);
+    free(ahead->copy);
+    free(ahead);
+    return started == 0;
+}
+
+/**
+ * @brief Run a script file in batch mode. A regular file is mapped and run
+ * in place, anything else such as a FIFO is read with sh_run_stream.
+ *
+ * @param sh The shell
+ * @param path The script to run
+ * @return The exit status of the last command, or 127 if the script could
+ * not be opened
+ */
+int sh_run_file(struct shell *sh, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return sh->last_status = 127;
+    }
+    if (S_ISREG(info.st_mode)) {
+        if (info.st_size == 0) { // nothing to map or run
+            close(fd);
+            return sh->last_status;
+        }
+        char *map = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd); // the mapping keeps the file alive
+        if (map == MAP_FAILED) {
+            perror(path);
+            return sh->last_status = 127;
+        }
+        madvise(map, (size_t)info.st_size, MADV_SEQUENTIAL);
+        if (!run_mapped_ahead(sh, map, (size_t)info.st_size)) {
+            run_mapped(sh, map, (size_t)info.st_size);
+        }
+        munmap(map, (size_t)info.st_size);
+        return sh->last_status;
+    }
+    FILE *in = fdopen(fd, "r");
+    if (!in) {
+        perror(path);
+        close(fd);
+        return sh->last_status = 127;
+    }
+    int status = sh_run_stream(sh, in);
+    fclose(in);
+    return status;
+}
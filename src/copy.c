@@ -0,0 +1,319 @@
+/**
+ * @file copy.c
+ * @brief The cat and cp builtins of the shell lab.
+ *
+ * Scripts that only move data around would otherwise pay a fork and exec
+ * of coreutils for every cat or cp. These builtins run in the shell and
+ * let the kernel move the bytes: copy_file_range between files, which can
+ * share extents or copy on the server, sendfile from a file to anything,
+ * and splice when one end is a pipe. A read and write loop through one
+ * buffer is only used when none of those apply, such as for a terminal.
+ *
+ * They are not on by default since they don't take the options of the real
+ * programs, `enable cat cp` turns them on. The shell ignores SIGINT, so an
+ * interactive shell runs them in a child like the programs they replace,
+ * where Ctrl-C stops a `cat /dev/zero` or a cat reading the terminal; a
+ * script runs them in the shell.
+ *
+ * References:
+ * https://man7.org/linux/man-pages/man2/copy_file_range.2.html
+ * https://man7.org/linux/man-pages/man2/sendfile.2.html
+ * https://man7.org/linux/man-pages/man2/splice.2.html
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "lab.h"
+
+#define COPY_CHUNK (8 << 20)          // bytes asked for in one system call, a signal is seen between two
+#define COPY_BUFFER_SIZE (128 * 1024) // buffer of the read and write loop
+
+/**
+ * @brief Helper function to tell whether a failed zero-copy call means the
+ * method does not apply to these descriptors, rather than a real error.
+ *
+ * @param err The errno of the call
+ * @return True if the next method should be tried
+ */
+static bool unsupported(int err) {
+    return err == EINVAL || err == EXDEV || err == ENOSYS || err == EOPNOTSUPP || err == EBADF ||
+           err == ESPIPE;
+}
+
+/**
+ * @brief Helper function to copy with one of the zero-copy calls until the
+ * input ends.
+ *
+ * @param method 0 for copy_file_range, 1 for sendfile, 2 for splice
+ * @param in The input
+ * @param out The output
+ * @param copied Set to the bytes copied
+ * @return 0 at the end of the input, -1 with errno set on failure
+ */
+static int copy_with(int method, int in, int out, off_t *copied) {
+    *copied = 0;
+    for (;;) {
+        ssize_t n;
+        if (method == 0) {
+            n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+        } else if (method == 1) {
+            n = sendfile(out, in, NULL, COPY_CHUNK);
+        } else {
+            n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE);
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        *copied += n;
+    }
+}
+
+/**
+ * @brief Helper function to copy through a buffer, the last resort.
+ *
+ * @param in The input
+ * @param out The output
+ * @return 0 at the end of the input, -1 with errno set on failure
+ */
+static int copy_buffered(int in, int out) {
+    static char buffer[COPY_BUFFER_SIZE];
+    for (;;) {
+        ssize_t n = read(in, buffer, sizeof(buffer));
+        if (n == 0) {
+            return 0;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (ssize_t done = 0; done < n;) {
+            ssize_t written = write(out, buffer + done, (size_t)(n - done));
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            done += written;
+        }
+    }
+}
+
+/**
+ * @brief Copy everything left in one descriptor to another with the
+ * cheapest call the two support. copy_file_range needs two regular files,
+ * sendfile a regular input and splice a pipe at either end. A call that
+ * turns out not to apply is only abandoned if it copied nothing.
+ *
+ * @param in The input
+ * @param out The output
+ * @return 0 on success, -1 with errno set on failure
+ */
+int copy_fd(int in, int out) {
+    struct stat in_info, out_info;
+    if (fstat(in, &in_info) != 0 || fstat(out, &out_info) != 0) {
+        return -1;
+    }
+    // Files in /proc and /sys claim to be empty and the zero-copy calls take them at their word.
+    bool in_file = S_ISREG(in_info.st_mode) && in_info.st_size > 0;
+    bool out_file = S_ISREG(out_info.st_mode);
+    bool pipe_end = S_ISFIFO(in_info.st_mode) || S_ISFIFO(out_info.st_mode);
+    bool methods[] = {in_file && out_file, in_file, pipe_end};
+    for (int method = 0; method < 3; method++) {
+        if (!methods[method]) {
+            continue;
+        }
+        off_t copied;
+        if (copy_with(method, in, out, &copied) == 0) {
+            return 0;
+        }
+        if (copied > 0 || !unsupported(errno)) {
+            return -1;
+        }
+    }
+    return copy_buffered(in, out);
+}
+
+/**
+ * @brief Helper function to tell whether two descriptors are the same
+ * regular file, which would make cat or cp read what it writes.
+ *
+ * @param a One descriptor
+ * @param b The other
+ * @return True if both are the same regular file
+ */
+static bool same_file(int a, int b) {
+    struct stat a_info, b_info;
+    return fstat(a, &a_info) == 0 && fstat(b, &b_info) == 0 && S_ISREG(a_info.st_mode) &&
+           a_info.st_dev == b_info.st_dev && a_info.st_ino == b_info.st_ino;
+}
+
+/**
+ * @brief Helper function to reject options, which the builtins don't take.
+ *
+ * @param argv The command and its arguments
+ * @return The first option, or NULL if there is none
+ */
+static const char *find_option(char **argv) {
+    for (size_t i = 1; argv[i]; i++) {
+        if (argv[i][0] == '-' && argv[i][1]) {
+            return argv[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief The cat builtin. Copies each file, or standard input for "-" or
+ * no file at all, to standard output.
+ *
+ * @param sh The shell
+ * @param argv The cat command and its arguments
+ * @return 0 on success, 1 if a file could not be copied, 2 for an option
+ */
+int builtin_cat(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    const char *option = find_option(argv);
+    if (option) {
+        fprintf(stderr, "cat: %s: the builtin takes no options, `enable -n cat' runs the program\n", option);
+        return 2;
+    }
+    fflush(stdout);
+    char *stdin_only[] = {argv[0], "-", NULL};
+    int status = 0;
+    for (char **arg = argv[1] ? argv + 1 : stdin_only + 1; *arg; arg++) {
+        bool from_stdin = strcmp(*arg, "-") == 0;
+        int in = from_stdin ? STDIN_FILENO : open(*arg, O_RDONLY | O_CLOEXEC);
+        if (in < 0) {
+            fprintf(stderr, "cat: %s: %s\n", *arg, strerror(errno));
+            status = 1;
+            continue;
+        }
+        if (same_file(in, STDOUT_FILENO)) {
+            fprintf(stderr, "cat: %s: input file is output file\n", *arg);
+            status = 1;
+        } else if (copy_fd(in, STDOUT_FILENO) != 0) {
+            fprintf(stderr, "cat: %s: %s\n", *arg, strerror(errno));
+            status = 1;
+        }
+        if (!from_stdin) {
+            close(in);
+        }
+    }
+    return status;
+}
+
+/**
+ * @brief Helper function to copy one file for cp. The copy gets the
+ * permission bits of the source.
+ *
+ * @param source The file to copy
+ * @param target The file to create or replace
+ * @return 0 on success, 1 on failure after printing an error
+ */
+static int copy_file(const char *source, const char *target) {
+    int in = open(source, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (in < 0 || fstat(in, &info) != 0) {
+        fprintf(stderr, "cp: %s: %s\n", source, strerror(errno));
+        if (in >= 0) {
+            close(in);
+        }
+        return 1;
+    }
+    if (S_ISDIR(info.st_mode)) {
+        fprintf(stderr, "cp: %s: is a directory\n", source);
+        close(in);
+        return 1;
+    }
+    // Checked before O_TRUNC would empty the source.
+    struct stat target_info;
+    if (stat(target, &target_info) == 0 && target_info.st_dev == info.st_dev && target_info.st_ino == info.st_ino) {
+        fprintf(stderr, "cp: %s and %s are the same file\n", source, target);
+        close(in);
+        return 1;
+    }
+    int out = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, info.st_mode & 0777);
+    int status = 0;
+    if (out < 0) {
+        fprintf(stderr, "cp: %s: %s\n", target, strerror(errno));
+        status = 1;
+    } else {
+        if (copy_fd(in, out) != 0) {
+            fprintf(stderr, "cp: %s: %s\n", target, strerror(errno));
+            status = 1;
+        }
+        if (close(out) != 0 && status == 0) {
+            fprintf(stderr, "cp: %s: %s\n", target, strerror(errno));
+            status = 1;
+        }
+    }
+    close(in);
+    return status;
+}
+
+/**
+ * @brief The cp builtin. `cp source target` copies a file,
+ * `cp source... dir` copies files into a directory.
+ *
+ * @param sh The shell
+ * @param argv The cp command and its arguments
+ * @return 0 on success, 1 if a file could not be copied, 2 for bad
+ * arguments
+ */
+int builtin_cp(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    size_t count = 0;
+    while (argv[count]) {
+        count++;
+    }
+    const char *option = find_option(argv);
+    if (option || count < 3) {
+        if (option) {
+            fprintf(stderr, "cp: %s: the builtin takes no options, `enable -n cp' runs the program\n", option);
+        } else {
+            fprintf(stderr, "cp: usage: cp source target, or cp source ... dir\n");
+        }
+        return 2;
+    }
+    const char *target = argv[count - 1];
+    struct stat info;
+    bool into_dir = stat(target, &info) == 0 && S_ISDIR(info.st_mode);
+    if (!into_dir && count > 3) {
+        fprintf(stderr, "cp: %s: not a directory\n", target);
+        return 1;
+    }
+    if (!into_dir) {
+        return copy_file(argv[1], target);
+    }
+    int status = 0;
+    for (size_t i = 1; i + 1 < count; i++) {
+        char *name = strdup(argv[i]); // basename may modify its argument
+        char *path = NULL;
+        if (!name || asprintf(&path, "%s/%s", target, basename(name)) < 0) {
+            perror("cp");
+            free(name);
+            return 1;
+        }
+        status |= copy_file(argv[i], path);
+        free(path);
+        free(name);
+    }
+    return status;
+}
@@ -0,0 +1,526 @@
+/**
+ * @file dirs.c
+ * @brief The directories of the shell lab: the cached cwd, the home
+ * directory, the pushd stack and CDPATH.
+ *
+ * The shell knows where it is without asking the kernel. The cwd is found
+ * once, from PWD when it names the directory the shell is in and with
+ * getcwd otherwise, and every cd after that works out the new directory
+ * from the old one as text: "." and ".." are taken off and the path is put
+ * together like cd -L in sh does. The canonical path is what chdir is
+ * given, so the text and the kernel agree, and only when that fails, a ".."
+ * out of a symbolic link to a directory that is gone say, is the path tried
+ * as it is and getcwd asked once. A path without ".." names the same
+ * directory either way and is given to chdir as it was typed, which spares
+ * the kernel the walk from /. The prompt and pwd read the cached string,
+ * PWD and OLDPWD are put in the environment only before the next program
+ * is launched and the home directory is resolved only once, with getpwuid
+ * if HOME is not set. The variables come from the shell's table, see
+ * env.c.
+ *
+ * CDPATH is split and its absolute entries are opened with O_PATH the
+ * first time a cd needs it and again only when CDPATH is changed. A cd
+ * through CDPATH is then an openat relative to the entry and an fchdir to
+ * the result, the kernel walks only the part of the path that was typed.
+ *
+ * References:
+ * https://pubs.opengroup.org/onlinepubs/9699919799/utilities/cd.html
+ * https://www.gnu.org/software/bash/manual/html_node/Directory-Stack-Builtins.html
+ * https://man7.org/linux/man-pages/man2/open.2.html
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "lab.h"
+
+/**
+ * @brief Helper function to put a path together with the directory it is
+ * relative to, taking out empty parts, "." and ".." without looking at the
+ * file system.
+ *
+ * @param base A canonical absolute directory, ignored if path is absolute
+ * @param path The path
+ * @return The canonical path, which the caller must free, or NULL if out of
+ * memory
+ */
+static char *canonical_join(const char *base, const char *path) {
+    size_t base_length = path[0] == '/' ? 0 : strlen(base);
+    char *out = malloc(base_length + strlen(path) + 2);
+    if (!out) {
+        return NULL;
+    }
+    size_t length = base_length;
+    memcpy(out, base, base_length);
+    while (length > 0 && out[length - 1] == '/') {
+        length--; // "/" becomes "" so every part can be added as "/part"
+    }
+    for (const char *part = path; *part;) {
+        while (*part == '/') {
+            part++;
+        }
+        const char *end = strchrnul(part, '/');
+        size_t n = (size_t)(end - part);
+        if (n == 2 && part[0] == '.' && part[1] == '.') {
+            while (length > 0 && out[length - 1] != '/') {
+                length--;
+            }
+            if (length > 0) {
+                length--;
+            }
+        } else if (n > 0 && !(n == 1 && part[0] == '.')) {
+            out[length++] = '/';
+            memcpy(out + length, part, n);
+            length += n;
+        }
+        part = end;
+    }
+    if (length == 0) {
+        out[length++] = '/';
+    }
+    out[length] = '\0';
+    return out;
+}
+
+/**
+ * @brief Helper function to find the cwd the first time it is needed. PWD
+ * is taken if it is canonical and the same directory as ".", which keeps
+ * the name the user reached it by, getcwd is the fallback.
+ *
+ * @param sh The shell
+ */
+static void load_cwd(struct shell *sh) {
+    struct dir_state *dirs = &sh->dirs;
+    const char *pwd = sh_getenv(sh, "PWD");
+    if (pwd && pwd[0] == '/') {
+        char *canonical = canonical_join("/", pwd);
+        struct stat named, here;
+        if (canonical && strcmp(canonical, pwd) == 0 && stat(pwd, &named) == 0 && stat(".", &here) == 0 &&
+            named.st_dev == here.st_dev && named.st_ino == here.st_ino) {
+            dirs->cwd = canonical;
+            return;
+        }
+        free(canonical);
+    }
+    dirs->cwd = getcwd(NULL, 0);
+}
+
+/**
+ * @brief The canonical working directory of the shell. See dirs.c.
+ *
+ * @param sh The shell
+ * @return The directory, or "." if it could not be found
+ */
+const char *sh_cwd(struct shell *sh) {
+    if (!sh->dirs.cwd) {
+        load_cwd(sh);
+    }
+    return sh->dirs.cwd ? sh->dirs.cwd : ".";
+}
+
+/**
+ * @brief The home directory of the user, HOME or else the password entry,
+ * which is only read once.
+ *
+ * @param sh The shell
+ * @return The directory, or NULL if there is none
+ */
+const char *sh_home(struct shell *sh) {
+    const char *home = sh_getenv(sh, "HOME");
+    if (home) {
+        return home;
+    }
+    if (!sh->dirs.home) {
+        struct passwd *user_info = getpwuid(getuid());
+        sh->dirs.home = user_info ? strdup(user_info->pw_dir) : NULL;
+    }
+    return sh->dirs.home;
+}
+
+/**
+ * @brief Helper function to close the CDPATH entries.
+ *
+ * @param dirs The directory state
+ */
+static void close_entries(struct dir_state *dirs) {
+    for (size_t i = 0; i < dirs->entry_count; i++) {
+        if (dirs->entries[i].fd >= 0) {
+            close(dirs->entries[i].fd);
+        }
+        free(dirs->entries[i].path);
+    }
+    dirs->entry_count = 0;
+}
+
+/**
+ * @brief Helper function to split CDPATH into entries and open the
+ * absolute ones, unless it is the CDPATH they were opened for.
+ *
+ * @param dirs The directory state
+ * @param cdpath The value of CDPATH
+ */
+static void load_cdpath(struct dir_state *dirs, const char *cdpath) {
+    if (dirs->cdpath && strcmp(dirs->cdpath, cdpath) == 0) {
+        return;
+    }
+    close_entries(dirs);
+    free(dirs->cdpath);
+    dirs->cdpath = strdup(cdpath);
+    if (!dirs->cdpath) {
+        return;
+    }
+    for (const char *start = cdpath;; start++) {
+        const char *end = strchrnul(start, ':');
+        char *entry = strndup(start, (size_t)(end - start)); // "" is the current directory
+        if (entry && grow_buffer((void **)&dirs->entries, &dirs->entry_cap, dirs->entry_count + 1,
+                                 sizeof(struct cdpath_entry)) == 0) {
+            struct cdpath_entry *e = &dirs->entries[dirs->entry_count++];
+            e->fd = AT_FDCWD; // a relative entry moves with the cwd, it can't be opened once
+            e->path = entry;
+            if (entry[0] == '/') {
+                e->path = canonical_join("/", entry);
+                free(entry);
+                e->fd = e->path ? fd_move_high(open(e->path, O_PATH | O_DIRECTORY | O_CLOEXEC)) : -1;
+            }
+        } else {
+            free(entry);
+        }
+        if (*end == '\0') {
+            break;
+        }
+        start = end;
+    }
+}
+
+/**
+ * @brief Helper function to tell whether a path has a ".." part.
+ *
+ * @param path The path
+ * @return True if a part of path is ".."
+ */
+static bool has_dotdot(const char *path) {
+    for (const char *dots = strstr(path, ".."); dots; dots = strstr(dots + 2, "..")) {
+        if ((dots == path || dots[-1] == '/') && (dots[2] == '/' || dots[2] == '\0')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Helper function to tell whether a path is looked up in CDPATH,
+ * which is not the case for one that starts with /, . or ..
+ *
+ * @param path The path
+ * @return True for a path CDPATH applies to
+ */
+static bool uses_cdpath(const char *path) {
+    if (path[0] == '/' || path[0] == '\0') {
+        return false;
+    }
+    size_t dots = path[0] == '.' ? (path[1] == '.' ? 2 : 1) : 0;
+    return dots == 0 || (path[dots] != '/' && path[dots] != '\0');
+}
+
+/**
+ * @brief Helper function to look a directory up in CDPATH.
+ *
+ * @param sh The shell
+ * @param path The relative path given to cd
+ * @param logical Set to the canonical path of the directory found
+ * @param named Set to true if the entry was not the current directory,
+ * when cd prints where it went
+ * @return An O_PATH descriptor of the directory, or -1 if CDPATH does not
+ * apply or has no such directory
+ */
+static int cdpath_open(struct shell *sh, const char *path, char **logical, bool *named) {
+    const char *cdpath = sh_getenv(sh, "CDPATH");
+    if (!cdpath || !*cdpath || !uses_cdpath(path)) {
+        return -1;
+    }
+    struct dir_state *dirs = &sh->dirs;
+    load_cdpath(dirs, cdpath);
+    for (size_t i = 0; i < dirs->entry_count; i++) {
+        struct cdpath_entry *e = &dirs->entries[i];
+        char *relative = NULL;
+        if (e->fd == -1 || (e->fd == AT_FDCWD && asprintf(&relative, "%s/%s", e->path[0] ? e->path : ".", path) < 0)) {
+            continue;
+        }
+        int fd = openat(e->fd, relative ? relative : path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            *logical = relative ? canonical_join(sh_cwd(sh), relative) : canonical_join(e->path, path);
+            *named = !relative || (e->path[0] && strcmp(e->path, ".") != 0);
+            free(relative);
+            return fd;
+        }
+        free(relative);
+    }
+    return -1;
+}
+
+/**
+ * @brief Change the directory of the shell and update the cached cwd, PWD
+ * and OLDPWD. See dirs.c.
+ *
+ * @param sh The shell
+ * @param path The directory
+ * @param report Print the new directory
+ * @return 0 on success, -1 on failure
+ */
+int sh_chdir(struct shell *sh, const char *path, bool report) {
+    struct dir_state *dirs = &sh->dirs;
+    const char *cwd = sh_cwd(sh); // before the chdir, it is what a relative path is joined to
+    char *logical = NULL;
+    bool named = false;
+    int fd = cdpath_open(sh, path, &logical, &named);
+    if (fd >= 0) {
+        int result = fchdir(fd);
+        int err = errno;
+        close(fd);
+        if (result != 0) {
+            fprintf(stderr, "cd: %s: %s\n", path, strerror(err));
+            free(logical);
+            return -1;
+        }
+        report = report || named;
+    } else {
+        if (dirs->cwd || path[0] == '/') {
+            logical = canonical_join(cwd, path);
+        }
+        // Without a ".." the path names the same directory however the cwd was reached.
+        if (!logical || chdir(has_dotdot(path) ? logical : path) != 0) {
+            // The text and the file system disagree, go by the file system.
+            free(logical);
+            if (chdir(path) != 0) {
+                fprintf(stderr, "cd: %s: %s\n", path, strerror(errno));
+                return -1;
+            }
+            logical = getcwd(NULL, 0);
+        }
+    }
+    free(dirs->oldpwd);
+    dirs->oldpwd = dirs->cwd;
+    dirs->cwd = logical;
+    dirs->unexported = true;
+    sh->cwd_generation++; // what caches the cwd looks again
+    if (report) {
+        printf("%s\n", sh_cwd(sh));
+    }
+    return 0;
+}
+
+/**
+ * @brief Put PWD and OLDPWD in the environment if a cd changed them since
+ * the last time. See dirs.c.
+ *
+ * @param sh The shell
+ */
+void dirs_export(struct shell *sh) {
+    struct dir_state *dirs = &sh->dirs;
+    if (!dirs->unexported) {
+        return;
+    }
+    dirs->unexported = false;
+    if (dirs->cwd) {
+        sh_setenv(sh, "PWD", dirs->cwd, true);
+    }
+    if (dirs->oldpwd) {
+        sh_setenv(sh, "OLDPWD", dirs->oldpwd, true);
+    }
+}
+
+/**
+ * @brief Free the cached directories, the pushd stack and close the CDPATH
+ * descriptors.
+ *
+ * @param dirs The directory state
+ */
+void dirs_destroy(struct dir_state *dirs) {
+    close_entries(dirs);
+    free(dirs->entries);
+    free(dirs->cdpath);
+    for (size_t i = 0; i < dirs->depth; i++) {
+        free(dirs->stack[i]);
+    }
+    free(dirs->stack);
+    free(dirs->cwd);
+    free(dirs->oldpwd);
+    free(dirs->home);
+    memset(dirs, 0, sizeof(*dirs));
+}
+
+/**
+ * @brief The cd builtin. With no directory it goes home, with - back to
+ * the directory before the last cd.
+ *
+ * @param sh The shell
+ * @param argv The cd command and its arguments
+ * @return 0 on success, 1 on failure
+ */
+int builtin_cd(struct shell *sh, char **argv) {
+    if (argv[1] && argv[2]) {
+        fprintf(stderr, "cd: too many arguments\n");
+        return 1;
+    }
+    const char *path = argv[1];
+    bool back = path && strcmp(path, "-") == 0;
+    if (!path) {
+        path = sh_home(sh);
+        if (!path) {
+            fprintf(stderr, "cd: Could not determine home directory\n");
+            return 1;
+        }
+    } else if (back) {
+        path = sh->dirs.oldpwd;
+        if (!path) {
+            fprintf(stderr, "cd: OLDPWD not set\n");
+            return 1;
+        }
+    }
+    return sh_chdir(sh, path, back) == 0 ? 0 : 1;
+}
+
+/**
+ * @brief Helper function to print the cwd and the directory stack, top
+ * first, with the home directory shown as ~.
+ *
+ * @param sh The shell
+ */
+static void print_dirs(struct shell *sh) {
+    const char *home = sh_home(sh);
+    size_t home_length = home && strcmp(home, "/") != 0 ? strlen(home) : 0;
+    for (size_t i = 0; i <= sh->dirs.depth; i++) {
+        const char *dir = i == 0 ? sh_cwd(sh) : sh->dirs.stack[sh->dirs.depth - i];
+        fputs(i == 0 ? "" : " ", stdout);
+        if (home_length > 0 && strncmp(dir, home, home_length) == 0 &&
+            (dir[home_length] == '/' || dir[home_length] == '\0')) {
+            printf("~%s", dir + home_length);
+        } else {
+            fputs(dir, stdout);
+        }
+    }
+    putchar('\n');
+}
+
+/**
+ * @brief The pushd builtin. `pushd dir` saves the cwd on the stack and
+ * changes to dir, `pushd` alone swaps the cwd with the top of the stack.
+ * Prints the stack like dirs.
+ *
+ * @param sh The shell
+ * @param argv The pushd command and its arguments
+ * @return 0 on success, 1 on failure, 2 for bad arguments
+ */
+int builtin_pushd(struct shell *sh, char **argv) {
+    struct dir_state *dirs = &sh->dirs;
+    if (argv[1] && argv[2]) {
+        fprintf(stderr, "pushd: usage: pushd [dir]\n");
+        return 2;
+    }
+    if (!argv[1] && dirs->depth == 0) {
+        fprintf(stderr, "pushd: no other directory\n");
+        return 1;
+    }
+    if (grow_buffer((void **)&dirs->stack, &dirs->stack_cap, dirs->depth + 1, sizeof(char *)) != 0) {
+        perror("pushd");
+        return 1;
+    }
+    char *cwd = strdup(sh_cwd(sh));
+    const char *target = argv[1] ? argv[1] : dirs->stack[dirs->depth - 1];
+    if (!cwd || sh_chdir(sh, target, false) != 0) {
+        free(cwd);
+        return 1;
+    }
+    if (argv[1]) {
+        dirs->stack[dirs->depth++] = cwd;
+    } else {
+        free(dirs->stack[dirs->depth - 1]);
+        dirs->stack[dirs->depth - 1] = cwd;
+    }
+    print_dirs(sh);
+    return 0;
+}
+
+/**
+ * @brief The popd builtin. Changes to the top of the directory stack and
+ * removes it, then prints the stack like dirs.
+ *
+ * @param sh The shell
+ * @param argv The popd command and its arguments
+ * @return 0 on success, 1 on failure, 2 for bad arguments
+ */
+int builtin_popd(struct shell *sh, char **argv) {
+    struct dir_state *dirs = &sh->dirs;
+    if (argv[1]) {
+        fprintf(stderr, "popd: usage: popd\n");
+        return 2;
+    }
+    if (dirs->depth == 0) {
+        fprintf(stderr, "popd: directory stack empty\n");
+        return 1;
+    }
+    if (sh_chdir(sh, dirs->stack[dirs->depth - 1], false) != 0) {
+        return 1;
+    }
+    free(dirs->stack[--dirs->depth]);
+    print_dirs(sh);
+    return 0;
+}
+
+/**
+ * @brief The dirs builtin. Prints the cwd and the directory stack, top
+ * first, or clears the stack with -c.
+ *
+ * @param sh The shell
+ * @param argv The dirs command and its arguments
+ * @return 0 on success, 2 for bad arguments
+ */
+int builtin_dirs(struct shell *sh, char **argv) {
+    if (argv[1] && (strcmp(argv[1], "-c") != 0 || argv[2])) {
+        fprintf(stderr, "dirs: usage: dirs [-c]\n");
+        return 2;
+    }
+    if (argv[1]) {
+        while (sh->dirs.depth > 0) {
+            free(sh->dirs.stack[--sh->dirs.depth]);
+        }
+        return 0;
+    }
+    print_dirs(sh);
+    return 0;
+}
+
+/**
+ * @brief The pwd builtin. Prints the cached cwd, or with -P the directory
+ * getcwd finds with the symbolic links resolved.
+ *
+ * @param sh The shell
+ * @param argv The pwd command and its arguments
+ * @return 0 on success, 1 on failure, 2 for bad arguments
+ */
+int builtin_pwd(struct shell *sh, char **argv) {
+    bool physical = argv[1] && strcmp(argv[1], "-P") == 0;
+    if (argv[1] && ((!physical && strcmp(argv[1], "-L") != 0) || argv[2])) {
+        fprintf(stderr, "pwd: usage: pwd [-L | -P]\n");
+        return 2;
+    }
+    sh_cwd(sh);
+    if (!physical && sh->dirs.cwd) {
+        puts(sh->dirs.cwd);
+        return 0;
+    }
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd) {
+        perror("pwd");
+        return 1;
+    }
+    puts(cwd);
+    free(cwd);
+    return 0;
+}
@@ -0,0 +1,524 @@
+/**
+ * @file env.c
+ * @brief The variables of the shell lab: a hash table loaded from environ
+ * and the envp children get.
+ *
+ * getenv walks environ comparing every entry, and setenv rebuilds it when a
+ * name is added. The shell keeps its variables in a hash table instead,
+ * filled from environ the first time it is needed, so looking one up costs
+ * a hash and a compare however big the environment is. Every change moves
+ * the table's generation on. The envp given to execve and posix_spawn is an
+ * array of pointers to the "NAME=value" pairs of the exported variables,
+ * built once and shared by every child until the generation says a
+ * variable changed. The PATH cache compares the generation too, and only
+ * looks at PATH again when it moved.
+ *
+ * An exported variable is also set in environ, so readline, the C library
+ * and the parts of the shell that read the environment through getenv
+ * agree with the table. The table's own pair goes in with putenv, never a
+ * copy made by setenv: glibc keeps every value setenv has replaced, so a
+ * script exporting in a loop would grow the shell by each value it set.
+ *
+ * `NAME=value cmd` sets the variable, exported, for the one command. What
+ * it replaced is saved on a stack and put back once the command is launched,
+ * or once a builtin returns.
+ *
+ * References:
+ * https://pubs.opengroup.org/onlinepubs/9699919799/utilities/V3_chap02.html#tag_18_09_01
+ * https://man7.org/linux/man-pages/man7/environ.7.html
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "lab.h"
+
+#define ENV_BUCKETS 64 // initial number of buckets, always a power of two
+
+extern char **environ;
+
+/**
+ * @brief Helper function to tell how long the name at the start of a word
+ * is, if it is a variable name followed by "=".
+ *
+ * @param word The word
+ * @param end What has to follow the name, '=' for an assignment or '\0'
+ * for a bare name
+ * @return The length of the name, or 0 if the word is not of that form
+ */
+static size_t name_length(const char *word, char end) {
+    if (!(isalpha((unsigned char)word[0]) || word[0] == '_')) {
+        return 0;
+    }
+    size_t length = 1;
+    while (isalnum((unsigned char)word[length]) || word[length] == '_') {
+        length++;
+    }
+    return word[length] == end ? length : 0;
+}
+
+/**
+ * @brief Helper function to find the bucket slot holding a name. Returns the
+ * address of the pointer to the variable so callers can also unlink it.
+ *
+ * @param env The table, with buckets
+ * @param name The name
+ * @param length Length of the name
+ * @return The slot, *slot is NULL if the variable is not set
+ */
+static struct env_var **find_slot(const struct env_table *env, const char *name, size_t length) {
+    struct env_var **slot = &env->buckets[fnv1a_hash(name, length) & (env->nbuckets - 1)];
+    while (*slot && ((*slot)->name_length != length || memcmp((*slot)->pair, name, length) != 0)) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+/**
+ * @brief Helper function to double the number of buckets once the table is
+ * as full as it is wide.
+ *
+ * @param env The table
+ * @return 0 on success, -1 if the allocation failed
+ */
+static int grow_buckets(struct env_table *env) {
+    size_t nbuckets = env->nbuckets ? env->nbuckets * 2 : ENV_BUCKETS;
+    struct env_var **buckets = calloc(nbuckets, sizeof(*buckets));
+    if (!buckets) {
+        return -1;
+    }
+    for (size_t i = 0; i < env->nbuckets; i++) {
+        struct env_var *var = env->buckets[i];
+        while (var) {
+            struct env_var *next = var->next;
+            size_t index = fnv1a_hash(var->pair, var->name_length) & (nbuckets - 1);
+            var->next = buckets[index];
+            buckets[index] = var;
+            var = next;
+        }
+    }
+    free(env->buckets);
+    env->buckets = buckets;
+    env->nbuckets = nbuckets;
+    return 0;
+}
+
+/**
+ * @brief Helper function to set environ to match a variable. The pair is
+ * put in environ as it is, so it must stay allocated until it is replaced
+ * or removed there.
+ *
+ * @param var The variable
+ * @param set True to set it, false to remove it
+ */
+static void mirror(struct env_var *var, bool set) {
+    if (set) {
+        putenv(var->pair);
+    } else {
+        char *name = strndup(var->pair, var->name_length); // unsetenv wants the name alone
+        if (name) {
+            unsetenv(name);
+            free(name);
+        }
+    }
+    var->in_environ = set;
+}
+
+/**
+ * @brief Helper function to set or remove a variable.
+ *
+ * @param env The table
+ * @param name The name, not necessarily terminated
+ * @param length Length of the name
+ * @param value The value, NULL to remove the variable
+ * @param exported Export the variable
+ * @param update_environ Make environ agree, false while loading from it
+ * @return 0 on success, -1 if out of memory
+ */
+static int store(struct env_table *env, const char *name, size_t length, const char *value, bool exported,
+                 bool update_environ) {
+    if (env->nbuckets == 0 && grow_buckets(env) != 0) {
+        return -1;
+    }
+    struct env_var **slot = find_slot(env, name, length);
+    struct env_var *var = *slot;
+    env->generation++;
+    if (!value) {
+        if (var) {
+            if (var->exported && update_environ) {
+                mirror(var, false);
+            }
+            *slot = var->next;
+            free(var->pair);
+            free(var);
+            env->count--;
+        }
+        return 0;
+    }
+    size_t value_length = strlen(value);
+    char *pair = malloc(length + value_length + 2);
+    if (!pair) {
+        return -1;
+    }
+    memcpy(pair, name, length);
+    pair[length] = '=';
+    memcpy(pair + length + 1, value, value_length + 1);
+    if (!var) {
+        if (env->count >= env->nbuckets) {
+            if (grow_buckets(env) != 0) {
+                free(pair);
+                return -1;
+            }
+            slot = find_slot(env, name, length);
+        }
+        var = calloc(1, sizeof(*var));
+        if (!var) {
+            free(pair);
+            return -1;
+        }
+        var->name_length = length;
+        *slot = var;
+        env->count++;
+    }
+    bool was_exported = var->exported;
+    char *old = var->pair; // freed only once environ no longer points at it
+    var->pair = pair;
+    var->exported = exported;
+    if (update_environ && (exported || was_exported)) {
+        mirror(var, exported);
+    }
+    free(old);
+    return 0;
+}
+
+/**
+ * @brief Helper function to find a variable.
+ *
+ * @param env The table
+ * @param name The name, not necessarily terminated
+ * @param length Length of the name
+ * @return The variable, or NULL if it is not set
+ */
+static struct env_var *find(const struct env_table *env, const char *name, size_t length) {
+    return env->nbuckets ? *find_slot(env, name, length) : NULL;
+}
+
+/**
+ * @brief The shell's variables, imported from environ the first time.
+ *
+ * @param sh The shell
+ * @return The table
+ */
+struct env_table *sh_env(struct shell *sh) {
+    struct env_table *env = &sh->env;
+    if (!env->loaded) {
+        env->loaded = true;
+        for (char **entry = environ; entry && *entry; entry++) {
+            const char *equals = strchr(*entry, '=');
+            if (equals && equals > *entry) {
+                store(env, *entry, (size_t)(equals - *entry), equals + 1, true, false);
+            }
+        }
+    }
+    return env;
+}
+
+/**
+ * @brief Look a variable up in a loaded table.
+ *
+ * @param env The table
+ * @param name The name of the variable
+ * @return The value, or NULL if the variable is not set
+ */
+const char *env_get(const struct env_table *env, const char *name) {
+    size_t length = strlen(name);
+    struct env_var *var = find(env, name, length);
+    return var ? var->pair + length + 1 : NULL;
+}
+
+/**
+ * @brief Look up a shell variable, exported or not.
+ *
+ * @param sh The shell
+ * @param name The name of the variable
+ * @return The value, or NULL if the variable is not set
+ */
+const char *sh_getenv(struct shell *sh, const char *name) {
+    return env_get(sh_env(sh), name);
+}
+
+/**
+ * @brief Set a shell variable, see env.c.
+ *
+ * @param sh The shell
+ * @param name The name of the variable
+ * @param value The value
+ * @param export Export the variable, otherwise it keeps its export flag
+ * @return 0 on success, -1 if out of memory
+ */
+int sh_setenv(struct shell *sh, const char *name, const char *value, bool export) {
+    struct env_table *env = sh_env(sh);
+    size_t length = strlen(name);
+    struct env_var *var = find(env, name, length);
+    return store(env, name, length, value, export || (var && var->exported), true);
+}
+
+/**
+ * @brief Remove a shell variable.
+ *
+ * @param sh The shell
+ * @param name The name of the variable
+ */
+void sh_unsetenv(struct shell *sh, const char *name) {
+    store(sh_env(sh), name, strlen(name), NULL, false, true);
+}
+
+/**
+ * @brief The environment for a child, built again only when a variable
+ * changed since the last call.
+ *
+ * @param sh The shell
+ * @return The NULL terminated array, valid until a variable changes
+ */
+char **sh_envp(struct shell *sh) {
+    struct env_table *env = sh_env(sh);
+    if (env->envp && env->envp_generation == env->generation) {
+        return env->envp;
+    }
+    if (grow_buffer((void **)&env->envp, &env->envp_cap, env->count + 1, sizeof(char *)) != 0) {
+        return environ; // what the table mirrors, only slower to keep up to date
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < env->nbuckets; i++) {
+        for (struct env_var *var = env->buckets[i]; var; var = var->next) {
+            if (var->exported) {
+                env->envp[n++] = var->pair;
+            }
+        }
+    }
+    env->envp[n] = NULL;
+    env->envp_generation = env->generation;
+    return env->envp;
+}
+
+/**
+ * @brief Count the NAME=value words at the start of a command.
+ *
+ * @param argv The command
+ * @return The number of assignments before the command name
+ */
+size_t env_assignments(char **argv) {
+    size_t count = 0;
+    while (argv[count] && name_length(argv[count], '=') > 0) {
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @brief Set variables for one command, exported, saving what they replace
+ * on the table's stack.
+ *
+ * @param sh The shell
+ * @param assignments The NAME=value words
+ * @param count Number of assignments
+ * @return A mark to give env_pop
+ */
+size_t env_push(struct shell *sh, char **assignments, size_t count) {
+    if (count == 0) {
+        return sh->env.nsaved; // the common case, nothing to load
+    }
+    struct env_table *env = sh_env(sh);
+    size_t mark = env->nsaved;
+    for (size_t i = 0; i < count; i++) {
+        size_t length = name_length(assignments[i], '=');
+        if (grow_buffer((void **)&env->saved, &env->saved_cap, env->nsaved + 1, sizeof(struct env_saved)) != 0) {
+            perror("env");
+            break;
+        }
+        struct env_var *var = find(env, assignments[i], length);
+        struct env_saved *saved = &env->saved[env->nsaved];
+        saved->name = strndup(assignments[i], length);
+        saved->value = var ? strdup(var->pair + length + 1) : NULL;
+        saved->exported = var && var->exported;
+        if (!saved->name || (var && !saved->value)) {
+            perror("env");
+            free(saved->name);
+            free(saved->value);
+            break;
+        }
+        env->nsaved++;
+        store(env, assignments[i], length, assignments[i] + length + 1, true, true);
+    }
+    return mark;
+}
+
+/**
+ * @brief Put back the variables saved since env_push returned mark, the
+ * last first.
+ *
+ * @param sh The shell
+ * @param mark The mark
+ */
+void env_pop(struct shell *sh, size_t mark) {
+    struct env_table *env = &sh->env;
+    while (env->nsaved > mark) {
+        struct env_saved *saved = &env->saved[--env->nsaved];
+        store(env, saved->name, strlen(saved->name), saved->value, saved->exported, true);
+        free(saved->name);
+        free(saved->value);
+    }
+}
+
+/**
+ * @brief Set variables for good, as a line of only NAME=value words does.
+ * A variable that was exported stays exported.
+ *
+ * @param sh The shell
+ * @param assignments The NAME=value words
+ * @param count Number of assignments
+ * @return 0 on success, 1 if out of memory
+ */
+int env_assign(struct shell *sh, char **assignments, size_t count) {
+    struct env_table *env = sh_env(sh);
+    for (size_t i = 0; i < count; i++) {
+        size_t length = name_length(assignments[i], '=');
+        struct env_var *var = find(env, assignments[i], length);
+        if (store(env, assignments[i], length, assignments[i] + length + 1, var && var->exported, true) != 0) {
+            perror("env");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Free the variables. The pairs environ points at are replaced
+ * there with copies made by setenv first.
+ *
+ * @param env The table
+ */
+void env_destroy(struct env_table *env) {
+    for (size_t i = 0; i < env->nbuckets; i++) {
+        struct env_var *var = env->buckets[i];
+        while (var) {
+            struct env_var *next = var->next;
+            char *name = var->in_environ ? strndup(var->pair, var->name_length) : NULL;
+            if (name) {
+                setenv(name, var->pair + var->name_length + 1, 1);
+                free(name);
+            }
+            free(var->pair);
+            free(var);
+            var = next;
+        }
+    }
+    for (size_t i = 0; i < env->nsaved; i++) {
+        free(env->saved[i].name);
+        free(env->saved[i].value);
+    }
+    free(env->buckets);
+    free(env->envp);
+    free(env->saved);
+    memset(env, 0, sizeof(*env));
+}
+
+/**
+ * @brief Helper function to order variables by their pairs for export.
+ *
+ * @param a One variable
+ * @param b The other
+ * @return Less than, equal to or greater than zero, like strcmp
+ */
+static int compare_vars(const void *a, const void *b) {
+    return strcmp((*(struct env_var *const *)a)->pair, (*(struct env_var *const *)b)->pair);
+}
+
+/**
+ * @brief Helper function to print the exported variables in order.
+ *
+ * @param env The table
+ * @return 0 on success, 1 if out of memory
+ */
+static int print_exported(struct env_table *env) {
+    struct env_var **vars = malloc((env->count + 1) * sizeof(*vars));
+    if (!vars) {
+        perror("export");
+        return 1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < env->nbuckets; i++) {
+        for (struct env_var *var = env->buckets[i]; var; var = var->next) {
+            if (var->exported) {
+                vars[n++] = var;
+            }
+        }
+    }
+    qsort(vars, n, sizeof(*vars), compare_vars);
+    for (size_t i = 0; i < n; i++) {
+        printf("export %s\n", vars[i]->pair);
+    }
+    free(vars);
+    return 0;
+}
+
+/**
+ * @brief The export builtin. `export NAME=value` sets and exports a
+ * variable, `export NAME` exports one that is set, and `export` alone
+ * lists the exported variables.
+ *
+ * @param sh The shell
+ * @param argv The export command and its arguments
+ * @return 0 on success, 1 for a name that is not valid
+ */
+int builtin_export(struct shell *sh, char **argv) {
+    struct env_table *env = sh_env(sh);
+    if (!argv[1]) {
+        return print_exported(env);
+    }
+    int status = 0;
+    for (size_t i = 1; argv[i]; i++) {
+        size_t length = name_length(argv[i], '=');
+        if (length == 0 && name_length(argv[i], '\0') == 0) {
+            fprintf(stderr, "export: `%s': not a valid identifier\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        const char *value = length ? argv[i] + length + 1 : NULL;
+        if (!length) {
+            length = strlen(argv[i]);
+            struct env_var *var = find(env, argv[i], length);
+            if (!var || var->exported) {
+                continue;
+            }
+            value = var->pair + length + 1; // stays valid, store copies it before freeing the old pair
+        }
+        if (store(env, argv[i], length, value, true, true) != 0) {
+            perror("export");
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/**
+ * @brief The unset builtin, removes each named variable.
+ *
+ * @param sh The shell
+ * @param argv The unset command and its arguments
+ * @return 0 on success, 1 for a name that is not valid
+ */
+int builtin_unset(struct shell *sh, char **argv) {
+    int status = 0;
+    for (size_t i = 1; argv[i]; i++) {
+        if (name_length(argv[i], '\0') == 0) {
+            fprintf(stderr, "unset: `%s': not a valid identifier\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        sh_unsetenv(sh, argv[i]);
+    }
+    return status;
+}
@@ -0,0 +1,671 @@
+/**
+ * @file event.c
+ * @brief The event loop of the shell lab and the interactive session built
+ * on it.
+ *
+ * A shell that waits in readline can't notice a background job finishing,
+ * and one that waits in waitpid can't read the terminal. The event loop
+ * waits for all of them at once: terminal input, the SIGCHLD signalfd of
+ * the job table, timers and the sockets of the -S server. Children are
+ * reaped when SIGCHLD arrives, never by polling, so hundreds of them cost
+ * nothing while they run.
+ *
+ * Two backends do the waiting. epoll is the default. With -U the loop
+ * queues a one-shot poll request per descriptor on an io_uring instead,
+ * and the requests re-armed after a round of handlers go to the kernel in
+ * the same io_uring_enter that waits for the next round. The io_uring is
+ * driven with the raw system calls, there is no liburing dependency. A
+ * kernel without io_uring, or one too old for the timeout the loop needs,
+ * gets epoll.
+ *
+ * References:
+ * https://man7.org/linux/man-pages/man7/epoll.7.html
+ * https://man7.org/linux/man-pages/man7/io_uring.7.html
+ * https://man7.org/linux/man-pages/man2/timerfd_create.2.html
+ * https://tiswww.cwru.edu/php/chet/readline/readline.html#Alternate-Interface
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include "lab.h"
+
+#define EVENT_BATCH 64            // events handled per wait
+#define EVENT_URING_ENTRIES 256   // submission queue size, more requests are submitted early
+#define EVENT_URING_REMOVE UINT64_MAX // user_data of poll removals, whose completions are ignored
+
+/**
+ * @brief Helper function to make the user_data of a poll request: the
+ * descriptor and the generation of its watch.
+ *
+ * @param fd The descriptor
+ * @param generation The generation of the watch
+ * @return The user_data
+ */
+static uint64_t uring_tag(int fd, uint32_t generation) {
+    return (uint64_t)generation << 32 | (uint32_t)fd;
+}
+
+/**
+ * @brief Helper function to map the rings of a new io_uring.
+ *
+ * @param loop The loop, loop->fd is the io_uring
+ * @param params What io_uring_setup returned
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int uring_map(struct event_loop *loop, const struct io_uring_params *params) {
+    struct event_uring *ring = &loop->uring;
+    ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params->features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        return -1;
+    }
+    ring->cq_ring = ring->sq_ring;
+    if (!single) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             loop->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            return -1;
+        }
+    }
+    ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return -1;
+    }
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params->sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params->sq_off.tail);
+    ring->sq_array = (unsigned *)(sq + params->sq_off.array);
+    ring->sq_mask = *(unsigned *)(sq + params->sq_off.ring_mask);
+    ring->sq_entries = params->sq_entries;
+    ring->cq_head = (unsigned *)(cq + params->cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params->cq_off.tail);
+    ring->cqes = cq + params->cq_off.cqes;
+    ring->cq_mask = *(unsigned *)(cq + params->cq_off.ring_mask);
+    return 0;
+}
+
+/**
+ * @brief Helper function to unmap the rings of an io_uring.
+ *
+ * @param ring The rings
+ */
+static void uring_unmap(struct event_uring *ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    memset(ring, 0, sizeof(*ring));
+}
+
+/**
+ * @brief Helper function to hand the queued requests to the kernel and
+ * optionally wait for completions.
+ *
+ * @param loop The loop
+ * @param wait Wait for at least one completion
+ * @param timeout_ms How long to wait, -1 for no limit
+ * @return 0 on success or timeout, -1 with errno set on failure
+ */
+static int uring_enter(struct event_loop *loop, bool wait, int timeout_ms) {
+    struct __kernel_timespec ts = {timeout_ms / 1000, (long long)(timeout_ms % 1000) * 1000000};
+    struct io_uring_getevents_arg arg = {0};
+    arg.ts = timeout_ms >= 0 ? (uint64_t)(uintptr_t)&ts : 0;
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+    for (;;) {
+        long n = syscall(__NR_io_uring_enter, loop->fd, loop->uring.to_submit, wait ? 1 : 0, flags,
+                         wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+        if (n >= 0) {
+            loop->uring.to_submit -= (unsigned)n < loop->uring.to_submit ? (unsigned)n : loop->uring.to_submit;
+            return 0;
+        }
+        if (errno == ETIME) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+        if (wait) {
+            errno = EINTR;
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief Helper function to queue a request, submitting the queue first if
+ * it is full. The request is only filled in, it goes to the kernel with
+ * the next uring_enter.
+ *
+ * @param loop The loop
+ * @return The request to fill in, or NULL if the queue can't be emptied
+ */
+static struct io_uring_sqe *uring_sqe(struct event_loop *loop) {
+    struct event_uring *ring = &loop->uring;
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        if (uring_enter(loop, false, 0) != 0 ||
+            tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)ring->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    // Without SQPOLL the kernel reads the queue only in io_uring_enter, after the caller has filled it in.
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+/**
+ * @brief Helper function to queue a one-shot poll for a watch. A poll on a
+ * descriptor that is already ready completes at once, which makes the
+ * watch level triggered.
+ *
+ * @param loop The loop
+ * @param fd The watched descriptor
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int uring_arm(struct event_loop *loop, int fd) {
+    struct event_watch *watch = &loop->watches[fd];
+    if (watch->armed || watch->events == 0) {
+        return 0;
+    }
+    struct io_uring_sqe *sqe = uring_sqe(loop);
+    if (!sqe) {
+        errno = EBUSY;
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = watch->events;
+    sqe->user_data = uring_tag(fd, watch->generation);
+    watch->armed = true;
+    return 0;
+}
+
+/**
+ * @brief Helper function to cancel the poll of a watch, if it has one. The
+ * generation moves on so a completion that was already on its way is
+ * recognized as stale.
+ *
+ * @param loop The loop
+ * @param fd The watched descriptor
+ */
+static void uring_disarm(struct event_loop *loop, int fd) {
+    struct event_watch *watch = &loop->watches[fd];
+    if (watch->armed) {
+        struct io_uring_sqe *sqe = uring_sqe(loop);
+        if (sqe) {
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = uring_tag(fd, watch->generation);
+            sqe->user_data = EVENT_URING_REMOVE;
+        }
+        watch->armed = false;
+    }
+    watch->generation++;
+}
+
+/**
+ * @brief Helper function to set up an io_uring for the loop.
+ *
+ * @param loop The loop
+ * @return 0 on success, -1 if the kernel can't give the loop what it needs
+ */
+static int uring_init(struct event_loop *loop) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    long fd = syscall(__NR_io_uring_setup, EVENT_URING_ENTRIES, &params);
+    if (fd < 0) {
+        return -1;
+    }
+    loop->fd = fd_move_high((int)fd);
+    // The timeout of event_wait is passed with IORING_ENTER_EXT_ARG, from Linux 5.11.
+    if (!(params.features & IORING_FEAT_EXT_ARG) || uring_map(loop, &params) != 0) {
+        uring_unmap(&loop->uring);
+        close(loop->fd);
+        loop->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Set up an event loop. See event.c.
+ *
+ * @param loop The loop to set up
+ * @param backend The backend to try
+ * @return 0 on success, -1 with errno set on failure
+ */
+int event_loop_init(struct event_loop *loop, enum event_backend backend) {
+    memset(loop, 0, sizeof(*loop));
+    loop->fd = -1;
+    if (backend == EVENT_URING && uring_init(loop) == 0) {
+        loop->backend = EVENT_URING;
+        return 0;
+    }
+    loop->backend = EVENT_EPOLL;
+    loop->fd = fd_move_high(epoll_create1(EPOLL_CLOEXEC));
+    return loop->fd < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Release an event loop. Watched descriptors are not closed.
+ *
+ * @param loop The loop
+ */
+void event_loop_destroy(struct event_loop *loop) {
+    if (loop->backend == EVENT_URING) {
+        uring_unmap(&loop->uring);
+    }
+    if (loop->fd >= 0) {
+        close(loop->fd);
+    }
+    free(loop->watches);
+    loop->watches = NULL;
+    loop->cap = 0;
+    loop->fd = -1;
+}
+
+/**
+ * @brief Helper function to find the watch of a descriptor.
+ *
+ * @param loop The loop
+ * @param fd The descriptor
+ * @return The watch, or NULL if fd is not watched
+ */
+static struct event_watch *find_watch(struct event_loop *loop, int fd) {
+    if (fd < 0 || (size_t)fd >= loop->cap || !loop->watches[fd].active) {
+        return NULL;
+    }
+    return &loop->watches[fd];
+}
+
+/**
+ * @brief Watch a descriptor, level triggered.
+ *
+ * @param loop The loop
+ * @param fd The descriptor
+ * @param events EPOLLIN and or EPOLLOUT
+ * @param fn Called when fd is ready
+ * @param data Passed to fn
+ * @return 0 on success, -1 with errno set on failure
+ */
+int event_add(struct event_loop *loop, int fd, uint32_t events, event_fn fn, void *data) {
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    size_t old_cap = loop->cap;
+    if (grow_buffer((void **)&loop->watches, &loop->cap, (size_t)fd + 1, sizeof(*loop->watches)) != 0) {
+        return -1;
+    }
+    if (loop->cap > old_cap) {
+        memset(loop->watches + old_cap, 0, (loop->cap - old_cap) * sizeof(*loop->watches));
+    }
+    struct event_watch *watch = &loop->watches[fd];
+    if (watch->active) {
+        errno = EEXIST;
+        return -1;
+    }
+    if (loop->backend == EVENT_EPOLL) {
+        struct epoll_event event = {.events = events, .data.fd = fd};
+        if (epoll_ctl(loop->fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            return -1;
+        }
+    }
+    uint32_t generation = watch->generation;
+    *watch = (struct event_watch){fn, data, events, true, false, false, generation};
+    return loop->backend == EVENT_URING ? uring_arm(loop, fd) : 0;
+}
+
+/**
+ * @brief Change what a watched descriptor waits for.
+ *
+ * @param loop The loop
+ * @param fd The descriptor
+ * @param events The new events, 0 to pause the watch
+ * @return 0 on success, -1 with errno set on failure
+ */
+int event_modify(struct event_loop *loop, int fd, uint32_t events) {
+    struct event_watch *watch = find_watch(loop, fd);
+    if (!watch) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (watch->events == events) {
+        return 0;
+    }
+    watch->events = events;
+    if (loop->backend == EVENT_EPOLL) {
+        struct epoll_event event = {.events = events, .data.fd = fd};
+        return epoll_ctl(loop->fd, EPOLL_CTL_MOD, fd, &event);
+    }
+    uring_disarm(loop, fd);
+    return uring_arm(loop, fd);
+}
+
+/**
+ * @brief Stop watching a descriptor.
+ *
+ * @param loop The loop
+ * @param fd The descriptor
+ */
+void event_remove(struct event_loop *loop, int fd) {
+    struct event_watch *watch = find_watch(loop, fd);
+    if (!watch) {
+        return;
+    }
+    if (loop->backend == EVENT_EPOLL) {
+        epoll_ctl(loop->fd, EPOLL_CTL_DEL, fd, NULL);
+    } else {
+        uring_disarm(loop, fd);
+    }
+    watch->active = false;
+    watch->events = 0;
+}
+
+/**
+ * @brief Create a periodic timer and watch it.
+ *
+ * @param loop The loop
+ * @param interval_ns The period
+ * @param fn Called every period
+ * @param data Passed to fn
+ * @return The timer, or -1 with errno set
+ */
+int event_timer(struct event_loop *loop, uint64_t interval_ns, event_fn fn, void *data) {
+    int fd = fd_move_high(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+    if (fd < 0) {
+        return -1;
+    }
+    struct timespec period = {(time_t)(interval_ns / 1000000000u), (long)(interval_ns % 1000000000u)};
+    struct itimerspec spec = {period, period};
+    if (timerfd_settime(fd, 0, &spec, NULL) != 0 || event_add(loop, fd, EPOLLIN, fn, data) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    loop->watches[fd].timer = true;
+    return fd;
+}
+
+/**
+ * @brief Helper function to call the handler of a ready descriptor.
+ *
+ * @param loop The loop
+ * @param fd The descriptor
+ * @param events What it is ready for
+ */
+static void dispatch(struct event_loop *loop, int fd, uint32_t events) {
+    struct event_watch *watch = find_watch(loop, fd);
+    if (!watch) {
+        return; // removed by a handler earlier in this round
+    }
+    if (watch->timer) {
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+            return; // went off for an earlier round already
+        }
+    }
+    watch->fn(loop, fd, events, watch->data);
+}
+
+/**
+ * @brief Helper function to wait for one round of completions on the
+ * io_uring. The completions are copied out before any handler runs, the
+ * handlers then queue new requests and re-arm their watches.
+ *
+ * @param loop The loop
+ * @param timeout_ms How long to wait, -1 for no limit
+ * @return The number of handlers called, or -1 with errno set
+ */
+static int uring_wait(struct event_loop *loop, int timeout_ms) {
+    struct event_uring *ring = &loop->uring;
+    if (uring_enter(loop, true, timeout_ms) != 0) {
+        return -1;
+    }
+    struct {
+        int fd;
+        uint32_t events;
+    } ready[EVENT_BATCH];
+    size_t count = 0;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail && count < EVENT_BATCH; head++) {
+        const struct io_uring_cqe *cqe = (const struct io_uring_cqe *)ring->cqes + (head & ring->cq_mask);
+        if (cqe->user_data == EVENT_URING_REMOVE) {
+            continue;
+        }
+        int fd = (int)(uint32_t)cqe->user_data;
+        struct event_watch *watch = find_watch(loop, fd);
+        if (!watch || watch->generation != (uint32_t)(cqe->user_data >> 32)) {
+            continue; // the watch was removed or changed after this poll was queued
+        }
+        watch->armed = false;
+        ready[count].fd = fd;
+        ready[count++].events = cqe->res < 0 ? EPOLLERR : (uint32_t)cqe->res;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < count; i++) {
+        dispatch(loop, ready[i].fd, ready[i].events);
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (find_watch(loop, ready[i].fd)) {
+            uring_arm(loop, ready[i].fd); // goes to the kernel with the next wait
+        }
+    }
+    return (int)count;
+}
+
+/**
+ * @brief Wait for the watched descriptors and call the handlers of those
+ * that are ready.
+ *
+ * @param loop The loop
+ * @param timeout_ms How long to wait, -1 for no limit
+ * @return The number of handlers called, or -1 with errno set
+ */
+int event_wait(struct event_loop *loop, int timeout_ms) {
+    if (loop->backend == EVENT_URING) {
+        return uring_wait(loop, timeout_ms);
+    }
+    struct epoll_event events[EVENT_BATCH];
+    int n = epoll_wait(loop->fd, events, EVENT_BATCH, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        dispatch(loop, events[i].data.fd, events[i].events);
+    }
+    return n;
+}
+
+/**
+ * @brief State of the interactive session.
+ */
+struct session {
+    struct shell *sh;
+    struct event_loop loop;
+    bool done;          // end of input
+    uint64_t prompt_ns; // when the prompt was shown
+};
+
+/**
+ * @brief Helper function to run a line the user entered, called by
+ * readline. The prompt comes back once it returns.
+ *
+ * @param input The line, NULL at the end of input
+ * @param data The session
+ */
+static void session_line(char *input, void *data) {
+    struct session *session = data;
+    struct shell *sh = session->sh;
+    sh_stat_record(sh, STAT_READLINE, sh_now_ns() - session->prompt_ns);
+    if (!input) {
+        session->done = true;
+        sh_readline_stop();
+        return;
+    }
+    // do nothing on blank lines don't save history or attempt to exec
+    uint64_t start = sh_now_ns();
+    char *line = trim_white(input);
+    sh_stat_record(sh, STAT_TRIM, sh_now_ns() - start);
+    if (*line) {
+        history_add(&sh->history, line);
+        // builtins run in the shell, everything else as a pipeline of children
+        sh_run_line(sh, line);
+    }
+    free(input);
+    // readline draws the prompt once this returns, with what the command changed
+    sh_readline_set_prompt(prompt_render(sh, true));
+    session->prompt_ns = sh_now_ns();
+}
+
+/**
+ * @brief Helper function to take the input that is ready on the terminal.
+ */
+static void session_input(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    UNUSED(loop);
+    UNUSED(fd);
+    UNUSED(events);
+    UNUSED(data);
+    sh_readline_input();
+}
+
+/**
+ * @brief Helper function to tell whether the shell has background jobs, the
+ * only ones that can be reported while the prompt is up.
+ *
+ * @param sh The shell
+ * @return True if a job is in the background
+ */
+static bool has_background_jobs(struct shell *sh) {
+    for (size_t i = 0; i < sh->jobs.cap; i++) {
+        if (sh->jobs.jobs[i].state != JOB_FREE && sh->jobs.jobs[i].background) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Helper function to report background jobs as soon as they finish,
+ * above the line being edited. The SIGCHLD of a foreground job, which was
+ * already waited for, is only drained.
+ */
+static void session_sigchld(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    UNUSED(loop);
+    UNUSED(fd);
+    UNUSED(events);
+    struct session *session = data;
+    bool redraw = has_background_jobs(session->sh);
+    if (redraw) {
+        sh_readline_hide();
+    }
+    jobs_reap(session->sh);
+    if (redraw) {
+        sh_readline_show();
+    }
+}
+
+/**
+ * @brief Helper function to draw the prompt again when its VCS thread found
+ * a different branch.
+ */
+static void session_vcs(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    UNUSED(loop);
+    UNUSED(events);
+    struct session *session = data;
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+    sh_readline_hide();
+    sh_readline_set_prompt(prompt_render(session->sh, false));
+    sh_readline_show();
+}
+
+/**
+ * @brief Helper function to append the held back history on the HISTFLUSH
+ * timer, so a line reaches the file even if no other line follows it.
+ */
+static void session_flush(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    UNUSED(loop);
+    UNUSED(fd);
+    UNUSED(events);
+    struct session *session = data;
+    history_flush(&session->sh->history);
+}
+
+/**
+ * @brief The interactive session. See event.c.
+ *
+ * @param sh The shell, set up with sh_init
+ * @return The exit status of the last command
+ */
+int sh_run_interactive(struct shell *sh) {
+    struct session session = {.sh = sh};
+    if (event_loop_init(&session.loop, sh->event_backend) != 0) {
+        perror("event loop");
+        return EXIT_FAILURE;
+    }
+    int timer = -1;
+    if (sh->history.path && sh->history.flush_interval_ns) {
+        timer = event_timer(&session.loop, sh->history.flush_interval_ns, session_flush, &session);
+    }
+    if (sh->jobs.sigchld_fd >= 0) {
+        event_add(&session.loop, sh->jobs.sigchld_fd, EPOLLIN, session_sigchld, &session);
+    }
+    // report background jobs that finished before the first prompt
+    jobs_reap(sh);
+    session.prompt_ns = sh_now_ns();
+    sh_readline_start(sh, session_line, &session);
+    if (sh->prompt.vcs_started) {
+        event_add(&session.loop, sh->prompt.vcs_notify, EPOLLIN, session_vcs, &session);
+    }
+    if (event_add(&session.loop, STDIN_FILENO, EPOLLIN, session_input, &session) != 0) {
+        perror("event loop");
+        session.done = true;
+    }
+    while (!session.done) {
+        if (event_wait(&session.loop, -1) < 0 && errno != EINTR) {
+            perror("event loop");
+            break;
+        }
+    }
+    sh_readline_stop();
+    if (timer >= 0) {
+        event_remove(&session.loop, timer);
+        close(timer);
+    }
+    event_loop_destroy(&session.loop);
+    return sh->last_status;
+}
@@ -0,0 +1,339 @@
+/**
+ * @file exec.c
+ * @brief Running parsed lines for the shell lab: builtins, pipelines and
+ * waiting for them to finish.
+ *
+ * Every stage of a pipeline is launched into one process group and the
+ * stages are connected with pipe2(O_CLOEXEC). The child side of each pipe is
+ * installed with dup2 in the spawn engine, which clears close-on-exec on the
+ * copy, so no other pipe end leaks into an unrelated stage. The data flows
+ * kernel to kernel between the stages, the shell never touches it.
+ *
+ * References:
+ * https://man7.org/linux/man-pages/man2/pipe.2.html
+ * https://man7.org/linux/man-pages/man2/fcntl.2.html (F_SETPIPE_SZ)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "lab.h"
+
+/**
+ * @brief Helper function to create a pipe between two stages. Both ends are
+ * close-on-exec. When the shell was started with -p the buffer is enlarged
+ * with F_SETPIPE_SZ, which is only a hint so failure is ignored.
+ *
+ * @param sh The shell
+ * @param fds Filled with the read and write ends
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int open_pipe(struct shell *sh, int fds[2]) {
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    if (sh->pipe_size > 0) {
+        fcntl(fds[1], F_SETPIPE_SZ, sh->pipe_size);
+    }
+    return 0;
+}
+
+/**
+ * @brief Helper function to launch every stage of a pipeline as one job.
+ * With job control each job gets its own process group, led by its first
+ * stage. A foreground job gets the terminal and is waited for, a background
+ * job is left running and collected later by jobs_reap.
+ *
+ * @param sh The shell
+ * @param stages The argument array of each stage, the redirections of each
+ * stage are in sh->parse
+ * @param nstages Number of stages
+ * @param background True to leave the job running in the background
+ * @return The exit status of the last stage, 0 for a background job
+ */
+static int run_pipeline(struct shell *sh, char ***stages, size_t nstages, bool background) {
+    int prev_read = -1; // read end of the pipe feeding the current stage
+
+    struct job *job = job_new(sh);
+    if (!job) {
+        perror("run_pipeline: realloc failed");
+        return EXIT_FAILURE;
+    }
+    if (background && !sh->shell_is_interactive) {
+        // Without job control nothing stops a background job from stealing the shell's input.
+        prev_read = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    fflush(stdout); // output of earlier builtins must come before the children's
+    for (size_t i = 0; i < nstages; i++) {
+        int fds[2] = {-1, -1};
+        if (i + 1 < nstages && open_pipe(sh, fds) != 0) {
+            perror("pipe");
+            job->status = EXIT_FAILURE;
+            break;
+        }
+        struct redirect *redirects = sh->parse.redirects + sh->parse.stage_redirects[i];
+        size_t nredirects = sh->parse.stage_redirects[i + 1] - sh->parse.stage_redirects[i];
+        size_t assignments = env_assignments(stages[i]);
+        char **argv = stages[i] + assignments;
+        struct spawn_spec spec = {argv, job->pgid, prev_read, fds[1], !background, redirects, nredirects, job};
+        const struct builtin *builtin = argv[0] ? builtin_find(argv[0]) : NULL;
+        size_t mark = env_push(sh, stages[i], assignments); // NAME=value for this stage only
+        pid_t pid = !argv[0] ? 0 : builtin ? sh_spawn_builtin(sh, builtin, &spec) : sh_spawn(sh, &spec);
+        env_pop(sh, mark);
+        if (pid == 0) {
+            // Only assignments, which the stage's subshell would forget, nothing to start.
+        } else if (pid < 0) {
+            int err = errno;
+            const char *culprit = redirect_failure(redirects, nredirects);
+            fprintf(stderr, "%s: %s\n", culprit ? culprit : argv[0], strerror(err));
+            if (culprit) {
+                job->status = EXIT_FAILURE; // the status sh gives a failed redirection
+            }
+        } else {
+            if (job->pgid == 0) {
+                job->pgid = pid; // the group is led by the first stage that starts
+            }
+            if (sh->shell_is_interactive) {
+                // Also set the group from the parent to avoid racing the child.
+                setpgid(pid, job->pgid);
+            }
+            if (job_add_proc(job, pid) != 0) {
+                perror("run_pipeline: realloc failed");
+                waitpid(pid, NULL, 0); // can't be tracked, don't leave it behind
+            } else if (i + 1 == nstages) {
+                job->last_pid = pid;
+            }
+        }
+        // The children hold their own copies, close the shell's.
+        if (prev_read >= 0) {
+            close(prev_read);
+        }
+        if (fds[1] >= 0) {
+            close(fds[1]);
+        }
+        prev_read = fds[0];
+    }
+    if (prev_read >= 0) {
+        close(prev_read);
+    }
+
+    if (job->nprocs == 0) { // nothing started
+        int status = job->status;
+        job_release(job);
+        return status;
+    }
+    if (background) {
+        job->background = true;
+        job_set_command(job, stages, nstages);
+        if (sh->shell_is_interactive) {
+            fprintf(stderr, "[%d] %d\n", job->id, (int)job->pgid);
+        }
+        return 0;
+    }
+    int status = job_wait(sh, job);
+    if (job->state == JOB_STOPPED) { // Ctrl-Z, the job only needs its text now
+        job_set_command(job, stages, nstages);
+        fprintf(stderr, "\n");
+        job_print(job, stderr);
+    }
+    return status;
+}
+
+/**
+ * @brief Helper function to tell whether a token ends a command of a list.
+ *
+ * @param kind The kind of the token
+ * @return True for ";" and "&"
+ */
+static bool ends_command(enum token_kind kind) {
+    return kind == TOK_SEMI || kind == TOK_BACKGROUND;
+}
+
+/**
+ * @brief Helper function to tell whether a token is a redirection
+ * operator.
+ *
+ * @param kind The kind of the token
+ * @return True for < > >> <& and >&
+ */
+static bool is_redirect(enum token_kind kind) {
+    return kind == TOK_LESS || kind == TOK_GREAT || kind == TOK_APPEND || kind == TOK_LESS_AND ||
+           kind == TOK_GREAT_AND;
+}
+
+/**
+ * @brief Helper function to check the operators of a parsed line before
+ * any of it runs, the way sh rejects a line with a syntax error as a whole.
+ *
+ * @param ctx The context holding the parsed line
+ * @return The token in error, or NULL if the line is fine
+ */
+static const char *check_syntax(const struct parse_ctx *ctx) {
+    for (size_t i = 0; i < ctx->count; i++) {
+        enum token_kind kind = ctx->kinds[i];
+        enum token_kind before = i > 0 ? ctx->kinds[i - 1] : TOK_END;
+        enum token_kind after = ctx->kinds[i + 1];
+        bool command_before = before != TOK_END && before != TOK_PIPE && !ends_command(before);
+        if (ends_command(kind) && !command_before) {
+            return ctx->argv[i]; // "; ls" or "ls & ; ls", a trailing separator is fine
+        }
+        if (kind == TOK_PIPE && (!command_before || after == TOK_END || ends_command(after))) {
+            return ctx->argv[i];
+        }
+        if (is_redirect(kind)) {
+            if (after != TOK_WORD) { // "ls >" or "ls > |"
+                return after == TOK_END ? "newline" : ctx->argv[i + 1];
+            }
+            const char *target = ctx->argv[i + 1];
+            bool dup = kind == TOK_LESS_AND || kind == TOK_GREAT_AND;
+            if (dup && strcmp(target, "-") != 0 && (!*target || target[strspn(target, "0123456789")])) {
+                return target; // only a descriptor number or "-" can be copied
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Parse and run one line, taking the tokens from the line cache if
+ * it was run before. A single builtin runs in the shell itself
+ * so that cd and exit affect it. Anything else is launched as a pipeline,
+ * in the background if the line ends with "&".
+ *
+ * @param sh The shell
+ * @param line The line to run, already trimmed
+ * @return The exit status of the last stage, also stored in sh->last_status
+ */
+int sh_run_line(struct shell *sh, const char *line) {
+    uint64_t start = sh_now_ns();
+    if (!line_cache_lookup(&sh->line_cache, &sh->parse, line, false)) {
+        if (!cmd_parse_into(&sh->parse, line)) {
+            return sh->last_status = sh->parse.error ? 2 : EXIT_FAILURE; // 2 for a syntax error, as check_syntax
+        }
+        line_cache_insert(&sh->line_cache, &sh->parse);
+    }
+    sh->timing.parse_ns = sh_now_ns() - start;
+    sh_stat_record(sh, STAT_PARSE, sh->timing.parse_ns);
+    return sh_run_parsed(sh);
+}
+
+/**
+ * @brief Helper function to run one command of the parsed line, the
+ * tokens from first up to the next NULL. Builtins run in the shell itself,
+ * anything else is launched as a pipeline. So does a builtin that stands in
+ * for a program, such as cat, in an interactive shell: the shell ignores
+ * SIGINT, in a foreground child of its own Ctrl-C stops it.
+ *
+ * @param sh The shell
+ * @param first Index of the first token of the command
+ * @param background True if the command ended with "&"
+ * @return The exit status of the last stage
+ */
+static int run_command(struct shell *sh, size_t first, bool background) {
+    struct parse_ctx *ctx = &sh->parse;
+    int nstages = cmd_pipeline_at(ctx, first);
+    if (nstages <= 0) { // nothing to run, or a stage with only redirections
+        if (nstages < 0) {
+            fprintf(stderr, "syntax error near unexpected token `|'\n");
+        }
+        return nstages < 0 ? 2 : sh->last_status;
+    }
+    size_t assignments = ctx->stages[0][0] ? env_assignments(ctx->stages[0]) : 0;
+    char **argv = ctx->stages[0] + assignments;
+    const struct builtin *builtin = argv[0] ? builtin_find(argv[0]) : NULL;
+    bool in_shell = !argv[0] || (builtin && !(builtin->optional && sh->shell_is_interactive));
+    if (nstages == 1 && !background && in_shell) {
+        // Builtins, "> file" and "NAME=value" run in the shell, with its descriptors redirected for as long as they run.
+        struct redirect *redirects = ctx->redirects + ctx->stage_redirects[0];
+        size_t nredirects = ctx->stage_redirects[1] - ctx->stage_redirects[0];
+        uint64_t start = sh_now_ns();
+        int status = EXIT_FAILURE;
+        if (redirect_apply(redirects, nredirects, true) == 0) {
+            if (!argv[0]) {
+                status = assignments ? env_assign(sh, ctx->stages[0], assignments) : 0;
+            } else {
+                size_t mark = env_push(sh, ctx->stages[0], assignments);
+                status = do_builtin(sh, argv) ? sh->last_status : 0;
+                env_pop(sh, mark);
+            }
+        }
+        redirect_restore(redirects, nredirects);
+        if (argv[0]) {
+            sh_stat_record(sh, STAT_BUILTIN, sh_now_ns() - start);
+        }
+        return status;
+    }
+    return run_pipeline(sh, ctx->stages, (size_t)nstages, background);
+}
+
+/**
+ * @brief Helper function to run one command of a list with its leading
+ * "time" or -T, and its leading "limit".
+ *
+ * @param sh The shell
+ * @param first Index of the first token of the command
+ * @param background True if the command ended with "&"
+ */
+static void run_timed(struct shell *sh, size_t first, bool background) {
+    // A leading "time" word, a quoted one included, is the keyword.
+    bool timed = sh->time_all;
+    if (sh->parse.argv[first] && strcmp(sh->parse.argv[first], "time") == 0) {
+        timed = true;
+        first++;
+    }
+    // Then "limit" with options, for the limits of this command's job alone.
+    struct job_limits limits = sh->limits;
+    long words = limit_prefix(sh, sh->parse.argv + first);
+    if (words < 0) {
+        sh->last_status = 2;
+        return;
+    }
+    first += (size_t)words;
+    if (timed) {
+        sh_timing_start(sh);
+    }
+    sh->last_status = run_command(sh, first, background);
+    if (timed) {
+        sh_timing_report(sh);
+    }
+    if (words > 0) {
+        sh->limits = limits;
+    }
+}
+
+/**
+ * @brief Run the line that was last parsed into sh->parse. The line is a
+ * list of commands separated by ";" or "&", one ending in "&" runs as a
+ * background job. A leading "time", or the -T option, prints how long a
+ * command took and what it used once it is done. Background jobs that
+ * finished since the last line are collected first.
+ *
+ * @param sh The shell
+ * @return The exit status of the last command, also stored in sh->last_status
+ */
+int sh_run_parsed(struct shell *sh) {
+    jobs_reap(sh);
+    struct parse_ctx *ctx = &sh->parse;
+    const char *error = check_syntax(ctx);
+    if (error) {
+        fprintf(stderr, "syntax error near unexpected token `%s'\n", error);
+        return sh->last_status = 2; // the status sh uses for syntax errors
+    }
+    size_t first = 0;
+    while (first < ctx->count) {
+        size_t end = first;
+        while (end < ctx->count && !ends_command(ctx->kinds[end])) {
+            end++;
+        }
+        bool background = ctx->kinds[end] == TOK_BACKGROUND;
+        ctx->argv[end] = NULL; // the command ends here
+        run_timed(sh, first, background);
+        first = end + 1;
+    }
+    return sh->last_status;
+}
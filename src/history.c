@@ -0,0 +1,611 @@
+/**
+ * @file history.c
+ * @brief Persistent command history for the shell lab.
+ *
+ * The history file named by HISTFILE is never rewritten by the shell.
+ * Each command is appended to a pending buffer and the buffer goes to the
+ * file with a single O_APPEND write, right away or once every HISTFLUSH
+ * seconds. Several shells can share one file because O_APPEND writes land
+ * whole at the end.
+ *
+ * The file is loaded the first time the history is needed, which for an
+ * interactive shell is the first prompt. It is mapped privately and every
+ * newline is replaced with a null terminator, so the loaded lines are used
+ * where they are without a copy, like in batch mode.
+ *
+ * Once the file holds a quarter more lines than HISTFILESIZE a background
+ * thread writes the newest HISTFILESIZE lines to a temporary file and
+ * renames it over the history file. Appends wait in the pending buffer
+ * while it runs, so the shell never blocks on the trim. Another shell may
+ * append to the same file meanwhile, so the trim holds an exclusive flock
+ * on it from the read to the rename and every append a shared one; an
+ * append that got its lock on a file renamed over since opens the new one.
+ *
+ * `history -s` looks text up in a trigram index: for every three bytes in
+ * a row the index lists the lines that contain them. Only the lines on the
+ * shortest list of the text's trigrams can match, and only those are
+ * compared. The index is built by the first search, a shell that never
+ * searches doesn't pay for it, and kept current by history_add after that.
+ *
+ * References:
+ * https://man7.org/linux/man-pages/man2/open.2.html (O_APPEND)
+ * https://man7.org/linux/man-pages/man2/flock.2.html
+ * https://www.gnu.org/software/bash/manual/html_node/Bash-History-Facilities.html
+ * https://swtch.com/~rsc/regexp/regexp4.html (trigram indexes)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "lab.h"
+
+#define HISTORY_DEFAULT_NAME ".lab_history" // in HOME when HISTFILE is not set
+#define HISTORY_DEFAULT_SIZE 10000          // lines kept in the file when HISTFILESIZE is not set
+#define HISTORY_READLINE_MAX 1000           // loaded lines handed to readline for recall
+#define HISTORY_GRAMS_MIN 4096              // first size of the trigram table
+
+/**
+ * @brief What the trimming thread needs, owned by the thread.
+ */
+struct history_trim {
+    struct history *history; // only trimming and trimmed_lines are touched
+    char *path;
+    size_t keep;
+};
+
+/**
+ * @brief Helper function to read a non-negative number from the
+ * environment.
+ *
+ * @param name The variable
+ * @param fallback Value when the variable is unset or not a number
+ * @return The value
+ */
+static long env_number(const char *name, long fallback) {
+    const char *value = getenv(name);
+    if (!value || !*value) {
+        return fallback;
+    }
+    char *end;
+    long number = strtol(value, &end, 10);
+    return *end || number < 0 ? fallback : number;
+}
+
+/**
+ * @brief Initialize an empty history. Nothing is read until the history is
+ * first used.
+ *
+ * @param history The history to initialize
+ * @param path The history file, NULL to keep the history in memory only
+ */
+void history_init(struct history *history, const char *path) {
+    memset(history, 0, sizeof(*history));
+    history->path = path ? strdup(path) : NULL;
+    history->max_lines = HISTORY_DEFAULT_SIZE;
+    history->owner = getpid();
+}
+
+/**
+ * @brief Initialize the history of an interactive shell from the
+ * environment: HISTFILE names the file, ~/.lab_history by default.
+ * HISTFILESIZE caps its lines and HISTFLUSH is the number of seconds
+ * appends may be held back, 0 writes every command at once.
+ *
+ * @param history The history to initialize
+ */
+void history_init_env(struct history *history) {
+    const char *file = getenv("HISTFILE");
+    char *path = NULL;
+    if (file) {
+        path = *file ? strdup(file) : NULL; // an empty HISTFILE turns the file off
+    } else if (getenv("HOME")) {
+        const char *home = getenv("HOME");
+        if ((path = malloc(strlen(home) + sizeof("/" HISTORY_DEFAULT_NAME)))) {
+            strcpy(stpcpy(path, home), "/" HISTORY_DEFAULT_NAME);
+        }
+    }
+    history_init(history, NULL);
+    history->path = path;
+    history->max_lines = (size_t)env_number("HISTFILESIZE", HISTORY_DEFAULT_SIZE);
+    history->flush_interval_ns = (uint64_t)env_number("HISTFLUSH", 0) * 1000000000u;
+}
+
+/**
+ * @brief Helper function to remember one line in memory.
+ *
+ * @param history The history
+ * @param text The line, null terminated
+ * @param length Length of the line
+ * @return 0 on success, -1 if the list could not grow
+ */
+static int push_line(struct history *history, const char *text, size_t length) {
+    if (grow_buffer((void **)&history->lines, &history->cap, history->count + 1, sizeof(struct history_line)) != 0) {
+        return -1;
+    }
+    history->lines[history->count].text = text;
+    history->lines[history->count].length = length;
+    history->count++;
+    return 0;
+}
+
+/**
+ * @brief Helper function to tell whether a line lives in the mapping of
+ * the file or was allocated by history_add.
+ *
+ * @param history The history
+ * @param text The line
+ * @return True if the line is part of the mapping
+ */
+static bool is_mapped(const struct history *history, const char *text) {
+    return history->map && text >= history->map && text < history->map + history->map_size;
+}
+
+/**
+ * @brief Load the history file, once. The file is mapped privately and
+ * its lines are split in place. The newest lines are also given to
+ * readline so they can be recalled with the arrow keys.
+ *
+ * @param history The history
+ */
+void history_load(struct history *history) {
+    if (history->loaded) {
+        return;
+    }
+    history->loaded = true;
+    if (!history->path) {
+        return;
+    }
+    int fd = open(history->path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return; // no history yet
+    }
+    size_t size = (size_t)info.st_size;
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    history->map = map;
+    history->map_size = size;
+    char *end = map + size;
+    for (char *line = map; line < end;) {
+        char *newline = memchr(line, '\n', (size_t)(end - line));
+        size_t length = (size_t)((newline ? newline : end) - line);
+        if (newline) {
+            *newline = '\0';
+        } else if (size % (size_t)sysconf(_SC_PAGESIZE) == 0) {
+            line = strndup(line, length); // no zero byte after the mapping, copy the last line
+        }
+        if (line && length > 0 && push_line(history, line, length) != 0 && !is_mapped(history, line)) {
+            free(line);
+        }
+        history->file_lines++;
+        if (!newline) {
+            break;
+        }
+        line = newline + 1;
+    }
+    size_t first = history->count > HISTORY_READLINE_MAX ? history->count - HISTORY_READLINE_MAX : 0;
+    for (size_t i = first; i < history->count; i++) {
+        sh_add_history(history->lines[i].text);
+    }
+}
+
+/**
+ * @brief Helper function to drop the oldest lines of the history file,
+ * run on its own thread. The newest lines are written to a temporary file
+ * next to the history file, which is then renamed over it. The file is
+ * locked the whole time so no other shell appends a line the copy misses.
+ *
+ * @param arg The struct history_trim, freed here
+ * @return NULL
+ */
+static void *trim_file(void *arg) {
+    struct history_trim *trim = arg;
+    size_t kept = 0;
+    int fd = open(trim->path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd >= 0 && flock(fd, LOCK_EX) == 0 && fstat(fd, &info) == 0 && info.st_size > 0) {
+        size_t size = (size_t)info.st_size;
+        char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            // Walk back over the newest lines, a trailing newline ends the last one.
+            size_t start = size;
+            size_t end = map[size - 1] == '\n' ? size - 1 : size;
+            while (start > 0 && kept < trim->keep) {
+                char *newline = memrchr(map, '\n', end);
+                start = newline ? (size_t)(newline - map) + 1 : 0;
+                end = newline ? (size_t)(newline - map) : 0;
+                kept++;
+            }
+            size_t length = strlen(trim->path);
+            char *temp = malloc(length + sizeof(".XXXXXX"));
+            if (temp) {
+                strcpy(stpcpy(temp, trim->path), ".XXXXXX");
+                int out = mkstemp(temp);
+                if (out >= 0) {
+                    fchmod(out, info.st_mode & 0777);
+                    bool written = write(out, map + start, size - start) == (ssize_t)(size - start);
+                    if (close(out) != 0 || !written || rename(temp, trim->path) != 0) {
+                        unlink(temp);
+                        kept = 0;
+                    }
+                }
+                free(temp);
+            }
+            munmap(map, size);
+        }
+    }
+    if (fd >= 0) {
+        close(fd); // and the lock, appends go to the renamed file from now on
+    }
+    trim->history->trimmed_lines = kept;
+    atomic_store_explicit(&trim->history->trimming, false, memory_order_release);
+    free(trim->path);
+    free(trim);
+    return NULL;
+}
+
+/**
+ * @brief Helper function to collect a trimming thread that has finished.
+ *
+ * @param history The history
+ * @param wait True to wait for a thread that is still running
+ */
+static void join_trim(struct history *history, bool wait) {
+    if (!history->trim_started) {
+        return;
+    }
+    if (!wait && atomic_load_explicit(&history->trimming, memory_order_acquire)) {
+        return;
+    }
+    pthread_join(history->trimmer, NULL);
+    history->trim_started = false;
+    if (history->trimmed_lines > 0) {
+        history->file_lines = history->trimmed_lines;
+    }
+}
+
+/**
+ * @brief Helper function to start trimming the file in the background
+ * once it has grown a quarter past its cap. The slack keeps the shell from
+ * trimming after every command.
+ *
+ * @param history The history
+ */
+static void maybe_trim(struct history *history) {
+    if (history->trim_started || history->max_lines == 0 ||
+        history->file_lines <= history->max_lines + history->max_lines / 4) {
+        return;
+    }
+    struct history_trim *trim = malloc(sizeof(*trim));
+    if (!trim || !(trim->path = strdup(history->path))) {
+        free(trim);
+        return;
+    }
+    trim->history = history;
+    trim->keep = history->max_lines;
+    history->trimmed_lines = 0;
+    atomic_store_explicit(&history->trimming, true, memory_order_relaxed);
+    if (pthread_create(&history->trimmer, NULL, trim_file, trim) != 0) {
+        atomic_store_explicit(&history->trimming, false, memory_order_relaxed);
+        free(trim->path);
+        free(trim);
+        return;
+    }
+    history->trim_started = true;
+}
+
+/**
+ * @brief Helper function to open the history file for an append, with a
+ * shared lock so a trim by any shell waits for it to finish.
+ *
+ * @param path The history file
+ * @return The descriptor, or -1 with errno set
+ */
+static int open_locked_for_append(const char *path) {
+    for (;;) {
+        int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            return -1;
+        }
+        struct stat opened, named;
+        if (flock(fd, LOCK_SH) != 0 || fstat(fd, &opened) != 0 || stat(path, &named) != 0 ||
+            (opened.st_dev == named.st_dev && opened.st_ino == named.st_ino)) {
+            return fd; // without a lock or the name to compare it is appended as before
+        }
+        close(fd); // a trim renamed the copy over it while this waited for the lock
+    }
+}
+
+/**
+ * @brief Write the pending lines to the history file with one O_APPEND
+ * write. Does nothing while the file is being trimmed, the lines stay
+ * pending until the trim is done.
+ *
+ * @param history The history
+ * @return 0 on success or when there is nothing to write, -1 with errno
+ * set if the write failed
+ */
+int history_flush(struct history *history) {
+    join_trim(history, false);
+    if (history->pending_length == 0 || !history->path || history->trim_started) {
+        return 0;
+    }
+    // Opened for every flush so a file renamed over by a trim is picked up.
+    int fd = open_locked_for_append(history->path);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t written = write(fd, history->pending, history->pending_length);
+    int err = errno;
+    close(fd);
+    if (written != (ssize_t)history->pending_length) {
+        errno = written < 0 ? err : EIO;
+        return -1;
+    }
+    history->pending_length = 0;
+    history->file_lines += history->pending_lines;
+    history->pending_lines = 0;
+    history->last_flush_ns = sh_now_ns();
+    maybe_trim(history);
+    return 0;
+}
+
+/**
+ * @brief Helper function to get the trigram key of three bytes. None of
+ * the bytes of a string are zero so no key is 0, which marks an empty
+ * slot.
+ *
+ * @param text The first of the three bytes
+ * @return The key
+ */
+static uint32_t gram_key(const char *text) {
+    const unsigned char *bytes = (const unsigned char *)text;
+    return (uint32_t)bytes[0] << 16 | (uint32_t)bytes[1] << 8 | bytes[2];
+}
+
+/**
+ * @brief Helper function to find the slot of a trigram in the table, or
+ * the empty slot where it would go.
+ *
+ * @param grams The table
+ * @param cap The size of the table, a power of two
+ * @param key The trigram
+ * @return The slot
+ */
+static size_t gram_slot(const struct history_gram *grams, size_t cap, uint32_t key) {
+    size_t slot = (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15u) >> 32) & (cap - 1);
+    while (grams[slot].key && grams[slot].key != key) {
+        slot = (slot + 1) & (cap - 1);
+    }
+    return slot;
+}
+
+/**
+ * @brief Helper function to double the trigram table, keeping it at most
+ * half full.
+ *
+ * @param history The history
+ * @return 0 on success, -1 if the allocation failed
+ */
+static int grow_grams(struct history *history) {
+    size_t cap = history->grams_cap ? history->grams_cap * 2 : HISTORY_GRAMS_MIN;
+    struct history_gram *grams = calloc(cap, sizeof(*grams));
+    if (!grams) {
+        return -1;
+    }
+    for (size_t i = 0; i < history->grams_cap; i++) {
+        if (history->grams[i].key) {
+            grams[gram_slot(grams, cap, history->grams[i].key)] = history->grams[i];
+        }
+    }
+    free(history->grams);
+    history->grams = grams;
+    history->grams_cap = cap;
+    return 0;
+}
+
+/**
+ * @brief Helper function to add the lines the index doesn't have yet. A
+ * line is listed once under each of its trigrams, however often it repeats
+ * them.
+ *
+ * @param history The history
+ * @return 0 on success, -1 if the allocation failed
+ */
+static int index_lines(struct history *history) {
+    for (; history->indexed < history->count; history->indexed++) {
+        uint32_t line = (uint32_t)history->indexed;
+        const char *text = history->lines[line].text;
+        for (size_t i = 0; i + 3 <= history->lines[line].length; i++) {
+            if ((history->grams_used + 1) * 2 > history->grams_cap && grow_grams(history) != 0) {
+                return -1;
+            }
+            uint32_t key = gram_key(text + i);
+            struct history_gram *gram = &history->grams[gram_slot(history->grams, history->grams_cap, key)];
+            if (!gram->key) {
+                gram->key = key;
+                history->grams_used++;
+            }
+            if (gram->count > 0 && gram->lines[gram->count - 1] == line) {
+                continue; // already listed for this line
+            }
+            if (grow_buffer((void **)&gram->lines, &gram->cap, gram->count + 1, sizeof(uint32_t)) != 0) {
+                return -1;
+            }
+            gram->lines[gram->count++] = line;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Helper function to add a match to the results of a search.
+ *
+ * @param matches The results
+ * @param cap Capacity of the results
+ * @param count Matches so far, updated
+ * @param line The matching line
+ * @return 0 on success, -1 if the allocation failed
+ */
+static int add_match(size_t **matches, size_t *cap, size_t *count, size_t line) {
+    if (grow_buffer((void **)matches, cap, *count + 1, sizeof(size_t)) != 0) {
+        return -1;
+    }
+    (*matches)[(*count)++] = line;
+    return 0;
+}
+
+/**
+ * @brief Find the history lines that contain text, oldest first. Text of
+ * three bytes or more only compares the lines listed under its rarest
+ * trigram, without the index every line is compared.
+ *
+ * @param history The history
+ * @param text The text to look for
+ * @param matches Indexes of the matching lines, grown as needed and freed
+ * by the caller
+ * @param cap Capacity of matches in elements
+ * @return The number of matches
+ */
+size_t history_search(struct history *history, const char *text, size_t **matches, size_t *cap) {
+    history_load(history);
+    size_t count = 0;
+    size_t length = strlen(text);
+    if (length >= 3 && index_lines(history) == 0) {
+        const struct history_gram *rarest = NULL;
+        for (size_t i = 0; i + 3 <= length; i++) {
+            uint32_t key = gram_key(text + i);
+            const struct history_gram *gram = &history->grams[gram_slot(history->grams, history->grams_cap, key)];
+            if (!gram->key) {
+                return 0; // no line has this trigram
+            }
+            if (!rarest || gram->count < rarest->count) {
+                rarest = gram;
+            }
+        }
+        for (size_t i = 0; i < rarest->count; i++) {
+            const struct history_line *line = &history->lines[rarest->lines[i]];
+            if (line->length >= length && strstr(line->text, text) &&
+                add_match(matches, cap, &count, rarest->lines[i]) != 0) {
+                break;
+            }
+        }
+        return count;
+    }
+    for (size_t i = 0; i < history->count; i++) {
+        if (strstr(history->lines[i].text, text) && add_match(matches, cap, &count, i) != 0) {
+            break;
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Add a command to the history: to the list in memory, to readline
+ * and to the pending buffer for the file. The buffer is flushed when it has
+ * waited at least the flush interval.
+ *
+ * @param history The history
+ * @param line The command, without a newline
+ */
+void history_add(struct history *history, const char *line) {
+    history_load(history);
+    size_t length = strlen(line);
+    char *copy = strdup(line);
+    if (!copy || push_line(history, copy, length) != 0) {
+        free(copy);
+        return;
+    }
+    sh_add_history(line);
+    if (history->grams) {
+        index_lines(history); // a failed allocation is retried by the next search
+    }
+    if (!history->path) {
+        return;
+    }
+    if (grow_buffer((void **)&history->pending, &history->pending_cap, history->pending_length + length + 1,
+                    sizeof(char)) == 0) {
+        memcpy(history->pending + history->pending_length, line, length);
+        history->pending_length += length;
+        history->pending[history->pending_length++] = '\n';
+        history->pending_lines++;
+    }
+    if (sh_now_ns() - history->last_flush_ns >= history->flush_interval_ns) {
+        history_flush(history);
+    }
+}
+
+/**
+ * @brief Write what is pending, wait for a trim that is still running and
+ * release the history. A forked child only frees its copy: the pending
+ * lines are the shell's to write and the trimming thread is not in it.
+ *
+ * @param history The history to destroy
+ */
+void history_destroy(struct history *history) {
+    if (history->owner == getpid()) {
+        join_trim(history, true);
+        history_flush(history);
+        join_trim(history, true); // the last flush may have started a trim
+    }
+    for (size_t i = 0; i < history->count; i++) {
+        if (!is_mapped(history, history->lines[i].text)) {
+            free((char *)history->lines[i].text);
+        }
+    }
+    for (size_t i = 0; i < history->grams_cap; i++) {
+        free(history->grams[i].lines);
+    }
+    free(history->grams);
+    if (history->map) {
+        munmap(history->map, history->map_size);
+    }
+    free(history->lines);
+    free(history->pending);
+    free(history->path);
+    memset(history, 0, sizeof(*history));
+}
+
+/**
+ * @brief Print the newest lines of the history with their numbers, which
+ * count from 1.
+ *
+ * @param history The history
+ * @param n How many lines to print
+ * @param out Where to print
+ */
+void history_print_last(struct history *history, size_t n, FILE *out) {
+    history_load(history);
+    if (history->count == 0) {
+        fprintf(stderr, "Command history is empty.\n");
+        return;
+    }
+    for (size_t i = n < history->count ? history->count - n : 0; i < history->count; i++) {
+        fprintf(out, "%zu.) %s\n", i + 1, history->lines[i].text);
+    }
+}
+
+/**
+ * @brief Print the whole history, numbered from 1, the way the history
+ * builtin shows it.
+ *
+ * @param history The history
+ * @param out Where to print
+ */
+void history_print(struct history *history, FILE *out) {
+    history_print_last(history, SIZE_MAX, out);
+}
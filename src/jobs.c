@@ -0,0 +1,498 @@
+/**
+ * @file jobs.c
+ * @brief Job control for the shell lab: the job table, background jobs and
+ * the jobs, fg and bg builtins.
+ *
+ * Every pipeline the shell launches is a job. Foreground jobs are waited for
+ * right away and their slot is handed back, background jobs and jobs that
+ * were stopped with Ctrl-Z stay in the table until they finish. Slots keep
+ * their buffers when they are released so running a foreground command does
+ * not allocate once the table has warmed up.
+ *
+ * SIGCHLD is blocked and delivered through a signalfd instead of a handler.
+ * Finished background jobs are collected by jobs_reap between commands, and
+ * only when the signalfd says a child changed state, so a shell with no
+ * background jobs makes no extra waitpid calls. The descriptor can also be
+ * watched by an event loop.
+ *
+ * References:
+ * https://man7.org/linux/man-pages/man2/signalfd.2.html
+ * https://www.gnu.org/software/libc/manual/html_node/Implementing-a-Shell.html
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "lab.h"
+
+/**
+ * @brief Initialize an empty job table. SIGCHLD is blocked and a
+ * non-blocking signalfd is created to receive it. Children get an empty
+ * signal mask when they are launched.
+ *
+ * @param table The table to initialize
+ */
+void jobs_init(struct job_table *table) {
+    table->jobs = NULL;
+    table->cap = 0;
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    table->sigchld_fd = fd_move_high(signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC));
+}
+
+/**
+ * @brief Release the job table. Jobs that are still running are left alone.
+ *
+ * @param table The table to destroy
+ */
+void jobs_destroy(struct job_table *table) {
+    for (size_t i = 0; i < table->cap; i++) {
+        if (table->jobs[i].cgroup_fd >= 0) {
+            close(table->jobs[i].cgroup_fd); // still running, the cgroup stays with it
+        }
+        free(table->jobs[i].procs);
+        free(table->jobs[i].command);
+    }
+    free(table->jobs);
+    if (table->sigchld_fd >= 0) {
+        close(table->sigchld_fd);
+    }
+    table->jobs = NULL;
+    table->cap = 0;
+    table->sigchld_fd = -1;
+}
+
+/**
+ * @brief Reserve a slot for a new job. The lowest free slot is used so job
+ * numbers stay small. The job gets a copy of the shell's limits. The
+ * returned pointer is only valid until the next call to job_new.
+ *
+ * @param sh The shell
+ * @return The new job in the JOB_RUNNING state with no processes, or NULL
+ * if the table could not grow
+ */
+struct job *job_new(struct shell *sh) {
+    struct job_table *table = &sh->jobs;
+    size_t slot = 0;
+    while (slot < table->cap && table->jobs[slot].state != JOB_FREE) {
+        slot++;
+    }
+    if (slot == table->cap) {
+        size_t old_cap = table->cap;
+        if (grow_buffer((void **)&table->jobs, &table->cap, slot + 1, sizeof(struct job)) != 0) {
+            return NULL;
+        }
+        memset(table->jobs + old_cap, 0, (table->cap - old_cap) * sizeof(struct job));
+        for (size_t i = old_cap; i < table->cap; i++) {
+            table->jobs[i].cgroup_fd = -1;
+        }
+    }
+    struct job *job = &table->jobs[slot];
+    job->id = (int)slot + 1;
+    job->state = JOB_RUNNING;
+    job->pgid = 0;
+    job->nprocs = 0;
+    job->last_pid = -1;
+    job->status = 127; // until the last stage reports, it could not be started
+    job->background = false;
+    memset(&job->usage, 0, sizeof(job->usage));
+    job->limits = sh->limits;
+    if (job->command) {
+        job->command[0] = '\0';
+    }
+    return job;
+}
+
+/**
+ * @brief Give a job's slot back to the table. The buffers stay with the
+ * slot for the next job that uses it, its cgroup is removed.
+ *
+ * @param job The job to release
+ */
+void job_release(struct job *job) {
+    job_limits_release(job);
+    job->state = JOB_FREE;
+}
+
+/**
+ * @brief Add a launched process to a job.
+ *
+ * @param job The job
+ * @param pid The process that was launched
+ * @return 0 on success, -1 if the process list could not grow
+ */
+int job_add_proc(struct job *job, pid_t pid) {
+    if (grow_buffer((void **)&job->procs, &job->procs_cap, job->nprocs + 1, sizeof(struct job_proc)) != 0) {
+        return -1;
+    }
+    job->procs[job->nprocs].pid = pid;
+    job->procs[job->nprocs].state = JOB_RUNNING;
+    job->nprocs++;
+    return 0;
+}
+
+/**
+ * @brief Store the command text shown by jobs, rebuilt from the argument
+ * arrays of the stages. Only done when a job becomes visible, so plain
+ * foreground commands never pay for it.
+ *
+ * @param job The job
+ * @param stages The argument array of each stage
+ * @param nstages Number of stages
+ */
+void job_set_command(struct job *job, char ***stages, size_t nstages) {
+    size_t length = 0;
+    for (size_t i = 0; i < nstages; i++) {
+        for (char **arg = stages[i]; *arg; arg++) {
+            length += strlen(*arg) + 1;
+        }
+        length += 2; // "| "
+    }
+    if (grow_buffer((void **)&job->command, &job->command_cap, length + 1, sizeof(char)) != 0) {
+        return;
+    }
+    char *out = job->command;
+    for (size_t i = 0; i < nstages; i++) {
+        if (i > 0) {
+            out = stpcpy(out, "| ");
+        }
+        for (char **arg = stages[i]; *arg; arg++) {
+            out = stpcpy(out, *arg);
+            *out++ = ' ';
+        }
+    }
+    if (out > job->command) {
+        out--; // drop the trailing space
+    }
+    *out = '\0';
+}
+
+/**
+ * @brief Helper function to work out the state of a job from the states of
+ * its processes.
+ *
+ * @param job The job to update
+ */
+static void update_job_state(struct job *job) {
+    bool running = false;
+    bool stopped = false;
+    for (size_t i = 0; i < job->nprocs; i++) {
+        running |= job->procs[i].state == JOB_RUNNING;
+        stopped |= job->procs[i].state == JOB_STOPPED;
+    }
+    job->state = running ? JOB_RUNNING : stopped ? JOB_STOPPED : JOB_DONE;
+}
+
+/**
+ * @brief Helper function to turn a wait status into a shell exit status.
+ * A child killed or stopped by a signal gets 128 plus the signal number.
+ *
+ * @param wstatus The status reported by waitpid
+ * @return The exit status
+ */
+static int exit_status(int wstatus) {
+    if (WIFEXITED(wstatus)) {
+        return WEXITSTATUS(wstatus);
+    }
+    if (WIFSIGNALED(wstatus)) {
+        return 128 + WTERMSIG(wstatus);
+    }
+    if (WIFSTOPPED(wstatus)) {
+        return 128 + WSTOPSIG(wstatus);
+    }
+    return EXIT_FAILURE;
+}
+
+/**
+ * @brief Helper function to record a wait status in the job it belongs to.
+ *
+ * @param job The job owning the process
+ * @param proc The process that changed state
+ * @param wstatus The status reported by wait4
+ * @param usage The resource usage reported by wait4, may be NULL
+ */
+static void record_status(struct job *job, struct job_proc *proc, int wstatus, const struct rusage *usage) {
+    if (usage) {
+        rusage_add(&job->usage, usage);
+    }
+    if (WIFSTOPPED(wstatus)) {
+        proc->state = JOB_STOPPED;
+    } else if (WIFCONTINUED(wstatus)) {
+        proc->state = JOB_RUNNING;
+    } else {
+        proc->state = JOB_DONE;
+    }
+    if (proc->pid == job->last_pid || WIFSTOPPED(wstatus)) {
+        job->status = exit_status(wstatus);
+    }
+    update_job_state(job);
+}
+
+/**
+ * @brief Record a status reported by wait4 for any child of the shell.
+ *
+ * @param sh The shell
+ * @param pid The child that changed state
+ * @param wstatus The status reported by wait4
+ * @param usage The resource usage reported by wait4, may be NULL
+ * @return The job the child belongs to, or NULL if no job owns it
+ */
+struct job *job_update(struct shell *sh, pid_t pid, int wstatus, const struct rusage *usage) {
+    struct job_table *table = &sh->jobs;
+    for (size_t i = 0; i < table->cap; i++) {
+        struct job *job = &table->jobs[i];
+        if (job->state == JOB_FREE) {
+            continue;
+        }
+        for (size_t p = 0; p < job->nprocs; p++) {
+            if (job->procs[p].pid == pid) {
+                record_status(job, &job->procs[p], wstatus, usage);
+                return job;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Print a job the way bash does, for example
+ * "[1]   Running                 sleep 10 &".
+ *
+ * @param job The job to print
+ * @param out Where to print
+ */
+void job_print(const struct job *job, FILE *out) {
+    const char *state = job->state == JOB_RUNNING ? "Running" : job->state == JOB_STOPPED ? "Stopped" : "Done";
+    fprintf(out, "[%d]   %-24s%s%s\n", job->id, state, job->command ? job->command : "",
+            job->state == JOB_RUNNING ? " &" : "");
+}
+
+/**
+ * @brief Collect every child that changed state without blocking and update
+ * the job table. Background jobs that finished are reported when the shell
+ * is interactive and then released. When the signalfd shows no SIGCHLD
+ * arrived this returns without calling waitpid.
+ *
+ * @param sh The shell
+ */
+void jobs_reap(struct shell *sh) {
+    struct job_table *table = &sh->jobs;
+    if (table->sigchld_fd >= 0) {
+        struct signalfd_siginfo info;
+        bool signalled = false;
+        // Signals coalesce, one read per pending SIGCHLD is enough to know waitpid has work.
+        while (read(table->sigchld_fd, &info, sizeof(info)) == sizeof(info)) {
+            signalled = true;
+        }
+        if (!signalled) {
+            return;
+        }
+    }
+    int wstatus;
+    pid_t pid;
+    struct rusage usage;
+    while ((pid = wait4(-1, &wstatus, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        job_update(sh, pid, wstatus, &usage);
+    }
+    for (size_t i = 0; i < table->cap; i++) {
+        struct job *job = &table->jobs[i];
+        if (job->state == JOB_DONE && job->background) {
+            if (sh->shell_is_interactive) {
+                job_print(job, stderr);
+            }
+            job_release(job);
+        }
+    }
+}
+
+/**
+ * @brief Helper function to send a signal to every process of a job. With
+ * job control the whole process group gets it at once.
+ *
+ * @param sh The shell
+ * @param job The job to signal
+ * @param sig The signal to send
+ */
+static void signal_job(struct shell *sh, struct job *job, int sig) {
+    if (sh->shell_is_interactive && job->pgid > 0) {
+        kill(-job->pgid, sig);
+        return;
+    }
+    for (size_t i = 0; i < job->nprocs; i++) {
+        if (job->procs[i].state != JOB_DONE) {
+            kill(job->procs[i].pid, sig);
+        }
+    }
+}
+
+/**
+ * @brief Wait for a job in the foreground. The job gets the terminal while
+ * it runs and the shell takes it back afterwards. A job that finishes is
+ * released, a job that is stopped stays in the table and becomes a
+ * background job, the caller reports it.
+ *
+ * @param sh The shell
+ * @param job The job to wait for
+ * @return The exit status of the last stage, or 128 plus the signal number
+ * if the job was stopped
+ */
+int job_wait(struct shell *sh, struct job *job) {
+    uint64_t start = sh_now_ns();
+    job->background = false;
+    if (sh->shell_is_interactive && job->pgid > 0) {
+        tcsetpgrp(sh->shell_terminal, job->pgid);
+    }
+    while (job->state == JOB_RUNNING) {
+        struct job_proc *proc = NULL;
+        for (size_t i = 0; i < job->nprocs && !proc; i++) {
+            if (job->procs[i].state == JOB_RUNNING) {
+                proc = &job->procs[i];
+            }
+        }
+        int wstatus = 0;
+        struct rusage usage;
+        // wait4 costs the same as waitpid and also says what the child used.
+        pid_t rval = wait4(proc->pid, &wstatus, WUNTRACED, &usage);
+        if (rval == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Wait pid failed with -1\n");
+            proc->state = JOB_DONE; // nothing left to wait for
+            update_job_state(job);
+            continue;
+        }
+        record_status(job, proc, wstatus, &usage);
+    }
+    // get control of the shell, with the terminal modes it had before the job
+    if (sh->shell_is_interactive) {
+        tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
+        tcsetattr(sh->shell_terminal, TCSADRAIN, &sh->shell_tmodes);
+    }
+    sh_stat_record(sh, STAT_WAIT, sh_now_ns() - start);
+    if (sh->timing.active) {
+        rusage_add(&sh->timing.children, &job->usage);
+    }
+    int status = job->status;
+    if (job->state == JOB_DONE) {
+        job_release(job);
+    } else {
+        job->background = true; // stopped, it is reported like a background job from now on
+    }
+    return status;
+}
+
+/**
+ * @brief Helper function to find the job a fg or bg argument names. "%n" and
+ * "n" are job numbers, no argument means the most recent job.
+ *
+ * @param sh The shell
+ * @param arg The argument, may be NULL
+ * @param name The builtin name for error messages
+ * @return The job, or NULL after printing an error
+ */
+static struct job *find_job(struct shell *sh, const char *arg, const char *name) {
+    struct job_table *table = &sh->jobs;
+    if (!arg) {
+        for (size_t i = table->cap; i-- > 0;) {
+            if (table->jobs[i].state == JOB_RUNNING || table->jobs[i].state == JOB_STOPPED) {
+                return &table->jobs[i];
+            }
+        }
+        fprintf(stderr, "%s: current: no such job\n", name);
+        return NULL;
+    }
+    size_t id = strtoul(arg[0] == '%' ? arg + 1 : arg, NULL, 10);
+    if (id == 0 || id > table->cap || table->jobs[id - 1].state == JOB_FREE || table->jobs[id - 1].state == JOB_DONE) {
+        fprintf(stderr, "%s: %s: no such job\n", name, arg);
+        return NULL;
+    }
+    return &table->jobs[id - 1];
+}
+
+/**
+ * @brief Helper function to mark every stopped process of a job running
+ * again and send it SIGCONT.
+ *
+ * @param sh The shell
+ * @param job The job to continue
+ */
+static void continue_job(struct shell *sh, struct job *job) {
+    for (size_t i = 0; i < job->nprocs; i++) {
+        if (job->procs[i].state == JOB_STOPPED) {
+            job->procs[i].state = JOB_RUNNING;
+        }
+    }
+    update_job_state(job);
+    signal_job(sh, job, SIGCONT);
+}
+
+/**
+ * @brief The jobs builtin, lists the background and stopped jobs.
+ *
+ * @param sh The shell
+ * @param argv The jobs command and its arguments
+ * @return Always 0
+ */
+int builtin_jobs(struct shell *sh, char **argv) {
+    UNUSED(argv);
+    jobs_reap(sh);
+    for (size_t i = 0; i < sh->jobs.cap; i++) {
+        struct job *job = &sh->jobs.jobs[i];
+        if (job->state == JOB_RUNNING || job->state == JOB_STOPPED) {
+            job_print(job, stdout);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief The fg builtin, continues a job in the foreground and waits for it.
+ *
+ * @param sh The shell
+ * @param argv The fg command and its arguments
+ * @return The exit status of the job, 1 if there is no such job
+ */
+int builtin_fg(struct shell *sh, char **argv) {
+    struct job *job = find_job(sh, argv[1], "fg");
+    if (!job) {
+        return EXIT_FAILURE;
+    }
+    printf("%s\n", job->command ? job->command : "");
+    fflush(stdout);
+    if (sh->shell_is_interactive && job->pgid > 0) {
+        tcsetpgrp(sh->shell_terminal, job->pgid); // before SIGCONT so it can read the terminal
+    }
+    continue_job(sh, job);
+    int status = job_wait(sh, job);
+    if (job->state == JOB_STOPPED) {
+        fprintf(stderr, "\n");
+        job_print(job, stderr);
+    }
+    return status;
+}
+
+/**
+ * @brief The bg builtin, continues a stopped job in the background.
+ *
+ * @param sh The shell
+ * @param argv The bg command and its arguments
+ * @return 0 on success, 1 if there is no such job
+ */
+int builtin_bg(struct shell *sh, char **argv) {
+    struct job *job = find_job(sh, argv[1], "bg");
+    if (!job) {
+        return EXIT_FAILURE;
+    }
+    job->background = true;
+    continue_job(sh, job);
+    printf("[%d] %s &\n", job->id, job->command ? job->command : "");
+    return 0;
+}
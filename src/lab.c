@@ -5,19 +5,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "lab.h"
-#include <readline/readline.h> 
-#include <readline/history.h>
 #include <pwd.h>
 #include <errno.h>
 #include <ctype.h>
 #include <signal.h>
 
-
-  // TODO -- Extra Credit: change fork() to posix_spawn.
-
-#define VALID_OPTIONS "v"  // Defines the valid option(s) for getopt
+#define VALID_OPTIONS "vfhTUp:c:J:S:C:A:"  // Defines the valid option(s) for getopt
 
 /**
  * @brief Set the shell prompt. This function will attempt to load a prompt
@@ -46,16 +42,19 @@ char *get_prompt(const char *env) {
  * the real user ID of the calling process, and the getpwuid() function searches the user database for 
  * an entry with a matching uid.
  * 
+ * The cd builtin uses sh_chdir in dirs.c instead, which also keeps the
+ * shell's cached cwd up to date.
+ *
  * References:
  * https://man7.org/linux/man-pages/man2/getuid.2.html
  * https://man7.org/linux/man-pages/man3/getpwuid.3p.html
  *
- * @param dir The directory to change to
+ * @param dir The cd argument list, dir[1] is the directory to change to
  * @return  On success, zero is returned.  On error, -1 is returned, and
  * errno is set to indicate the error.
  */
 int change_dir(char **dir) {
-    const char *path = dir[0]; // target directory
+    const char *path = dir[1]; // target directory, dir[0] is the "cd" command itself
 
     // If no directory is provided, default to HOME
     if (!path) {
@@ -80,31 +79,19 @@ int change_dir(char **dir) {
     return 0;
 }
 
-/**
- * @brief Helper function to free allocated memory on strdup failure.
- *
- * @param args array of allocated strings.
- * @param count Number of strings.
- * @param line_copy duplicated input line.
- * @return NULL, so that we can return NULL in the calling function.
- */
-static char **strdup_failure(char **args, size_t count, char *line_copy) {
-    perror("cmd_parse: strdup failed");
-    // Free each argument string allocated by strdup in cmd_parse.
-    for (size_t i = 0; i < count; i++) {
-        free(args[i]);
-    }
-    free(args);
-    free(line_copy);
-    return NULL;
-}
-
 /**
  * @brief Convert line read from the user into to format that will work with
  * execvp. We limit the number of arguments to ARG_MAX loaded from sysconf.
  * This function allocates memory that must be reclaimed with the cmd_free
  * function.
  *
+ * The argument array and the text of every argument live in one block: the
+ * NULL terminated pointer array comes first, then the text of the line,
+ * which is tokenized right there, and the kind of every token. The number of
+ * tokens is bounded with cmd_lex_bound before the block is allocated, so
+ * parsing a command costs a single malloc no matter how many arguments it
+ * has.
+ *
  * @param line The line to process
  *
  * @return The line read in a format suitable for exec
@@ -113,55 +100,249 @@ char **cmd_parse(const char *line) {
     if (!line) { // null line
         return NULL;
     }
-
-    long arg_max = sysconf(_SC_ARG_MAX);  // TODO - man page
-    char **args = malloc(arg_max * sizeof(char*)); // TODO: Experiment with calloc?
-    if (!args) { // calloc failure
+    size_t slots = cmd_lex_bound(line) + 1; // +1 for the NULL terminator
+    size_t length = strlen(line);
+    size_t table = slots * sizeof(char *);
+    size_t kinds_at = (table + length + 1 + _Alignof(enum token_kind) - 1) & ~(_Alignof(enum token_kind) - 1);
+    char **args = malloc(kinds_at + slots * sizeof(enum token_kind));
+    if (!args) { // malloc failure
         perror("cmd_parse: malloc failed");
         return NULL;
     }
-    // Set array pointers to null
-    for (long i = 0; i < arg_max; i++) {
-        args[i] = NULL;
-    }    
-    // Save a mutable copy of the line. 
-    char *line_copy = strdup(line);
-    if (!line_copy) {
-        perror("cmd_parse: strdup failed");
+    // A context over the block, big enough that cmd_lex never grows it.
+    struct parse_ctx ctx;
+    parse_ctx_init(&ctx);
+    ctx.argv = args;
+    ctx.argv_cap = slots;
+    ctx.kinds = (enum token_kind *)((char *)args + kinds_at);
+    ctx.kinds_cap = slots;
+    char *text = (char *)args + table;
+    memcpy(text, line, length + 1);
+    if (cmd_lex(&ctx, text, text) < 0) {
         free(args);
         return NULL;
     }
-    // Parse tokens into args array. Continue while tokens remain and we haven't reached arg_max limit.
-    size_t index = 0; // array index and counter, tracking number of args parsed.
-    char *current_token = strtok(line_copy, " \t"); // tokenize by spaces and tabs
-    // TODO strtok_r, thread safety
-    while ( current_token && (index < (size_t)(arg_max-1)) ) {
-        // Copy the current token into the args array and move to the next token.
-        args[index++] = strdup(current_token);
-        if (!args[index]) { // strdup failed
-            return strdup_failure(args, index, line_copy);
-        }
-        current_token = strtok(NULL, " \t");
-    }
-    // Clean-up and return.
-    args[index] = NULL;
-    free(line_copy);
     return args;
 }
 
 /**
- * @brief Free the line that was constructed with parse_cmd
+ * @brief Initialize an empty parse context. No memory is allocated until
+ * the first line is parsed.
  *
- * @param line the line to free
+ * @param ctx The context to initialize
  */
-void cmd_free(char **line) {
+void parse_ctx_init(struct parse_ctx *ctx) {
+    ctx->store = NULL;
+    ctx->store_cap = 0;
+    ctx->argv = NULL;
+    ctx->argv_cap = 0;
+    ctx->kinds = NULL;
+    ctx->kinds_cap = 0;
+    ctx->count = 0;
+    ctx->stages = NULL;
+    ctx->stages_cap = 0;
+    ctx->nstages = 0;
+    ctx->redirects = NULL;
+    ctx->redirects_cap = 0;
+    ctx->stage_redirects = NULL;
+    ctx->stage_redirects_cap = 0;
+    ctx->defer_errors = false;
+    ctx->error = NULL;
+}
+
+/**
+ * @brief Release the buffers held by a parse context.
+ *
+ * @param ctx The context to destroy
+ */
+void parse_ctx_destroy(struct parse_ctx *ctx) {
+    free(ctx->store);
+    free(ctx->argv);
+    free(ctx->kinds);
+    free(ctx->stages);
+    free(ctx->redirects);
+    free(ctx->stage_redirects);
+    parse_ctx_init(ctx);
+}
+
+/**
+ * @brief Grow a buffer so it holds at least needed elements. The capacity
+ * is doubled so that growing is amortized and a buffer that is reused
+ * quickly settles on a size that fits every use.
+ *
+ * @param buffer The buffer to grow, replaced on success
+ * @param capacity The current capacity in elements, updated on success
+ * @param needed The minimum number of elements required
+ * @param size The size of one element
+ * @return 0 on success, -1 if the allocation failed
+ */
+int grow_buffer(void **buffer, size_t *capacity, size_t needed, size_t size) {
+    if (needed <= *capacity) { // already big enough, the common case
+        return 0;
+    }
+    size_t new_capacity = *capacity ? *capacity : 16;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    void *grown = realloc(*buffer, new_capacity * size);
+    if (!grown) {
+        return -1;
+    }
+    *buffer = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+/**
+ * @brief Same as cmd_parse but the result is stored in the context's
+ * buffers instead of a new allocation. The returned array is owned by the
+ * context and is only valid until the next call with the same context.
+ *
+ * @param ctx The context providing the storage
+ * @param line The line to process
+ * @return The line read in a format suitable for exec, or NULL on error
+ */
+char **cmd_parse_into(struct parse_ctx *ctx, const char *line) {
     if (!line) { // null line
-        return;
+        return NULL;
+    }
+    // A word is never longer than its input, the whole line is enough room for all of them.
+    if (grow_buffer((void **)&ctx->store, &ctx->store_cap, strlen(line) + 1, sizeof(char)) != 0) {
+        perror("cmd_parse: realloc failed");
+        return NULL;
+    }
+    return cmd_lex(ctx, line, ctx->store) < 0 ? NULL : ctx->argv;
+}
+
+/**
+ * @brief Parse a line in place. The words are written back into the line
+ * with their quotes removed and null terminated, and ctx->argv points
+ * straight into line, so no token is copied to another buffer. Only the
+ * argument array lives in the context. Operators point at constant strings
+ * since their character in the line may have been used to terminate the
+ * word in front of them.
+ *
+ * @param ctx The context providing the argument array
+ * @param line The line to process, modified
+ * @return The line read in a format suitable for exec, or NULL on error
+ */
+char **cmd_parse_inplace(struct parse_ctx *ctx, char *line) {
+    if (!line) { // null line
+        return NULL;
+    }
+    return cmd_lex(ctx, line, line) < 0 ? NULL : ctx->argv;
+}
+
+/**
+ * @brief Split the arguments last parsed into the context into the stages
+ * of a pipeline. Every "|" token in ctx->argv is replaced with NULL so each
+ * stage is a NULL terminated argument array pointing into the context, no
+ * strings are copied. The stages are stored in ctx->stages.
+ *
+ * @param ctx The context holding the parsed line
+ * @return The number of stages, 0 for an empty line, or -1 if a stage is
+ * empty such as in "ls |" or "| wc"
+ */
+int cmd_pipeline(struct parse_ctx *ctx) {
+    return cmd_pipeline_at(ctx, 0);
+}
+
+/**
+ * @brief Helper function to add the start of a stage to the context,
+ * together with where its redirections start.
+ *
+ * @param ctx The context
+ * @param stage The stage
+ * @param nredirects Redirections collected so far
+ * @return 0 on success, -1 if the allocation failed
+ */
+static int add_stage(struct parse_ctx *ctx, char **stage, size_t nredirects) {
+    if (grow_buffer((void **)&ctx->stages, &ctx->stages_cap, ctx->nstages + 1, sizeof(char**)) != 0 ||
+        grow_buffer((void **)&ctx->stage_redirects, &ctx->stage_redirects_cap, ctx->nstages + 2, sizeof(size_t)) != 0) {
+        perror("cmd_pipeline: realloc failed");
+        return -1;
+    }
+    ctx->stages[ctx->nstages++] = stage;
+    ctx->stage_redirects[ctx->nstages] = nredirects;
+    return 0;
+}
+
+/**
+ * @brief Split one command of a list into the stages of a pipeline, see
+ * cmd_pipeline. Only "|" operators count, a quoted "|" is a word. Each
+ * redirection, with its descriptor number and target, is moved to
+ * ctx->redirects and the words after it move down to close the gap.
+ *
+ * @param ctx The context holding the parsed line
+ * @param first Index of the first token of the command, which ends at the
+ * next NULL
+ * @return The number of stages, 0 for an empty command, or -1 if a stage
+ * is empty or a redirection has no target
+ */
+int cmd_pipeline_at(struct parse_ctx *ctx, size_t first) {
+    ctx->nstages = 0;
+    if (!ctx->argv || !ctx->argv[first]) {
+        return 0;
     }
-    // Free each argument string allocated by strdup in cmd_parse.
-    for (size_t i = 0; line[i]; i++) {
-        free(line[i]);
+    if (grow_buffer((void **)&ctx->stage_redirects, &ctx->stage_redirects_cap, 1, sizeof(size_t)) != 0) {
+        perror("cmd_pipeline: realloc failed");
+        return -1;
     }
+    ctx->stage_redirects[0] = 0;
+    size_t nredirects = 0;
+    size_t stage = first; // start of the stage being scanned
+    size_t out = first;   // where the next word of the stage goes
+    bool empty = false;   // a stage has redirections and no words
+    for (size_t i = first; ; i++) {
+        enum token_kind kind = ctx->argv[i] ? ctx->kinds[i] : TOK_END;
+        if (kind == TOK_WORD) {
+            ctx->argv[out] = ctx->argv[i];
+            ctx->kinds[out++] = TOK_WORD;
+            continue;
+        }
+        if (kind != TOK_PIPE && kind != TOK_END) { // a redirection, its target is the next word
+            int fd = kind == TOK_LESS || kind == TOK_LESS_AND ? STDIN_FILENO : STDOUT_FILENO;
+            if (kind == TOK_IO_NUMBER) {
+                fd = atoi(ctx->argv[i++]);
+                kind = ctx->kinds[i];
+                fd = fd >= 0 ? fd : STDOUT_FILENO;
+            }
+            if (!ctx->argv[i + 1]) { // "ls >", the shell turns the line away before it gets here
+                return -1;
+            }
+            if (grow_buffer((void **)&ctx->redirects, &ctx->redirects_cap, nredirects + 1, sizeof(struct redirect)) != 0) {
+                perror("cmd_pipeline: realloc failed");
+                return -1;
+            }
+            ctx->redirects[nredirects++] = (struct redirect){fd, kind, ctx->argv[++i], -1};
+            continue;
+        }
+        if (out == stage) {
+            if (nredirects == ctx->stage_redirects[ctx->nstages]) { // nothing between two bars
+                return -1;
+            }
+            empty = true;
+        }
+        char **start = ctx->argv + stage;
+        ctx->argv[out] = NULL; // terminate this stage in place
+        if (add_stage(ctx, start, nredirects) != 0) {
+            return -1;
+        }
+        if (kind == TOK_END) {
+            break;
+        }
+        stage = out = out + 1;
+    }
+    return empty && ctx->nstages > 1 ? -1 : (int)ctx->nstages;
+}
+
+/**
+ * @brief Free the line that was constructed with parse_cmd. The arguments
+ * share one allocation with the array so a single free releases everything.
+ *
+ * @param line the line to free
+ */
+void cmd_free(char **line) {
     free(line);
 }
 
@@ -200,31 +381,292 @@ char *trim_white(char *line) {
 }
 
 /**
- * @brief Prints the command history stored by the Readline library.
- * 
- * HIST_ENTRY is a data type provided by the GNU Readline library that represents a single command the 
- * user previously typed into the shell.
- * 
- * Blank lines are not saved in the history, so they will not be printed by this function. If there are 
- * blank lines, they are handled in main.c.
- * 
- * Reference:
- * https://tiswww.cwru.edu/php/chet/readline/history.html
+ * @brief The exit builtin. Tears the shell down and exits with the given
+ * status, or the status of the last command when there is none. Run in a
+ * forked stage, as in `exit | cat`, it ends that process alone and leaves
+ * the teardown, the history and the -J dump to the shell.
+ *
+ * @param sh The shell
+ * @param argv The exit command and its arguments
+ * @return Does not return
+ */
+static int builtin_exit(struct shell *sh, char **argv) {
+    int status = argv[1] ? atoi(argv[1]) : sh->last_status;
+    if (getpid() != sh->shell_pid) {
+        fflush(NULL); // a stage of "exit | cat" or "exit &" ends only itself, the shell tears down
+        _exit(status);
+    }
+    sh_destroy(sh);
+    exit(status);
+}
+
+/**
+ * @brief The history builtin. Prints the whole command history, the last n
+ * commands with `history n`, or the commands containing text with
+ * `history -s text`. Blank lines are never added to the history so they
+ * are not printed.
+ *
+ * @param sh The shell
+ * @param argv The history command and its arguments
+ * @return 0, 1 if -s found nothing or 2 for bad arguments
+ */
+static int builtin_history(struct shell *sh, char **argv) {
+    if (!argv[1]) {
+        history_print(&sh->history, stdout);
+        return 0;
+    }
+    if (strcmp(argv[1], "-s") == 0 && argv[2] && !argv[3]) {
+        size_t *matches = NULL;
+        size_t cap = 0;
+        size_t count = history_search(&sh->history, argv[2], &matches, &cap);
+        for (size_t i = 0; i < count; i++) {
+            printf("%zu.) %s\n", matches[i] + 1, sh->history.lines[matches[i]].text);
+        }
+        free(matches);
+        return count > 0 ? 0 : 1;
+    }
+    char *end;
+    long n = strtol(argv[1], &end, 10);
+    if (*end || end == argv[1] || n < 0 || argv[2]) {
+        fprintf(stderr, "history: usage: history [n | -s text]\n");
+        return 2;
+    }
+    history_print_last(&sh->history, (size_t)n, stdout);
+    return 0;
+}
+
+/**
+ * @brief The hash builtin. With no arguments the cached commands are
+ * printed, `hash -r` forgets them all and `hash name...` resolves each name
+ * again and adds it to the cache.
+ *
+ * @param sh The shell
+ * @param argv The hash command and its arguments
+ * @return 0 on success, 1 if a name could not be found
+ */
+static int builtin_hash(struct shell *sh, char **argv) {
+    sh->path_cache.env = sh_env(sh); // PATH as the shell sees it
+    if (!argv[1]) {
+        path_cache_print(&sh->path_cache);
+        return 0;
+    }
+    if (strcmp(argv[1], "-r") == 0) {
+        path_cache_clear(&sh->path_cache);
+        return 0;
+    }
+    int status = 0;
+    for (size_t i = 1; argv[i]; i++) {
+        path_cache_forget(&sh->path_cache, argv[i]);
+        if (!path_cache_lookup(&sh->path_cache, argv[i])) {
+            fprintf(stderr, "hash: %s: not found\n", argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+static int builtin_help(struct shell *sh, char **argv);
+static int builtin_enable(struct shell *sh, char **argv);
+
+/**
+ * @brief Every builtin the shell knows about. This is the only place a
+ * builtin has to be registered: do_builtin, help and parse_args all work
+ * from this table.
+ */
+static const struct builtin builtins[] = {
+    {"bg", builtin_bg, "bg [%n]", "continue a stopped job in the background", false},
+    {"cat", builtin_cat, "cat [file ...]", "copy files to standard output in the shell", true},
+    {"cd", builtin_cd, "cd [dir | -]", "change the current directory, HOME by default", false},
+    {"cp", builtin_cp, "cp source ... target", "copy files in the shell", true},
+    {"dirs", builtin_dirs, "dirs [-c]", "show or clear the directory stack", false},
+    {"enable", builtin_enable, "enable [-n] [name ...]", "turn builtins on, off with -n, or list them", false},
+    {"exit", builtin_exit, "exit [n]", "exit the shell with status n", false},
+    {"export", builtin_export, "export [name[=value] ...]", "export variables to the commands, or list them", false},
+    {"fg", builtin_fg, "fg [%n]", "continue a job in the foreground", false},
+    {"hash", builtin_hash, "hash [-r] [name ...]", "show, reset or add to the PATH lookup cache", false},
+    {"help", builtin_help, "help", "list the builtin commands", false},
+    {"history", builtin_history, "history [n | -s text]", "print the command history, the last n or those containing text", false},
+    {"jobs", builtin_jobs, "jobs", "list the background and stopped jobs", false},
+    {"limit", builtin_limit, "limit [-cmtn value] [-r] [cmd ...]", "show or set the cpu, memory and file limits of jobs", false},
+    {"parallel", builtin_parallel, "parallel [-j n] [--] cmd [::: cmd ...]", "run commands with at most n at once", false},
+    {"popd", builtin_popd, "popd", "go back to the directory on top of the stack", false},
+    {"pushd", builtin_pushd, "pushd [dir]", "save the current directory on the stack and change to dir", false},
+    {"pwd", builtin_pwd, "pwd [-L | -P]", "print the current directory", false},
+    {"shstat", builtin_shstat, "shstat [-j | -r]", "show, as JSON or reset the shell's latency histograms", false},
+    {"unset", builtin_unset, "unset name ...", "remove variables", false},
+};
+
+#define BUILTIN_COUNT (sizeof(builtins) / sizeof(builtins[0]))
+#define BUILTIN_SLOT_BITS 6 // the perfect hash table has 2^6 slots, more than BUILTIN_COUNT
+#define BUILTIN_SLOTS (1u << BUILTIN_SLOT_BITS)
+
+#define BUILTIN_SEED_TRIES 4096 // multipliers to try before settling for probing
+
+static unsigned char builtin_slots[BUILTIN_SLOTS]; // index into builtins + 1, 0 marks an empty slot
+static bool builtin_flipped[BUILTIN_COUNT]; // turned the other way with enable, an optional one on, any other off
+static pthread_once_t builtin_once = PTHREAD_ONCE_INIT; // the slots are built once, whichever thread looks first
+static atomic_bool builtin_built; // set after the slots, so a lookup skips the call to pthread_once
+static unsigned builtin_seed;     // multiplier that makes the hash below collision free
+static size_t builtin_max_length; // names longer than this can't be builtins
+
+/**
+ * @brief Helper function to hash a command name from its length and its
+ * first, second and last characters. Cheap enough to run for every command.
+ * The slot is the top bits of the product, which depend on every bit of
+ * the key, so exit and export differ by their length alone.
+ *
+ * @param name The command name
+ * @param length Length of the name, must be at least 1
+ * @param seed The multiplier picked by build_builtin_slots
+ * @return The slot for the name
+ */
+static size_t builtin_hash_name(const char *name, size_t length, unsigned seed) {
+    unsigned key = ((unsigned)length << 24) | ((unsigned char)name[0] << 16) |
+                   ((unsigned char)name[length > 1] << 8) | (unsigned char)name[length - 1];
+    return (key * seed) >> (32 - BUILTIN_SLOT_BITS);
+}
+
+/**
+ * @brief Helper function to fill the slots with one multiplier. Collisions
+ * are resolved by linear probing.
+ *
+ * @param seed The multiplier to use
+ * @return True if every builtin landed in its home slot
+ */
+static bool fill_builtin_slots(unsigned seed) {
+    bool perfect = true;
+    memset(builtin_slots, 0, sizeof(builtin_slots));
+    for (size_t i = 0; i < BUILTIN_COUNT; i++) {
+        size_t length = strlen(builtins[i].name);
+        size_t slot = builtin_hash_name(builtins[i].name, length, seed);
+        while (builtin_slots[slot]) {
+            perfect = false;
+            slot = (slot + 1) & (BUILTIN_SLOTS - 1);
+        }
+        builtin_slots[slot] = (unsigned char)(i + 1);
+        if (length > builtin_max_length) {
+            builtin_max_length = length;
+        }
+    }
+    return perfect;
+}
+
+/**
+ * @brief Helper function to build the perfect hash table for the builtins.
+ * Tries multipliers until every builtin lands in its own slot, so a lookup
+ * is one hash and at most one strcmp no matter how many builtins there are.
+ * The table is fixed at compile time, so this runs once, through
+ * pthread_once: the read-ahead thread of batch.c may look up the first
+ * command while the shell does. builtin_built is set last, with release,
+ * so every later lookup costs a load instead of that call. If no multiplier works the last one is kept
+ * and lookups fall back to a short probe.
+ */
+static void build_builtin_slots(void) {
+    unsigned seed = 0x9E3779B1u;
+    for (int tries = 1; !fill_builtin_slots(seed) && tries < BUILTIN_SEED_TRIES; tries++) {
+        seed += 2; // odd multipliers only
+    }
+    builtin_seed = seed; // the slots were filled with this one, perfect or not
+    atomic_store_explicit(&builtin_built, true, memory_order_release);
+}
+
+/**
+ * @brief Helper function to find a builtin by name, whether it is on or
+ * off.
+ *
+ * @param name The command name
+ * @return The builtin, or NULL if name is not a builtin
+ */
+static const struct builtin *builtin_lookup(const char *name) {
+    if (!atomic_load_explicit(&builtin_built, memory_order_acquire)) {
+        pthread_once(&builtin_once, build_builtin_slots);
+    }
+    size_t length = strnlen(name, builtin_max_length + 1);
+    if (length == 0 || length > builtin_max_length) {
+        return NULL;
+    }
+    size_t slot = builtin_hash_name(name, length, builtin_seed);
+    while (builtin_slots[slot]) {
+        const struct builtin *builtin = &builtins[builtin_slots[slot] - 1];
+        if (strcmp(builtin->name, name) == 0) {
+            return builtin;
+        }
+        slot = (slot + 1) & (BUILTIN_SLOTS - 1);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Find a builtin by name. A builtin that is off is not found, so
+ * the command runs whatever program has its name.
+ *
+ * @param name The command name
+ * @return The builtin, or NULL if name is not a builtin that is on
  */
-void print_history() {
-    // Collect history entries.
-    HIST_ENTRY **history_entries = history_list(); 
-    // If no history entries, print error message.
-    if (!history_entries) {
-        fprintf(stderr, "Command history is empty.\n");
-        return;
+const struct builtin *builtin_find(const char *name) {
+    const struct builtin *builtin = builtin_lookup(name);
+    return builtin && builtin->optional == builtin_flipped[builtin - builtins] ? builtin : NULL;
+}
+
+/**
+ * @brief The enable builtin. With no names every builtin is listed with
+ * whether it is on, `enable name...` turns builtins on and `enable -n
+ * name...` turns them off. cat and cp are off until they are enabled: they
+ * run in the shell without a fork, but take no options and can't be
+ * interrupted from the terminal like a program.
+ *
+ * @param sh The shell
+ * @param argv The enable command and its arguments
+ * @return 0 on success, 1 if a name is not a builtin
+ */
+static int builtin_enable(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    bool off = argv[1] && strcmp(argv[1], "-n") == 0;
+    char **names = argv + 1 + off;
+    if (!*names) {
+        for (size_t i = 0; i < BUILTIN_COUNT; i++) {
+            printf("enable %s%s\n", builtins[i].optional != builtin_flipped[i] ? "-n " : "", builtins[i].name);
+        }
+        return 0;
     }
-    // Print history entries.
-    int index = 0;
-    while (history_entries[index]) {
-        printf("%d.) %s\n", index+1, history_entries[index]->line);
-        index++;
+    int status = 0;
+    for (; *names; names++) {
+        const struct builtin *builtin = builtin_lookup(*names);
+        if (!builtin || (off && builtin->run == builtin_enable)) {
+            fprintf(stderr, "enable: %s: %s\n", *names, builtin ? "can't be turned off" : "not a shell builtin");
+            status = 1;
+            continue;
+        }
+        builtin_flipped[builtin - builtins] = off != builtin->optional;
+    }
+    return status;
+}
+
+/**
+ * @brief Print every builtin with its usage and a one line description.
+ *
+ * @param out Where to print
+ */
+void builtins_print(FILE *out) {
+    for (size_t i = 0; i < BUILTIN_COUNT; i++) {
+        fprintf(out, "  %-24s %s\n", builtins[i].usage, builtins[i].help);
     }
+}
+
+/**
+ * @brief The help builtin, lists the builtin commands.
+ *
+ * @param sh The shell
+ * @param argv The help command and its arguments
+ * @return Always 0
+ */
+static int builtin_help(struct shell *sh, char **argv) {
+    UNUSED(sh);
+    UNUSED(argv);
+    printf("Builtin commands:\n");
+    builtins_print(stdout);
+    return 0;
+}
 
 /**
  * @brief Takes an argument list and checks if the first argument is a
@@ -233,6 +675,10 @@ void print_history() {
  * true. If the first argument is NOT a built in command this function will
  * return false.
  *
+ * The builtin is found with a perfect hash over the builtins table, so
+ * commands that fall through to exec pay the same small cost however many
+ * builtins there are. The builtin's exit status is stored in sh->last_status.
+ *
  * @param sh The shell
  * @param argv The command to check
  * @return True if the command was a built in command
@@ -242,24 +688,12 @@ bool do_builtin(struct shell *sh, char **argv) {
     if (!argv[0]) {
         return false;
     }
-    // Exit
-    if (strcmp(argv[0], "exit") == 0) {
-        sh_destroy(sh);
-        exit(EXIT_SUCCESS);
-    } 
-    // Change directory
-    if (strcmp(argv[0], "cd") == 0) {
-        // +1 below to skip argv[0], "cd", and provide only the directory argument, argv[1].
-        change_dir(argv+1);
-        return true;
-    }
-    // History
-    if (strcmp(argv[0], "history") == 0) {
-        print_history();
-        return true;
+    const struct builtin *builtin = builtin_find(argv[0]);
+    if (!builtin) {
+        return false;
     }
-
-    return false;
+    sh->last_status = builtin->run(sh, argv);
+    return true;
 }
 
 #include <signal.h>
@@ -279,6 +713,8 @@ static void setup_process_group(struct shell *sh) {
     setpgid(sh->shell_pgid, sh->shell_pgid);
     // Assign shell as the terminal's foreground process group.
     tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
+    // Remember the terminal modes so they can be restored after a job changed them.
+    tcgetattr(sh->shell_terminal, &sh->shell_tmodes);
 }
 
 /**
@@ -300,7 +736,8 @@ static void setup_signal_handling() {
  * process group. NOTE: This function will block until the shell is
  * in its own program group. Attaching a debugger will always cause
  * this function to fail because the debugger maintains control of
- * the subprocess it is debugging.
+ * the subprocess it is debugging. The options filled in by parse_args are
+ * left untouched.
  * 
  * "MY_PROMPT" is the name of the environment variable we are using.
  * 
@@ -309,17 +746,32 @@ static void setup_signal_handling() {
  * @param sh
  */
 void sh_init(struct shell *sh) {
-    // Allocate memory for the prompt and set it to the environment variable "MY_PROMPT". 
-    sh->prompt = get_prompt("MY_PROMPT"); // set shell's prompt with env variable
-    if (!sh->prompt) {
-        sh->prompt = strdup("shell>"); // default if env variable is not set
-    }
+    // The prompt from "MY_PROMPT" and readline itself are set up by the first prompt, batch runs never need them.
+    memset(&sh->prompt, 0, sizeof(sh->prompt));
+    // Start with an empty parse context, its buffers grow with the first lines read.
+    parse_ctx_init(&sh->parse);
+    // Commands are resolved against PATH once and remembered here.
+    path_cache_init(&sh->path_cache);
     // Set the shell to control the terminal's standard input
     sh->shell_terminal = STDIN_FILENO;
-    // Set up the process group and terminal control for the shell
-    setup_process_group(sh);
-    // Configure signals to be ignored by the shell
-    setup_signal_handling();
+    // Only a terminal with no -c command, script or socket to serve is an interactive session.
+    sh->shell_is_interactive = isatty(sh->shell_terminal) && !sh->command && !sh->script && !sh->server_socket;
+    sh->shell_pgid = getpgrp();
+    sh->shell_pid = getpid();
+    // SIGCHLD is read from a signalfd so background jobs are reaped between commands.
+    jobs_init(&sh->jobs);
+    // Only an interactive shell keeps HISTFILE, it is read on the first prompt.
+    if (sh->shell_is_interactive) {
+        history_init_env(&sh->history);
+    } else {
+        history_init(&sh->history, NULL);
+    }
+    if (sh->shell_is_interactive) {
+        // Set up the process group and terminal control for the shell
+        setup_process_group(sh);
+        // Configure signals to be ignored by the shell
+        setup_signal_handling();
+    }
 }
 
 /**
@@ -329,9 +781,19 @@ void sh_init(struct shell *sh) {
  * @param sh
  */
 void sh_destroy(struct shell *sh) {
-    free(sh->prompt); // free the prompt
-    // tcsetattr(sh->shell_terminal, TCSANOW, &sh->shell_tmodes);
-    // TODO - set attributess back to original
+    sh_stats_dump(sh); // -J, written before anything is torn down
+    prompt_destroy(&sh->prompt); // stop the prompt's VCS thread and free the segments
+    dirs_destroy(&sh->dirs); // free the cached directories and close the CDPATH descriptors
+    env_destroy(&sh->env); // free the variables, environ is given copies
+    line_cache_destroy(&sh->line_cache); // free the tokens of the recent lines
+    parse_ctx_destroy(&sh->parse); // free the reusable parse buffers
+    path_cache_destroy(&sh->path_cache); // free the PATH lookup cache
+    jobs_destroy(&sh->jobs); // free the job table
+    limits_destroy(sh); // close the cgroup jobs are made in
+    history_destroy(&sh->history); // append what is pending to HISTFILE
+    if (sh->shell_is_interactive) {
+        tcsetattr(sh->shell_terminal, TCSANOW, &sh->shell_tmodes); // set attributes back to original
+    }
     // TODO - shell code in Tassk 8, Linux library
     // TODO - exit?
 }
@@ -339,17 +801,33 @@ void sh_destroy(struct shell *sh) {
 /**
  * @brief Parse command line args from the user when the shell was launched.
  * 
- * This function processes command-line arguments using `getopt()` (see documentation link below). For
- * now, this function only enabled `-v` to print the shell version, but it is designed so that it is    
- * easy to add more arg options later. To do so, add a new case in the switch statement and add the arg  
- * to the VALID_OPTIONS constant at the top of this file.
+ * This function processes command-line arguments using `getopt()` (see documentation link below). It
+ * is designed so that it is easy to add more arg options later. To do so, add a new case in the switch
+ * statement and add the arg to the VALID_OPTIONS constant at the top of this file.
+ *
+ * Options:
+ *   -v  print the shell version and exit
+ *   -f  launch commands with fork() + execv() instead of posix_spawn()
+ *   -h  print the options and the builtin commands and exit
+ *   -T  time every command line, like prefixing it with `time`
+ *   -U  wait for events with io_uring instead of epoll, see event.c
+ *   -p  size in bytes to give every pipe buffer with F_SETPIPE_SZ
+ *   -c  run the given command line and exit
+ *   -J  write the shstat histograms as JSON to this file on exit, - for stderr
+ *   -S  serve command lines on this UNIX socket until SIGTERM, see server.c
+ *   -C  send the -c command line to the server on this socket instead
+ *   -A  read a script ahead on a thread: on, off or auto, see batch.c
+ *
+ * The first argument that is not an option is a script to run instead of
+ * reading commands from the terminal.
  *
  * https://www.gnu.org/software/libc/manual/html_node/Example-of-Getopt.html
  *
+ * @param sh The shell to configure
  * @param argc Number of args
  * @param argv The arg array
  */
-void parse_args(int argc, char **argv) {
+void parse_args(struct shell *sh, int argc, char **argv) {
     int opt;
     while ((opt = getopt(argc, argv, VALID_OPTIONS)) != -1) {
 
@@ -358,8 +836,67 @@ void parse_args(int argc, char **argv) {
                 printf("Shell Version: %d.%d\n", lab_VERSION_MAJOR, lab_VERSION_MINOR);
                 exit(EXIT_SUCCESS);
                 break;
+            case 'f': // fall back to the classic fork launch path
+                sh->spawn_engine = SPAWN_FORK;
+                break;
+            case 'h': // usage, enumerating the builtins table
+                printf("Usage: %s [-v] [-f] [-h] [-T] [-U] [-p bytes] [-J file] [-S socket] [-C socket] [-A on|off|auto] [-c command | script]\n", argv[0]);
+                printf("  -v  print the shell version\n");
+                printf("  -f  launch commands with fork instead of posix_spawn\n");
+                printf("  -h  print this help\n");
+                printf("  -T  time every command line\n");
+                printf("  -U  wait for input and children with io_uring instead of epoll\n");
+                printf("  -p  enlarge pipeline buffers to this many bytes\n");
+                printf("  -c  run the command and exit\n");
+                printf("  -J  write latency histograms as JSON to file on exit, - for stderr\n");
+                printf("  -S  serve command lines on a UNIX socket\n");
+                printf("  -C  run the -c command on the server at a UNIX socket\n");
+                printf("  -A  parse a script ahead on a thread: on, off or auto (with two CPUs)\n");
+                printf("Builtin commands:\n");
+                builtins_print(stdout);
+                exit(EXIT_SUCCESS);
+                break;
+            case 'T': // report rusage and shell overhead for every line
+                sh->time_all = true;
+                break;
+            case 'U': // io_uring backend for the event loops
+                sh->event_backend = EVENT_URING;
+                break;
+            case 'p': // pipe buffer size for high throughput pipelines
+                sh->pipe_size = atoi(optarg);
+                if (sh->pipe_size <= 0) {
+                    fprintf(stderr, "Invalid pipe size '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c': // run one command line and exit
+                sh->command = optarg;
+                break;
+            case 'J': // dump the shstat histograms when the shell exits
+                sh->stats_json = optarg;
+                break;
+            case 'S': // stay resident and run the lines sent to a socket
+                sh->server_socket = optarg;
+                break;
+            case 'C': // hand the -c line to a resident shell
+                sh->client_socket = optarg;
+                break;
+            case 'A': // parse scripts ahead on a thread
+                if (strcmp(optarg, "on") == 0) {
+                    sh->read_ahead = READ_AHEAD_ON;
+                } else if (strcmp(optarg, "off") == 0) {
+                    sh->read_ahead = READ_AHEAD_OFF;
+                } else if (strcmp(optarg, "auto") == 0) {
+                    sh->read_ahead = READ_AHEAD_AUTO;
+                } else {
+                    fprintf(stderr, "Invalid read-ahead mode '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case '?': // not a valid option, so print the error and exit.
-                if (isprint(optopt)) { // if the opt is printable, print it.
+                if (optopt == 'p' || optopt == 'c' || optopt == 'J' || optopt == 'S' || optopt == 'C' || optopt == 'A') { // known option missing its argument
+                    fprintf(stderr, "Option '-%c' requires an argument\n", optopt);
+                } else if (isprint(optopt)) { // if the opt is printable, print it.
                     fprintf(stderr, "Unknown option '-%c'\n", optopt);
                 } else { // if opt is not printable, print its hex value.
                     fprintf(stderr, "Unknown option character '\\x%x'\n", optopt);
@@ -369,5 +906,12 @@ void parse_args(int argc, char **argv) {
                 abort(); // failsafe exit
         }
     }
-}
+    if (sh->client_socket && !sh->command) {
+        fprintf(stderr, "Option '-C' needs a command to send with '-c'\n");
+        exit(EXIT_FAILURE);
+    }
+    // The first operand is a script to run in batch mode.
+    if (optind < argc && !sh->command) {
+        sh->script = argv[optind];
+    }
 }
@@ -1,8 +1,13 @@
 #ifndef LAB_H
 #define LAB_H
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <termios.h>
 #include <unistd.h>
 
@@ -15,17 +20,570 @@ extern "C"
 {
 #endif
 
+  /**
+   * @brief What a token of a command line is. Only words are arguments,
+   * a quoted "|" is a word like any other.
+   */
+  enum token_kind
+  {
+    TOK_END,        // after the last token
+    TOK_WORD,
+    TOK_IO_NUMBER,  // the digits in front of a redirection, as in 2>&1
+    TOK_PIPE,       // |
+    TOK_BACKGROUND, // &
+    TOK_SEMI,       // ;
+    TOK_LESS,       // <
+    TOK_GREAT,      // >
+    TOK_APPEND,     // >>
+    TOK_LESS_AND,   // <&
+    TOK_GREAT_AND   // >&
+  };
+
+  /**
+   * @brief One redirection of a command, kept in the order it was written.
+   */
+  struct redirect
+  {
+    int fd;             // the descriptor redirected, 0 for < and <& and 1 for the others unless given
+    enum token_kind op; // TOK_LESS, TOK_GREAT, TOK_APPEND, TOK_LESS_AND or TOK_GREAT_AND
+    const char *target; // the file, or for <& and >& the descriptor to copy or "-" to close fd
+    int saved;          // copy of fd kept by redirect_apply to restore it
+  };
+
+  /**
+   * @brief Reusable storage for parsing command lines. The buffers are kept
+   * between calls and only ever grow, so once they have reached the size of
+   * the longest line seen, parsing a line does not touch the heap.
+   */
+  struct parse_ctx
+  {
+    char *store;     // token text, each token null terminated
+    size_t store_cap;
+    char **argv;     // NULL terminated argument array pointing into store
+    size_t argv_cap; // capacity of argv in pointers
+    enum token_kind *kinds; // kind of each token in argv, TOK_END at the end
+    size_t kinds_cap;
+    size_t count;    // tokens in argv
+    char ***stages;  // pipeline stages pointing into argv, filled by cmd_pipeline
+    size_t stages_cap;
+    size_t nstages;
+    struct redirect *redirects; // redirections taken out of the stages by cmd_pipeline
+    size_t redirects_cap;
+    size_t *stage_redirects; // stage i has redirects[stage_redirects[i]] up to stage_redirects[i + 1]
+    size_t stage_redirects_cap;
+    bool defer_errors;  // keep a syntax error in error instead of printing it, for a thread parsing ahead
+    const char *error;  // the syntax error of the last cmd_lex, NULL if it found none
+  };
+
+  /**
+   * @brief A line and its tokens in the line cache. The key, the kinds, the
+   * offsets and the text share the one allocation of the entry.
+   */
+  struct line_entry
+  {
+    struct line_entry *next;  // next entry in the same bucket
+    struct line_entry *newer; // toward the most recently used entry
+    struct line_entry *older; // toward the least recently used entry
+    uint64_t hash;
+    size_t length;            // length of the line
+    size_t count;             // number of tokens
+    size_t text_size;         // bytes of token text
+    const char *line;
+    const enum token_kind *kinds; // count + 1, TOK_END at the end
+    const size_t *offsets;    // where each token starts in text
+    const char *text;         // the tokens, each null terminated
+  };
+
+  /**
+   * @brief The most recently run lines with their tokens, so a line seen
+   * before is not tokenized again. See linecache.c.
+   */
+  struct line_cache
+  {
+    struct line_entry **buckets; // allocated on first use
+    struct line_entry *newest;
+    struct line_entry *oldest;
+    size_t count;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t *seen;           // hashes of lines missed once, allocated with the buckets
+    const char *key_line;     // the line of the last miss, for line_cache_insert: the caller's or key
+    char *key;                // a copy of it when the caller parses in place
+    size_t key_cap;
+    size_t key_length;
+    uint64_t key_hash;
+    bool key_pending;         // the last lookup missed a line seen before, it may be inserted
+  };
+
+  /**
+   * @brief The ways the shell can launch an external command.
+   */
+  enum spawn_engine
+  {
+    SPAWN_POSIX, // posix_spawnp, the default
+    SPAWN_FORK   // fork followed by execvp
+  };
+
+  /**
+   * @brief How an event loop waits for its descriptors, selected with -U.
+   */
+  enum event_backend
+  {
+    EVENT_EPOLL, // epoll_wait, the default
+    EVENT_URING  // poll requests on an io_uring, falls back to epoll if the kernel refuses
+  };
+
+  /**
+   * @brief Whether a script file is parsed ahead on a thread, selected
+   * with -A. See batch.c.
+   */
+  enum read_ahead_mode
+  {
+    READ_AHEAD_AUTO, // when the shell may run on a second CPU, the default
+    READ_AHEAD_ON,   // always, even on a single CPU
+    READ_AHEAD_OFF   // never
+  };
+
+  struct event_loop;
+
+  /**
+   * @brief Called by an event loop when a descriptor it watches is ready.
+   * events holds EPOLLIN, EPOLLOUT, EPOLLHUP and EPOLLERR as they apply.
+   */
+  typedef void (*event_fn)(struct event_loop *loop, int fd, uint32_t events, void *data);
+
+  /**
+   * @brief A descriptor watched by an event loop.
+   */
+  struct event_watch
+  {
+    event_fn fn;
+    void *data;
+    uint32_t events;     // what is waited for, 0 to pause the watch
+    bool active;         // the descriptor is watched
+    bool timer;          // a timerfd, read by the loop before fn is called
+    bool armed;          // io_uring: a poll request is queued for it
+    uint32_t generation; // io_uring: tells completions for an earlier watch of the same descriptor apart
+  };
+
+  /**
+   * @brief The rings of an io_uring, mapped from the kernel.
+   */
+  struct event_uring
+  {
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;       // the same mapping as sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_size;
+    void *sqes;          // struct io_uring_sqe array
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    void *cqes;          // struct io_uring_cqe array
+    unsigned cq_mask;
+    unsigned to_submit;  // queued requests the kernel has not seen
+  };
+
+  /**
+   * @brief An event loop: descriptors, indexed by number, and the handlers
+   * to call when they are ready.
+   */
+  struct event_loop
+  {
+    enum event_backend backend; // the one in use, EVENT_EPOLL if io_uring was refused
+    int fd;                     // the epoll or io_uring descriptor
+    struct event_watch *watches;
+    size_t cap;
+    struct event_uring uring;
+  };
+
+  /**
+   * @brief One shell variable.
+   */
+  struct env_var
+  {
+    char *pair;             // "NAME=value", the form a child's envp takes
+    size_t name_length;     // length of NAME
+    bool exported;          // passed to children
+    bool in_environ;        // pair itself is in environ, put there with putenv
+    struct env_var *next;   // next variable in the same bucket
+  };
+
+  /**
+   * @brief A variable changed for one command by `NAME=value cmd`, and what
+   * to put back once the command is launched.
+   */
+  struct env_saved
+  {
+    char *name;
+    char *value;   // the old value, NULL if the variable did not exist
+    bool exported; // the old export flag
+  };
+
+  /**
+   * @brief The shell's variables, a hash table loaded from environ. See
+   * env.c.
+   */
+  struct env_table
+  {
+    bool loaded;
+    struct env_var **buckets;
+    size_t nbuckets;           // always zero or a power of two
+    size_t count;
+    uint64_t generation;       // moved on by every change
+    char **envp;               // the exported variables for a child
+    size_t envp_cap;
+    uint64_t envp_generation;  // generation envp was built at, 0 for never
+    struct env_saved *saved;   // stack of the temporary assignments in effect
+    size_t nsaved;
+    size_t saved_cap;
+  };
+
+  /**
+   * @brief One resolved command in the PATH cache.
+   */
+  struct path_entry
+  {
+    char *name;              // command name as typed
+    char *path;              // absolute path found in PATH
+    unsigned hits;           // number of times the entry was used
+    struct path_entry *next; // next entry in the same bucket
+  };
+
+  /**
+   * @brief Hash table of command names resolved against PATH.
+   */
+  struct path_cache
+  {
+    struct path_entry **buckets;
+    size_t nbuckets;          // always zero or a power of two
+    size_t count;             // number of entries
+    char *path_env;           // value of PATH the entries were resolved against
+    unsigned long generation; // bumped every time entries are dropped
+    const struct env_table *env; // where PATH is read, NULL for getenv
+    uint64_t env_generation;     // env->generation when PATH was last compared
+    bool fixed_path;             // path_env was given with path_cache_set_path, PATH is not read
+  };
+
+  /**
+   * @brief The budget of a job, set with the limit builtin. A limit that
+   * is 0 is not set.
+   */
+  struct job_limits
+  {
+    long cpu_percent; // share of one CPU, cpu.max of the job's cgroup
+    long long memory; // bytes, memory.max of the job's cgroup, RLIMIT_AS without one
+    long cpu_seconds; // RLIMIT_CPU of every process of the job
+    long files;       // RLIMIT_NOFILE of every process of the job
+  };
+
+  /**
+   * @brief The cgroup v2 the shell makes the cgroups of its jobs in, looked
+   * for the first time a job needs one.
+   */
+  struct cgroup_state
+  {
+    bool probed;
+    int dir_fd;      // the directory of the shell's cgroup, -1 if there is none to use
+    bool cpu;        // the cpu controller is enabled for the jobs' cgroups
+    bool memory;     // the memory controller is enabled for the jobs' cgroups
+    pid_t leaf;      // the shell that moved itself into lab-PID-shell, 0 if none did
+    bool enabled[2]; // cpu and memory were turned on by the shell, which turns them off on exit
+  };
+
+  /**
+   * @brief Describes one process to launch with sh_spawn.
+   */
+  struct spawn_spec
+  {
+    char **argv;     // the command to run
+    pid_t pgid;      // process group to join, 0 to lead a new group
+    int fd_in;       // becomes the child's stdin, -1 to inherit the shell's
+    int fd_out;      // becomes the child's stdout, -1 to inherit the shell's
+    bool foreground; // give the group control of the terminal
+    struct redirect *redirects; // applied in the child after fd_in and fd_out
+    size_t nredirects;
+    struct job *job; // the job it is part of, whose limits it gets, NULL for none
+  };
+
+  /**
+   * @brief The state of a job or of one of its processes.
+   */
+  enum job_state
+  {
+    JOB_FREE,    // the slot is unused
+    JOB_RUNNING,
+    JOB_STOPPED, // stopped by a signal such as SIGTSTP
+    JOB_DONE     // every process has exited
+  };
+
+  /**
+   * @brief One process of a job.
+   */
+  struct job_proc
+  {
+    pid_t pid;
+    enum job_state state;
+  };
+
+  /**
+   * @brief A pipeline launched by the shell. Slots are reused and keep their
+   * buffers, so launching a job does not allocate once the table is warm.
+   */
+  struct job
+  {
+    int id;                 // job number shown by jobs, the slot index plus one
+    enum job_state state;
+    pid_t pgid;             // process group of the job, 0 without job control
+    struct job_proc *procs; // one entry per launched stage
+    size_t nprocs;
+    size_t procs_cap;
+    pid_t last_pid;         // the last stage decides the status of the job
+    int status;             // exit status of the last stage
+    bool background;        // finished jobs are reported and released by jobs_reap
+    struct rusage usage;    // resource usage of the processes that finished, from wait4
+    char *command;          // command text for jobs, only set once the job is visible
+    size_t command_cap;
+    struct job_limits limits; // the shell's limits when the job was started
+    int cgroup_fd;          // the job's own cgroup, made for its first process, -1 for none
+    int cgroup_parent;      // directory the cgroup was made in
+    bool cgroup_memory;     // memory.max of the cgroup holds limits.memory
+  };
+
+  /**
+   * @brief The jobs of a shell and the descriptor SIGCHLD is read from.
+   */
+  struct job_table
+  {
+    struct job *jobs;
+    size_t cap;
+    int sigchld_fd; // signalfd for SIGCHLD, -1 if it could not be created
+  };
+
+  /**
+   * @brief What is measured for a line run under `time` or with -T.
+   */
+  struct sh_timing
+  {
+    bool active;            // the line being run is timed
+    uint64_t start_ns;      // when the line started
+    uint64_t parse_ns;      // tokenizing the line, measured for every line
+    uint64_t resolve_ns;    // looking the commands up in PATH
+    uint64_t spawn_ns;      // from starting each launch until the child has exec'd
+    struct rusage self;     // the shell's own usage when the line started
+    struct rusage children; // usage of the line's children, from wait4
+  };
+
+  /**
+   * @brief The stages of the shell loop shstat keeps a histogram for.
+   */
+  enum sh_stat
+  {
+    STAT_READLINE, // waiting in readline for the user
+    STAT_TRIM,     // trim_white
+    STAT_PARSE,    // tokenizing the line
+    STAT_BUILTIN,  // looking up and running a builtin in the shell
+    STAT_SPAWN,    // launching one process until it has exec'd
+    STAT_WAIT,     // waiting for a foreground job
+    STAT_COUNT
+  };
+
+#define SH_HIST_BUCKETS 256 // four log-linear buckets per power of two cover all of uint64_t
+
+  /**
+   * @brief Latency histogram of one stage, in nanoseconds.
+   */
+  struct sh_histogram
+  {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint32_t buckets[SH_HIST_BUCKETS];
+  };
+
+  /**
+   * @brief One command of the history.
+   */
+  struct history_line
+  {
+    const char *text; // inside the mapping of the file, or allocated by history_add
+    size_t length;
+  };
+
+  /**
+   * @brief The lines of the history that contain one trigram, three bytes
+   * in a row.
+   */
+  struct history_gram
+  {
+    uint32_t key;    // the three bytes, 0 for an empty slot
+    uint32_t *lines; // indexes into the history lines, ascending
+    size_t count;
+    size_t cap;
+  };
+
+  /**
+   * @brief The command history and the file it is kept in.
+   */
+  struct history
+  {
+    char *path;                 // HISTFILE, NULL to keep the history in memory only
+    bool loaded;                // the file has been read
+    char *map;                  // private mapping of the file as loaded, lines split in place
+    size_t map_size;
+    struct history_line *lines; // oldest first
+    size_t count;
+    size_t cap;
+    char *pending;              // lines not yet appended to the file, newline terminated
+    size_t pending_length;
+    size_t pending_cap;
+    size_t pending_lines;
+    uint64_t flush_interval_ns; // how long appends may be held back, from HISTFLUSH
+    uint64_t last_flush_ns;
+    size_t file_lines;          // lines in the file as far as this shell knows
+    size_t max_lines;           // HISTFILESIZE, 0 never trims
+    pthread_t trimmer;          // background thread trimming the file
+    bool trim_started;          // trimmer has to be joined
+    atomic_bool trimming;       // cleared by trimmer when it is done
+    size_t trimmed_lines;       // lines trimmer left in the file, 0 if it failed
+    struct history_gram *grams; // trigram index for history -s, open addressing, built by the first search
+    size_t grams_cap;           // a power of two
+    size_t grams_used;
+    size_t indexed;             // lines in the index, history_add keeps it current once it exists
+    pid_t owner;                // process that writes the file, a forked child only frees its copy
+  };
+
+  /**
+   * @brief What a segment of a compiled prompt shows.
+   */
+  enum prompt_kind
+  {
+    PROMPT_TEXT,     // literal text
+    PROMPT_CWD,      // \w, the working directory with HOME as ~
+    PROMPT_CWD_BASE, // \W, the last part of it
+    PROMPT_USER,     // \u
+    PROMPT_HOST,     // \h, up to the first dot
+    PROMPT_STATUS,   // \?, the exit status of the last command
+    PROMPT_TIME,     // \t, HH:MM:SS
+    PROMPT_SIGIL,    // \$, # for root and $ for everyone else
+    PROMPT_VCS       // \g, the git branch, looked up on a thread
+  };
+
+  /**
+   * @brief A CDPATH entry, opened once so a cd through it is a lookup
+   * relative to a descriptor. See dirs.c.
+   */
+  struct cdpath_entry
+  {
+    char *path; // canonical, or as written for a relative entry
+    int fd;     // O_PATH descriptor of an absolute entry, AT_FDCWD for a relative one, -1 if missing
+  };
+
+  /**
+   * @brief The directories the shell keeps track of. See dirs.c.
+   */
+  struct dir_state
+  {
+    char *cwd;                     // canonical working directory, NULL until first asked for
+    char *oldpwd;                  // the directory before the last cd, for cd -
+    bool unexported;               // PWD and OLDPWD are behind cwd and oldpwd, see dirs_export
+    char *home;                    // home of the password entry, for when HOME is not set
+    char **stack;                  // the pushd stack, the top is the last entry
+    size_t depth;
+    size_t stack_cap;
+    char *cdpath;                  // the CDPATH entries were opened for
+    struct cdpath_entry *entries;
+    size_t entry_count;
+    size_t entry_cap;
+  };
+
+  /**
+   * @brief One segment of a compiled prompt and its cached value.
+   */
+  struct prompt_segment
+  {
+    enum prompt_kind kind;
+    char *text;     // the cached value, or the literal text
+    uint64_t stamp; // what the value was computed from, such as the cwd generation
+    bool valid;     // text holds a value
+  };
+
+  /**
+   * @brief MY_PROMPT compiled into segments, rendered again only where a
+   * value could have changed.
+   */
+  struct prompt
+  {
+    bool compiled;
+    struct prompt_segment *segments;
+    size_t count;
+    char *rendered;            // the segments put together
+    size_t rendered_cap;
+    bool dirty;                // a segment changed since rendered was put together
+    bool vcs_started;          // the VCS thread and what follows exist
+    pthread_t vcs_worker;
+    pthread_mutex_t vcs_lock;
+    pthread_cond_t vcs_wake;
+    char *vcs_dir;             // directory to look at next, NULL when there is no request
+    char *vcs_value;           // the latest branch found, owned by the thread under vcs_lock
+    bool vcs_quit;
+    int vcs_notify;            // eventfd written when vcs_value changes
+    pid_t vcs_owner;           // process the thread runs in, a forked child has no thread to stop
+  };
+
   struct shell
   {
     int shell_is_interactive;
     pid_t shell_pgid;
+    pid_t shell_pid;                // the shell process, a forked builtin stage that runs exit is not it
     struct termios shell_tmodes;
     int shell_terminal;
-    char *prompt;
+    struct prompt prompt;           // compiled from MY_PROMPT on the first prompt
+    struct env_table env;           // the shell's variables, loaded on first use
+    struct dir_state dirs;          // cwd, home, pushd stack and CDPATH
+    uint64_t cwd_generation;        // moved on by every chdir of the shell, for what caches the cwd
+    struct parse_ctx parse;
+    struct line_cache line_cache;   // tokens of the lines run recently
+    enum spawn_engine spawn_engine; // set by parse_args
+    int pipe_size;                  // F_SETPIPE_SZ for pipelines, 0 keeps the default, set by parse_args
+    char *command;                  // line given with -c, set by parse_args
+    char *script;                   // script file to run, set by parse_args
+    struct path_cache path_cache;
+    int last_status;                // exit status of the last command
+    struct job_table jobs;
+    struct job_limits limits;       // given to every job started, set by the limit builtin
+    struct cgroup_state cgroup;     // where jobs with a cpu or memory limit get their cgroup
+    bool time_all;                  // time every line, set by parse_args with -T
+    struct sh_timing timing;
+    struct sh_histogram stats[STAT_COUNT]; // per-stage latencies shown by shstat
+    char *stats_json;               // file the histograms are written to by sh_destroy, set by parse_args with -J
+    struct history history;         // loaded on the first prompt
+    char *server_socket;            // socket to serve on, set by parse_args with -S
+    char *client_socket;            // socket of a server to send -c to, set by parse_args with -C
+    enum event_backend event_backend; // set by parse_args with -U
+    enum read_ahead_mode read_ahead; // scripts parsed ahead on a thread, set by parse_args with -A
   };
 
 
 
+  /**
+   * @brief A builtin command. run returns the exit status of the command.
+   */
+  struct builtin
+  {
+    const char *name;
+    int (*run)(struct shell *sh, char **argv);
+    const char *usage; // synopsis shown by help
+    const char *help;  // one line description shown by help
+    bool optional;     // off until turned on with enable, for those that stand in for a program
+  };
+
   /**
    * @brief Set the shell prompt. This function will attempt to load a prompt
    * from the requested environment variable, if the environment variable is
@@ -42,7 +600,7 @@ extern "C"
    * call chdir. With no arguments the users home directory is used as the
    * directory to change to.
    *
-   * @param dir The directory to change to
+   * @param dir The cd argument list, dir[1] is the directory to change to
    * @return  On success, zero is returned.  On error, -1 is returned, and
    * errno is set to indicate the error.
    */
@@ -52,7 +610,7 @@ extern "C"
    * @brief Convert line read from the user into to format that will work with
    * execvp. We limit the number of arguments to ARG_MAX loaded from sysconf.
    * This function allocates memory that must be reclaimed with the cmd_free
-   * function.
+   * function. The array and the argument strings share a single allocation.
    *
    * @param line The line to process
    *
@@ -60,6 +618,205 @@ extern "C"
    */
   char **cmd_parse(char const *line);
 
+  /**
+   * @brief Grow a buffer so it holds at least needed elements. The capacity
+   * is doubled so that growing is amortized.
+   *
+   * @param buffer The buffer to grow, replaced on success
+   * @param capacity The current capacity in elements, updated on success
+   * @param needed The minimum number of elements required
+   * @param size The size of one element
+   * @return 0 on success, -1 if the allocation failed
+   */
+  int grow_buffer(void **buffer, size_t *capacity, size_t needed, size_t size);
+
+  /**
+   * @brief FNV-1a hash of some bytes, the hash of every table of the shell
+   * keyed by a string: the PATH cache, the variables and the line cache.
+   *
+   * @param data The bytes, not necessarily terminated
+   * @param length How many there are
+   * @return The hash value
+   */
+  static inline uint64_t fnv1a_hash(const char *data, size_t length)
+  {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+      hash ^= (unsigned char)data[i];
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }
+
+  /**
+   * @brief Initialize an empty parse context. No memory is allocated until
+   * the first line is parsed.
+   *
+   * @param ctx The context to initialize
+   */
+  void parse_ctx_init(struct parse_ctx *ctx);
+
+  /**
+   * @brief Release the buffers held by a parse context.
+   *
+   * @param ctx The context to destroy
+   */
+  void parse_ctx_destroy(struct parse_ctx *ctx);
+
+  /**
+   * @brief Same as cmd_parse but the result is stored in the context's
+   * buffers instead of a new allocation. The returned array is owned by the
+   * context and is only valid until the next call with the same context or
+   * until parse_ctx_destroy. Do NOT pass it to cmd_free.
+   *
+   * @param ctx The context providing the storage
+   * @param line The line to process
+   * @return The line read in a format suitable for exec, or NULL on error
+   */
+  char **cmd_parse_into(struct parse_ctx *ctx, const char *line);
+
+  /**
+   * @brief Parse a line in place: the separators after each token are
+   * overwritten with null terminators and the argument array in the context
+   * points straight into line, so no token text is copied. The array is
+   * owned by the context and only valid while line is.
+   *
+   * @param ctx The context providing the argument array
+   * @param line The line to process, modified
+   * @return The line read in a format suitable for exec, or NULL on error
+   */
+  char **cmd_parse_inplace(struct parse_ctx *ctx, char *line);
+
+  /**
+   * @brief Split a line into words and operators in one pass. Quotes and
+   * backslashes are removed from the words, operators need no spaces around
+   * them and the kind of every token is stored in ctx->kinds. Reentrant,
+   * every thread only needs its own context.
+   *
+   * @param ctx The context that receives the tokens
+   * @param line The line to split
+   * @param out Where the words are written, ctx->store with room for the
+   * whole line, or line itself to parse in place
+   * @return The number of tokens, or -1 after printing an error such as an
+   * unterminated quote, kept in ctx->error instead if ctx->defer_errors
+   */
+  long cmd_lex(struct parse_ctx *ctx, const char *line, char *out);
+
+  /**
+   * @brief Bound the number of tokens cmd_lex finds in a line with one
+   * pass over its bytes, for callers that size their buffers up front.
+   *
+   * @param line The line
+   * @return At least the number of tokens of the line
+   */
+  size_t cmd_lex_bound(const char *line);
+
+  /**
+   * @brief Move a descriptor the shell keeps open above the numbers users
+   * redirect, 10 and up like sh. The result is close-on-exec.
+   *
+   * @param fd The descriptor, closed if it was moved
+   * @return The new descriptor, or fd if it could not be moved
+   */
+  int fd_move_high(int fd);
+
+  /**
+   * @brief Open flags for the file of a redirection.
+   *
+   * @param op TOK_LESS, TOK_GREAT or TOK_APPEND
+   * @return The flags for open
+   */
+  int redirect_flags(enum token_kind op);
+
+  /**
+   * @brief Carry out redirections in order, printing an error for the one
+   * that fails. With save the replaced descriptors are kept for
+   * redirect_restore, which is how a builtin is redirected in the shell.
+   * Without it only async-signal-safe calls are made, for a child about to
+   * exec.
+   *
+   * @param redirects The redirections
+   * @param count Number of redirections
+   * @param save True to save the replaced descriptors
+   * @return 0 on success, -1 if one failed
+   */
+  int redirect_apply(struct redirect *redirects, size_t count, bool save);
+
+  /**
+   * @brief Put back the descriptors saved by redirect_apply.
+   *
+   * @param redirects The redirections
+   * @param count Number of redirections
+   */
+  void redirect_restore(struct redirect *redirects, size_t count);
+
+  /**
+   * @brief Find the redirection that made a launch fail.
+   *
+   * @param redirects The redirections of the command
+   * @param count Number of redirections
+   * @return The target that can't be opened, or NULL if the command itself
+   * failed
+   */
+  const char *redirect_failure(const struct redirect *redirects, size_t count);
+
+  /**
+   * @brief Fill a parse context with the tokens of a line run before. On
+   * the second miss of a line it is remembered for line_cache_insert, the
+   * first only notes its hash.
+   *
+   * @param cache The cache
+   * @param ctx The context to fill
+   * @param line The line
+   * @param inplace True if the caller parses the line in place, then a
+   * line to be inserted is copied; otherwise it must stay as it is until
+   * line_cache_insert
+   * @return True on a hit, false if the line still has to be parsed
+   */
+  bool line_cache_lookup(struct line_cache *cache, struct parse_ctx *ctx, const char *line, bool inplace);
+
+  /**
+   * @brief Add the tokens just parsed into a context for the line of the
+   * last miss if it was seen before, dropping the least recently used line
+   * if the cache is full.
+   *
+   * @param cache The cache
+   * @param ctx The context holding the tokens of the line
+   */
+  void line_cache_insert(struct line_cache *cache, const struct parse_ctx *ctx);
+
+  /**
+   * @brief Free every cached line.
+   *
+   * @param cache The cache
+   */
+  void line_cache_destroy(struct line_cache *cache);
+
+  /**
+   * @brief Split the arguments last parsed into the context into the stages
+   * of a pipeline. Every "|" token in ctx->argv is replaced with NULL so each
+   * stage is a NULL terminated argument array pointing into the context.
+   * The stages are stored in ctx->stages and ctx->nstages. Redirections are
+   * moved out of the stages into ctx->redirects, a stage may be left with
+   * no words when it is the only one, as in "> file".
+   *
+   * @param ctx The context holding the parsed line
+   * @return The number of stages, 0 for an empty line, or -1 if a stage is
+   * empty such as in "ls |" or "| wc"
+   */
+  int cmd_pipeline(struct parse_ctx *ctx);
+
+  /**
+   * @brief Same as cmd_pipeline for the command that starts at
+   * ctx->argv[first] and ends at the next NULL, one command of a list.
+   *
+   * @param ctx The context holding the parsed line
+   * @param first Index of the first token of the command
+   * @return The number of stages, 0 for an empty command, or -1 if a stage
+   * is empty or a redirection has no target
+   */
+  int cmd_pipeline_at(struct parse_ctx *ctx, size_t first);
+
   /**
    * @brief Free the line that was constructed with parse_cmd
    *
@@ -84,7 +841,7 @@ extern "C"
    * built in command such as exit, cd, jobs, etc. If the command is a
    * built in command this function will handle the command and then return
    * true. If the first argument is NOT a built in command this function will
-   * return false.
+   * return false. The builtin's exit status is stored in sh->last_status.
    *
    * @param sh The shell
    * @param argv The command to check
@@ -92,13 +849,1048 @@ extern "C"
    */
   bool do_builtin(struct shell *sh, char **argv);
 
+  /**
+   * @brief Initialize an empty PATH cache. The buckets are allocated on first
+   * use.
+   *
+   * @param cache The cache to initialize
+   */
+  void path_cache_init(struct path_cache *cache);
+
+  /**
+   * @brief Release all memory held by the cache.
+   *
+   * @param cache The cache to destroy
+   */
+  void path_cache_destroy(struct path_cache *cache);
+
+  /**
+   * @brief Forget every entry in the cache, like `hash -r`.
+   *
+   * @param cache The cache to clear
+   */
+  void path_cache_clear(struct path_cache *cache);
+
+  /**
+   * @brief Look up the absolute path of a command, searching PATH and adding
+   * it to the cache on a miss. Names that contain a slash are returned as
+   * they are. The whole cache is dropped first if PATH has changed since the
+   * entries were resolved.
+   *
+   * @param cache The cache to use
+   * @param name The command name
+   * @return The absolute path owned by the cache, or NULL with errno set to
+   * ENOENT if the command is not in PATH
+   */
+  const char *path_cache_lookup(struct path_cache *cache, const char *name);
+
+  /**
+   * @brief Remove one command from the cache.
+   *
+   * @param cache The cache to update
+   * @param name The command name
+   */
+  void path_cache_forget(struct path_cache *cache, const char *name);
+
+  /**
+   * @brief Resolve against the given PATH value from now on instead of
+   * reading PATH, for a cache used away from the shell's variables. The
+   * entries are dropped if the value differs from the last one.
+   *
+   * @param cache The cache
+   * @param path The PATH value
+   */
+  void path_cache_set_path(struct path_cache *cache, const char *path);
+
+  /**
+   * @brief Remember a command resolved by another cache against the same
+   * PATH, unless the name is cached already.
+   *
+   * @param cache The cache to update
+   * @param name The command name
+   * @param path Its absolute path
+   */
+  void path_cache_seed(struct path_cache *cache, const char *name, const char *path);
+
+  /**
+   * @brief Print the cached commands in the same format as the bash hash
+   * builtin.
+   *
+   * @param cache The cache to print
+   */
+  void path_cache_print(struct path_cache *cache);
+
+  /**
+   * @brief Search the directories of a PATH value for an executable file.
+   * An empty entry in PATH means the current directory, like execvp.
+   *
+   * @param path The PATH value to search
+   * @param name The command name, must not contain a slash
+   * @param result Buffer for the absolute path
+   * @param size Size of the result buffer
+   * @return 0 if found, -1 with errno set to ENOENT otherwise
+   */
+  int path_search(const char *path, const char *name, char *result, size_t size);
+
+  /**
+   * @brief Launch an external command using the engine selected in
+   * sh->spawn_engine. The child joins or leads the process group in the
+   * spec and gets the spec's descriptors as stdin and stdout. The signals
+   * the shell ignores are reset to their defaults in the child. The command
+   * is resolved through the shell's PATH cache and exec'd by absolute path.
+   * If the cached file has disappeared the entry is revalidated and the
+   * launch retried once. This function does not wait for the child.
+   *
+   * @param sh The shell
+   * @param spec What to launch and how
+   * @return The pid of the child, or -1 with errno set on failure
+   */
+  pid_t sh_spawn(struct shell *sh, const struct spawn_spec *spec);
+
+  /**
+   * @brief Run a builtin in a forked child described by spec, used for
+   * builtins that are a stage of a pipeline. The child exits with the
+   * builtin's status, so the builtin cannot change the shell itself.
+   *
+   * @param sh The shell
+   * @param builtin The builtin to run
+   * @param spec The arguments, process group and descriptors for the child
+   * @return The pid of the child, or -1 with errno set on failure
+   */
+  pid_t sh_spawn_builtin(struct shell *sh, const struct builtin *builtin, const struct spawn_spec *spec);
+
+  /**
+   * @brief Print "what: error" on stderr with write alone, for a child
+   * between clone and exec where stdio may be locked by a thread that only
+   * exists in the parent.
+   *
+   * @param what What failed, a program or a file
+   * @param err The errno value
+   */
+  void child_error(const char *what, int err);
+
+  /**
+   * @brief Parse and run one line. A single builtin runs in the shell
+   * itself. Anything else is launched as a pipeline whose stages share one
+   * process group and are connected with pipes, then waited for as a whole.
+   * The line is parsed into sh->parse so no memory is allocated once its
+   * buffers have grown.
+   *
+   * @param sh The shell
+   * @param line The line to run, already trimmed
+   * @return The exit status of the last stage, also stored in sh->last_status
+   */
+  int sh_run_line(struct shell *sh, const char *line);
+
+  /**
+   * @brief Run the line that was last parsed into sh->parse, the second half
+   * of sh_run_line for callers that parse the line themselves.
+   *
+   * @param sh The shell
+   * @return The exit status of the last stage, also stored in sh->last_status
+   */
+  int sh_run_parsed(struct shell *sh);
+
+  /**
+   * @brief Run every line read from a stream, for scripts and piped input.
+   * Lines are read with getline into one reused buffer through a large
+   * stdio buffer, without readline, prompts or history. Blank lines and
+   * lines starting with '#' are skipped.
+   *
+   * @param sh The shell
+   * @param in The stream to read
+   * @return The exit status of the last command
+   */
+  int sh_run_stream(struct shell *sh, FILE *in);
+
+  /**
+   * @brief Run a script file in batch mode. A regular file is mapped with a
+   * private writable mapping and each line is trimmed and tokenized in the
+   * mapped bytes, so after the mmap there is no I/O system call and no copy
+   * per line. Unless sh->read_ahead says otherwise a thread tokenizes and
+   * resolves the lines ahead of the one running, see batch.c. Other files
+   * are read with sh_run_stream.
+   *
+   * @param sh The shell
+   * @param path The script to run
+   * @return The exit status of the last command, or 127 if the script
+   * could not be opened
+   */
+  int sh_run_file(struct shell *sh, const char *path);
+
+  /**
+   * @brief Initialize an empty job table. SIGCHLD is blocked in the shell and
+   * read from a non-blocking signalfd instead, children are launched with an
+   * empty signal mask.
+   *
+   * @param table The table to initialize
+   */
+  void jobs_init(struct job_table *table);
+
+  /**
+   * @brief Release the job table and its signalfd. Jobs that are still
+   * running are left alone.
+   *
+   * @param table The table to destroy
+   */
+  void jobs_destroy(struct job_table *table);
+
+  /**
+   * @brief Reserve a slot for a new job. The lowest free slot is used so job
+   * numbers stay small. The pointer is only valid until the next job_new.
+   *
+   * @param sh The shell
+   * @return The new job with no processes, or NULL if the table could not grow
+   */
+  struct job *job_new(struct shell *sh);
+
+  /**
+   * @brief Give a job's slot back to the table.
+   *
+   * @param job The job to release
+   */
+  void job_release(struct job *job);
+
+  /**
+   * @brief Add a launched process to a job.
+   *
+   * @param job The job
+   * @param pid The process that was launched
+   * @return 0 on success, -1 if the process list could not grow
+   */
+  int job_add_proc(struct job *job, pid_t pid);
+
+  /**
+   * @brief Store the command text shown by jobs, rebuilt from the stages.
+   *
+   * @param job The job
+   * @param stages The argument array of each stage
+   * @param nstages Number of stages
+   */
+  void job_set_command(struct job *job, char ***stages, size_t nstages);
+
+  /**
+   * @brief Record a status reported by wait4 in the job owning pid.
+   *
+   * @param sh The shell
+   * @param pid The child that changed state
+   * @param wstatus The status reported by wait4
+   * @param usage The resource usage reported by wait4, may be NULL
+   * @return The job the child belongs to, or NULL if no job owns it
+   */
+  struct job *job_update(struct shell *sh, pid_t pid, int wstatus, const struct rusage *usage);
+
+  /**
+   * @brief Wait for a job in the foreground, giving it the terminal while it
+   * runs. A finished job is released, a stopped job stays in the table.
+   *
+   * @param sh The shell
+   * @param job The job to wait for
+   * @return The exit status of the last stage, or 128 plus the signal number
+   * if the job was stopped
+   */
+  int job_wait(struct shell *sh, struct job *job);
+
+  /**
+   * @brief Print a job the way the jobs builtin shows it.
+   *
+   * @param job The job to print
+   * @param out Where to print
+   */
+  void job_print(const struct job *job, FILE *out);
+
+  /**
+   * @brief Collect the children that changed state without blocking. The
+   * signalfd is drained first and waitpid is only called if a SIGCHLD
+   * arrived. Finished background jobs are reported when the shell is
+   * interactive and released.
+   *
+   * @param sh The shell
+   */
+  void jobs_reap(struct shell *sh);
+
+  /**
+   * @brief Tell whether any limit is set.
+   *
+   * @param limits The limits
+   * @return True if at least one limit is set
+   */
+  bool job_limits_set(const struct job_limits *limits);
+
+  /**
+   * @brief Take the words `limit [options]` off the front of a command, the
+   * way `time` is, and add the options to sh->limits for the command's job
+   * alone. The caller saves sh->limits and puts it back afterwards.
+   *
+   * @param sh The shell
+   * @param argv The command
+   * @return The number of words taken, 0 if the command does not start
+   * with limit and options followed by a command, or -1 after printing an
+   * error
+   */
+  long limit_prefix(struct shell *sh, char **argv);
+
+  /**
+   * @brief Make the cgroup of a job with a cpu or memory limit before its
+   * first process is launched, if the shell has a cgroup v2 to make it in.
+   * Does nothing for other jobs or once the cgroup exists.
+   *
+   * @param sh The shell
+   * @param job The job
+   */
+  void job_limits_prepare(struct shell *sh, struct job *job);
+
+  /**
+   * @brief Fork a process of a job. A child that only execs is created in
+   * the job's cgroup with clone3(CLONE_INTO_CGROUP), otherwise this is fork.
+   *
+   * @param job The job, NULL for none
+   * @param exec True if the child makes only async-signal-safe calls
+   * before execve
+   * @param joined Set to true if the child starts in the job's cgroup
+   * @return What fork returns
+   */
+  pid_t job_limits_fork(const struct job *job, bool exec, bool *joined);
+
+  /**
+   * @brief Put the limits of its job on a forked child before it execs:
+   * join the cgroup if the child was not created in it and set the
+   * rlimits. Only system calls are made, no memory is allocated.
+   *
+   * @param job The job, NULL for none
+   * @param joined True if the child was created in the job's cgroup
+   */
+  void job_limits_apply(const struct job *job, bool joined);
+
+  /**
+   * @brief Remove the cgroup of a job whose processes are all gone.
+   *
+   * @param job The job
+   */
+  void job_limits_release(struct job *job);
+
+  /**
+   * @brief Close the cgroup directory of the shell. If the shell moved
+   * itself into `lab-PID-shell`, it turns off the controllers it enabled,
+   * moves back to its cgroup and removes the leaf.
+   *
+   * @param sh The shell
+   */
+  void limits_destroy(struct shell *sh);
+
+  /**
+   * @brief The limit builtin, `limit [-c percent] [-m size] [-t seconds]
+   * [-n files] [-r] [command ...]`. Sets the limits of every job started
+   * afterwards, or lists them without options. In front of a command, see
+   * limit_prefix, the options are for that command's job alone.
+   *
+   * @param sh The shell
+   * @param argv The limit command and its arguments
+   * @return 0 on success, 2 for a bad option
+   */
+  int builtin_limit(struct shell *sh, char **argv);
+
+  /**
+   * @brief The jobs builtin, lists the background and stopped jobs.
+   *
+   * @param sh The shell
+   * @param argv The jobs command and its arguments
+   * @return Always 0
+   */
+  int builtin_jobs(struct shell *sh, char **argv);
+
+  /**
+   * @brief The fg builtin, `fg [%n]` continues a job in the foreground.
+   *
+   * @param sh The shell
+   * @param argv The fg command and its arguments
+   * @return The exit status of the job, 1 if there is no such job
+   */
+  int builtin_fg(struct shell *sh, char **argv);
+
+  /**
+   * @brief The bg builtin, `bg [%n]` continues a stopped job in the
+   * background.
+   *
+   * @param sh The shell
+   * @param argv The bg command and its arguments
+   * @return 0 on success, 1 if there is no such job
+   */
+  int builtin_bg(struct shell *sh, char **argv);
+
+  /**
+   * @brief The parallel builtin. `parallel [-j K] [--] cmd [::: cmd ...]`
+   * runs the commands separated by ":::" as jobs with at most K of them in
+   * flight, starting the next one as soon as any finishes. K defaults to the
+   * number of online CPUs. The wall time and status of each command and a
+   * summary are printed on stderr.
+   *
+   * @param sh The shell
+   * @param argv The parallel command and its arguments
+   * @return 0 if every command succeeded, otherwise the number of commands
+   * that failed, at most 101
+   */
+  int builtin_parallel(struct shell *sh, char **argv);
+
+  /**
+   * @brief Read the monotonic clock.
+   *
+   * @return The time in nanoseconds
+   */
+  uint64_t sh_now_ns(void);
+
+  /**
+   * @brief Add the resource usage of one process to a total. Times and
+   * context switches are summed, the maximum resident set size is the
+   * largest of the two.
+   *
+   * @param total The total to update
+   * @param usage The usage to add
+   */
+  void rusage_add(struct rusage *total, const struct rusage *usage);
+
+  /**
+   * @brief Start timing the line about to run.
+   *
+   * @param sh The shell
+   */
+  void sh_timing_start(struct shell *sh);
+
+  /**
+   * @brief Stop timing and print wall, user and sys time, maximum resident
+   * set size and context switches on stderr, followed by the time the shell
+   * spent parsing, resolving PATH and spawning.
+   *
+   * @param sh The shell
+   */
+  void sh_timing_report(struct shell *sh);
+
+  /**
+   * @brief Record one latency sample of a stage of the shell loop. Costs a
+   * few instructions and never allocates.
+   *
+   * @param sh The shell
+   * @param stat The stage
+   * @param ns How long it took
+   */
+  void sh_stat_record(struct shell *sh, enum sh_stat stat, uint64_t ns);
+
+  /**
+   * @brief Estimate a percentile of a histogram, within the width of one
+   * bucket.
+   *
+   * @param hist The histogram
+   * @param percent The percentile, 0 to 100
+   * @return The estimate in nanoseconds, 0 for an empty histogram
+   */
+  uint64_t sh_histogram_percentile(const struct sh_histogram *hist, double percent);
+
+  /**
+   * @brief Print count, p50, p99 and max of every stage as a table.
+   *
+   * @param sh The shell
+   * @param out Where to print
+   */
+  void sh_stats_print(struct shell *sh, FILE *out);
+
+  /**
+   * @brief Print the histograms as one JSON object keyed by stage.
+   *
+   * @param sh The shell
+   * @param out Where to print
+   */
+  void sh_stats_json(struct shell *sh, FILE *out);
+
+  /**
+   * @brief Write the histograms as JSON to the file given with -J, "-"
+   * means stderr. Does nothing without -J.
+   *
+   * @param sh The shell
+   */
+  void sh_stats_dump(struct shell *sh);
+
+  /**
+   * @brief The shstat builtin. Prints p50 and p99 of every stage of the
+   * shell loop, `shstat -j` prints JSON and `shstat -r` clears the counters.
+   *
+   * @param sh The shell
+   * @param argv The shstat command and its arguments
+   * @return 0 on success, 2 for an unknown option
+   */
+  int builtin_shstat(struct shell *sh, char **argv);
+
+  /**
+   * @brief Load readline with dlopen the first time it is needed, so
+   * shells that never prompt don't pay for it at startup.
+   *
+   * @return True if readline is available
+   */
+  bool sh_readline_load(void);
+
+  /**
+   * @brief Called with every line the user enters, a malloc'ed string the
+   * callee frees, or NULL at the end of input.
+   */
+  typedef void (*sh_line_fn)(char *line, void *data);
+
+  /**
+   * @brief Show the prompt and start taking a line from the user without
+   * blocking, loading readline, the prompt from MY_PROMPT and the history on
+   * first use. sh_readline_input then reads whatever is there whenever
+   * standard input is ready, and on_line gets each line that is complete.
+   * After on_line returns the prompt is shown again. Without readline the
+   * prompt is printed and the lines are split from plain reads.
+   *
+   * @param sh The shell
+   * @param on_line Called with each line
+   * @param data Passed to on_line
+   */
+  void sh_readline_start(struct shell *sh, sh_line_fn on_line, void *data);
+
+  /**
+   * @brief Change the prompt. readline shows it the next time the prompt is
+   * drawn, on the next line or after sh_readline_show.
+   *
+   * @param prompt The new prompt, copied by readline
+   */
+  void sh_readline_set_prompt(const char *prompt);
+
+  /**
+   * @brief Read the input that is ready on standard input, for an event loop.
+   */
+  void sh_readline_input(void);
+
+  /**
+   * @brief Stop taking lines and give the terminal back its settings.
+   */
+  void sh_readline_stop(void);
+
+  /**
+   * @brief Clear the prompt and the line being edited from the screen so
+   * something else can be printed, sh_readline_show puts them back.
+   */
+  void sh_readline_hide(void);
+
+  /**
+   * @brief Draw the prompt and the line being edited again after
+   * sh_readline_hide.
+   */
+  void sh_readline_show(void);
+
+  /**
+   * @brief Add a line to the interactive history.
+   *
+   * @param line The line to remember
+   */
+  void sh_add_history(const char *line);
+
+  /**
+   * @brief Initialize an empty history that is kept in a file. Nothing is
+   * read until the history is first used.
+   *
+   * @param history The history to initialize
+   * @param path The history file, NULL to keep the history in memory only
+   */
+  void history_init(struct history *history, const char *path);
+
+  /**
+   * @brief Initialize the history of an interactive shell from HISTFILE,
+   * HISTFILESIZE and HISTFLUSH. The file defaults to ~/.lab_history.
+   *
+   * @param history The history to initialize
+   */
+  void history_init_env(struct history *history);
+
+  /**
+   * @brief Load the history file with mmap, once, and give the newest
+   * lines to readline.
+   *
+   * @param history The history
+   */
+  void history_load(struct history *history);
+
+  /**
+   * @brief Add a command to the history. It is appended to the file with
+   * O_APPEND, at once or once the flush interval has passed.
+   *
+   * @param history The history
+   * @param line The command, without a newline
+   */
+  void history_add(struct history *history, const char *line);
+
+  /**
+   * @brief Append the pending commands to the history file with one write.
+   * Once the file is a quarter over HISTFILESIZE lines it is trimmed by a
+   * background thread, and nothing is appended until that is done.
+   *
+   * @param history The history
+   * @return 0 on success, -1 with errno set if the write failed
+   */
+  int history_flush(struct history *history);
+
+  /**
+   * @brief Flush the history, wait for a running trim and free it.
+   *
+   * @param history The history to destroy
+   */
+  void history_destroy(struct history *history);
+
+  /**
+   * @brief Print the history numbered from 1, for the history builtin.
+   *
+   * @param history The history
+   * @param out Where to print
+   */
+  void history_print(struct history *history, FILE *out);
+
+  /**
+   * @brief Print the newest lines of the history with their numbers.
+   *
+   * @param history The history
+   * @param n How many lines to print
+   * @param out Where to print
+   */
+  void history_print_last(struct history *history, size_t n, FILE *out);
+
+  /**
+   * @brief Find the history lines that contain text. Text of three bytes
+   * or more is looked up in a trigram index, which the first search builds
+   * and history_add extends, so only lines holding its rarest trigram are
+   * compared. Shorter text is compared against every line.
+   *
+   * @param history The history
+   * @param text The text to look for
+   * @param matches Indexes of the matching lines, oldest first, grown as
+   * needed and freed by the caller
+   * @param cap Capacity of matches in elements
+   * @return The number of matches
+   */
+  size_t history_search(struct history *history, const char *text, size_t **matches, size_t *cap);
+
+  /**
+   * @brief The shell's variables, imported from environ the first time.
+   *
+   * @param sh The shell
+   * @return The table
+   */
+  struct env_table *sh_env(struct shell *sh);
+
+  /**
+   * @brief Look a variable up in a loaded table.
+   *
+   * @param env The table
+   * @param name The name of the variable
+   * @return The value, or NULL if the variable is not set
+   */
+  const char *env_get(const struct env_table *env, const char *name);
+
+  /**
+   * @brief Look up a shell variable, exported or not.
+   *
+   * @param sh The shell
+   * @param name The name of the variable
+   * @return The value, or NULL if the variable is not set
+   */
+  const char *sh_getenv(struct shell *sh, const char *name);
+
+  /**
+   * @brief Set a shell variable. An exported variable is also set in
+   * environ so the libraries the shell uses see it.
+   *
+   * @param sh The shell
+   * @param name The name of the variable
+   * @param value The value
+   * @param export Export the variable, otherwise it keeps its export flag
+   * @return 0 on success, -1 if out of memory
+   */
+  int sh_setenv(struct shell *sh, const char *name, const char *value, bool export);
+
+  /**
+   * @brief Remove a shell variable.
+   *
+   * @param sh The shell
+   * @param name The name of the variable
+   */
+  void sh_unsetenv(struct shell *sh, const char *name);
+
+  /**
+   * @brief The environment for a child, the exported variables. Built again
+   * only when a variable changed since the last call.
+   *
+   * @param sh The shell
+   * @return The NULL terminated array, valid until a variable changes
+   */
+  char **sh_envp(struct shell *sh);
+
+  /**
+   * @brief Count the NAME=value words at the start of a command.
+   *
+   * @param argv The command
+   * @return The number of assignments before the command name
+   */
+  size_t env_assignments(char **argv);
+
+  /**
+   * @brief Set variables for one command, exported, saving what they
+   * replace.
+   *
+   * @param sh The shell
+   * @param assignments The NAME=value words
+   * @param count Number of assignments
+   * @return A mark to give env_pop
+   */
+  size_t env_push(struct shell *sh, char **assignments, size_t count);
+
+  /**
+   * @brief Put back the variables saved since env_push returned mark.
+   *
+   * @param sh The shell
+   * @param mark The mark
+   */
+  void env_pop(struct shell *sh, size_t mark);
+
+  /**
+   * @brief Set variables for good, as a line of only NAME=value words does.
+   *
+   * @param sh The shell
+   * @param assignments The NAME=value words
+   * @param count Number of assignments
+   * @return 0 on success, 1 if out of memory
+   */
+  int env_assign(struct shell *sh, char **assignments, size_t count);
+
+  /**
+   * @brief Free the variables. environ keeps its own copies.
+   *
+   * @param env The table
+   */
+  void env_destroy(struct env_table *env);
+
+  /**
+   * @brief The export builtin, `export [name[=value] ...]`. Lists the
+   * exported variables without arguments.
+   *
+   * @param sh The shell
+   * @param argv The export command and its arguments
+   * @return 0 on success, 1 for a name that is not valid
+   */
+  int builtin_export(struct shell *sh, char **argv);
+
+  /**
+   * @brief The unset builtin, `unset name ...`.
+   *
+   * @param sh The shell
+   * @param argv The unset command and its arguments
+   * @return 0 on success, 1 for a name that is not valid
+   */
+  int builtin_unset(struct shell *sh, char **argv);
+
+  /**
+   * @brief The canonical working directory of the shell, found once and
+   * then kept up to date by sh_chdir without calling getcwd.
+   *
+   * @param sh The shell
+   * @return The directory, or "." if it could not be found
+   */
+  const char *sh_cwd(struct shell *sh);
+
+  /**
+   * @brief The home directory of the user, HOME or else the password entry,
+   * which is only read once.
+   *
+   * @param sh The shell
+   * @return The directory, or NULL if there is none
+   */
+  const char *sh_home(struct shell *sh);
+
+  /**
+   * @brief Change the directory of the shell and update the cached cwd,
+   * PWD and OLDPWD. A relative path is looked up in CDPATH first.
+   * Prints an error on failure.
+   *
+   * @param sh The shell
+   * @param path The directory
+   * @param report Print the new directory, as cd does when CDPATH or cd -
+   * picked it
+   * @return 0 on success, -1 on failure
+   */
+  int sh_chdir(struct shell *sh, const char *path, bool report);
+
+  /**
+   * @brief Put PWD and OLDPWD in the environment if a cd changed them since
+   * the last time, called before a program is launched.
+   *
+   * @param sh The shell
+   */
+  void dirs_export(struct shell *sh);
+
+  /**
+   * @brief Free the cached directories, the pushd stack and close the CDPATH
+   * descriptors.
+   *
+   * @param dirs The directory state
+   */
+  void dirs_destroy(struct dir_state *dirs);
+
+  /**
+   * @brief The cd builtin, `cd [dir | -]`.
+   *
+   * @param sh The shell
+   * @param argv The cd command and its arguments
+   * @return 0 on success, 1 on failure
+   */
+  int builtin_cd(struct shell *sh, char **argv);
+
+  /**
+   * @brief The pushd builtin, `pushd [dir]`. Saves the cwd on the directory
+   * stack and changes to dir, or swaps the cwd with the top of the stack.
+   *
+   * @param sh The shell
+   * @param argv The pushd command and its arguments
+   * @return 0 on success, 1 on failure, 2 for bad arguments
+   */
+  int builtin_pushd(struct shell *sh, char **argv);
+
+  /**
+   * @brief The popd builtin, changes to the top of the directory stack and
+   * removes it.
+   *
+   * @param sh The shell
+   * @param argv The popd command and its arguments
+   * @return 0 on success, 1 on failure, 2 for bad arguments
+   */
+  int builtin_popd(struct shell *sh, char **argv);
+
+  /**
+   * @brief The dirs builtin, `dirs [-c]`. Prints the cwd and the directory
+   * stack, or clears the stack with -c.
+   *
+   * @param sh The shell
+   * @param argv The dirs command and its arguments
+   * @return 0 on success, 2 for bad arguments
+   */
+  int builtin_dirs(struct shell *sh, char **argv);
+
+  /**
+   * @brief The pwd builtin, `pwd [-L | -P]`. Prints the cached cwd, or with
+   * -P the one getcwd finds, symbolic links resolved.
+   *
+   * @param sh The shell
+   * @param argv The pwd command and its arguments
+   * @return 0 on success, 1 on failure, 2 for bad arguments
+   */
+  int builtin_pwd(struct shell *sh, char **argv);
+
+  /**
+   * @brief Copy everything left in one descriptor to another, with
+   * copy_file_range, sendfile or splice when the descriptors allow it and
+   * through a buffer otherwise.
+   *
+   * @param in The input
+   * @param out The output
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int copy_fd(int in, int out);
+
+  /**
+   * @brief The cat builtin, copies files or standard input to standard
+   * output in the shell. Optional, see enable.
+   *
+   * @param sh The shell
+   * @param argv The cat command and its arguments
+   * @return 0 on success, 1 if a file could not be copied, 2 for an option
+   */
+  int builtin_cat(struct shell *sh, char **argv);
+
+  /**
+   * @brief The cp builtin, copies files in the shell. Optional, see enable.
+   *
+   * @param sh The shell
+   * @param argv The cp command and its arguments
+   * @return 0 on success, 1 if a file could not be copied, 2 for bad
+   * arguments
+   */
+  int builtin_cp(struct shell *sh, char **argv);
+
+  /**
+   * @brief Create the listening socket of the -S server, readable and
+   * writable by its user alone whatever the umask. A socket left behind by
+   * a server that is gone is replaced.
+   *
+   * @param path Where to create the socket
+   * @return The listening descriptor, or -1 after printing an error
+   */
+  int server_listen(const char *path);
+
+  /**
+   * @brief Run the command lines sent to a listening socket, each in a child
+   * forked from the shell, until SIGTERM or SIGINT. See server.c for the
+   * protocol.
+   *
+   * @param sh The shell, set up with sh_init
+   * @param listen_fd A socket from server_listen, closed when the loop ends
+   * @return 0 after a clean shutdown, 1 if the loop could not be set up
+   */
+  int sh_serve(struct shell *sh, int listen_fd);
+
+  /**
+   * @brief Connect to a -S server.
+   *
+   * @param path The socket of the server
+   * @return The connected descriptor, or -1 with errno set
+   */
+  int server_connect(const char *path);
+
+  /**
+   * @brief Send one command line to a server and wait for its exit status.
+   *
+   * @param fd A connection from server_connect
+   * @param line The command line
+   * @param fds Standard input, output and error for the line, may be NULL
+   * @param nfds Number of descriptors in fds, at most three, the others
+   * are /dev/null
+   * @return The exit status of the line, or -1 with errno set if the
+   * request could not be sent or the server went away
+   */
+  int server_request(int fd, const char *line, const int *fds, size_t nfds);
+
+  /**
+   * @brief The -C client. Runs one line on a server with this process's
+   * standard input, output and error.
+   *
+   * @param path The socket of the server
+   * @param line The command line
+   * @return The exit status of the line, or 1 if the server could not run it
+   */
+  int sh_client(const char *path, const char *line);
+
+  /**
+   * @brief Set up an event loop with the given backend. io_uring falls back
+   * to epoll when the kernel does not have what the loop needs.
+   *
+   * @param loop The loop to set up
+   * @param backend The backend to try
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int event_loop_init(struct event_loop *loop, enum event_backend backend);
+
+  /**
+   * @brief Release an event loop. Watched descriptors are not closed.
+   *
+   * @param loop The loop
+   */
+  void event_loop_destroy(struct event_loop *loop);
+
+  /**
+   * @brief Watch a descriptor. Waiting is level triggered, fn is called on
+   * every wait for as long as the descriptor stays ready.
+   *
+   * @param loop The loop
+   * @param fd The descriptor
+   * @param events EPOLLIN and or EPOLLOUT
+   * @param fn Called when fd is ready
+   * @param data Passed to fn
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int event_add(struct event_loop *loop, int fd, uint32_t events, event_fn fn, void *data);
+
+  /**
+   * @brief Change what a watched descriptor waits for. 0 pauses the watch,
+   * epoll still reports a hang up then, io_uring reports nothing.
+   *
+   * @param loop The loop
+   * @param fd The descriptor
+   * @param events The new events
+   * @return 0 on success, -1 with errno set on failure
+   */
+  int event_modify(struct event_loop *loop, int fd, uint32_t events);
+
+  /**
+   * @brief Stop watching a descriptor. Must be called before it is closed.
+   *
+   * @param loop The loop
+   * @param fd The descriptor
+   */
+  void event_remove(struct event_loop *loop, int fd);
+
+  /**
+   * @brief Create a timerfd that goes off every interval and watch it. The
+   * loop reads the timer before fn is called.
+   *
+   * @param loop The loop
+   * @param interval_ns The period
+   * @param fn Called every period
+   * @param data Passed to fn
+   * @return The timer, which the caller removes and closes, or -1 with errno
+   * set
+   */
+  int event_timer(struct event_loop *loop, uint64_t interval_ns, event_fn fn, void *data);
+
+  /**
+   * @brief Wait until at least one watched descriptor is ready or the
+   * timeout passes, and call the handlers of those that are ready.
+   *
+   * @param loop The loop
+   * @param timeout_ms How long to wait, -1 for no limit
+   * @return The number of handlers called, or -1 with errno set
+   */
+  int event_wait(struct event_loop *loop, int timeout_ms);
+
+  /**
+   * @brief Render the prompt from MY_PROMPT, which is compiled into segments
+   * the first time. Each segment keeps its value and is only computed again
+   * when it could have changed: the cwd after a cd, the status when it is
+   * different, the time once a second. The VCS segment shows what the
+   * prompt's thread found last, with after_command it is asked to look
+   * again and writes vcs_notify if the answer changes.
+   *
+   * @param sh The shell
+   * @param after_command A command ran since the last render
+   * @return The prompt, valid until the next render
+   */
+  const char *prompt_render(struct shell *sh, bool after_command);
+
+  /**
+   * @brief Stop the prompt's thread and free the compiled prompt.
+   *
+   * @param prompt The prompt
+   */
+  void prompt_destroy(struct prompt *prompt);
+
+  /**
+   * @brief The interactive session: one event loop waits for terminal input,
+   * SIGCHLD and the HISTFLUSH timer, so finished background jobs are
+   * reported at once, even while a line is being edited.
+   *
+   * @param sh The shell, set up with sh_init
+   * @return The exit status of the last command
+   */
+  int sh_run_interactive(struct shell *sh);
+
+  /**
+   * @brief Find a builtin by name. The lookup is a perfect hash over the
+   * builtins table so it costs the same however many builtins exist.
+   *
+   * @param name The command name
+   * @return The builtin, or NULL if name is not a builtin
+   */
+  const struct builtin *builtin_find(const char *name);
+
+  /**
+   * @brief Print every builtin with its usage and a one line description.
+   *
+   * @param out Where to print
+   */
+  void builtins_print(FILE *out);
+
   /**
    * @brief Initialize the shell for use. Allocate all data structures
    * Grab control of the terminal and put the shell in its own
    * process group. NOTE: This function will block until the shell is
    * in its own program group. Attaching a debugger will always cause
    * this function to fail because the debugger maintains control of
-   * the subprocess it is debugging.
+   * the subprocess it is debugging. The options filled in by parse_args are
+   * left untouched.
    *
    * @param sh
    */
@@ -114,11 +1906,16 @@ extern "C"
 
   /**
    * @brief Parse command line args from the user when the shell was launched
+   * and store the selected options in the shell. The shell should be zero
+   * initialized before this is called and sh_init called afterwards. `-c`
+   * selects a command to run and the first operand a script to run, either
+   * makes the shell non-interactive.
    *
+   * @param sh The shell to configure
    * @param argc Number of args
    * @param argv The arg array
    */
-  void parse_args(int argc, char **argv);
+  void parse_args(struct shell *sh, int argc, char **argv);
 
 
 
@@ -0,0 +1,311 @@
+/**
+ * @file lex.c
+ * @brief The command line lexer of the shell lab.
+ *
+ * A line is split into words and operators in a single pass by a small
+ * state machine: between tokens, in a word, in single quotes and in double
+ * quotes. Quotes and backslashes are removed while the word is copied, so
+ * a word's text is ready for exec as soon as its terminator is written.
+ * Every character class the machine cares about is looked up in one table.
+ *
+ * The text of the words is written behind the reading position, either
+ * into the context's store or back into the line itself. A word is never
+ * longer than the input it came from, so parsing in place never overwrites
+ * input that has not been read. The only byte that may be overwritten is
+ * the one right after a word, which is read before the terminator goes in.
+ *
+ * Long runs of plain word characters are scanned 16 bytes at a time with
+ * SSE2 when it is available, the table is used for the rest.
+ *
+ * All state lives on the stack and in the context, so the lexer can run on
+ * several threads as long as each has its own context. A thread parsing
+ * ahead sets defer_errors so a syntax error is printed in its turn, by the
+ * thread running the line.
+ *
+ * References:
+ * https://pubs.opengroup.org/onlinepubs/9699919799/utilities/V3_chap02.html#tag_18_02
+ * https://pubs.opengroup.org/onlinepubs/9699919799/utilities/V3_chap02.html#tag_18_03
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lab.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * @brief Character classes of the lexer.
+ */
+enum char_class {
+    CHAR_PLAIN,    // part of a word
+    CHAR_END,      // the null terminator
+    CHAR_BLANK,    // separates words
+    CHAR_OPERATOR, // starts an operator and ends the word before it
+    CHAR_QUOTE,    // ' " or a backslash
+};
+
+/**
+ * @brief Class of every byte. Anything not listed is a plain word byte.
+ */
+static const unsigned char char_classes[256] = {
+    ['\0'] = CHAR_END,
+    [' '] = CHAR_BLANK,
+    ['\t'] = CHAR_BLANK,
+    ['|'] = CHAR_OPERATOR,
+    ['&'] = CHAR_OPERATOR,
+    [';'] = CHAR_OPERATOR,
+    ['<'] = CHAR_OPERATOR,
+    ['>'] = CHAR_OPERATOR,
+    ['\''] = CHAR_QUOTE,
+    ['"'] = CHAR_QUOTE,
+    ['\\'] = CHAR_QUOTE,
+};
+
+/**
+ * @brief Text of each token kind. Operators point here because their
+ * characters in the line may be overwritten by the terminator of the word
+ * in front of them.
+ */
+static char token_text[][3] = {
+    [TOK_PIPE] = "|",
+    [TOK_BACKGROUND] = "&",
+    [TOK_SEMI] = ";",
+    [TOK_LESS] = "<",
+    [TOK_GREAT] = ">",
+    [TOK_APPEND] = ">>",
+    [TOK_LESS_AND] = "<&",
+    [TOK_GREAT_AND] = ">&",
+};
+
+/**
+ * @brief Helper function to get the ARG_MAX limit. sysconf(_SC_ARG_MAX) is
+ * derived from the stack rlimit, which costs a system call, so the value is
+ * looked up once and reused for every line.
+ *
+ * @return The maximum number of bytes of arguments for exec
+ */
+static size_t arg_max_limit(void) {
+    static size_t arg_max; // 0 until the first call
+    if (!arg_max) {
+        arg_max = (size_t)sysconf(_SC_ARG_MAX); // upper bound on exec arguments, see sysconf(3)
+    }
+    return arg_max;
+}
+
+/**
+ * @brief Helper function to count the plain word bytes at the start of a
+ * run. With SSE2 the run is compared 16 bytes at a time against every
+ * byte that is not plain, without it the table is used.
+ *
+ * @param cursor Start of the run
+ * @param end End of the line, the run never goes past it
+ * @return The number of plain bytes
+ */
+static size_t plain_run(const char *cursor, const char *end) {
+    const char *start = cursor;
+#ifdef __SSE2__
+    while (end - cursor >= 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)cursor);
+        __m128i special = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' '));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t')));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('|')));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('&')));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(';')));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('<')));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('>')));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\'')));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"')));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\')));
+        int mask = _mm_movemask_epi8(special);
+        if (mask) {
+            return (size_t)(cursor - start) + (size_t)__builtin_ctz((unsigned)mask);
+        }
+        cursor += 16;
+    }
+#endif
+    while (cursor < end && char_classes[(unsigned char)*cursor] == CHAR_PLAIN) {
+        cursor++;
+    }
+    return (size_t)(cursor - start);
+}
+
+/**
+ * @brief Helper function to read the operator starting with first. The
+ * first byte is passed on its own because it may already have been
+ * overwritten by the terminator of the word in front of it.
+ *
+ * @param first The first byte of the operator
+ * @param cursor Points at the first byte, moved past the operator
+ * @return The kind of operator
+ */
+static enum token_kind read_operator(char first, const char **cursor) {
+    char second = (*cursor)[1];
+    *cursor += 1;
+    switch (first) {
+    case '|':
+        return TOK_PIPE;
+    case '&':
+        return TOK_BACKGROUND;
+    case ';':
+        return TOK_SEMI;
+    case '<':
+        if (second == '&') {
+            *cursor += 1;
+            return TOK_LESS_AND;
+        }
+        return TOK_LESS;
+    default: // '>'
+        if (second == '>' || second == '&') {
+            *cursor += 1;
+            return second == '>' ? TOK_APPEND : TOK_GREAT_AND;
+        }
+        return TOK_GREAT;
+    }
+}
+
+/**
+ * @brief Bound the number of tokens cmd_lex can find in a line, without
+ * lexing it. A word starts a run of bytes that are not blank or follows an
+ * operator, and an operator takes at least one operator byte, so a token
+ * is either the start of a run or one of the two an operator byte can
+ * give. Quotes only make the bound larger than needed.
+ *
+ * @param line The line
+ * @return The most tokens cmd_lex returns for it
+ */
+size_t cmd_lex_bound(const char *line) {
+    size_t bound = 0;
+    bool blank = true; // before the line counts as a blank
+    for (const unsigned char *byte = (const unsigned char *)line; *byte; byte++) {
+        enum char_class class = char_classes[*byte];
+        bound += class == CHAR_OPERATOR ? 2 : blank && class != CHAR_BLANK;
+        blank = class == CHAR_BLANK;
+    }
+    return bound;
+}
+
+/**
+ * @brief Helper function to report a syntax error, printed at once unless
+ * the context's errors are deferred. It is kept in the context either way,
+ * which tells it from a failed allocation.
+ *
+ * @param ctx The context
+ * @param message The error
+ * @return -1, for cmd_lex to return
+ */
+static long lex_error(struct parse_ctx *ctx, const char *message) {
+    ctx->error = message;
+    if (!ctx->defer_errors) {
+        fprintf(stderr, "%s\n", message);
+    }
+    return -1;
+}
+
+/**
+ * @brief Split a line into tokens. See lex.c for how the state machine
+ * works.
+ *
+ * @param ctx The context that receives the tokens and their kinds
+ * @param line The line to split
+ * @param out Where the text of the words is written, ctx->store or line
+ * itself to parse in place
+ * @return The number of tokens, or -1 after printing an error, or only
+ * keeping it in ctx->error if ctx->defer_errors is set; ctx->error stays
+ * NULL when an allocation failed
+ */
+long cmd_lex(struct parse_ctx *ctx, const char *line, char *out) {
+    ctx->error = NULL;
+    size_t arg_max = arg_max_limit();
+    const char *cursor = line;
+    const char *end = line + strlen(line);
+    size_t count = 0;
+    char c = *cursor; // the byte at cursor, which writing out may have overwritten
+    for (;;) {
+        while (char_classes[(unsigned char)c] == CHAR_BLANK) {
+            c = *++cursor;
+        }
+        if (c == '\0' || count >= arg_max - 1) {
+            break;
+        }
+        // Room for this token and the NULL terminator.
+        if (grow_buffer((void **)&ctx->argv, &ctx->argv_cap, count + 2, sizeof(char *)) != 0 ||
+            grow_buffer((void **)&ctx->kinds, &ctx->kinds_cap, count + 2, sizeof(enum token_kind)) != 0) {
+            perror("cmd_parse: realloc failed");
+            return -1;
+        }
+        if (char_classes[(unsigned char)c] == CHAR_OPERATOR) {
+            enum token_kind kind = read_operator(c, &cursor);
+            ctx->argv[count] = token_text[kind];
+            ctx->kinds[count++] = kind;
+            c = *cursor;
+            continue;
+        }
+        char *word = out;
+        bool digits = true; // only unquoted digits so far, a candidate file descriptor
+        for (;;) {
+            enum char_class class = char_classes[(unsigned char)c];
+            if (class == CHAR_PLAIN) {
+                size_t length = plain_run(cursor, end);
+                for (size_t i = 0; i < length && digits; i++) {
+                    digits = cursor[i] >= '0' && cursor[i] <= '9';
+                }
+                if (out != cursor) {
+                    memmove(out, cursor, length);
+                }
+                out += length;
+                cursor += length;
+                c = *cursor;
+                continue;
+            }
+            if (class != CHAR_QUOTE) {
+                break; // blank, operator or the end of the line
+            }
+            digits = false;
+            cursor++;
+            if (c == '\\') { // the next byte is taken as it is
+                if (*cursor) {
+                    *out++ = *cursor++;
+                } else {
+                    *out++ = '\\'; // a backslash ending the line stays
+                }
+            } else if (c == '\'') { // everything up to the closing quote
+                const char *close = strchr(cursor, '\'');
+                if (!close) {
+                    return lex_error(ctx, "syntax error: unterminated single quote");
+                }
+                memmove(out, cursor, (size_t)(close - cursor));
+                out += close - cursor;
+                cursor = close + 1;
+            } else { // double quotes, a backslash only escapes " \ $ and `
+                while (*cursor != '"') {
+                    if (!*cursor) {
+                        return lex_error(ctx, "syntax error: unterminated double quote");
+                    }
+                    if (*cursor == '\\' && cursor[1] && strchr("\"\\$`", cursor[1])) {
+                        cursor++;
+                    }
+                    *out++ = *cursor++;
+                }
+                cursor++;
+            }
+            c = *cursor;
+        }
+        *out++ = '\0'; // may overwrite the byte at cursor, which is saved in c
+        ctx->argv[count] = word;
+        // "2>file": a number right in front of a redirection is the descriptor it applies to.
+        ctx->kinds[count++] = digits && (c == '<' || c == '>') ? TOK_IO_NUMBER : TOK_WORD;
+    }
+    // An empty line still needs room for the terminators.
+    if (grow_buffer((void **)&ctx->argv, &ctx->argv_cap, count + 1, sizeof(char *)) != 0 ||
+        grow_buffer((void **)&ctx->kinds, &ctx->kinds_cap, count + 1, sizeof(enum token_kind)) != 0) {
+        perror("cmd_parse: realloc failed");
+        return -1;
+    }
+    ctx->argv[count] = NULL;
+    ctx->kinds[count] = TOK_END;
+    ctx->count = count;
+    return (long)count;
+}
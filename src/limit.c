@@ -0,0 +1,559 @@
+/**
+ * @file limit.c
+ * @brief Resource limits for the jobs of the shell lab: the limit builtin,
+ * a cgroup v2 per job and rlimits.
+ *
+ * `limit -c 50 -m 2G` gives every job started afterwards half a CPU and
+ * 2 GiB, `limit -m 512M make -j8` gives them to that one job, background,
+ * pipeline or parallel, as `time` does for timing. A job takes a copy of
+ * the limits when it is started, so changing them later never touches a
+ * job that is running.
+ *
+ * The cpu share and the memory are a budget for the job as a whole, so
+ * they are set on a cgroup of its own: the shell makes `lab-PID-job-N` in
+ * its cgroup v2 and writes cpu.max and memory.max there. A process of the
+ * job is created right in that cgroup with clone3(CLONE_INTO_CGROUP), so
+ * joining it costs the child no system call, and the cgroup is removed
+ * once the job is released. The shell's cgroup is a leaf with the shell in
+ * it, and a cgroup with processes can't hand controllers to its children,
+ * so the shell first moves itself into `lab-PID-shell` next to its jobs.
+ * On exit it turns off the controllers it enabled, moves back and removes
+ * the leaf, leaving its cgroup as it found it.
+ *
+ * Without a cgroup v2 the shell is allowed to write to, cgroup v1 among
+ * them, the memory limit falls back to RLIMIT_AS on every process and a
+ * cpu share can't be had at all. The cpu time and open files limits are
+ * rlimits either way, set in the child between fork and exec. posix_spawn
+ * has no step for that, so a job with limits is always launched through
+ * the fork engine, and a job without them costs nothing more than before.
+ *
+ * References:
+ * https://docs.kernel.org/admin-guide/cgroup-v2.html
+ * https://man7.org/linux/man-pages/man2/clone3.2.html
+ * https://man7.org/linux/man-pages/man2/setrlimit.2.html
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <linux/magic.h>
+#include <linux/sched.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include "lab.h"
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_HYBRID_ROOT "/sys/fs/cgroup/unified" // where the v2 hierarchy is mounted next to v1 ones
+#define CGROUP_CPU_PERIOD 100000                   // cpu.max period in microseconds, the kernel's default
+#define CGROUP_NAME_MAX 64
+
+/**
+ * @brief Tell whether any limit is set.
+ *
+ * @param limits The limits
+ * @return True if at least one limit is set
+ */
+bool job_limits_set(const struct job_limits *limits) {
+    return limits->cpu_percent || limits->memory || limits->cpu_seconds || limits->files;
+}
+
+/**
+ * @brief Helper function to write a short string to a file in a cgroup.
+ *
+ * @param dir_fd The cgroup directory
+ * @param file The file, such as "memory.max"
+ * @param text What to write
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int cgroup_write(int dir_fd, const char *file, const char *text) {
+    int fd = openat(dir_fd, file, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = write(fd, text, strlen(text));
+    int err = errno;
+    close(fd);
+    errno = err;
+    return n < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Helper function to find the directory of the shell's cgroup v2.
+ *
+ * @return The directory, open, or -1 if the shell is in no cgroup v2
+ */
+static int open_own_cgroup(void) {
+    FILE *in = fopen("/proc/self/cgroup", "re");
+    if (!in) {
+        return -1;
+    }
+    char *line = NULL, *relative = NULL;
+    size_t cap = 0;
+    ssize_t length;
+    while ((length = getline(&line, &cap, in)) > 0) {
+        if (strncmp(line, "0::", 3) == 0) { // the v2 hierarchy has no controller names, only an id of 0
+            line[length - 1] = line[length - 1] == '\n' ? '\0' : line[length - 1];
+            relative = line + 3;
+            break;
+        }
+    }
+    fclose(in);
+    int fd = -1;
+    struct statfs fs;
+    const char *roots[] = {CGROUP_ROOT, CGROUP_HYBRID_ROOT};
+    for (size_t i = 0; relative && fd < 0 && i < sizeof(roots) / sizeof(roots[0]); i++) {
+        if (statfs(roots[i], &fs) == 0 && fs.f_type == CGROUP2_SUPER_MAGIC) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s%s", roots[i], relative);
+            fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+    }
+    free(line);
+    return fd < 0 ? -1 : fd_move_high(fd);
+}
+
+/**
+ * @brief Helper function to tell whether a controller is listed in a
+ * cgroup's cgroup.subtree_control.
+ *
+ * @param dir_fd The cgroup directory
+ * @param controller The controller, such as "cpu"
+ * @return True if it is enabled for the children
+ */
+static bool subtree_has(int dir_fd, const char *controller) {
+    char text[256];
+    int fd = openat(dir_fd, "cgroup.subtree_control", O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd < 0 ? -1 : read(fd, text, sizeof(text) - 1);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (n <= 0) {
+        return false;
+    }
+    text[n] = '\0';
+    size_t length = strlen(controller);
+    char *save;
+    for (char *word = strtok_r(text, " \n", &save); word; word = strtok_r(NULL, " \n", &save)) {
+        if (strlen(word) == length && strcmp(word, controller) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char *const cgroup_controllers[] = {"+cpu", "+memory"}; // in the order of cgroup_state.enabled
+
+/**
+ * @brief Helper function to name the leaf cgroup the shell moves into.
+ *
+ * @param pid The shell
+ * @param name Room for CGROUP_NAME_MAX bytes
+ */
+static void shell_cgroup_name(pid_t pid, char *name) {
+    snprintf(name, CGROUP_NAME_MAX, "lab-%d-shell", (int)pid);
+}
+
+/**
+ * @brief Helper function to enable the cpu and memory controllers for the
+ * cgroups of the jobs. A cgroup with processes refuses with EBUSY, so the
+ * shell then moves itself into a leaf of its own and tries again.
+ *
+ * @param state The shell's cgroup, which records what was changed
+ */
+static void enable_controllers(struct cgroup_state *state) {
+    int dir_fd = state->dir_fd;
+    for (size_t i = 0; i < sizeof(cgroup_controllers) / sizeof(cgroup_controllers[0]); i++) {
+        if (subtree_has(dir_fd, cgroup_controllers[i] + 1)) {
+            continue;
+        }
+        if (cgroup_write(dir_fd, "cgroup.subtree_control", cgroup_controllers[i]) == 0) {
+            state->enabled[i] = true;
+        } else if (errno == EBUSY && !state->leaf) {
+            char name[CGROUP_NAME_MAX];
+            shell_cgroup_name(getpid(), name);
+            if (mkdirat(dir_fd, name, 0755) != 0 && errno != EEXIST) {
+                return;
+            }
+            int leaf = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            bool moved = leaf >= 0 && cgroup_write(leaf, "cgroup.procs", "0") == 0;
+            if (leaf >= 0) {
+                close(leaf);
+            }
+            if (!moved) {
+                unlinkat(dir_fd, name, AT_REMOVEDIR);
+                return;
+            }
+            state->leaf = getpid();
+            state->enabled[i] = cgroup_write(dir_fd, "cgroup.subtree_control", cgroup_controllers[i]) == 0;
+        }
+    }
+}
+
+/**
+ * @brief Helper function to find the cgroup jobs are made in, once.
+ *
+ * @param sh The shell
+ */
+static void probe_cgroup(struct shell *sh) {
+    if (sh->cgroup.probed) {
+        return;
+    }
+    sh->cgroup.probed = true;
+    sh->cgroup.dir_fd = open_own_cgroup();
+    if (sh->cgroup.dir_fd >= 0) {
+        enable_controllers(&sh->cgroup);
+        sh->cgroup.cpu = subtree_has(sh->cgroup.dir_fd, "cpu");
+        sh->cgroup.memory = subtree_has(sh->cgroup.dir_fd, "memory");
+    }
+    if (!sh->cgroup.cpu && !sh->cgroup.memory && sh->cgroup.dir_fd >= 0 && !sh->cgroup.leaf) {
+        close(sh->cgroup.dir_fd); // nothing to limit with, the rlimits are all there is
+        sh->cgroup.dir_fd = -1;
+    }
+}
+
+/**
+ * @brief Helper function to name the cgroup of a job.
+ *
+ * @param job The job
+ * @param name Room for CGROUP_NAME_MAX bytes
+ */
+static void job_cgroup_name(const struct job *job, char *name) {
+    snprintf(name, CGROUP_NAME_MAX, "lab-%d-job-%d", (int)getpid(), job->id);
+}
+
+/**
+ * @brief Make the cgroup of a job with a cpu or memory limit before its
+ * first process is launched. See limit.c.
+ *
+ * @param sh The shell
+ * @param job The job
+ */
+void job_limits_prepare(struct shell *sh, struct job *job) {
+    if (job->cgroup_fd >= 0 || (!job->limits.cpu_percent && !job->limits.memory)) {
+        return;
+    }
+    probe_cgroup(sh);
+    bool cpu = job->limits.cpu_percent && sh->cgroup.cpu;
+    bool memory = job->limits.memory && sh->cgroup.memory;
+    if (!cpu && !memory) {
+        return;
+    }
+    char name[CGROUP_NAME_MAX], text[64];
+    job_cgroup_name(job, name);
+    // A job of the same slot may have left a process behind in it, the cgroup is used again.
+    if (mkdirat(sh->cgroup.dir_fd, name, 0755) != 0 && errno != EEXIST) {
+        return;
+    }
+    int fd = openat(sh->cgroup.dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    if (cpu) {
+        snprintf(text, sizeof(text), "%ld %d", job->limits.cpu_percent * (CGROUP_CPU_PERIOD / 100), CGROUP_CPU_PERIOD);
+        cgroup_write(fd, "cpu.max", text);
+    }
+    if (memory) {
+        snprintf(text, sizeof(text), "%lld", job->limits.memory);
+        job->cgroup_memory = cgroup_write(fd, "memory.max", text) == 0;
+    }
+    job->cgroup_fd = fd_move_high(fd);
+    job->cgroup_parent = sh->cgroup.dir_fd;
+}
+
+/**
+ * @brief Fork a process of a job, into its cgroup with clone3 when it has
+ * one. clone3 is a raw system call, so glibc's fork handlers don't run and
+ * a malloc or stdio lock another thread of the shell held stays held in
+ * the child: only a child that goes straight to execve is made this way.
+ * Any other, and every child on a kernel without CLONE_INTO_CGROUP, comes
+ * from fork and joins the cgroup itself.
+ *
+ * @param job The job, NULL for none
+ * @param exec True if the child makes only async-signal-safe calls before execve
+ * @param joined Set to true if the child starts in the job's cgroup
+ * @return What fork returns
+ */
+pid_t job_limits_fork(const struct job *job, bool exec, bool *joined) {
+    *joined = false;
+    if (exec && job && job->cgroup_fd >= 0) {
+        struct clone_args args = {0};
+        args.flags = CLONE_INTO_CGROUP;
+        args.exit_signal = SIGCHLD;
+        args.cgroup = (uint64_t)job->cgroup_fd;
+        long pid = syscall(SYS_clone3, &args, sizeof(args));
+        if (pid >= 0) {
+            *joined = true;
+            return (pid_t)pid;
+        }
+        if (errno != ENOSYS && errno != E2BIG && errno != EINVAL) {
+            return -1;
+        }
+    }
+    return fork();
+}
+
+/**
+ * @brief Helper function to lower one rlimit of the child, never above
+ * the hard limit it already has.
+ *
+ * @param resource The resource
+ * @param value The limit
+ */
+static void lower_rlimit(int resource, rlim_t value) {
+    struct rlimit limit;
+    if (getrlimit(resource, &limit) == 0) {
+        if (limit.rlim_max != RLIM_INFINITY && value > limit.rlim_max) {
+            value = limit.rlim_max;
+        }
+        limit.rlim_cur = limit.rlim_max = value;
+        setrlimit(resource, &limit);
+    }
+}
+
+/**
+ * @brief Put the limits of its job on a forked child before it execs.
+ *
+ * @param job The job, NULL for none
+ * @param joined True if the child was created in the job's cgroup
+ */
+void job_limits_apply(const struct job *job, bool joined) {
+    if (!job) {
+        return;
+    }
+    if (job->cgroup_fd >= 0 && !joined) {
+        cgroup_write(job->cgroup_fd, "cgroup.procs", "0");
+    }
+    if (job->limits.memory && !job->cgroup_memory) {
+        lower_rlimit(RLIMIT_AS, (rlim_t)job->limits.memory);
+    }
+    if (job->limits.cpu_seconds) {
+        lower_rlimit(RLIMIT_CPU, (rlim_t)job->limits.cpu_seconds);
+    }
+    if (job->limits.files) {
+        lower_rlimit(RLIMIT_NOFILE, (rlim_t)job->limits.files);
+    }
+}
+
+/**
+ * @brief Remove the cgroup of a job whose processes are all gone. A
+ * process the job left running keeps it, rmdir fails and it is used again
+ * by the next job in the slot.
+ *
+ * @param job The job
+ */
+void job_limits_release(struct job *job) {
+    if (job->cgroup_fd < 0) {
+        return;
+    }
+    char name[CGROUP_NAME_MAX];
+    job_cgroup_name(job, name);
+    close(job->cgroup_fd);
+    unlinkat(job->cgroup_parent, name, AT_REMOVEDIR);
+    job->cgroup_fd = -1;
+    job->cgroup_memory = false;
+}
+
+/**
+ * @brief Helper function to put the shell's cgroup back as it was before
+ * enable_controllers. A cgroup with controllers on for its children can't
+ * hold processes, so they go first; a job cgroup a stray process still
+ * keeps alive loses its cpu and memory limits with them. If the shell's
+ * cgroup had other controllers on already the shell stays in its leaf.
+ *
+ * @param state The shell's cgroup
+ */
+static void restore_cgroup(const struct cgroup_state *state) {
+    for (size_t i = 0; i < sizeof(cgroup_controllers) / sizeof(cgroup_controllers[0]); i++) {
+        if (state->enabled[i]) {
+            char off[16];
+            snprintf(off, sizeof(off), "-%s", cgroup_controllers[i] + 1);
+            cgroup_write(state->dir_fd, "cgroup.subtree_control", off);
+        }
+    }
+    if (cgroup_write(state->dir_fd, "cgroup.procs", "0") == 0) {
+        char name[CGROUP_NAME_MAX];
+        shell_cgroup_name(state->leaf, name);
+        unlinkat(state->dir_fd, name, AT_REMOVEDIR);
+    }
+}
+
+/**
+ * @brief Close the cgroup directory of the shell, moving the shell back
+ * into it first. See lab.h.
+ *
+ * @param sh The shell
+ */
+void limits_destroy(struct shell *sh) {
+    if (sh->cgroup.probed && sh->cgroup.dir_fd >= 0) {
+        if (sh->cgroup.leaf && sh->cgroup.leaf == getpid()) { // a forked child is not the shell that moved
+            restore_cgroup(&sh->cgroup);
+        }
+        close(sh->cgroup.dir_fd);
+    }
+    memset(&sh->cgroup, 0, sizeof(sh->cgroup));
+}
+
+/**
+ * @brief Helper function to read the value of an option, a number with an
+ * optional K, M or G suffix when it is a size.
+ *
+ * @param text The value
+ * @param size True to allow the suffixes
+ * @param value Filled with the value
+ * @return True if it is a number of 0 or more
+ */
+static bool parse_value(const char *text, bool size, long long *value) {
+    char *end;
+    errno = 0;
+    long long number = strtoll(text, &end, 10);
+    if (end == text || number < 0 || errno) {
+        return false;
+    }
+    int shift = 0;
+    if (size && *end) {
+        const char *suffixes = "KMG";
+        const char *at = strchr(suffixes, *end == 'k' ? 'K' : *end);
+        if (!at || end[1]) {
+            return false;
+        }
+        shift = 10 * (int)(at - suffixes + 1);
+        end++;
+    }
+    if (*end || number > (LLONG_MAX >> shift)) {
+        return false;
+    }
+    *value = number << shift;
+    return true;
+}
+
+/**
+ * @brief Helper function to read the options of limit into a set of
+ * limits. A value of 0 takes a limit off, -r takes them all off.
+ *
+ * @param sh The shell, whose cgroup decides if -c can be used
+ * @param argv The limit command and its arguments
+ * @param limits The limits to change
+ * @param changed Set to true if there was an option
+ * @return Index of the first word of the command, or -1 after printing an
+ * error
+ */
+static int parse_limit_options(struct shell *sh, char **argv, struct job_limits *limits, bool *changed) {
+    int i = 1;
+    *changed = false;
+    for (; argv[i] && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            return i + 1;
+        }
+        const char *option = argv[i];
+        if (strcmp(option, "-r") == 0) {
+            memset(limits, 0, sizeof(*limits));
+            *changed = true;
+            continue;
+        }
+        long long value;
+        bool known = option[1] && !option[2] && strchr("cmtn", option[1]);
+        if (!known || !argv[i + 1]) {
+            fprintf(stderr, "limit: usage: limit [-c percent] [-m size] [-t seconds] [-n files] [-r] [command ...]\n");
+            return -1;
+        }
+        if (!parse_value(argv[++i], option[1] == 'm', &value) || (option[1] != 'm' && value > LONG_MAX)) {
+            fprintf(stderr, "limit: %s: invalid value for %s\n", argv[i], option);
+            return -1;
+        }
+        switch (option[1]) {
+        case 'c':
+            probe_cgroup(sh);
+            if (value && !sh->cgroup.cpu) {
+                fprintf(stderr, "limit: -c needs the cpu controller of a cgroup v2\n");
+                return -1;
+            }
+            limits->cpu_percent = (long)value;
+            break;
+        case 'm':
+            limits->memory = value;
+            break;
+        case 't':
+            limits->cpu_seconds = (long)value;
+            break;
+        default:
+            limits->files = (long)value;
+            break;
+        }
+        *changed = true;
+    }
+    return i;
+}
+
+/**
+ * @brief Take `limit [options]` off the front of a command, see lab.h.
+ *
+ * @param sh The shell
+ * @param argv The command
+ * @return The number of words taken, 0 if this is no limit prefix, or -1
+ * after printing an error
+ */
+long limit_prefix(struct shell *sh, char **argv) {
+    if (!argv[0] || strcmp(argv[0], "limit") != 0) {
+        return 0;
+    }
+    struct job_limits limits = sh->limits;
+    bool changed;
+    int first = parse_limit_options(sh, argv, &limits, &changed);
+    if (first < 0) {
+        return -1;
+    }
+    if (!argv[first]) {
+        return 0; // the builtin sets the shell's limits
+    }
+    sh->limits = limits;
+    return first;
+}
+
+/**
+ * @brief The limit builtin. See lab.h.
+ *
+ * @param sh The shell
+ * @param argv The limit command and its arguments
+ * @return 0 on success, 2 for a bad option
+ */
+int builtin_limit(struct shell *sh, char **argv) {
+    struct job_limits limits = sh->limits;
+    bool changed;
+    int first = parse_limit_options(sh, argv, &limits, &changed);
+    if (first < 0) {
+        return 2;
+    }
+    if (argv[first]) { // only a stage of a pipeline lands here, limit_prefix takes the others
+        fprintf(stderr, "limit: a command with limits must start the pipeline\n");
+        return 2;
+    }
+    if (changed) {
+        sh->limits = limits;
+        return 0;
+    }
+    // Memory says how it is enforced, which depends on the cgroup found.
+    if (limits.memory) {
+        probe_cgroup(sh);
+    }
+    if (limits.cpu_percent) {
+        printf("-c %ld\tcpu.max\n", limits.cpu_percent);
+    }
+    if (limits.memory) {
+        printf("-m %lld\t%s\n", limits.memory, sh->cgroup.memory ? "memory.max" : "RLIMIT_AS");
+    }
+    if (limits.cpu_seconds) {
+        printf("-t %ld\tRLIMIT_CPU\n", limits.cpu_seconds);
+    }
+    if (limits.files) {
+        printf("-n %ld\tRLIMIT_NOFILE\n", limits.files);
+    }
+    return 0;
+}
@@ -0,0 +1,259 @@
+/**
+ * @file linecache.c
+ * @brief The line cache of the shell lab: tokens of recently run lines.
+ *
+ * Generated scripts and the interactive history run the same lines over
+ * and over, and every time the lexer walks the line byte by byte to find
+ * the same tokens. The cache keeps the tokens of the last
+ * LINE_CACHE_ENTRIES lines in a hash table keyed by the line. An entry is
+ * a single allocation holding the line, the kind of every token, where
+ * each one starts and their text, so a hit is one hash of the line, a
+ * compare and two copies into the parse context. The least recently used
+ * line goes when the cache is full.
+ *
+ * A line run once is not kept: most lines of a generated script never come
+ * back, and caching each would cost a copy of the line and an allocation,
+ * then an eviction and a free. The first miss of a line only writes its
+ * hash into a small table, a line is inserted on the miss that finds it
+ * there. The line is copied for line_cache_insert only when the caller
+ * parses it in place, otherwise the caller's line is read.
+ *
+ * Only the tokens are cached, no lookups made with them. They depend on
+ * the bytes of the line alone, so nothing can make an entry stale: a
+ * change of PATH or of the builtins turned on is seen when the command is
+ * looked up, through the PATH cache and the builtin table, on every run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lab.h"
+
+#define LINE_CACHE_ENTRIES 256  // lines kept, the least recently used goes first
+#define LINE_CACHE_BUCKETS 512  // a power of two, twice the entries keeps chains short
+#define LINE_CACHE_MAX_LINE 1024 // longer lines are rarely run twice and are not kept
+#define LINE_CACHE_SEEN 1024     // a power of two, slots of the table of lines missed once
+
+/**
+ * @brief Helper function to find the bucket slot holding a line. Returns
+ * the address of the pointer to the entry so callers can also unlink it.
+ *
+ * @param cache The cache, with buckets
+ * @param line The line
+ * @param length Length of the line
+ * @param hash Hash of the line
+ * @return The slot, *slot is NULL if the line is not cached
+ */
+static struct line_entry **find_slot(struct line_cache *cache, const char *line, size_t length, uint64_t hash) {
+    struct line_entry **slot = &cache->buckets[hash & (LINE_CACHE_BUCKETS - 1)];
+    while (*slot && ((*slot)->hash != hash || (*slot)->length != length || memcmp((*slot)->line, line, length) != 0)) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+/**
+ * @brief Helper function to take an entry out of the recency list.
+ *
+ * @param cache The cache
+ * @param entry The entry
+ */
+static void unlink_recent(struct line_cache *cache, struct line_entry *entry) {
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+}
+
+/**
+ * @brief Helper function to put an entry at the most recently used end.
+ *
+ * @param cache The cache
+ * @param entry The entry, not in the list
+ */
+static void push_newest(struct line_cache *cache, struct line_entry *entry) {
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest) {
+        cache->newest->newer = entry;
+    } else {
+        cache->oldest = entry;
+    }
+    cache->newest = entry;
+}
+
+/**
+ * @brief Helper function to copy the tokens of an entry into a parse
+ * context, the way cmd_lex leaves it.
+ *
+ * @param entry The entry
+ * @param ctx The context
+ * @return 0 on success, -1 if the allocation failed
+ */
+static int restore(const struct line_entry *entry, struct parse_ctx *ctx) {
+    if (grow_buffer((void **)&ctx->store, &ctx->store_cap, entry->text_size, sizeof(char)) != 0 ||
+        grow_buffer((void **)&ctx->argv, &ctx->argv_cap, entry->count + 1, sizeof(char *)) != 0 ||
+        grow_buffer((void **)&ctx->kinds, &ctx->kinds_cap, entry->count + 1, sizeof(enum token_kind)) != 0) {
+        return -1;
+    }
+    memcpy(ctx->store, entry->text, entry->text_size);
+    memcpy(ctx->kinds, entry->kinds, (entry->count + 1) * sizeof(enum token_kind));
+    for (size_t i = 0; i < entry->count; i++) {
+        ctx->argv[i] = ctx->store + entry->offsets[i];
+    }
+    ctx->argv[entry->count] = NULL;
+    ctx->count = entry->count;
+    return 0;
+}
+
+/**
+ * @brief Helper function to allocate the buckets and the table of lines
+ * seen once.
+ *
+ * @param cache The cache
+ * @return 0 on success, -1 if the allocation failed
+ */
+static int alloc_tables(struct line_cache *cache) {
+    if (!cache->buckets && !(cache->buckets = calloc(LINE_CACHE_BUCKETS, sizeof(*cache->buckets)))) {
+        return -1;
+    }
+    if (!cache->seen && !(cache->seen = calloc(LINE_CACHE_SEEN, sizeof(*cache->seen)))) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Fill a parse context with the tokens of a line run before, moving
+ * it to the most recently used end. A miss of a line whose hash is in the
+ * seen table remembers it, copied if it is parsed in place, to be inserted
+ * once it is parsed; any other miss puts the hash there.
+ *
+ * @param cache The cache
+ * @param ctx The context to fill
+ * @param line The line
+ * @param inplace True if the caller parses the line in place
+ * @return True on a hit, false if the line still has to be parsed
+ */
+bool line_cache_lookup(struct line_cache *cache, struct parse_ctx *ctx, const char *line, bool inplace) {
+    cache->key_pending = false;
+    size_t length = strnlen(line, LINE_CACHE_MAX_LINE + 1);
+    if (length > LINE_CACHE_MAX_LINE || alloc_tables(cache) != 0) {
+        return false;
+    }
+    uint64_t hash = fnv1a_hash(line, length);
+    struct line_entry *entry = *find_slot(cache, line, length, hash);
+    if (entry && restore(entry, ctx) == 0) {
+        cache->hits++;
+        unlink_recent(cache, entry);
+        push_newest(cache, entry);
+        return true;
+    }
+    cache->misses++;
+    uint64_t *seen = &cache->seen[hash & (LINE_CACHE_SEEN - 1)];
+    if (*seen != hash) {
+        *seen = hash; // the first time, or the other line of the slot is forgotten
+        return false;
+    }
+    if (!inplace) {
+        cache->key_line = line;
+    } else if (grow_buffer((void **)&cache->key, &cache->key_cap, length + 1, sizeof(char)) == 0) {
+        memcpy(cache->key, line, length + 1);
+        cache->key_line = cache->key;
+    } else {
+        return false;
+    }
+    cache->key_length = length;
+    cache->key_hash = hash;
+    cache->key_pending = true;
+    return false;
+}
+
+/**
+ * @brief Helper function to drop the least recently used entry.
+ *
+ * @param cache The cache, not empty
+ */
+static void evict_oldest(struct line_cache *cache) {
+    struct line_entry *entry = cache->oldest;
+    struct line_entry **slot = find_slot(cache, entry->line, entry->length, entry->hash);
+    *slot = entry->next;
+    unlink_recent(cache, entry);
+    cache->count--;
+    free(entry);
+}
+
+/**
+ * @brief Add the tokens just parsed into a context for the line of the
+ * last miss, if that was its second. See linecache.c.
+ *
+ * @param cache The cache
+ * @param ctx The context holding the tokens of the line
+ */
+void line_cache_insert(struct line_cache *cache, const struct parse_ctx *ctx) {
+    if (!cache->key_pending) {
+        return;
+    }
+    cache->key_pending = false;
+    size_t text_size = 0;
+    for (size_t i = 0; i < ctx->count; i++) {
+        text_size += strlen(ctx->argv[i]) + 1;
+    }
+    // Laid out by alignment: the header, the offsets, the kinds, then the bytes.
+    size_t offsets_at = sizeof(struct line_entry);
+    size_t kinds_at = offsets_at + ctx->count * sizeof(size_t);
+    size_t line_at = kinds_at + (ctx->count + 1) * sizeof(enum token_kind);
+    size_t text_at = line_at + cache->key_length + 1;
+    struct line_entry *entry = malloc(text_at + text_size);
+    if (!entry) {
+        return;
+    }
+    char *base = (char *)entry;
+    size_t *offsets = (size_t *)(base + offsets_at);
+    enum token_kind *kinds = (enum token_kind *)(base + kinds_at);
+    char *text = base + text_at;
+    memcpy(base + line_at, cache->key_line, cache->key_length + 1);
+    memcpy(kinds, ctx->kinds, (ctx->count + 1) * sizeof(enum token_kind));
+    size_t at = 0;
+    for (size_t i = 0; i < ctx->count; i++) {
+        size_t size = strlen(ctx->argv[i]) + 1;
+        offsets[i] = at;
+        memcpy(text + at, ctx->argv[i], size);
+        at += size;
+    }
+    *entry = (struct line_entry){.hash = cache->key_hash, .length = cache->key_length, .count = ctx->count,
+                                 .text_size = text_size, .line = base + line_at, .kinds = kinds,
+                                 .offsets = offsets, .text = text};
+    if (cache->count >= LINE_CACHE_ENTRIES) {
+        evict_oldest(cache);
+    }
+    cache->seen[entry->hash & (LINE_CACHE_SEEN - 1)] = 0; // found in the buckets from now on
+    struct line_entry **slot = &cache->buckets[entry->hash & (LINE_CACHE_BUCKETS - 1)];
+    entry->next = *slot;
+    *slot = entry;
+    push_newest(cache, entry);
+    cache->count++;
+}
+
+/**
+ * @brief Free every cached line.
+ *
+ * @param cache The cache
+ */
+void line_cache_destroy(struct line_cache *cache) {
+    while (cache->newest) {
+        struct line_entry *entry = cache->newest;
+        cache->newest = entry->older;
+        free(entry);
+    }
+    free(cache->buckets);
+    free(cache->seen);
+    free(cache->key);
+    memset(cache, 0, sizeof(*cache));
+}
@@ -0,0 +1,292 @@
+/**
+ * @file parallel.c
+ * @brief The parallel builtin: run a group of commands with a bounded number
+ * of them in flight, in the spirit of xargs -P.
+ *
+ * `parallel -j 4 -- make -C a ::: make -C b ::: make -C c` runs the commands
+ * separated by ":::" with at most four children at a time. Each command is a
+ * job in the shell's job table, so it shows up in jobs while it runs. The
+ * builtin blocks in wait4(-1) and starts the next command as soon as any
+ * child exits, a slot is never left idle while a command is waiting.
+ *
+ * In an interactive shell the commands run in one process group that holds
+ * the terminal while the builtin waits, like a foreground pipeline, so
+ * Ctrl-C reaches all of them and the shell, which ignores SIGINT, keeps
+ * running; once one is killed by SIGINT no more are started, as xargs
+ * does. The group is made by the first command and joined by the next
+ * ones; once none of it is left the next command starts a new one. A
+ * builtin can't be suspended, so a group stopped with Ctrl-Z is continued.
+ *
+ * References:
+ * https://man7.org/linux/man-pages/man1/xargs.1.html (-P)
+ * https://www.gnu.org/software/parallel/parallel.html (exit status)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "lab.h"
+
+#define PARALLEL_SEPARATOR ":::"
+#define PARALLEL_MAX_FAILED 101 // the status is the number of failed commands, capped like GNU parallel
+
+/**
+ * @brief One command of the group.
+ */
+struct parallel_cmd {
+    char **argv;        // points into the builtin's arguments
+    size_t slot;        // index of the job running it in sh->jobs
+    bool running;
+    struct timespec start;
+};
+
+/**
+ * @brief Helper function to get the seconds elapsed since start.
+ *
+ * @param start When the command was started
+ * @return The wall time in seconds
+ */
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Helper function to parse the options in front of the commands.
+ *
+ * @param argv The parallel command and its arguments
+ * @param jobs Filled with the number of commands to keep in flight
+ * @return Index of the first word of the first command, or -1 after
+ * printing an error
+ */
+static int parse_parallel_options(char **argv, long *jobs) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    *jobs = online > 0 ? online : 1;
+    int i = 1;
+    while (argv[i] && argv[i][0] == '-') {
+        if (strcmp(argv[i], "--") == 0) {
+            return i + 1;
+        }
+        if (strcmp(argv[i], "-j") != 0 || !argv[i + 1]) {
+            fprintf(stderr, "parallel: usage: parallel [-j jobs] [--] cmd [::: cmd ...]\n");
+            return -1;
+        }
+        char *end;
+        *jobs = strtol(argv[i + 1], &end, 10);
+        if (*end || *jobs <= 0) {
+            fprintf(stderr, "parallel: %s: invalid number of jobs\n", argv[i + 1]);
+            return -1;
+        }
+        i += 2;
+    }
+    return i;
+}
+
+/**
+ * @brief Helper function to split the arguments into commands. Every ":::"
+ * is replaced with NULL so each command is a NULL terminated argument array.
+ *
+ * @param first The first word of the first command
+ * @param cmds Filled with the commands, must hold one entry per word
+ * @return The number of commands, or -1 if a command is empty
+ */
+static int split_commands(char **first, struct parallel_cmd *cmds) {
+    int count = 0;
+    char **start = first;
+    for (char **arg = first; ; arg++) {
+        bool last = *arg == NULL;
+        if (!last && strcmp(*arg, PARALLEL_SEPARATOR) != 0) {
+            continue;
+        }
+        if (arg == start) {
+            return -1;
+        }
+        cmds[count++].argv = start;
+        if (last) {
+            break;
+        }
+        *arg = NULL;
+        start = arg + 1;
+    }
+    return count;
+}
+
+/**
+ * @brief Helper function to start one command of the group as a job.
+ *
+ * @param sh The shell
+ * @param cmd The command to start
+ * @param devnull Descriptor of /dev/null used as the command's stdin
+ * @param group Process group of the commands, 0 to make a new one, set to
+ * it when this command makes it
+ * @return 0 if the command is running, -1 if it could not be started
+ */
+static int start_command(struct shell *sh, struct parallel_cmd *cmd, int devnull, pid_t *group) {
+    struct job *job = job_new(sh);
+    if (!job) {
+        perror("parallel: realloc failed");
+        return -1;
+    }
+    // The children share the terminal's output but never its input.
+    // The shell hands the group the terminal, a child's stdin is /dev/null already when it could.
+    struct spawn_spec spec = {cmd->argv, *group, devnull, -1, false, NULL, 0, job};
+    const struct builtin *builtin = builtin_find(cmd->argv[0]);
+    clock_gettime(CLOCK_MONOTONIC, &cmd->start);
+    pid_t pid = builtin ? sh_spawn_builtin(sh, builtin, &spec) : sh_spawn(sh, &spec);
+    if (pid < 0) {
+        fprintf(stderr, "%s: %s\n", cmd->argv[0], strerror(errno));
+        job_release(job);
+        return -1;
+    }
+    if (sh->shell_is_interactive) {
+        setpgid(pid, *group ? *group : pid); // also from the parent to avoid racing the child
+        if (!*group) {
+            tcsetpgrp(sh->shell_terminal, pid);
+        }
+    }
+    pid_t pgid = *group ? *group : pid;
+    if (job_add_proc(job, pid) != 0) {
+        perror("parallel: realloc failed");
+        waitpid(pid, NULL, 0);
+        job_release(job);
+        return -1;
+    }
+    job->pgid = pgid;
+    job->last_pid = pid;
+    *group = pgid;
+    job_set_command(job, &cmd->argv, 1);
+    cmd->slot = (size_t)job->id - 1; // job pointers move when the table grows
+    cmd->running = true;
+    return 0;
+}
+
+/**
+ * @brief Helper function to print how one command finished.
+ *
+ * @param cmd The command
+ * @param status Its exit status
+ * @param seconds Its wall time
+ */
+static void report_command(const struct parallel_cmd *cmd, int status, double seconds) {
+    fprintf(stderr, "parallel: %8.3fs  status %3d  ", seconds, status);
+    for (char **arg = cmd->argv; *arg; arg++) {
+        fprintf(stderr, arg == cmd->argv ? "%s" : " %s", *arg);
+    }
+    fprintf(stderr, "\n");
+}
+
+/**
+ * @brief The parallel builtin. `parallel [-j K] [--] cmd [::: cmd ...]` runs
+ * every command with at most K of them running at once, K defaults to the
+ * number of online CPUs. As each command finishes its wall time and exit
+ * status are printed on stderr, followed by a summary for the group.
+ *
+ * @param sh The shell
+ * @param argv The parallel command and its arguments
+ * @return 0 if every command succeeded, otherwise the number of commands
+ * that failed or could not be started, at most 101
+ */
+int builtin_parallel(struct shell *sh, char **argv) {
+    long max_jobs;
+    int first = parse_parallel_options(argv, &max_jobs);
+    if (first < 0) {
+        return 2;
+    }
+    if (!argv[first]) {
+        return 0; // no commands
+    }
+    size_t words = 0;
+    while (argv[first + words]) {
+        words++;
+    }
+    struct parallel_cmd *cmds = calloc(words, sizeof(*cmds));
+    if (!cmds) {
+        perror("parallel: calloc failed");
+        return EXIT_FAILURE;
+    }
+    int ncmds = split_commands(argv + first, cmds);
+    if (ncmds < 0) {
+        fprintf(stderr, "parallel: empty command near `" PARALLEL_SEPARATOR "'\n");
+        free(cmds);
+        return 2;
+    }
+    int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    struct timespec group_start;
+    clock_gettime(CLOCK_MONOTONIC, &group_start);
+    fflush(NULL); // output buffered so far must come before the children's
+
+    int next = 0;     // next command to start
+    long running = 0; // commands in flight
+    int failed = 0;
+    pid_t group = 0;  // process group of the running commands
+    while (next < ncmds || running > 0) {
+        // Refill every free slot before blocking.
+        while (next < ncmds && running < max_jobs) {
+            if (running == 0) {
+                group = 0; // the old group is gone with its last command
+            }
+            if (start_command(sh, &cmds[next], devnull, &group) == 0) {
+                running++;
+            } else {
+                failed++;
+            }
+            next++;
+        }
+        if (running == 0) {
+            break;
+        }
+        int wstatus;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &wstatus, sh->shell_is_interactive ? WUNTRACED : 0, &usage);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("parallel: wait4");
+            break;
+        }
+        if (WIFSTOPPED(wstatus) && group && getpgid(pid) == group) {
+            kill(-group, SIGCONT); // Ctrl-Z, there is nowhere to put the builtin in the background
+            continue;
+        }
+        // The child may also be a background job, job_update records it either way.
+        struct job *job = job_update(sh, pid, wstatus, &usage);
+        if (!job || job->state != JOB_DONE) {
+            continue;
+        }
+        for (int i = 0; i < next; i++) {
+            if (cmds[i].running && cmds[i].slot == (size_t)job->id - 1 && job->last_pid == pid) {
+                report_command(&cmds[i], job->status, seconds_since(&cmds[i].start));
+                if (sh->timing.active) {
+                    rusage_add(&sh->timing.children, &job->usage);
+                }
+                failed += job->status != 0;
+                if (WIFSIGNALED(wstatus) && WTERMSIG(wstatus) == SIGINT && next < ncmds) {
+                    failed += ncmds - next; // interrupted, the rest never run
+                    next = ncmds;
+                }
+                cmds[i].running = false;
+                job_release(job);
+                running--;
+                break;
+            }
+        }
+    }
+    if (sh->shell_is_interactive) {
+        tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
+        tcsetattr(sh->shell_terminal, TCSADRAIN, &sh->shell_tmodes);
+    }
+    fprintf(stderr, "parallel: %d commands, %d failed, %.3fs wall\n", ncmds, failed, seconds_since(&group_start));
+    if (devnull >= 0) {
+        close(devnull);
+    }
+    free(cmds);
+    return failed > PARALLEL_MAX_FAILED ? PARALLEL_MAX_FAILED : failed;
+}
@@ -0,0 +1,330 @@
+/**
+ * @file path.c
+ * @brief Hashed PATH lookup cache, in the spirit of the bash `hash` builtin.
+ *
+ * execvp walks every directory in $PATH and tries an execve in each one until
+ * it finds the command. On slow or network mounted directories that adds up
+ * to milliseconds per command. The cache resolves a name once, remembers the
+ * absolute path in a hash table and lets the spawn engine exec it directly.
+ * The table is dropped whenever the value of PATH changes. The shell's
+ * cache reads PATH from its variable table and only compares it when the
+ * table's generation moved, see env.c. The read-ahead thread of batch.c
+ * resolves with a cache of its own, given a fixed PATH value, and the
+ * shell's cache is seeded with what it found.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "lab.h"
+
+#define PATH_CACHE_BUCKETS 64 // initial number of buckets, always a power of two
+
+/**
+ * @brief Initialize an empty cache. The buckets are allocated on first use.
+ *
+ * @param cache The cache to initialize
+ */
+void path_cache_init(struct path_cache *cache) {
+    cache->buckets = NULL;
+    cache->nbuckets = 0;
+    cache->count = 0;
+    cache->path_env = NULL;
+    cache->generation = 0;
+    cache->env = NULL;
+    cache->env_generation = 0;
+    cache->fixed_path = false;
+}
+
+/**
+ * @brief Forget every entry in the cache, like `hash -r`.
+ *
+ * @param cache The cache to clear
+ */
+void path_cache_clear(struct path_cache *cache) {
+    for (size_t i = 0; i < cache->nbuckets; i++) {
+        struct path_entry *entry = cache->buckets[i];
+        while (entry) {
+            struct path_entry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        cache->buckets[i] = NULL;
+    }
+    cache->count = 0;
+    cache->generation++;
+}
+
+/**
+ * @brief Release all memory held by the cache.
+ *
+ * @param cache The cache to destroy
+ */
+void path_cache_destroy(struct path_cache *cache) {
+    path_cache_clear(cache);
+    free(cache->buckets);
+    free(cache->path_env);
+    unsigned long generation = cache->generation;
+    const struct env_table *env = cache->env;
+    path_cache_init(cache);
+    cache->generation = generation; // keep counting so stale users still notice
+    cache->env = env;
+}
+
+/**
+ * @brief Helper function to drop the cache when PATH no longer matches the
+ * value the entries were resolved against.
+ *
+ * @param cache The cache to check
+ */
+static void check_path_env(struct path_cache *cache) {
+    if (cache->fixed_path) {
+        return; // the owner gives PATH with path_cache_set_path
+    }
+    if (cache->env && cache->path_env && cache->env_generation == cache->env->generation) {
+        return; // no variable changed, PATH can't have
+    }
+    const char *path = cache->env ? env_get(cache->env, "PATH") : getenv("PATH");
+    if (cache->env) {
+        cache->env_generation = cache->env->generation;
+    }
+    if (!path) {
+        path = "";
+    }
+    if (cache->path_env && strcmp(cache->path_env, path) == 0) {
+        return; // PATH is unchanged, the common case
+    }
+    path_cache_clear(cache);
+    free(cache->path_env);
+    cache->path_env = strdup(path);
+}
+
+/**
+ * @brief Helper function to find the bucket slot holding name. Returns the
+ * address of the pointer to the entry so callers can also unlink it.
+ *
+ * @param cache The cache to search
+ * @param name The command name
+ * @return The slot, *slot is NULL if the name is not cached
+ */
+static struct path_entry **find_slot(struct path_cache *cache, const char *name) {
+    struct path_entry **slot = &cache->buckets[fnv1a_hash(name, strlen(name)) & (cache->nbuckets - 1)];
+    while (*slot && strcmp((*slot)->name, name) != 0) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+/**
+ * @brief Helper function to double the number of buckets once the table is
+ * as full as it is wide, so chains stay short.
+ *
+ * @param cache The cache to grow
+ * @return 0 on success, -1 if the allocation failed
+ */
+static int grow_buckets(struct path_cache *cache) {
+    size_t nbuckets = cache->nbuckets ? cache->nbuckets * 2 : PATH_CACHE_BUCKETS;
+    struct path_entry **buckets = calloc(nbuckets, sizeof(*buckets));
+    if (!buckets) {
+        return -1;
+    }
+    // Rehash the existing entries into the new buckets.
+    for (size_t i = 0; i < cache->nbuckets; i++) {
+        struct path_entry *entry = cache->buckets[i];
+        while (entry) {
+            struct path_entry *next = entry->next;
+            size_t index = fnv1a_hash(entry->name, strlen(entry->name)) & (nbuckets - 1);
+            entry->next = buckets[index];
+            buckets[index] = entry;
+            entry = next;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = nbuckets;
+    return 0;
+}
+
+/**
+ * @brief Helper function to add a resolved command at its empty slot,
+ * growing the table first if it is as full as it is wide.
+ *
+ * @param cache The cache to update
+ * @param slot The slot find_slot gave for name
+ * @param name The command name
+ * @param found Its absolute path
+ * @return The new entry, or NULL if the allocation failed
+ */
+static struct path_entry *add_entry(struct path_cache *cache, struct path_entry **slot, const char *name,
+                                    const char *found) {
+    if (cache->count >= cache->nbuckets) {
+        if (grow_buckets(cache) != 0) {
+            return NULL;
+        }
+        slot = find_slot(cache, name);
+    }
+    size_t name_size = strlen(name) + 1;
+    size_t path_size = strlen(found) + 1;
+    // The entry, its name and its path share one allocation.
+    struct path_entry *entry = malloc(sizeof(*entry) + name_size + path_size);
+    if (!entry) {
+        return NULL;
+    }
+    entry->name = (char *)(entry + 1);
+    entry->path = entry->name + name_size;
+    memcpy(entry->name, name, name_size);
+    memcpy(entry->path, found, path_size);
+    entry->hits = 1;
+    entry->next = NULL;
+    *slot = entry;
+    cache->count++;
+    return entry;
+}
+
+/**
+ * @brief Search the directories of a PATH value for an executable file.
+ * An empty entry in PATH means the current directory, like execvp.
+ *
+ * @param path The PATH value to search
+ * @param name The command name, must not contain a slash
+ * @param result Buffer for the absolute path
+ * @param size Size of the result buffer
+ * @return 0 if found, -1 with errno set to ENOENT otherwise
+ */
+int path_search(const char *path, const char *name, char *result, size_t size) {
+    size_t name_length = strlen(name);
+    const char *dir = path;
+    while (dir) {
+        const char *end = strchr(dir, ':');
+        size_t dir_length = end ? (size_t)(end - dir) : strlen(dir);
+        if (dir_length == 0) { // empty entry, the current directory
+            dir = ".";
+            dir_length = 1;
+        }
+        if (dir_length + name_length + 2 <= size) {
+            struct stat info;
+            memcpy(result, dir, dir_length);
+            result[dir_length] = '/';
+            memcpy(result + dir_length + 1, name, name_length + 1);
+            if (stat(result, &info) == 0 && S_ISREG(info.st_mode) && access(result, X_OK) == 0) {
+                return 0;
+            }
+        }
+        dir = end ? end + 1 : NULL;
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+/**
+ * @brief Look up the absolute path of a command, searching PATH and adding
+ * it to the cache on a miss. Names that contain a slash are not looked up.
+ *
+ * @param cache The cache to use
+ * @param name The command name
+ * @return The absolute path owned by the cache, or NULL with errno set to
+ * ENOENT if the command is not in PATH
+ */
+const char *path_cache_lookup(struct path_cache *cache, const char *name) {
+    if (strchr(name, '/')) {
+        return name;
+    }
+    check_path_env(cache);
+    if (cache->nbuckets == 0 && grow_buckets(cache) != 0) {
+        return NULL;
+    }
+    struct path_entry **slot = find_slot(cache, name);
+    if (*slot) { // hit
+        (*slot)->hits++;
+        return (*slot)->path;
+    }
+
+    // Miss: walk PATH once and remember the answer.
+    char found[PATH_MAX];
+    if (path_search(cache->path_env, name, found, sizeof(found)) != 0) {
+        return NULL;
+    }
+    struct path_entry *entry = add_entry(cache, slot, name, found);
+    return entry ? entry->path : NULL;
+}
+
+/**
+ * @brief Use a fixed PATH value instead of reading PATH. See lab.h, the
+ * read-ahead thread of batch.c resolves with a cache of its own this way.
+ *
+ * @param cache The cache
+ * @param path The PATH value
+ */
+void path_cache_set_path(struct path_cache *cache, const char *path) {
+    cache->fixed_path = true;
+    if (cache->path_env && strcmp(cache->path_env, path) == 0) {
+        return;
+    }
+    path_cache_clear(cache);
+    free(cache->path_env);
+    cache->path_env = strdup(path);
+}
+
+/**
+ * @brief Add a command another cache resolved against the same PATH, so
+ * the next lookup of it is a hit.
+ *
+ * @param cache The cache to update
+ * @param name The command name, without a slash
+ * @param path Its absolute path
+ */
+void path_cache_seed(struct path_cache *cache, const char *name, const char *path) {
+    check_path_env(cache);
+    if (cache->nbuckets == 0 && grow_buckets(cache) != 0) {
+        return;
+    }
+    struct path_entry **slot = find_slot(cache, name);
+    struct path_entry *entry = *slot ? NULL : add_entry(cache, slot, name, path);
+    if (entry) {
+        entry->hits = 0; // counted once it is looked up
+    }
+}
+
+/**
+ * @brief Remove one command from the cache, used when exec reports that the
+ * cached file has gone away.
+ *
+ * @param cache The cache to update
+ * @param name The command name
+ */
+void path_cache_forget(struct path_cache *cache, const char *name) {
+    if (cache->nbuckets == 0) {
+        return;
+    }
+    struct path_entry **slot = find_slot(cache, name);
+    if (*slot) {
+        struct path_entry *entry = *slot;
+        *slot = entry->next;
+        free(entry);
+        cache->count--;
+        cache->generation++;
+    }
+}
+
+/**
+ * @brief Print the cached commands in the same format as the bash hash
+ * builtin.
+ *
+ * @param cache The cache to print
+ */
+void path_cache_print(struct path_cache *cache) {
+    if (cache->count == 0) {
+        printf("hash: hash table empty\n");
+        return;
+    }
+    printf("hits\tcommand\n");
+    for (size_t i = 0; i < cache->nbuckets; i++) {
+        for (struct path_entry *entry = cache->buckets[i]; entry; entry = entry->next) {
+            printf("%4u\t%s\n", entry->hits, entry->path);
+        }
+    }
+}
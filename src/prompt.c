@@ -0,0 +1,459 @@
+/**
+ * @file prompt.c
+ * @brief The prompt of the shell lab: MY_PROMPT compiled into segments with
+ * cached values.
+ *
+ * MY_PROMPT may use these escapes, anything else is shown as it is:
+ *
+ *   \w  working directory, HOME shown as ~    \W  its last part
+ *   \u  user name                              \h  host name up to the first dot
+ *   \?  exit status of the last command        \t  time as HH:MM:SS
+ *   \$  # for root, $ for everyone else        \g  git branch, empty outside a repository
+ *   \e  escape, for colors                     \[ \]  around text that takes no room
+ *   \n  newline                                \\  a backslash
+ *
+ * The template is compiled once, on the first prompt. Each segment keeps
+ * its value with a stamp of what it was computed from, and before a prompt
+ * only the segments whose stamp is out of date are computed again: the
+ * directory when the shell's cwd generation moved, which cd does, the
+ * status when it is a different number and the time when the second
+ * changed. User and host never change. The prompt text is put together
+ * again only if a segment changed, most prompts cost a few compares.
+ *
+ * The git branch needs a walk up the directory tree, stats and a read of
+ * HEAD, which can be slow on a network file system. It is looked up on a
+ * thread of its own, the prompt shows the last answer and never waits. The
+ * thread writes an eventfd when the answer changes and the interactive
+ * session draws the prompt again, see event.c.
+ *
+ * References:
+ * https://www.gnu.org/software/bash/manual/html_node/Controlling-the-Prompt.html
+ * https://git-scm.com/docs/gitrepository-layout
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "lab.h"
+
+#define PROMPT_VCS_MAX 256 // longest HEAD that is read
+
+/**
+ * @brief Helper function to add a segment to the prompt being compiled.
+ *
+ * @param prompt The prompt
+ * @param cap Capacity of prompt->segments
+ * @param kind What the segment shows
+ * @param text Literal text for PROMPT_TEXT, NULL otherwise
+ * @param length Length of text
+ * @return 0 on success, -1 if memory ran out
+ */
+static int add_segment(struct prompt *prompt, size_t *cap, enum prompt_kind kind, const char *text, size_t length) {
+    // Text next to text is merged, "\[" and "\e" would otherwise split it.
+    if (kind == PROMPT_TEXT && prompt->count > 0 && prompt->segments[prompt->count - 1].kind == PROMPT_TEXT) {
+        struct prompt_segment *last = &prompt->segments[prompt->count - 1];
+        size_t old = strlen(last->text);
+        char *grown = realloc(last->text, old + length + 1);
+        if (!grown) {
+            return -1;
+        }
+        memcpy(grown + old, text, length);
+        grown[old + length] = '\0';
+        last->text = grown;
+        return 0;
+    }
+    if (grow_buffer((void **)&prompt->segments, cap, prompt->count + 1, sizeof(*prompt->segments)) != 0) {
+        return -1;
+    }
+    char *copy = text ? strndup(text, length) : NULL;
+    if (text && !copy) {
+        return -1;
+    }
+    prompt->segments[prompt->count++] = (struct prompt_segment){kind, copy, 0, text != NULL};
+    return 0;
+}
+
+/**
+ * @brief Helper function to compile a template into segments.
+ *
+ * @param prompt The prompt
+ * @param template The template, such as the value of MY_PROMPT
+ * @return 0 on success, -1 if memory ran out
+ */
+static int compile(struct prompt *prompt, const char *template) {
+    size_t cap = 0;
+    const char *cursor = template;
+    while (*cursor) {
+        size_t run = strcspn(cursor, "\\");
+        if (run > 0) {
+            if (add_segment(prompt, &cap, PROMPT_TEXT, cursor, run) != 0) {
+                return -1;
+            }
+            cursor += run;
+            continue;
+        }
+        char escape = cursor[1];
+        enum prompt_kind kind = PROMPT_TEXT;
+        const char *text = NULL;
+        size_t used = 2; // the backslash and the escape
+        switch (escape) {
+        case 'w': kind = PROMPT_CWD; break;
+        case 'W': kind = PROMPT_CWD_BASE; break;
+        case 'u': kind = PROMPT_USER; break;
+        case 'h': kind = PROMPT_HOST; break;
+        case '?': kind = PROMPT_STATUS; break;
+        case 't': kind = PROMPT_TIME; break;
+        case '$': kind = PROMPT_SIGIL; break;
+        case 'g': kind = PROMPT_VCS; break;
+        case 'e': text = "\033"; break;
+        case '[': text = "\001"; break; // readline's markers for text that is not printed
+        case ']': text = "\002"; break;
+        case 'n': text = "\n"; break;
+        case '\\': text = "\\"; break;
+        default: // not an escape, the backslash is shown and what follows is text
+            text = "\\";
+            used = 1;
+            break;
+        }
+        int result = text ? add_segment(prompt, &cap, PROMPT_TEXT, text, strlen(text))
+                          : add_segment(prompt, &cap, kind, NULL, 0);
+        if (result != 0) {
+            return -1;
+        }
+        cursor += used;
+    }
+    return 0;
+}
+
+/**
+ * @brief Helper function to find the branch of the git repository a
+ * directory is in, the way git does: the first parent with a .git, which
+ * is a directory or a file pointing at one with "gitdir:".
+ *
+ * @param dir The directory
+ * @return The branch, the first 7 digits of the commit for a detached
+ * HEAD or an empty string outside a repository, malloc'ed, or NULL if
+ * memory ran out
+ */
+static char *find_branch(const char *dir) {
+    char *path = strdup(dir);
+    if (!path) {
+        return NULL;
+    }
+    char head[PROMPT_VCS_MAX];
+    ssize_t length = -1;
+    for (;;) {
+        char *git = NULL;
+        if (asprintf(&git, "%s/.git", *path ? path : "") < 0) {
+            break;
+        }
+        struct stat info;
+        if (stat(git, &info) == 0) {
+            char *head_path = NULL;
+            if (S_ISREG(info.st_mode)) { // a worktree or submodule
+                int fd = open(git, O_RDONLY | O_CLOEXEC);
+                ssize_t n = fd >= 0 ? read(fd, head, sizeof(head) - 1) : -1;
+                if (fd >= 0) {
+                    close(fd);
+                }
+                if (n > 8 && strncmp(head, "gitdir: ", 8) == 0) {
+                    head[n] = '\0';
+                    head[strcspn(head, "\n")] = '\0';
+                    const char *target = head + 8;
+                    int made = target[0] == '/' ? asprintf(&head_path, "%s/HEAD", target)
+                                                : asprintf(&head_path, "%s/%s/HEAD", path, target);
+                    if (made < 0) {
+                        head_path = NULL;
+                    }
+                }
+            } else if (asprintf(&head_path, "%s/HEAD", git) < 0) {
+                head_path = NULL;
+            }
+            if (head_path) {
+                int fd = open(head_path, O_RDONLY | O_CLOEXEC);
+                length = fd >= 0 ? read(fd, head, sizeof(head) - 1) : -1;
+                if (fd >= 0) {
+                    close(fd);
+                }
+                free(head_path);
+            }
+            free(git);
+            break;
+        }
+        free(git);
+        char *slash = strrchr(path, '/');
+        if (!slash || !*path) {
+            break;
+        }
+        *slash = '\0'; // one level up, "" stands for the root
+    }
+    free(path);
+    if (length <= 0) {
+        return strdup("");
+    }
+    head[length] = '\0';
+    head[strcspn(head, "\n")] = '\0';
+    const char *ref = "ref: refs/heads/";
+    if (strncmp(head, ref, strlen(ref)) == 0) {
+        return strdup(head + strlen(ref));
+    }
+    return strndup(head, 7);
+}
+
+/**
+ * @brief Helper function run by the prompt's thread: take the latest
+ * directory asked for, find its branch and tell the session if it changed.
+ *
+ * @param arg The prompt
+ * @return NULL
+ */
+static void *vcs_worker(void *arg) {
+    struct prompt *prompt = arg;
+    pthread_mutex_lock(&prompt->vcs_lock);
+    for (;;) {
+        while (!prompt->vcs_dir && !prompt->vcs_quit) {
+            pthread_cond_wait(&prompt->vcs_wake, &prompt->vcs_lock);
+        }
+        if (prompt->vcs_quit) {
+            break;
+        }
+        char *dir = prompt->vcs_dir;
+        prompt->vcs_dir = NULL;
+        pthread_mutex_unlock(&prompt->vcs_lock);
+        char *branch = find_branch(dir);
+        free(dir);
+        pthread_mutex_lock(&prompt->vcs_lock);
+        if (branch && (!prompt->vcs_value || strcmp(branch, prompt->vcs_value) != 0)) {
+            free(prompt->vcs_value);
+            prompt->vcs_value = branch;
+            uint64_t one = 1;
+            if (write(prompt->vcs_notify, &one, sizeof(one)) < 0) {
+                // the counter is full, which means the session was told already
+            }
+        } else {
+            free(branch);
+        }
+    }
+    pthread_mutex_unlock(&prompt->vcs_lock);
+    return NULL;
+}
+
+/**
+ * @brief Helper function to start the prompt's thread the first time the
+ * prompt has a \g.
+ *
+ * @param prompt The prompt
+ * @return 0 on success, -1 if it could not be started
+ */
+static int start_vcs(struct prompt *prompt) {
+    prompt->vcs_notify = fd_move_high(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    if (prompt->vcs_notify < 0) {
+        return -1;
+    }
+    pthread_mutex_init(&prompt->vcs_lock, NULL);
+    pthread_cond_init(&prompt->vcs_wake, NULL);
+    if (pthread_create(&prompt->vcs_worker, NULL, vcs_worker, prompt) != 0) {
+        pthread_mutex_destroy(&prompt->vcs_lock);
+        pthread_cond_destroy(&prompt->vcs_wake);
+        close(prompt->vcs_notify);
+        return -1;
+    }
+    prompt->vcs_started = true;
+    prompt->vcs_owner = getpid();
+    return 0;
+}
+
+/**
+ * @brief Helper function to give a segment a new value, marking the prompt
+ * dirty if it differs from the old one.
+ *
+ * @param prompt The prompt
+ * @param segment The segment
+ * @param value The value, may be NULL if memory ran out
+ * @param stamp What the value was computed from
+ */
+static void set_value(struct prompt *prompt, struct prompt_segment *segment, const char *value, uint64_t stamp) {
+    segment->stamp = stamp;
+    if (!value || (segment->valid && strcmp(segment->text, value) == 0)) {
+        return;
+    }
+    char *copy = strdup(value);
+    if (!copy) {
+        return;
+    }
+    free(segment->text);
+    segment->text = copy;
+    segment->valid = true;
+    prompt->dirty = true;
+}
+
+/**
+ * @brief Helper function to compute one segment if its value could have
+ * changed.
+ *
+ * @param sh The shell
+ * @param segment The segment
+ * @param after_command A command ran since the last render
+ */
+static void refresh_segment(struct shell *sh, struct prompt_segment *segment, bool after_command) {
+    struct prompt *prompt = &sh->prompt;
+    char buffer[256];
+    switch (segment->kind) {
+    case PROMPT_TEXT:
+        return;
+    case PROMPT_CWD:
+    case PROMPT_CWD_BASE:
+        if (segment->valid && segment->stamp == sh->cwd_generation) {
+            return;
+        }
+        {
+            const char *cwd = sh_cwd(sh);
+            const char *home = sh_home(sh);
+            size_t home_length = home ? strlen(home) : 0;
+            if (segment->kind == PROMPT_CWD_BASE) {
+                const char *slash = strrchr(cwd, '/');
+                set_value(prompt, segment, slash && slash[1] ? slash + 1 : cwd, sh->cwd_generation);
+            } else if (home_length > 1 && strncmp(cwd, home, home_length) == 0 &&
+                       (cwd[home_length] == '/' || cwd[home_length] == '\0')) {
+                snprintf(buffer, sizeof(buffer), "~%s", cwd + home_length);
+                set_value(prompt, segment, buffer, sh->cwd_generation);
+            } else {
+                set_value(prompt, segment, cwd, sh->cwd_generation);
+            }
+        }
+        return;
+    case PROMPT_USER:
+    case PROMPT_SIGIL:
+        if (!segment->valid) {
+            struct passwd *pw = getpwuid(geteuid());
+            const char *user = pw ? pw->pw_name : "?";
+            set_value(prompt, segment, segment->kind == PROMPT_USER ? user : geteuid() == 0 ? "#" : "$", 0);
+        }
+        return;
+    case PROMPT_HOST:
+        if (!segment->valid) {
+            if (gethostname(buffer, sizeof(buffer)) != 0) {
+                strcpy(buffer, "?");
+            }
+            buffer[sizeof(buffer) - 1] = '\0';
+            buffer[strcspn(buffer, ".")] = '\0';
+            set_value(prompt, segment, buffer, 0);
+        }
+        return;
+    case PROMPT_STATUS:
+        if (!segment->valid || segment->stamp != (uint64_t)sh->last_status) {
+            snprintf(buffer, sizeof(buffer), "%d", sh->last_status);
+            set_value(prompt, segment, buffer, (uint64_t)sh->last_status);
+        }
+        return;
+    case PROMPT_TIME: {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME_COARSE, &now);
+        if (!segment->valid || segment->stamp != (uint64_t)now.tv_sec) {
+            struct tm local;
+            localtime_r(&now.tv_sec, &local);
+            strftime(buffer, sizeof(buffer), "%H:%M:%S", &local);
+            set_value(prompt, segment, buffer, (uint64_t)now.tv_sec);
+        }
+        return;
+    }
+    case PROMPT_VCS:
+        if (!prompt->vcs_started && start_vcs(prompt) != 0) {
+            set_value(prompt, segment, "", 0);
+            return;
+        }
+        pthread_mutex_lock(&prompt->vcs_lock);
+        if (after_command || !segment->valid) { // a command, git checkout say, may have moved HEAD
+            free(prompt->vcs_dir);
+            prompt->vcs_dir = strdup(sh_cwd(sh));
+            pthread_cond_signal(&prompt->vcs_wake);
+        }
+        set_value(prompt, segment, prompt->vcs_value ? prompt->vcs_value : "", 0);
+        pthread_mutex_unlock(&prompt->vcs_lock);
+        return;
+    }
+}
+
+/**
+ * @brief Render the prompt, computing again only the segments that could
+ * have changed. See prompt.c.
+ *
+ * @param sh The shell
+ * @param after_command A command ran since the last render
+ * @return The prompt, valid until the next render
+ */
+const char *prompt_render(struct shell *sh, bool after_command) {
+    struct prompt *prompt = &sh->prompt;
+    if (!prompt->compiled) {
+        prompt->compiled = true;
+        prompt->dirty = true;
+        char *template = get_prompt("MY_PROMPT");
+        if (!template || compile(prompt, template) != 0) {
+            perror("prompt");
+        }
+        free(template);
+    }
+    for (size_t i = 0; i < prompt->count; i++) {
+        refresh_segment(sh, &prompt->segments[i], after_command);
+    }
+    if (!prompt->dirty && prompt->rendered) {
+        return prompt->rendered;
+    }
+    size_t length = 0;
+    for (size_t i = 0; i < prompt->count; i++) {
+        length += prompt->segments[i].valid ? strlen(prompt->segments[i].text) : 0;
+    }
+    if (grow_buffer((void **)&prompt->rendered, &prompt->rendered_cap, length + 1, sizeof(char)) != 0) {
+        return "shell>";
+    }
+    char *out = prompt->rendered;
+    for (size_t i = 0; i < prompt->count; i++) {
+        if (prompt->segments[i].valid) {
+            out = stpcpy(out, prompt->segments[i].text);
+        }
+    }
+    *out = '\0';
+    prompt->dirty = false;
+    return prompt->rendered;
+}
+
+/**
+ * @brief Stop the prompt's thread and free the compiled prompt. In a child
+ * forked from the shell, such as a builtin stage running exit, the thread
+ * does not exist and its lock may have been copied held, so only the
+ * memory and the descriptor are let go.
+ *
+ * @param prompt The prompt
+ */
+void prompt_destroy(struct prompt *prompt) {
+    if (prompt->vcs_started && prompt->vcs_owner != getpid()) {
+        close(prompt->vcs_notify);
+        free(prompt->vcs_dir);
+        free(prompt->vcs_value);
+    } else if (prompt->vcs_started) {
+        pthread_mutex_lock(&prompt->vcs_lock);
+        prompt->vcs_quit = true;
+        pthread_cond_signal(&prompt->vcs_wake);
+        pthread_mutex_unlock(&prompt->vcs_lock);
+        pthread_join(prompt->vcs_worker, NULL);
+        pthread_mutex_destroy(&prompt->vcs_lock);
+        pthread_cond_destroy(&prompt->vcs_wake);
+        close(prompt->vcs_notify);
+        free(prompt->vcs_dir);
+        free(prompt->vcs_value);
+    }
+    for (size_t i = 0; i < prompt->count; i++) {
+        free(prompt->segments[i].text);
+    }
+    free(prompt->segments);
+    free(prompt->rendered);
+    memset(prompt, 0, sizeof(*prompt));
+}
@@ -0,0 +1,195 @@
+/**
+ * @file redirect.c
+ * @brief Applying the redirections of a command for the shell lab.
+ *
+ * A command launched with posix_spawn gets its redirections as file
+ * actions, which posix_spawn carries out in the child between clone and
+ * exec, see spawn.c. The functions here do the same work themselves: in a
+ * forked child right before exec, and in the shell for a builtin, which
+ * has the descriptors it replaces saved first and put back once it is done.
+ *
+ * References:
+ * https://pubs.opengroup.org/onlinepubs/9699919799/utilities/V3_chap02.html#tag_18_07
+ * https://man7.org/linux/man-pages/man3/posix_spawn_file_actions_addopen.3.html
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "lab.h"
+
+#define REDIRECT_SAVE_MIN 10 // saved descriptors are moved above those a user redirects, like sh does
+#define REDIRECT_NOT_APPLIED -2 // saved value of a redirection that was not carried out
+
+/**
+ * @brief Move a descriptor the shell keeps open to REDIRECT_SAVE_MIN or
+ * above, out of the way of the small numbers a user redirects, so that
+ * "3>file" or ">&3" never touches it. The result is close-on-exec.
+ *
+ * @param fd The descriptor, closed if it was moved
+ * @return The new descriptor, fd itself if it could not be moved or -1 if
+ * fd was -1
+ */
+int fd_move_high(int fd) {
+    if (fd < 0 || fd >= REDIRECT_SAVE_MIN) {
+        return fd;
+    }
+    int high = fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_SAVE_MIN);
+    if (high < 0) {
+        return fd;
+    }
+    close(fd);
+    return high;
+}
+
+/**
+ * @brief Flags to open the target of a file redirection with.
+ *
+ * @param op TOK_LESS, TOK_GREAT or TOK_APPEND
+ * @return The flags for open
+ */
+int redirect_flags(enum token_kind op) {
+    switch (op) {
+    case TOK_LESS:
+        return O_RDONLY;
+    case TOK_APPEND:
+        return O_WRONLY | O_CREAT | O_APPEND;
+    default:
+        return O_WRONLY | O_CREAT | O_TRUNC;
+    }
+}
+
+/**
+ * @brief Helper function to tell whether a redirection copies or closes a
+ * descriptor rather than opening a file.
+ *
+ * @param r The redirection
+ * @return True for <& and >&
+ */
+static bool is_dup(const struct redirect *r) {
+    return r->op == TOK_LESS_AND || r->op == TOK_GREAT_AND;
+}
+
+/**
+ * @brief Helper function to carry out one redirection.
+ *
+ * @param r The redirection
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int apply_one(const struct redirect *r) {
+    if (is_dup(r)) {
+        if (strcmp(r->target, "-") == 0) {
+            close(r->fd);
+            return 0;
+        }
+        int source = atoi(r->target);
+        if (fcntl(source, F_GETFD) < 0) {
+            return -1; // EBADF, dup2 onto the same descriptor would not notice
+        }
+        return source == r->fd || dup2(source, r->fd) >= 0 ? 0 : -1;
+    }
+    int fd = open(r->target, redirect_flags(r->op) | O_CLOEXEC, 0666);
+    if (fd < 0 || fd == r->fd) {
+        if (fd == r->fd) {
+            fcntl(fd, F_SETFD, 0); // was closed before, keep it open across exec
+        }
+        return fd < 0 ? -1 : 0;
+    }
+    int result = dup2(fd, r->fd) >= 0 ? 0 : -1;
+    int err = errno;
+    close(fd);
+    errno = err;
+    return result;
+}
+
+/**
+ * @brief Carry out the redirections of a command in order. With save the
+ * descriptors they replace are kept so redirect_restore can put them back,
+ * without it the changes are meant to last, as in a child about to exec,
+ * and stdio is left alone so the clone3 child of limit.c can use it. An
+ * error is printed with the name of the file or descriptor.
+ *
+ * @param redirects The redirections
+ * @param count Number of redirections
+ * @param save True to save the replaced descriptors
+ * @return 0 on success, -1 if one failed, the ones before it stay applied
+ */
+int redirect_apply(struct redirect *redirects, size_t count, bool save) {
+    for (size_t i = 0; i < count; i++) {
+        redirects[i].saved = REDIRECT_NOT_APPLIED;
+    }
+    if (save) {
+        fflush(NULL); // output written so far goes where it was meant to
+    }
+    for (size_t i = 0; i < count; i++) {
+        struct redirect *r = &redirects[i];
+        if (save) {
+            r->saved = fcntl(r->fd, F_DUPFD_CLOEXEC, REDIRECT_SAVE_MIN); // -1 if it was closed
+        }
+        if (apply_one(r) != 0) {
+            if (save) {
+                fprintf(stderr, "%s: %s\n", r->target, strerror(errno));
+            } else {
+                child_error(r->target, errno);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Put back the descriptors saved by redirect_apply, last first so
+ * a descriptor redirected twice ends up as it started.
+ *
+ * @param redirects The redirections
+ * @param count Number of redirections
+ */
+void redirect_restore(struct redirect *redirects, size_t count) {
+    fflush(NULL); // the builtin's output belongs to the redirected descriptors
+    for (size_t i = count; i-- > 0;) {
+        struct redirect *r = &redirects[i];
+        if (r->saved == REDIRECT_NOT_APPLIED) {
+            continue;
+        }
+        if (r->saved >= 0) {
+            dup2(r->saved, r->fd);
+            close(r->saved);
+        } else {
+            close(r->fd);
+        }
+        r->saved = REDIRECT_NOT_APPLIED;
+    }
+}
+
+/**
+ * @brief Find the redirection that made a launch fail. posix_spawn only
+ * reports an errno, so the files are opened again in order, without
+ * truncating, until one fails the way it did in the child.
+ *
+ * @param redirects The redirections of the command
+ * @param count Number of redirections
+ * @return The target of the redirection that fails, or NULL if they all
+ * work and the command itself is to blame
+ */
+const char *redirect_failure(const struct redirect *redirects, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        const struct redirect *r = &redirects[i];
+        if (is_dup(r)) {
+            if (strcmp(r->target, "-") != 0 && fcntl(atoi(r->target), F_GETFD) < 0) {
+                return r->target;
+            }
+            continue;
+        }
+        int fd = open(r->target, (redirect_flags(r->op) & ~O_TRUNC) | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            return r->target;
+        }
+        close(fd);
+    }
+    return NULL;
+}
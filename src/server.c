@@ -0,0 +1,532 @@
+/**
+ * @file server.c
+ * @brief The -S server mode of the shell lab and its -C client.
+ *
+ * `myprogram -S sock` stays resident and runs command lines sent to it over
+ * a UNIX domain socket, so a caller that runs one command at a time pays for
+ * starting the shell once instead of each time. `myprogram -C sock -c line`
+ * is a small client that starts without setting up a shell at all.
+ *
+ * The socket is SOCK_SEQPACKET so every request and every reply is one
+ * message and needs no framing:
+ *
+ *   request  the command line, with SCM_RIGHTS carrying up to three
+ *            descriptors that become its standard input, output and error,
+ *            in that order. Those not sent are /dev/null.
+ *   reply    the exit status of the line as decimal text, such as "0".
+ *
+ * A connection can send any number of requests but has one running at a
+ * time. The next message is only read once the reply has been sent.
+ *
+ * One event loop, see event.c, watches the listening socket, every
+ * connection, SIGCHLD and SIGTERM/SIGINT. Every request runs in a child
+ * forked from the resident shell, which already has its PATH cache and
+ * parse buffers warm. The child goes through sh_run_line like any batch line, so builtins,
+ * pipelines and redirections all work. Because the shell is forked, a
+ * request cannot change the state of the server: `cd` in one request does
+ * not move the next. The server never blocks on a child, so slow requests
+ * do not hold up the others.
+ *
+ * A request runs as the server's user, so only that user may send one: the
+ * socket is created with mode 0600 whatever the umask, and a connection
+ * whose SO_PEERCRED names another uid, root included, is closed unread.
+ *
+ * SIGTERM or SIGINT stop the server. It stops accepting, lets the requests
+ * that are running finish and reply, and removes the socket.
+ *
+ * References:
+ * https://man7.org/linux/man-pages/man7/unix.7.html
+ * https://man7.org/linux/man-pages/man3/cmsg.3.html
+ * https://man7.org/linux/man-pages/man7/epoll.7.html
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "lab.h"
+
+#define SERVER_BACKLOG 128        // connections waiting to be accepted
+#define SERVER_LINE_MAX 65536     // longest command line a request may carry
+#define SERVER_FDS 3              // standard input, output and error
+#define SERVER_STATUS_MAX 16      // room for a reply
+
+/**
+ * @brief A connection, indexed by its descriptor.
+ */
+struct server_client {
+    bool open;
+    pid_t pid; // child running the current request, 0 if there is none
+};
+
+/**
+ * @brief State of the server loop.
+ */
+struct server {
+    struct shell *sh;
+    struct event_loop loop;
+    int listen_fd;
+    int signal_fd;                  // SIGTERM and SIGINT
+    struct server_client *clients;  // indexed by descriptor
+    size_t clients_cap;
+    size_t running;                 // requests with a child
+    bool stopping;
+    char *line;                     // receive buffer of SERVER_LINE_MAX + 1 bytes
+};
+
+/**
+ * @brief Helper function to fill in the address of a socket path.
+ *
+ * @param addr The address to fill in
+ * @param path The path of the socket
+ * @return 0 on success, -1 with errno set if the path is too long
+ */
+static int socket_address(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/**
+ * @brief Create the listening socket of the server, with mode 0600. A
+ * socket left behind by a server that is gone is replaced, one that still
+ * answers is not.
+ *
+ * @param path Where to create the socket
+ * @return The listening descriptor, or -1 after printing an error
+ */
+int server_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (socket_address(&addr, path) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int fd = fd_move_high(socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    struct stat info;
+    if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+        int probe = server_connect(path);
+        if (probe >= 0) {
+            close(probe);
+            fprintf(stderr, "%s: a server is already listening\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+    }
+    mode_t umask_was = umask(0177); // the socket file is made 0600 by bind, a group-writable umask must not open it up
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(umask_was);
+    if (bound != 0 || listen(fd, SERVER_BACKLOG) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Connect to a server.
+ *
+ * @param path The socket of the server
+ * @return The connected descriptor, or -1 with errno set
+ */
+int server_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (socket_address(&addr, path) != 0) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Send one request and wait for its reply.
+ *
+ * @param fd A connection from server_connect
+ * @param line The command line
+ * @param fds Standard input, output and error for the line, may be NULL
+ * @param nfds Number of descriptors in fds, at most three
+ * @return The exit status of the line, or -1 with errno set if the
+ * request could not be sent or the server went away
+ */
+int server_request(int fd, const char *line, const int *fds, size_t nfds) {
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int) * SERVER_FDS)];
+    } control;
+    struct iovec iov = {(void *)line, strlen(line)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (nfds > SERVER_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (nfds > 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+    while (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    char reply[SERVER_STATUS_MAX];
+    ssize_t n;
+    while ((n = recv(fd, reply, sizeof(reply) - 1, 0)) < 0 && errno == EINTR) {
+    }
+    if (n <= 0) {
+        if (n == 0) {
+            errno = ECONNRESET;
+        }
+        return -1;
+    }
+    reply[n] = '\0';
+    return atoi(reply);
+}
+
+/**
+ * @brief The -C client. Runs one line on the server with this process's
+ * standard input, output and error.
+ *
+ * @param path The socket of the server
+ * @param line The command line
+ * @return The exit status of the line, or 1 if the server could not run it
+ */
+int sh_client(const char *path, const char *line) {
+    int fd = server_connect(path);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    int fds[SERVER_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    int status = server_request(fd, line, fds, SERVER_FDS);
+    if (status < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        status = EXIT_FAILURE;
+    }
+    close(fd);
+    return status;
+}
+
+/**
+ * @brief Helper function to drop a connection. A request that is still
+ * running is left to finish, its reply has nowhere to go.
+ *
+ * @param server The server
+ * @param fd The connection
+ */
+static void drop_client(struct server *server, int fd) {
+    event_remove(&server->loop, fd);
+    close(fd);
+    server->clients[fd].open = false;
+}
+
+/**
+ * @brief Helper function to send a reply. A client that went away or is
+ * not reading does not hold the server up, the reply is dropped.
+ *
+ * @param fd The connection
+ * @param status The exit status to send
+ */
+static void send_status(int fd, int status) {
+    char reply[SERVER_STATUS_MAX];
+    int length = snprintf(reply, sizeof(reply), "%d", status);
+    while (send(fd, reply, (size_t)length, MSG_NOSIGNAL | MSG_DONTWAIT) < 0 && errno == EINTR) {
+    }
+}
+
+/**
+ * @brief Helper function to run a request in the child forked for it. The
+ * descriptors of the server are closed and the received ones become the
+ * standard descriptors.
+ *
+ * @param server The server
+ * @param fds The received descriptors
+ * @param nfds How many were received
+ */
+static void run_request(struct server *server, int *fds, size_t nfds) {
+    struct shell *sh = server->sh;
+    close(server->listen_fd);
+    close(server->loop.fd);
+    close(server->signal_fd);
+    for (size_t fd = 0; fd < server->clients_cap; fd++) {
+        if (server->clients[fd].open) {
+            close((int)fd);
+        }
+    }
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    int null = fd_move_high(open("/dev/null", O_RDWR | O_CLOEXEC));
+    for (int i = 0; i < SERVER_FDS; i++) {
+        int source = (size_t)i < nfds ? fds[i] : null;
+        if (source < 0 || dup2(source, i) < 0) {
+            close(i);
+        }
+    }
+    sh_run_line(sh, trim_white(server->line));
+    fflush(NULL);
+    _exit(sh->last_status);
+}
+
+/**
+ * @brief Helper function to read a request from a connection and start it.
+ * A line that is too long or comes with too many descriptors is answered
+ * with status 2 without running it.
+ *
+ * @param server The server
+ * @param fd The connection
+ */
+static void read_request(struct server *server, int fd) {
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int) * SERVER_FDS)];
+    } control;
+    struct iovec iov = {server->line, SERVER_LINE_MAX};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buffer,
+                         .msg_controllen = sizeof(control.buffer)};
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            drop_client(server, fd);
+        }
+        return;
+    }
+    int fds[SERVER_FDS];
+    size_t nfds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count && nfds < SERVER_FDS; i++) {
+            int received;
+            memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            fds[nfds++] = fd_move_high(received);
+        }
+    }
+    if (n == 0 && nfds == 0) {
+        drop_client(server, fd); // end of file, the client hung up
+        return;
+    }
+    if ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || server->stopping) {
+        if (nfds >= 3 && !server->stopping) {
+            dprintf(fds[2], "server: request too large\n");
+        }
+        send_status(fd, 2);
+    } else {
+        server->line[n] = '\0';
+        fflush(NULL); // the child must not write the server's buffered output again
+        pid_t pid = fork();
+        if (pid == 0) {
+            run_request(server, fds, nfds);
+        }
+        if (pid < 0) {
+            perror("fork");
+            send_status(fd, EXIT_FAILURE);
+        } else {
+            server->clients[fd].pid = pid;
+            server->running++;
+            event_modify(&server->loop, fd, 0); // the next request waits for this reply
+        }
+    }
+    for (size_t i = 0; i < nfds; i++) {
+        close(fds[i]);
+    }
+}
+
+/**
+ * @brief Helper function to take a request or notice a hang up, called
+ * when a connection is ready.
+ */
+static void client_ready(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    UNUSED(loop);
+    struct server *server = data;
+    if (events & EPOLLIN) {
+        read_request(server, fd);
+    } else if (events & (EPOLLHUP | EPOLLERR)) {
+        drop_client(server, fd);
+    }
+}
+
+/**
+ * @brief Helper function to accept every pending connection, called when
+ * the listening socket is ready.
+ */
+static void accept_ready(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    UNUSED(fd);
+    UNUSED(events);
+    struct server *server = data;
+    for (;;) {
+        int client = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                perror("accept");
+            }
+            return;
+        }
+        struct ucred peer = {0, (uid_t)-1, (gid_t)-1};
+        socklen_t peer_length = sizeof(peer);
+        if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &peer_length) != 0 || peer.uid != geteuid()) {
+            fprintf(stderr, "server: refused a connection from uid %d\n", (int)peer.uid);
+            close(client);
+            continue;
+        }
+        size_t old_cap = server->clients_cap;
+        if (grow_buffer((void **)&server->clients, &server->clients_cap, (size_t)client + 1, sizeof(*server->clients)) != 0) {
+            perror("server: realloc failed");
+            close(client);
+            continue;
+        }
+        if (server->clients_cap > old_cap) {
+            memset(server->clients + old_cap, 0, (server->clients_cap - old_cap) * sizeof(*server->clients));
+        }
+        if (event_add(loop, client, EPOLLIN, client_ready, server) != 0) {
+            perror("server");
+            close(client);
+            continue;
+        }
+        server->clients[client] = (struct server_client){true, 0};
+    }
+}
+
+/**
+ * @brief Helper function to collect finished requests and reply to their
+ * connections, called on SIGCHLD.
+ */
+static void sigchld_ready(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    UNUSED(events);
+    struct server *server = data;
+    struct signalfd_siginfo info;
+    while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+    int wstatus;
+    pid_t pid;
+    while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+        int status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+        server->running--;
+        for (size_t i = 0; i < server->clients_cap; i++) {
+            struct server_client *client = &server->clients[i];
+            if (client->pid != pid) {
+                continue;
+            }
+            client->pid = 0;
+            if (client->open) {
+                send_status((int)i, status);
+                event_modify(loop, (int)i, EPOLLIN);
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Helper function to start shutting down on SIGTERM or SIGINT: the
+ * socket is removed and no new requests are taken, those running still get
+ * their reply.
+ */
+static void stop_ready(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    UNUSED(events);
+    struct server *server = data;
+    struct signalfd_siginfo info;
+    while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+    if (server->stopping) {
+        return;
+    }
+    server->stopping = true;
+    struct sockaddr_un addr;
+    socklen_t length = sizeof(addr);
+    if (getsockname(server->listen_fd, (struct sockaddr *)&addr, &length) == 0 && addr.sun_path[0]) {
+        unlink(addr.sun_path);
+    }
+    event_remove(loop, server->listen_fd);
+}
+
+/**
+ * @brief The -S server loop. Runs the requests sent to the listening socket
+ * until SIGTERM or SIGINT arrives and the requests that are running have
+ * replied. See server.c for the protocol.
+ *
+ * @param sh The shell, set up with sh_init
+ * @param listen_fd A socket from server_listen, closed when the loop ends
+ * @return 0 after a clean shutdown, 1 if the loop could not be set up
+ */
+int sh_serve(struct shell *sh, int listen_fd) {
+    struct server server = {sh, {0}, listen_fd, -1, NULL, 0, 0, false, NULL};
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    server.signal_fd = fd_move_high(signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC));
+    server.line = malloc(SERVER_LINE_MAX + 1);
+    int status = EXIT_SUCCESS;
+    if (event_loop_init(&server.loop, sh->event_backend) != 0 || server.signal_fd < 0 || !server.line ||
+        sh->jobs.sigchld_fd < 0 || event_add(&server.loop, listen_fd, EPOLLIN, accept_ready, &server) != 0 ||
+        event_add(&server.loop, server.signal_fd, EPOLLIN, stop_ready, &server) != 0 ||
+        event_add(&server.loop, sh->jobs.sigchld_fd, EPOLLIN, sigchld_ready, &server) != 0) {
+        perror("server");
+        status = EXIT_FAILURE;
+        server.stopping = true;
+    }
+    while (!server.stopping || server.running > 0) {
+        if (event_wait(&server.loop, -1) < 0 && errno != EINTR) {
+            perror("server");
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+    for (size_t fd = 0; fd < server.clients_cap; fd++) {
+        if (server.clients[fd].open) {
+            close((int)fd);
+        }
+    }
+    event_loop_destroy(&server.loop);
+    if (server.signal_fd >= 0) {
+        close(server.signal_fd);
+    }
+    close(listen_fd);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    free(server.clients);
+    free(server.line);
+    return status;
+}
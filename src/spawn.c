@@ -0,0 +1,332 @@
+/**
+ * @file spawn.c
+ * @brief Launching external commands for the shell lab.
+ *
+ * The default engine uses posix_spawn, which on glibc is implemented with
+ * clone(CLONE_VM|CLONE_VFORK) so the shell's page tables are never copied.
+ * That matters a lot for a shell linked with ASan and readline. The classic
+ * fork + exec path is kept as a fallback that can be selected at runtime.
+ * Either way the command is resolved through the shell's PATH cache first.
+ * posix_spawn only returns once the child has exec'd, so on a timed line
+ * the time spent in it is the spawn-to-exec latency. The fork path gets the
+ * same figure from a close-on-exec pipe.
+ *
+ * A process of a job with limits always takes the fork path, whatever the
+ * engine: its rlimits are set between fork and exec, which posix_spawn has
+ * no step for, and it is created in the job's cgroup, see limit.c.
+ *
+ * References:
+ * https://man7.org/linux/man-pages/man3/posix_spawn.3.html
+ * https://man7.org/linux/man-pages/man3/posix_spawnattr_init.3.html
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "lab.h"
+
+/**
+ * @brief Helper function to build the set of signals the shell ignores and
+ * every child must get back with their default dispositions.
+ *
+ * @param set The set to fill
+ */
+static void child_default_signals(sigset_t *set) {
+    sigemptyset(set);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGQUIT);
+    sigaddset(set, SIGTSTP);
+    sigaddset(set, SIGTTIN);
+    sigaddset(set, SIGTTOU);
+}
+
+/**
+ * @brief Helper function to launch a command with posix_spawn. The child is
+ * put in the requested process group, its stdin and stdout are connected
+ * and its redirections opened as file actions, the signals the shell ignores are reset to their defaults and the signal
+ * mask is cleared, all before exec without a fork of the shell.
+ *
+ * @param sh The shell
+ * @param path The absolute path of the program
+ * @param spec What to launch and how
+ * @param envp The environment of the program
+ * @return The pid of the child, or -1 with errno set on failure
+ */
+static pid_t spawn_posix(struct shell *sh, const char *path, const struct spawn_spec *spec, char **envp) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t defaults, mask;
+    int err;
+
+    if ((err = posix_spawnattr_init(&attr)) != 0) {
+        errno = err;
+        return -1;
+    }
+    if ((err = posix_spawn_file_actions_init(&actions)) != 0) {
+        posix_spawnattr_destroy(&attr);
+        errno = err;
+        return -1;
+    }
+    child_default_signals(&defaults);
+    sigemptyset(&mask);
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    if (sh->shell_is_interactive) { // process groups are only used for job control
+        posix_spawnattr_setpgroup(&attr, spec->pgid); // 0 makes the child the leader of a new group
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, flags);
+
+    // Pipe ends are opened O_CLOEXEC, dup2 clears the flag on the copy the child keeps.
+    if (spec->fd_in >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, spec->fd_in, STDIN_FILENO);
+    }
+    if (spec->fd_out >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, spec->fd_out, STDOUT_FILENO);
+    }
+    // Redirections come after the pipes, so "ls 2>&1 | wc" sends stderr down the pipe too.
+    for (size_t i = 0; i < spec->nredirects; i++) {
+        const struct redirect *r = &spec->redirects[i];
+        if (r->op != TOK_LESS_AND && r->op != TOK_GREAT_AND) {
+            posix_spawn_file_actions_addopen(&actions, r->fd, r->target, redirect_flags(r->op), 0666);
+        } else if (strcmp(r->target, "-") == 0) {
+            posix_spawn_file_actions_addclose(&actions, r->fd);
+        } else {
+            posix_spawn_file_actions_adddup2(&actions, atoi(r->target), r->fd);
+        }
+    }
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+    // Hand the terminal to the new group before exec so it can never read it while still in the background.
+    if (spec->foreground && spec->pgid == 0 && sh->shell_is_interactive) {
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, sh->shell_terminal);
+    }
+#endif
+
+    pid_t pid;
+    err = posix_spawn(&pid, path, &actions, &attr, spec->argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * @brief Print an error from a child without stdio. See lab.h.
+ *
+ * @param what What failed
+ * @param err The errno value
+ */
+void child_error(const char *what, int err) {
+    const char *text = strerrordesc_np(err); // unlike strerror it never looks at the locale
+    struct iovec parts[] = {
+        {(void *)what, strlen(what)}, {": ", 2}, {(void *)(text ? text : "Unknown error"), strlen(text ? text : "Unknown error")}, {"\n", 1},
+    };
+    if (writev(STDERR_FILENO, parts, 4) < 0) {
+        // nothing else a child can do about it
+    }
+}
+
+/**
+ * @brief Helper function for the child side of a fork: join the process
+ * group and take the terminal if the shell does job control, connect stdin
+ * and stdout, apply the redirections, reset the signals the shell ignores
+ * and clear the signal mask. Exits with status 1 if a redirection fails.
+ * Only async-signal-safe calls are made, so it also serves the clone3
+ * child of limit.c.
+ *
+ * @param sh The shell
+ * @param spec What to launch and how
+ */
+static void setup_forked_child(struct shell *sh, const struct spawn_spec *spec) {
+    if (sh->shell_is_interactive) {
+        pid_t child = getpid();
+        pid_t pgid = spec->pgid ? spec->pgid : child;
+        setpgid(child, pgid);
+        if (spec->foreground) {
+            tcsetpgrp(sh->shell_terminal, pgid);
+        }
+    }
+    if (spec->fd_in >= 0) {
+        dup2(spec->fd_in, STDIN_FILENO);
+    }
+    if (spec->fd_out >= 0) {
+        dup2(spec->fd_out, STDOUT_FILENO);
+    }
+    if (redirect_apply(spec->redirects, spec->nredirects, false) != 0) {
+        _exit(EXIT_FAILURE); // the error is printed already
+    }
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    // The shell blocks SIGCHLD for its signalfd, the child starts with an empty mask like posix_spawn.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+/**
+ * @brief Helper function to launch a command with fork and execve. This is
+ * the original launch path of the shell and is kept as a fallback. A
+ * close-on-exec pipe tells the parent how the exec went, like posix_spawn
+ * does: EOF once the program runs, or the errno of a failed execve, after
+ * which the child is reaped and the failure returned, so sh_spawn can drop
+ * a stale PATH cache entry whatever the engine.
+ *
+ * @param sh The shell
+ * @param path The absolute path of the program
+ * @param spec What to launch and how
+ * @param envp The environment of the program
+ * @return The pid of the child, or -1 with errno set on failure
+ */
+static pid_t spawn_fork(struct shell *sh, const char *path, const struct spawn_spec *spec, char **envp) {
+    int exec_fds[2];
+    if (pipe2(exec_fds, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    bool joined;
+    pid_t pid = job_limits_fork(spec->job, true, &joined);
+    if (pid == 0) {
+        /*This is the child process*/
+        close(exec_fds[0]);
+        setup_forked_child(sh, spec);
+        job_limits_apply(spec->job, joined);
+        execve(path, spec->argv, envp);
+        int err = errno;
+        if (write(exec_fds[1], &err, sizeof(err)) != (ssize_t)sizeof(err)) {
+            child_error(spec->argv[0], err); // the parent can't tell, say it here
+        }
+        _exit(127); // same status a shell uses for a command that could not be run
+    }
+    int err = errno;
+    close(exec_fds[1]);
+    // Also how the timing knows when the child has exec'd.
+    ssize_t n = 0;
+    if (pid > 0) {
+        while ((n = read(exec_fds[0], &err, sizeof(err))) < 0 && errno == EINTR) {
+            continue;
+        }
+    }
+    close(exec_fds[0]);
+    if (pid > 0 && n == (ssize_t)sizeof(err)) {
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+            continue;
+        }
+        pid = -1;
+    }
+    errno = err;
+    return pid;
+}
+
+/**
+ * @brief Helper function to run the selected engine.
+ *
+ * @param sh The shell
+ * @param path The absolute path of the program
+ * @param spec What to launch and how
+ * @param envp The environment of the program
+ * @return The pid of the child, or -1 with errno set on failure
+ */
+static pid_t spawn_path(struct shell *sh, const char *path, const struct spawn_spec *spec, char **envp) {
+    if (sh->spawn_engine == SPAWN_FORK || (spec->job && job_limits_set(&spec->job->limits))) {
+        return spawn_fork(sh, path, spec, envp);
+    }
+    return spawn_posix(sh, path, spec, envp);
+}
+
+/**
+ * @brief Launch an external command using the engine selected in
+ * sh->spawn_engine. The command is resolved through the PATH cache. When
+ * exec reports ENOENT for a cached path the entry is stale, so it is
+ * dropped, resolved again and the launch retried once.
+ *
+ * @param sh The shell
+ * @param spec What to launch and how
+ * @return The pid of the child, or -1 with errno set on failure
+ */
+pid_t sh_spawn(struct shell *sh, const struct spawn_spec *spec) {
+    char **argv = spec->argv;
+    if (!argv || !argv[0]) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint64_t start = sh_now_ns();
+    sh->path_cache.env = sh_env(sh); // PATH is compared only when a variable changed
+    const char *path = path_cache_lookup(&sh->path_cache, argv[0]);
+    uint64_t resolved = sh_now_ns();
+    if (sh->timing.active) {
+        sh->timing.resolve_ns += resolved - start;
+    }
+    if (!path) {
+        return -1;
+    }
+    dirs_export(sh); // the program gets the PWD of the shell
+    char **envp = sh_envp(sh); // shared by every child until a variable changes
+    if (spec->job) {
+        job_limits_prepare(sh, spec->job); // its cgroup, made for the first process
+    }
+    pid_t pid = spawn_path(sh, path, spec, envp);
+    // A redirection can fail with ENOENT too, only retry if the program is gone.
+    if (pid < 0 && errno == ENOENT && path != argv[0] && access(path, X_OK) != 0) {
+        // The cached file went away, revalidate the entry and try again.
+        path_cache_forget(&sh->path_cache, argv[0]);
+        if (!(path = path_cache_lookup(&sh->path_cache, argv[0]))) {
+            return -1;
+        }
+        pid = spawn_path(sh, path, spec, envp);
+    }
+    uint64_t spawned = sh_now_ns() - resolved;
+    sh_stat_record(sh, STAT_SPAWN, spawned);
+    if (sh->timing.active) {
+        sh->timing.spawn_ns += spawned;
+    }
+    return pid;
+}
+
+/**
+ * @brief Run a builtin in a forked child described by spec, used for
+ * builtins that are a stage of a pipeline such as `history | grep ls`.
+ * A builtin runs shell code rather than a program, so this always forks
+ * whatever engine is selected.
+ *
+ * @param sh The shell
+ * @param builtin The builtin to run
+ * @param spec The arguments, process group and descriptors for the child
+ * @return The pid of the child, or -1 with errno set on failure
+ */
+pid_t sh_spawn_builtin(struct shell *sh, const struct builtin *builtin, const struct spawn_spec *spec) {
+    fflush(NULL); // don't let the child flush output the shell already buffered
+    uint64_t start = sh_now_ns();
+    if (spec->job) {
+        job_limits_prepare(sh, spec->job);
+    }
+    bool joined;
+    pid_t pid = job_limits_fork(spec->job, false, &joined); // a builtin mallocs and uses stdio, it takes a real fork
+    if (pid == 0) {
+        setup_forked_child(sh, spec);
+        job_limits_apply(spec->job, joined);
+        sh->timing.active = false; // the builtin runs untimed in the child
+        int status = builtin->run(sh, spec->argv);
+        fflush(NULL);
+        _exit(status);
+    }
+    uint64_t spawned = sh_now_ns() - start;
+    sh_stat_record(sh, STAT_SPAWN, spawned);
+    if (sh->timing.active) {
+        sh->timing.spawn_ns += spawned;
+    }
+    return pid;
+}
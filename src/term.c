@@ -0,0 +1,247 @@
+/**
+ * @file term.c
+ * @brief Interactive line editing for the shell lab, loaded on demand.
+ *
+ * Only an interactive shell edits lines with readline, but linking
+ * libreadline makes every instance of the shell map and relocate it and
+ * libtinfo at startup, including the -c and script runs that tooling
+ * starts by the thousand. Instead the library is opened with dlopen the
+ * first time the shell needs a prompt, and the few functions the shell
+ * uses are called through a table. If readline can't be loaded the shell
+ * still works, with a plain prompt and no line editing or recall.
+ *
+ * References:
+ * https://man7.org/linux/man-pages/man3/dlopen.3.html
+ * https://tiswww.cwru.edu/php/chet/readline/readline.html
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include "lab.h"
+
+/**
+ * @brief The readline functions the shell uses, resolved from the library.
+ */
+static struct {
+    bool loaded;  // a load was attempted, successful or not
+    void *handle; // NULL if readline is not available
+    void (*add_history)(const char *line);
+    void (*callback_handler_install)(const char *prompt, void (*handler)(char *line));
+    void (*callback_read_char)(void);
+    void (*callback_handler_remove)(void);
+    int (*on_new_line)(void);
+    void (*redisplay)(void);
+    int (*set_prompt)(const char *prompt);
+    int (*clear_visible_line)(void); // readline 7 and later, optional
+} rl;
+
+/**
+ * @brief Where the lines go between sh_readline_start and sh_readline_stop.
+ */
+static struct {
+    bool active;      // the prompt is up and lines are taken
+    const char *prompt;
+    sh_line_fn on_line;
+    void *data;
+    char *input;      // without readline: bytes read that don't make a whole line yet
+    size_t length;
+    size_t cap;
+} reader;
+
+/**
+ * @brief Load readline the first time it is needed. Later calls return at
+ * once.
+ *
+ * @return True if readline is available
+ */
+bool sh_readline_load(void) {
+    if (rl.loaded) {
+        return rl.handle != NULL;
+    }
+    rl.loaded = true;
+    const char *names[] = {"libreadline.so.8", "libreadline.so"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]) && !rl.handle; i++) {
+        rl.handle = dlopen(names[i], RTLD_NOW | RTLD_GLOBAL);
+    }
+    if (!rl.handle) {
+        return false;
+    }
+    // POSIX allows converting the void * from dlsym to a function pointer.
+    *(void **)&rl.add_history = dlsym(rl.handle, "add_history");
+    *(void **)&rl.callback_handler_install = dlsym(rl.handle, "rl_callback_handler_install");
+    *(void **)&rl.callback_read_char = dlsym(rl.handle, "rl_callback_read_char");
+    *(void **)&rl.callback_handler_remove = dlsym(rl.handle, "rl_callback_handler_remove");
+    *(void **)&rl.on_new_line = dlsym(rl.handle, "rl_on_new_line");
+    *(void **)&rl.redisplay = dlsym(rl.handle, "rl_redisplay");
+    *(void **)&rl.set_prompt = dlsym(rl.handle, "rl_set_prompt");
+    *(void **)&rl.clear_visible_line = dlsym(rl.handle, "rl_clear_visible_line");
+    if (!rl.add_history || !rl.callback_handler_install || !rl.callback_read_char ||
+        !rl.callback_handler_remove || !rl.on_new_line || !rl.redisplay || !rl.set_prompt) {
+        dlclose(rl.handle);
+        rl.handle = NULL;
+    }
+    return rl.handle != NULL;
+}
+
+/**
+ * @brief Helper function to pass a line from readline on.
+ *
+ * @param line The line, NULL at the end of input
+ */
+static void readline_line(char *line) {
+    reader.on_line(line, reader.data);
+}
+
+/**
+ * @brief Helper function to print the prompt when readline is not there.
+ */
+static void print_prompt(void) {
+    fputs(reader.prompt, stdout);
+    fflush(stdout);
+}
+
+/**
+ * @brief Show the prompt and start taking lines without blocking. The
+ * prompt is rendered from MY_PROMPT, readline and the history file are
+ * loaded the first time this is called.
+ *
+ * @param sh The shell
+ * @param on_line Called with each line
+ * @param data Passed to on_line
+ */
+void sh_readline_start(struct shell *sh, sh_line_fn on_line, void *data) {
+    reader.prompt = prompt_render(sh, false);
+    bool editing = sh_readline_load();
+    history_load(&sh->history); // also fills readline's history for recall
+    reader.active = true;
+    reader.on_line = on_line;
+    reader.data = data;
+    if (editing) {
+        rl.callback_handler_install(reader.prompt, readline_line);
+    } else {
+        print_prompt();
+    }
+}
+
+/**
+ * @brief Change the prompt. readline copies it and shows it the next time
+ * the prompt is drawn.
+ *
+ * @param prompt The new prompt
+ */
+void sh_readline_set_prompt(const char *prompt) {
+    reader.prompt = prompt;
+    if (reader.active && rl.handle) {
+        rl.set_prompt(prompt);
+    }
+}
+
+/**
+ * @brief Helper function to read input without readline and pass on every
+ * line that is complete. At the end of input what is left is the last line.
+ */
+static void plain_input(void) {
+    if (grow_buffer((void **)&reader.input, &reader.cap, reader.length + 4096, sizeof(char)) != 0) {
+        perror("sh_readline: realloc failed");
+        return;
+    }
+    ssize_t n = read(STDIN_FILENO, reader.input + reader.length, reader.cap - reader.length);
+    if (n < 0) {
+        return; // EINTR or EAGAIN, the loop calls again
+    }
+    reader.length += (size_t)n;
+    size_t start = 0;
+    bool lines = false;
+    for (size_t i = 0; i < reader.length && reader.active; i++) {
+        if (reader.input[i] == '\n' || (n == 0 && i + 1 == reader.length)) {
+            size_t end = reader.input[i] == '\n' ? i : i + 1;
+            reader.on_line(strndup(reader.input + start, end - start), reader.data);
+            start = i + 1;
+            lines = true;
+        }
+    }
+    if (reader.active) {
+        memmove(reader.input, reader.input + start, reader.length - start);
+        reader.length -= start;
+    }
+    if (n == 0 && reader.active) {
+        reader.on_line(NULL, reader.data);
+    } else if (lines && reader.active) {
+        print_prompt();
+    }
+}
+
+/**
+ * @brief Read the input that is ready on standard input. readline takes
+ * one character at a time, the rest stays ready for the next call.
+ */
+void sh_readline_input(void) {
+    if (!reader.active) {
+        return;
+    }
+    if (rl.handle) {
+        rl.callback_read_char();
+    } else {
+        plain_input();
+    }
+}
+
+/**
+ * @brief Stop taking lines. readline gives the terminal its settings back.
+ */
+void sh_readline_stop(void) {
+    if (reader.active && rl.handle) {
+        rl.callback_handler_remove();
+    }
+    reader.active = false;
+    free(reader.input);
+    reader.input = NULL;
+    reader.length = 0;
+    reader.cap = 0;
+}
+
+/**
+ * @brief Clear the prompt and the line being edited from the screen. An
+ * old readline without rl_clear_visible_line moves to a new line instead.
+ */
+void sh_readline_hide(void) {
+    if (!reader.active) {
+        return;
+    }
+    if (rl.handle && rl.clear_visible_line) {
+        rl.clear_visible_line();
+    } else {
+        fputc('\n', stdout);
+    }
+    fflush(stdout);
+}
+
+/**
+ * @brief Draw the prompt and the line being edited again.
+ */
+void sh_readline_show(void) {
+    if (!reader.active) {
+        return;
+    }
+    if (rl.handle) {
+        rl.on_new_line();
+        rl.redisplay();
+    } else {
+        print_prompt();
+    }
+}
+
+/**
+ * @brief Add a line to the interactive history. Does nothing when readline
+ * is not loaded, a shell that never prompted has no history.
+ *
+ * @param line The line to remember
+ */
+void sh_add_history(const char *line) {
+    if (rl.handle) {
+        rl.add_history(line);
+    }
+}
@@ -0,0 +1,333 @@
+/**
+ * @file timing.c
+ * @brief Measuring commands for the shell lab: the `time` prefix, the -T
+ * option and the per-stage latency histograms shown by shstat.
+ *
+ * The children of a job are collected with wait4, which returns their
+ * resource usage with the status at no extra cost. For a timed line the
+ * shell also measures its own share of the latency: tokenizing the line,
+ * resolving the command in PATH and launching it until the child has
+ * exec'd. That tells apart a slow command from a slow shell.
+ *
+ * Every line also feeds a latency histogram per stage of the shell loop.
+ * A histogram is a fixed array of log-linear buckets, four per power of
+ * two, so recording a sample is a count-leading-zeros and an increment and
+ * a percentile is within 25% of the true value. Nothing is allocated.
+ *
+ * References:
+ * https://man7.org/linux/man-pages/man2/wait4.2.html
+ * https://man7.org/linux/man-pages/man2/getrusage.2.html
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "lab.h"
+
+#define HIST_SUB_BITS 2 // log2 of the buckets per power of two
+
+/**
+ * @brief Names of the stages, in the order of enum sh_stat.
+ */
+static const char *const stat_names[STAT_COUNT] = {"readline", "trim", "parse", "builtin", "spawn", "wait"};
+
+/**
+ * @brief Read the monotonic clock. Goes through the vDSO on Linux so it is
+ * cheap enough to call on every line.
+ *
+ * @return The time in nanoseconds
+ */
+uint64_t sh_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Helper function to convert a timeval to nanoseconds.
+ *
+ * @param tv The time to convert
+ * @return The time in nanoseconds
+ */
+static uint64_t timeval_ns(const struct timeval *tv) {
+    return (uint64_t)tv->tv_sec * 1000000000u + (uint64_t)tv->tv_usec * 1000u;
+}
+
+/**
+ * @brief Helper function to convert nanoseconds to a timeval.
+ *
+ * @param ns The time in nanoseconds
+ * @param tv Filled with the time
+ */
+static void ns_timeval(uint64_t ns, struct timeval *tv) {
+    tv->tv_sec = (time_t)(ns / 1000000000u);
+    tv->tv_usec = (suseconds_t)(ns % 1000000000u / 1000u);
+}
+
+/**
+ * @brief Add the resource usage of one process to a total. Times and
+ * context switches are summed, the maximum resident set size is the largest
+ * of the two.
+ *
+ * @param total The total to update
+ * @param usage The usage to add
+ */
+void rusage_add(struct rusage *total, const struct rusage *usage) {
+    ns_timeval(timeval_ns(&total->ru_utime) + timeval_ns(&usage->ru_utime), &total->ru_utime);
+    ns_timeval(timeval_ns(&total->ru_stime) + timeval_ns(&usage->ru_stime), &total->ru_stime);
+    if (usage->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+/**
+ * @brief Start timing the line about to run. The figures collected by the
+ * previous timed line are cleared.
+ *
+ * @param sh The shell
+ */
+void sh_timing_start(struct shell *sh) {
+    struct sh_timing *timing = &sh->timing;
+    timing->active = true;
+    timing->resolve_ns = 0;
+    timing->spawn_ns = 0;
+    memset(&timing->children, 0, sizeof(timing->children));
+    timing->start_ns = sh_now_ns();
+    getrusage(RUSAGE_SELF, &timing->self);
+}
+
+/**
+ * @brief Helper function to format a duration with a unit that keeps it
+ * readable, from nanoseconds to milliseconds.
+ *
+ * @param buf Where to write the text
+ * @param size Size of buf
+ * @param ns The duration
+ * @return buf
+ */
+static char *format_duration(char *buf, size_t size, uint64_t ns) {
+    if (ns < 10000u) {
+        snprintf(buf, size, "%luns", (unsigned long)ns);
+    } else if (ns < 10000000u) {
+        snprintf(buf, size, "%.1fus", (double)ns / 1e3);
+    } else {
+        snprintf(buf, size, "%.1fms", (double)ns / 1e6);
+    }
+    return buf;
+}
+
+/**
+ * @brief Stop timing and print the report on stderr: wall, user and sys
+ * time, maximum resident set size and context switches of the command, then
+ * the shell's own parse, PATH resolution and spawn latency. User and sys
+ * time include what the shell itself spent so builtins are measured too.
+ *
+ * @param sh The shell
+ */
+void sh_timing_report(struct shell *sh) {
+    struct sh_timing *timing = &sh->timing;
+    uint64_t wall = sh_now_ns() - timing->start_ns;
+    struct rusage self, total = timing->children;
+    getrusage(RUSAGE_SELF, &self);
+    // Only the shell's share of user and sys time during the line counts.
+    struct rusage delta = {0};
+    ns_timeval(timeval_ns(&self.ru_utime) - timeval_ns(&timing->self.ru_utime), &delta.ru_utime);
+    ns_timeval(timeval_ns(&self.ru_stime) - timeval_ns(&timing->self.ru_stime), &delta.ru_stime);
+    delta.ru_nvcsw = self.ru_nvcsw - timing->self.ru_nvcsw;
+    delta.ru_nivcsw = self.ru_nivcsw - timing->self.ru_nivcsw;
+    rusage_add(&total, &delta);
+    timing->active = false;
+
+    fprintf(stderr, "\nreal\t%.3fs\n", (double)wall / 1e9);
+    fprintf(stderr, "user\t%.3fs\n", (double)timeval_ns(&total.ru_utime) / 1e9);
+    fprintf(stderr, "sys\t%.3fs\n", (double)timeval_ns(&total.ru_stime) / 1e9);
+    fprintf(stderr, "maxrss\t%ld KiB\n", total.ru_maxrss);
+    fprintf(stderr, "ctxsw\t%ld voluntary, %ld involuntary\n", total.ru_nvcsw, total.ru_nivcsw);
+    char parse[32], resolve[32], spawn[32];
+    fprintf(stderr, "shell\tparse %s, resolve %s, spawn %s\n", format_duration(parse, sizeof(parse), timing->parse_ns),
+            format_duration(resolve, sizeof(resolve), timing->resolve_ns),
+            format_duration(spawn, sizeof(spawn), timing->spawn_ns));
+}
+
+/**
+ * @brief Helper function to find the bucket of a sample. Values below four
+ * get a bucket each, above that every power of two is split in four.
+ *
+ * @param ns The sample
+ * @return The bucket index
+ */
+static unsigned hist_bucket(uint64_t ns) {
+    if (ns < (1u << HIST_SUB_BITS)) {
+        return (unsigned)ns;
+    }
+    unsigned msb = 63 - (unsigned)__builtin_clzll(ns);
+    unsigned sub = (unsigned)(ns >> (msb - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+/**
+ * @brief Helper function to get the smallest value that falls in a bucket.
+ *
+ * @param bucket The bucket index
+ * @return The lower bound of the bucket in nanoseconds
+ */
+static uint64_t hist_lower(unsigned bucket) {
+    if (bucket < (1u << HIST_SUB_BITS)) {
+        return bucket;
+    }
+    unsigned msb = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1u << HIST_SUB_BITS) - 1);
+    return ((1ull << HIST_SUB_BITS) + sub) << (msb - HIST_SUB_BITS);
+}
+
+/**
+ * @brief Record one sample of a stage of the shell loop.
+ *
+ * @param sh The shell
+ * @param stat The stage
+ * @param ns How long it took
+ */
+void sh_stat_record(struct shell *sh, enum sh_stat stat, uint64_t ns) {
+    struct sh_histogram *hist = &sh->stats[stat];
+    if (hist->count == 0 || ns < hist->min) {
+        hist->min = ns;
+    }
+    if (ns > hist->max) {
+        hist->max = ns;
+    }
+    hist->count++;
+    hist->sum += ns;
+    hist->buckets[hist_bucket(ns)]++;
+}
+
+/**
+ * @brief Estimate a percentile of a histogram. The answer is the middle of
+ * the bucket holding the requested rank, kept within the recorded minimum
+ * and maximum.
+ *
+ * @param hist The histogram
+ * @param percent The percentile, 0 to 100
+ * @return The estimate in nanoseconds, 0 for an empty histogram
+ */
+uint64_t sh_histogram_percentile(const struct sh_histogram *hist, double percent) {
+    if (hist->count == 0) {
+        return 0;
+    }
+    // The nearest-rank definition: the smallest sample with at least percent of them at or below it.
+    double exact = percent / 100.0 * (double)hist->count;
+    uint64_t rank = (uint64_t)exact;
+    if ((double)rank < exact || rank == 0) {
+        rank++;
+    }
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < SH_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t low = hist_lower(i);
+            uint64_t value = low + (hist_lower(i + 1) - low) / 2;
+            return value < hist->min ? hist->min : value > hist->max ? hist->max : value;
+        }
+    }
+    return hist->max;
+}
+
+/**
+ * @brief Print the per-stage latency table of shstat, followed by the hits
+ * and misses of the line cache.
+ *
+ * @param sh The shell
+ * @param out Where to print
+ */
+void sh_stats_print(struct shell *sh, FILE *out) {
+    fprintf(out, "%-10s %10s %10s %10s %10s\n", "stage", "count", "p50", "p99", "max");
+    for (int i = 0; i < STAT_COUNT; i++) {
+        const struct sh_histogram *hist = &sh->stats[i];
+        char p50[32] = "-", p99[32] = "-", max[32] = "-";
+        if (hist->count) {
+            format_duration(p50, sizeof(p50), sh_histogram_percentile(hist, 50));
+            format_duration(p99, sizeof(p99), sh_histogram_percentile(hist, 99));
+            format_duration(max, sizeof(max), hist->max);
+        }
+        fprintf(out, "%-10s %10lu %10s %10s %10s\n", stat_names[i], (unsigned long)hist->count, p50, p99, max);
+    }
+    const struct line_cache *cache = &sh->line_cache;
+    fprintf(out, "line cache: %lu hits, %lu misses, %lu lines\n", (unsigned long)cache->hits,
+            (unsigned long)cache->misses, (unsigned long)cache->count);
+}
+
+/**
+ * @brief Print the per-stage histograms as a JSON object, one key per stage
+ * with the count, sum, min, max, p50 and p99 in nanoseconds, and a
+ * "line_cache" key with its hits, misses and lines.
+ *
+ * @param sh The shell
+ * @param out Where to print
+ */
+void sh_stats_json(struct shell *sh, FILE *out) {
+    fprintf(out, "{");
+    for (int i = 0; i < STAT_COUNT; i++) {
+        const struct sh_histogram *hist = &sh->stats[i];
+        fprintf(out, "%s\"%s\":{\"count\":%lu,\"sum_ns\":%lu,\"min_ns\":%lu,\"max_ns\":%lu,"
+                "\"p50_ns\":%lu,\"p99_ns\":%lu}",
+                i ? "," : "", stat_names[i], (unsigned long)hist->count, (unsigned long)hist->sum,
+                (unsigned long)hist->min, (unsigned long)hist->max,
+                (unsigned long)sh_histogram_percentile(hist, 50), (unsigned long)sh_histogram_percentile(hist, 99));
+    }
+    const struct line_cache *cache = &sh->line_cache;
+    fprintf(out, ",\"line_cache\":{\"hits\":%lu,\"misses\":%lu,\"lines\":%lu}}\n", (unsigned long)cache->hits,
+            (unsigned long)cache->misses, (unsigned long)cache->count);
+}
+
+/**
+ * @brief Write the histograms as JSON to the file given with -J, "-" means
+ * stderr. Called by sh_destroy.
+ *
+ * @param sh The shell
+ */
+void sh_stats_dump(struct shell *sh) {
+    if (!sh->stats_json) {
+        return;
+    }
+    if (strcmp(sh->stats_json, "-") == 0) {
+        sh_stats_json(sh, stderr);
+        return;
+    }
+    FILE *out = fopen(sh->stats_json, "w");
+    if (!out) {
+        fprintf(stderr, "%s: %s\n", sh->stats_json, strerror(errno));
+        return;
+    }
+    sh_stats_json(sh, out);
+    fclose(out);
+}
+
+/**
+ * @brief The shstat builtin. Prints p50 and p99 of every stage of the shell
+ * loop, `shstat -j` prints JSON instead and `shstat -r` clears the counters.
+ *
+ * @param sh The shell
+ * @param argv The shstat command and its arguments
+ * @return 0 on success, 2 for an unknown option
+ */
+int builtin_shstat(struct shell *sh, char **argv) {
+    if (!argv[1]) {
+        sh_stats_print(sh, stdout);
+        return 0;
+    }
+    if (strcmp(argv[1], "-j") == 0) {
+        sh_stats_json(sh, stdout);
+        return 0;
+    }
+    if (strcmp(argv[1], "-r") == 0) {
+        memset(sh->stats, 0, sizeof(sh->stats));
+        sh->line_cache.hits = sh->line_cache.misses = 0;
+        return 0;
+    }
+    fprintf(stderr, "shstat: usage: shstat [-j | -r]\n");
+    return 2;
+}
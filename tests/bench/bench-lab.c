@@ -0,0 +1,347 @@
+/**
+ * @file bench-lab.c
+ * @brief Micro benchmarks for the shell lab API.
+ *
+ * Every benchmark runs its operation for a warmup round, then for a number
+ * of timed repetitions, and reports the median cost per operation in
+ * nanoseconds along with the heap allocations per operation. Allocations
+ * are counted by replacing malloc, calloc and realloc with wrappers around
+ * the glibc implementations, so the suite must be built without ASan: `make
+ * bench` builds it at -O2 on objects of its own.
+ *
+ * When a baseline file is given the results are compared with it and the
+ * change is printed next to each benchmark. `make bench-baseline` rewrites
+ * the committed baseline so a regression shows up as a diff in review.
+ *
+ * Shell startup is measured by launching the shell named by BENCH_SHELL,
+ * which `make bench` points at an -O2 build of myprogram, in the
+ * non-interactive ways tooling runs it.
+ *
+ * Usage: bench-lab [--save] [baseline]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "../../src/lab.h"
+
+#define BENCH_REPS 5           // timed repetitions, the median is reported
+#define BENCH_ITERATIONS 20000 // operations per repetition for the in-process benchmarks
+#define BENCH_SPAWNS 200       // operations per repetition for the spawn benchmarks
+
+extern char **environ;
+#define BENCH_MAX 32           // benchmarks in the suite, for the baseline table
+#define BENCH_REGRESSION 10.0  // percent slower than the baseline that is flagged
+
+#ifndef __SANITIZE_ADDRESS__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long alloc_count; // heap allocations since the program started
+
+/**
+ * @brief Count and forward every malloc, including the ones made inside
+ * libc such as strdup.
+ */
+void *malloc(size_t size) {
+    alloc_count++;
+    return __libc_malloc(size);
+}
+
+/**
+ * @brief Count and forward every calloc.
+ */
+void *calloc(size_t nmemb, size_t size) {
+    alloc_count++;
+    return __libc_calloc(nmemb, size);
+}
+
+/**
+ * @brief Count and forward every realloc.
+ */
+void *realloc(void *ptr, size_t size) {
+    alloc_count++;
+    return __libc_realloc(ptr, size);
+}
+#else
+static unsigned long alloc_count; // ASan owns malloc, allocations read as zero
+#endif
+
+/**
+ * @brief One result, as stored in the baseline file.
+ */
+struct bench_result {
+    char name[64];
+    double ns_per_op;
+    double allocs_per_op;
+};
+
+static struct bench_result baseline[BENCH_MAX];
+static size_t nbaseline;
+static struct bench_result results[BENCH_MAX];
+static size_t nresults;
+
+typedef void (*bench_op)(void *arg);
+
+/**
+ * @brief Read the monotonic clock in nanoseconds.
+ */
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief Order doubles for qsort.
+ */
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Load a baseline written by --save. A missing file is not an error,
+ * there is just nothing to compare with.
+ *
+ * @param path The baseline file
+ */
+static void load_baseline(const char *path) {
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        return;
+    }
+    char line[256];
+    while (nbaseline < BENCH_MAX && fgets(line, sizeof(line), in)) {
+        struct bench_result *entry = &baseline[nbaseline];
+        if (line[0] != '#' && sscanf(line, "%63s %lf %lf", entry->name, &entry->ns_per_op, &entry->allocs_per_op) == 3) {
+            nbaseline++;
+        }
+    }
+    fclose(in);
+}
+
+/**
+ * @brief Write the results of this run as the new baseline.
+ *
+ * @param path The baseline file
+ * @return 0 on success, 1 if the file could not be written
+ */
+static int save_baseline(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        perror(path);
+        return 1;
+    }
+    fprintf(out, "# name ns/op allocs/op, written by make bench-baseline\n");
+    for (size_t i = 0; i < nresults; i++) {
+        fprintf(out, "%s %.1f %.2f\n", results[i].name, results[i].ns_per_op, results[i].allocs_per_op);
+    }
+    fclose(out);
+    return 0;
+}
+
+/**
+ * @brief Run one benchmark: a warmup round of a tenth of the iterations,
+ * then BENCH_REPS timed repetitions. Prints the median ns/op, the
+ * allocations per operation and the change against the baseline.
+ *
+ * @param name Name of the benchmark, without spaces
+ * @param op The operation to measure
+ * @param arg Passed to op
+ * @param iterations Operations per repetition
+ */
+static void bench_run(const char *name, bench_op op, void *arg, long iterations) {
+    double reps[BENCH_REPS];
+    for (long i = 0; i < iterations / 10 + 1; i++) {
+        op(arg);
+    }
+    unsigned long allocs = alloc_count;
+    for (int r = 0; r < BENCH_REPS; r++) {
+        long long start = now_ns();
+        for (long i = 0; i < iterations; i++) {
+            op(arg);
+        }
+        reps[r] = (double)(now_ns() - start) / (double)iterations;
+    }
+    allocs = alloc_count - allocs;
+    qsort(reps, BENCH_REPS, sizeof(reps[0]), compare_double);
+
+    static struct bench_result overflow; // results past BENCH_MAX are printed but not saved
+    struct bench_result *result = nresults < BENCH_MAX ? &results[nresults++] : &overflow;
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->ns_per_op = reps[BENCH_REPS / 2];
+    result->allocs_per_op = (double)allocs / (double)(iterations * BENCH_REPS);
+
+    printf("%-32s %12.1f %10.2f", name, result->ns_per_op, result->allocs_per_op);
+    for (size_t i = 0; i < nbaseline; i++) {
+        if (strcmp(baseline[i].name, name) == 0 && baseline[i].ns_per_op > 0) {
+            double change = (result->ns_per_op - baseline[i].ns_per_op) * 100.0 / baseline[i].ns_per_op;
+            printf(" %+9.1f%%%s", change, change > BENCH_REGRESSION ? "  slower" : "");
+            break;
+        }
+    }
+    printf("\n");
+}
+
+/**
+ * @brief cmd_parse followed by cmd_free.
+ */
+static void op_cmd_parse(void *arg) {
+    cmd_free(cmd_parse(arg));
+}
+
+/**
+ * @brief Argument of op_cmd_parse_into.
+ */
+struct parse_arg {
+    struct parse_ctx ctx;
+    const char *line;
+};
+
+/**
+ * @brief cmd_parse_into with a context reused between lines, the way the
+ * shell's loop parses.
+ */
+static void op_cmd_parse_into(void *arg) {
+    struct parse_arg *parse = arg;
+    cmd_parse_into(&parse->ctx, parse->line);
+}
+
+/**
+ * @brief trim_white on a fresh copy of the line, the copy is included.
+ */
+static void op_trim_white(void *arg) {
+    char line[64];
+    strcpy(line, arg);
+    trim_white(line);
+}
+
+/**
+ * @brief get_prompt and the free its result needs.
+ */
+static void op_get_prompt(void *arg) {
+    free(get_prompt(arg));
+}
+
+/**
+ * @brief builtin_find for one name.
+ */
+static void op_builtin_find(void *arg) {
+    const struct builtin *volatile builtin = builtin_find(arg);
+    (void)builtin;
+}
+
+/**
+ * @brief Argument of op_do_builtin.
+ */
+struct builtin_arg {
+    struct shell *sh;
+    char **argv;
+};
+
+/**
+ * @brief do_builtin on an argument list, `hash -r` for a builtin that
+ * does next to nothing and a plain command for the miss.
+ */
+static void op_do_builtin(void *arg) {
+    struct builtin_arg *builtin = arg;
+    do_builtin(builtin->sh, builtin->argv);
+}
+
+/**
+ * @brief Launch `true` with sh_spawn and reap it.
+ */
+static void op_spawn(void *arg) {
+    struct shell *sh = arg;
+    char *argv[] = {"true", NULL}; // resolved through the PATH cache
+    struct spawn_spec spec = {argv, 0, -1, -1, false, NULL, 0, NULL};
+    pid_t pid = sh_spawn(sh, &spec);
+    if (pid < 0 || waitpid(pid, NULL, 0) < 0) {
+        perror("op_spawn");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Launch a shell with its stdin on /dev/null and wait for it, the
+ * cost of one short-lived shell instance.
+ */
+static void op_startup(void *arg) {
+    char **argv = arg;
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    pid_t pid;
+    int err = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0 || waitpid(pid, NULL, 0) < 0) {
+        fprintf(stderr, "op_startup: %s: %s\n", argv[0], strerror(err));
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char **argv) {
+    bool save = argc > 1 && strcmp(argv[1], "--save") == 0;
+    const char *baseline_path = argc > 1 + save ? argv[1 + save] : NULL;
+    if (baseline_path && !save) {
+        load_baseline(baseline_path);
+    }
+    printf("%-32s %12s %10s %10s\n", "benchmark", "ns/op", "allocs/op", "baseline");
+
+    const char *lines[][2] = {
+        {"short", "ls -a"},
+        {"gcc", "gcc -Wall -Wextra -O2 -c lab.c -o lab.o"},
+        {"words20", "a b c d e f g h i j k l m n o p q r s t"},
+    };
+    char name[64];
+    for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+        snprintf(name, sizeof(name), "cmd_parse/%s", lines[i][0]);
+        bench_run(name, op_cmd_parse, (void *)lines[i][1], BENCH_ITERATIONS);
+    }
+    struct parse_arg parse;
+    parse_ctx_init(&parse.ctx);
+    for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+        parse.line = lines[i][1];
+        snprintf(name, sizeof(name), "cmd_parse_into/%s", lines[i][0]);
+        bench_run(name, op_cmd_parse_into, &parse, BENCH_ITERATIONS);
+    }
+    parse_ctx_destroy(&parse.ctx);
+
+    bench_run("trim_white/both", op_trim_white, "   ls -a | wc -l   ", BENCH_ITERATIONS);
+    bench_run("trim_white/none", op_trim_white, "ls -a | wc -l", BENCH_ITERATIONS);
+    bench_run("get_prompt/default", op_get_prompt, "BENCH_NO_SUCH_PROMPT", BENCH_ITERATIONS);
+    bench_run("builtin_find/hit", op_builtin_find, "history", BENCH_ITERATIONS);
+    bench_run("builtin_find/miss", op_builtin_find, "ls", BENCH_ITERATIONS);
+
+    struct shell sh = {0};
+    char *hash_argv[] = {"hash", "-r", NULL};
+    char *ls_argv[] = {"ls", "-a", NULL};
+    struct builtin_arg builtin = {&sh, hash_argv};
+    bench_run("do_builtin/hash-r", op_do_builtin, &builtin, BENCH_ITERATIONS);
+    builtin.argv = ls_argv;
+    bench_run("do_builtin/miss", op_do_builtin, &builtin, BENCH_ITERATIONS);
+
+    sh.spawn_engine = SPAWN_POSIX;
+    bench_run("sh_spawn/posix_spawn", op_spawn, &sh, BENCH_SPAWNS);
+    sh.spawn_engine = SPAWN_FORK;
+    bench_run("sh_spawn/fork+execv", op_spawn, &sh, BENCH_SPAWNS);
+    path_cache_destroy(&sh.path_cache);
+
+    char *shell = getenv("BENCH_SHELL");
+    if (shell) {
+        char *empty_argv[] = {shell, "-c", "", NULL};
+        char *builtin_argv[] = {shell, "-c", "cd .", NULL};
+        char *stdin_argv[] = {shell, NULL}; // batch mode on an empty stdin
+        bench_run("startup/-c-empty", op_startup, empty_argv, BENCH_SPAWNS);
+        bench_run("startup/-c-builtin", op_startup, builtin_argv, BENCH_SPAWNS);
+        bench_run("startup/stdin", op_startup, stdin_argv, BENCH_SPAWNS);
+    }
+
+    return save && baseline_path ? save_baseline(baseline_path) : 0;
+}
@@ -0,0 +1,48 @@
+# Training input for the pgo build, run through batch mode from a file
+# and from a pipe. It mixes what an automated caller sends: short
+# commands, long argument lists, pipelines and builtins.
+true
+false
+true
+cd .
+cd /
+cd /tmp
+hash
+hash true
+hash -r
+true
+true | true
+false | true
+printf 'a\nb\nc\n' | wc -l
+printf x | cat | cat | wc -c
+ls / | wc -l
+ls -a -l / | head -n 3
+echo a b c d e f g h i j k l m n o p q r s t u v w x y z
+echo gcc -Wall -Wextra -O2 -c lab.c -o lab.o -I include -DNDEBUG
+echo    leading   and   trailing   spaces
+echo "double quoted | text" 'single quoted ; text' escaped\ space
+true; false; true
+echo redirected > /dev/null 2>&1
+ls /nonexistent 2>/dev/null | wc -l >> /dev/null
+help > /dev/null
+false|true;true&
+	echo	tabs	between	words
+env | wc -l
+uname -a
+true &
+jobs
+parallel -j 2 true ::: true ::: false ::: true
+history
+help
+shstat
+true
+true
+true
+echo done
+cd .
+cd .
+true | true
+true
+echo one two three
+false
+true
@@ -0,0 +1,328 @@
+/**
+ * @file fuzz-parse.c
+ * @brief Fuzz target for cmd_parse, the parsers sharing its lexer and
+ * trim_white.
+ *
+ * Every input is taken as one line, up to its first null byte, and run
+ * through each way the shell tokenizes a line: cmd_parse, cmd_parse_into
+ * with a reused context, cmd_parse_inplace on a copy and a line cache hit.
+ * All of them must give the same tokens, and trim_white must only remove
+ * whitespace from the ends. The tokens are then split into commands and
+ * pipelines with cmd_pipeline_at. Any difference aborts, so besides the
+ * memory errors ASan finds the target also catches the parsers drifting
+ * apart.
+ *
+ * Built with -DLAB_LIBFUZZER and -fsanitize=fuzzer (`make fuzz`, clang)
+ * this is a libFuzzer target. Otherwise it has a main of its own that
+ * replays files and directories of inputs, such as tests/fuzz/corpus or
+ * the crashes libFuzzer saved, and with -n mutates the inputs it read that
+ * many times. `make fuzz-replay` builds it with gcc and ASan and runs the
+ * corpus that way.
+ *
+ * Usage: fuzz-parse [-n count] [-s seed] file|dir ...
+ *
+ * References:
+ * https://llvm.org/docs/LibFuzzer.html
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "../../src/lab.h"
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+#define FUZZ_MAX_INPUT 65536 // longer inputs are cut, libFuzzer's default -max_len is smaller
+#define FUZZ_MAX_SEEDS 4096  // inputs kept for mutation by the replay driver
+#define FUZZ_CACHED_LINE 1024 // LINE_CACHE_MAX_LINE, longer lines are not cached
+
+static int report_fd = STDERR_FILENO; // where a failed check is reported
+
+/**
+ * @brief Helper function to report a failed check and abort, so the
+ * input is saved by libFuzzer or named by the replay driver.
+ *
+ * @param what The check that failed
+ * @param line The line being parsed
+ */
+static void fuzz_fail(const char *what, const char *line) {
+    dprintf(report_fd, "fuzz-parse: %s for line \"%s\"\n", what, line);
+    abort();
+}
+
+/**
+ * @brief Helper function to compare two token arrays.
+ *
+ * @param a The first array, NULL terminated
+ * @param b The second array, NULL terminated
+ * @return True if both hold the same tokens
+ */
+static bool same_tokens(char **a, char **b) {
+    size_t i = 0;
+    for (; a[i] && b[i]; i++) {
+        if (strcmp(a[i], b[i]) != 0) {
+            return false;
+        }
+    }
+    return !a[i] && !b[i];
+}
+
+/**
+ * @brief Helper function to check trim_white on a copy of the line: the
+ * result must be the line without whitespace at either end.
+ *
+ * @param line The line
+ * @param length Length of the line
+ * @param copy Room for length + 1 bytes
+ */
+static void check_trim(const char *line, size_t length, char *copy) {
+    size_t start = 0, end = length;
+    while (start < end && isspace((unsigned char)line[start])) {
+        start++;
+    }
+    while (end > start && isspace((unsigned char)line[end - 1])) {
+        end--;
+    }
+    memcpy(copy, line, length + 1);
+    char *trimmed = trim_white(copy);
+    if (trimmed != copy + start || strlen(trimmed) != end - start) {
+        fuzz_fail("trim_white removed the wrong bytes", line);
+    }
+}
+
+/**
+ * @brief Parse one input every way the shell does and check they agree.
+ * Called by libFuzzer, or by the replay driver below.
+ *
+ * @param data The input, not null terminated
+ * @param size Size of the input
+ * @return 0, inputs are never rejected
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static struct parse_ctx ctx, inplace_ctx, cached_ctx; // reused the way the shell reuses its own
+    static struct line_cache cache;
+    size_t length = strnlen((const char *)data, size < FUZZ_MAX_INPUT ? size : FUZZ_MAX_INPUT);
+    char *line = malloc(length + 1);
+    char *copy = malloc(length + 1);
+    if (!line || !copy) {
+        free(line);
+        free(copy);
+        return 0;
+    }
+    memcpy(line, data, length);
+    line[length] = '\0';
+
+    check_trim(line, length, copy);
+
+    char **parsed = cmd_parse(line);
+    char **into = cmd_parse_into(&ctx, line);
+    memcpy(copy, line, length + 1);
+    char **inplace = cmd_parse_inplace(&inplace_ctx, copy);
+    if (!parsed != !into || !parsed != !inplace) {
+        fuzz_fail("the parsers disagree on an error", line);
+    }
+    if (parsed && (!same_tokens(parsed, into) || !same_tokens(parsed, inplace))) {
+        fuzz_fail("the parsers disagree on the tokens", line);
+    }
+    if (into) {
+        // The second miss remembers the line, the insert stores the tokens
+        // of ctx and the next lookup must give them back.
+        bool hit = line_cache_lookup(&cache, &cached_ctx, line, false) ||
+                   line_cache_lookup(&cache, &cached_ctx, line, false);
+        if (!hit) {
+            line_cache_insert(&cache, &ctx);
+            hit = line_cache_lookup(&cache, &cached_ctx, line, false);
+            if (!hit && length <= FUZZ_CACHED_LINE) {
+                fuzz_fail("a line just cached was missed", line);
+            }
+        }
+        if (hit && (cached_ctx.count != ctx.count || !same_tokens(cached_ctx.argv, into))) {
+            fuzz_fail("the line cache gave other tokens", line);
+        }
+        // Split the list at ";" and "&" the way sh_run_parsed does, then
+        // every command into its pipeline.
+        for (size_t first = 0, end; first < ctx.count; first = end + 1) {
+            for (end = first; end < ctx.count && ctx.kinds[end] != TOK_SEMI && ctx.kinds[end] != TOK_BACKGROUND; end++) {
+            }
+            ctx.argv[end] = NULL;
+            int stages = cmd_pipeline_at(&ctx, first);
+            if (stages < -1 || (stages >= 0 && (size_t)stages != ctx.nstages)) {
+                fuzz_fail("cmd_pipeline_at returned a wrong stage count", line);
+            }
+        }
+    }
+    cmd_free(parsed);
+    free(line);
+    free(copy);
+    return 0;
+}
+
+#ifndef LAB_LIBFUZZER
+struct seed {
+    uint8_t *data;
+    size_t size;
+};
+
+static struct seed seeds[FUZZ_MAX_SEEDS];
+static size_t nseeds;
+
+/**
+ * @brief Helper function to run one file and keep it for mutation.
+ *
+ * @param path The file
+ * @return 0 on success, -1 if it can't be read
+ */
+static int replay_file(const char *path) {
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        perror(path);
+        return -1;
+    }
+    uint8_t *data = malloc(FUZZ_MAX_INPUT);
+    size_t size = data ? fread(data, 1, FUZZ_MAX_INPUT, in) : 0;
+    fclose(in);
+    if (!data) {
+        return -1;
+    }
+    LLVMFuzzerTestOneInput(data, size);
+    if (nseeds < FUZZ_MAX_SEEDS) {
+        seeds[nseeds++] = (struct seed){data, size};
+    } else {
+        free(data);
+    }
+    return 0;
+}
+
+/**
+ * @brief Helper function to run a file, or every file in a directory.
+ *
+ * @param path The file or directory
+ * @return The number of paths that could not be read
+ */
+static int replay_path(const char *path) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return replay_file(path) != 0;
+    }
+    int failures = 0;
+    struct dirent *entry;
+    char name[4096];
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] != '.') {
+            snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+            failures += replay_file(name) != 0;
+        }
+    }
+    closedir(dir);
+    return failures;
+}
+
+/**
+ * @brief Helper function for the xorshift generator the mutations use, so
+ * a seed repeats a run.
+ *
+ * @param state The generator state, not zero
+ * @return The next value
+ */
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/**
+ * @brief Helper function to mutate a copy of a seed the way a fuzzer
+ * would: a few bytes replaced, inserted or removed, biased towards the
+ * bytes the lexer gives a meaning to.
+ *
+ * @param state The generator state
+ * @param out Room for FUZZ_MAX_INPUT bytes
+ * @param seed The input to start from
+ * @return The size of the mutated input
+ */
+static size_t mutate(uint64_t *state, uint8_t *out, const struct seed *seed) {
+    static const char special[] = " \t\n|&;<>'\"\\#=012";
+    size_t size = seed->size;
+    memcpy(out, seed->data, size);
+    for (int edits = 1 + next_random(state) % 4; edits > 0; edits--) {
+        uint64_t r = next_random(state);
+        uint8_t byte = r & 1 ? (uint8_t)special[(r >> 8) % (sizeof(special) - 1)] : (uint8_t)(r >> 16);
+        size_t at = size ? (r >> 24) % (size + 1) : 0;
+        switch ((r >> 4) % 3) {
+        case 0: // replace
+            if (at < size) {
+                out[at] = byte;
+            }
+            break;
+        case 1: // insert
+            if (size < FUZZ_MAX_INPUT) {
+                memmove(out + at + 1, out + at, size - at);
+                out[at] = byte;
+                size++;
+            }
+            break;
+        default: // remove
+            if (at < size) {
+                memmove(out + at, out + at + 1, size - at - 1);
+                size--;
+            }
+            break;
+        }
+    }
+    return size;
+}
+
+int main(int argc, char **argv) {
+    long count = 0;
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            count = atol(optarg);
+            break;
+        case 's':
+            state = strtoull(optarg, NULL, 0) | 1; // never zero
+            break;
+        default:
+            fprintf(stderr, "fuzz-parse: usage: fuzz-parse [-n count] [-s seed] file|dir ...\n");
+            return 2;
+        }
+    }
+    // The lexer reports every bad quote on stderr, which mutated inputs hit
+    // all the time. Keep failures and sanitizer reports on the real stderr.
+    report_fd = fd_move_high(dup(STDERR_FILENO));
+#ifdef __SANITIZE_ADDRESS__
+    __sanitizer_set_report_fd((void *)(intptr_t)report_fd);
+#endif
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+    }
+
+    int failures = 0;
+    for (int i = optind; i < argc; i++) {
+        failures += replay_path(argv[i]);
+    }
+    uint8_t *input = malloc(FUZZ_MAX_INPUT);
+    static const struct seed empty = {(uint8_t *)"", 0};
+    for (long i = 0; input && i < count; i++) {
+        const struct seed *seed = nseeds ? &seeds[next_random(&state) % nseeds] : &empty;
+        LLVMFuzzerTestOneInput(input, mutate(&state, input, seed));
+    }
+    dprintf(report_fd, "fuzz-parse: %zu inputs replayed, %ld mutated\n", nseeds, count);
+    free(input);
+    for (size_t i = 0; i < nseeds; i++) {
+        free(seeds[i].data);
+    }
+    return failures != 0;
+}
+#endif
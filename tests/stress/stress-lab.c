@@ -0,0 +1,446 @@
+/**
+ * @file stress-lab.c
+ * @brief Stress test of the shell's batch mode: throughput and peak
+ * memory on millions of generated lines.
+ *
+ * The harness generates STRESS_LINES lines, a million by default, from a
+ * fixed seed so every run sends the same bytes. They vary from empty and
+ * comment lines to assignments of hundreds of words several kilobytes
+ * long, with quotes, escapes and operators, and a share of them repeats a
+ * line run shortly before the way generated scripts do. Every command is
+ * one the shell runs itself, assignments, export, unset and cd, so the
+ * numbers are the cost of reading, trimming, parsing and dispatching a
+ * line and not of launching programs.
+ *
+ * The lines are run by the shell named by STRESS_SHELL, which `make
+ * stress` points at an -O2 build of myprogram, once from a script file,
+ * which is mapped, and once from a pipe, which goes through getline. Each
+ * mode is run STRESS_REPS times and the best lines per second is kept
+ * along with the peak RSS of the shell from wait4.
+ *
+ * When a baseline file is given the results are compared with it, and the
+ * harness exits with 1 if a mode lost more than STRESS_SLOWER percent of
+ * its throughput or grew its peak RSS by more than STRESS_RSS_GROWTH
+ * percent. `make stress-baseline` rewrites the committed baseline.
+ *
+ * Usage: stress-lab [--save] [baseline]
+ *
+ * References:
+ * https://man7.org/linux/man-pages/man2/wait4.2.html
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define STRESS_LINES 1000000L  // generated lines, STRESS_LINES in the environment overrides it
+#define STRESS_REPS 3          // runs of each mode, the best is kept
+#define STRESS_VARS 64         // distinct variable names, so the environment stays bounded
+#define STRESS_RECENT 64       // recent lines a repeated line is picked from
+#define STRESS_MAX_LINE 8192   // the longest generated line
+#define STRESS_MODES 2         // file and pipe
+#define STRESS_SLOWER 15.0     // percent fewer lines per second that fails the run
+#define STRESS_RSS_GROWTH 20.0 // percent more peak RSS that fails the run
+
+extern char **environ;
+
+/**
+ * @brief One result, as stored in the baseline file.
+ */
+struct stress_result {
+    char name[64];
+    double lines_per_sec;
+    long peak_rss_kb;
+};
+
+static struct stress_result baseline[STRESS_MODES];
+static size_t nbaseline;
+static struct stress_result results[STRESS_MODES];
+static size_t nresults;
+
+/**
+ * @brief Generated input, the script file holding it and its size.
+ */
+struct stress_input {
+    const char *path;
+    long long size;
+    long lines;
+};
+
+/**
+ * @brief Read the monotonic clock in nanoseconds.
+ */
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief xorshift, fixed seed so every run generates the same lines.
+ */
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/**
+ * @brief Generate a word of up to max bytes, sometimes quoted or with an
+ * escaped space so the lexer has to rewrite it.
+ *
+ * @param state The generator state
+ * @param out Room for max + 4 bytes
+ * @param max The longest word, at least 1
+ * @return The length of the word
+ */
+static size_t make_word(uint64_t *state, char *out, size_t max) {
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyz0123456789/._-";
+    uint64_t r = next_random(state);
+    size_t length = 1 + r % max;
+    size_t n = 0;
+    int style = (r >> 32) % 8; // mostly plain words
+    if (style == 0 || style == 1) {
+        out[n++] = style == 0 ? '\'' : '"';
+    }
+    for (size_t i = 0; i < length; i++) {
+        uint64_t c = next_random(state);
+        if (style == 2 && i == length / 2) {
+            out[n++] = '\\';
+            out[n++] = ' ';
+        } else if (style < 2 && c % 11 == 0) {
+            out[n++] = ' ';
+        } else {
+            out[n++] = letters[c % (sizeof(letters) - 1)];
+        }
+    }
+    if (style == 0 || style == 1) {
+        out[n++] = style == 0 ? '\'' : '"';
+    }
+    return n;
+}
+
+/**
+ * @brief Generate one line of a new shape into out.
+ *
+ * @param state The generator state
+ * @param out Room for STRESS_MAX_LINE bytes
+ * @return The length of the line, without a newline
+ */
+static size_t make_line(uint64_t *state, char *out) {
+    char word[64 + 4];
+    size_t n = 0;
+    uint64_t r = next_random(state);
+    int shape = r % 100;
+    if (shape < 4) { // blank, or whitespace only
+        n = (size_t)snprintf(out, STRESS_MAX_LINE, "%.*s", (int)((r >> 8) % 4), " \t  ");
+    } else if (shape < 8) {
+        n = (size_t)snprintf(out, STRESS_MAX_LINE, "# comment %lu", (unsigned long)(r >> 16));
+    } else if (shape < 10) {
+        n = (size_t)snprintf(out, STRESS_MAX_LINE, "cd .");
+    } else if (shape < 16) { // unset keeps the environment from filling up
+        n = (size_t)snprintf(out, STRESS_MAX_LINE, "unset");
+        for (int i = 1 + (r >> 8) % 8; i > 0; i--) {
+            n += (size_t)snprintf(out + n, STRESS_MAX_LINE - n, " V%lu", (unsigned long)(next_random(state) % STRESS_VARS));
+        }
+    } else {
+        // Assignments, a few of them exported or ended with an operator,
+        // where the common ones are short and one in a hundred is long.
+        bool exported = shape < 26;
+        size_t words = shape < 99 ? 1 + (r >> 8) % 8 : 16 + (r >> 8) % 240;
+        size_t longest = shape < 99 ? 24 : 64;
+        if ((r >> 40) % 4 == 0) { // leading whitespace for trim_white
+            out[n++] = ' ';
+            out[n++] = '\t';
+        }
+        if (exported) {
+            n += (size_t)snprintf(out + n, STRESS_MAX_LINE - n, "export ");
+        }
+        for (size_t i = 0; i < words && n + 16 + longest + 4 < STRESS_MAX_LINE; i++) {
+            n += (size_t)snprintf(out + n, STRESS_MAX_LINE - n, "%sV%lu=", i ? " " : "",
+                                  (unsigned long)(next_random(state) % STRESS_VARS));
+            size_t length = make_word(state, word, longest);
+            memcpy(out + n, word, length);
+            n += length;
+        }
+        if ((r >> 48) % 8 == 0) {
+            n += (size_t)snprintf(out + n, STRESS_MAX_LINE - n, "; V0=x  ");
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Generate the whole input into the script file. A third of the
+ * lines repeat one of the last STRESS_RECENT new lines.
+ *
+ * @param input The input, with the path of the file
+ * @param lines How many lines
+ * @return 0 on success, -1 if the file could not be written
+ */
+static int generate(struct stress_input *input, long lines) {
+    static char recent[STRESS_RECENT][STRESS_MAX_LINE];
+    static size_t recent_length[STRESS_RECENT];
+    FILE *out = fopen(input->path, "w");
+    if (!out) {
+        perror(input->path);
+        return -1;
+    }
+    size_t nrecent = 0;
+    uint64_t state = 0x2545f4914f6cdd1dULL;
+    for (long i = 0; i < lines; i++) {
+        uint64_t r = next_random(&state);
+        size_t slot;
+        if (nrecent > 0 && r % 3 == 0) {
+            slot = (r >> 8) % nrecent;
+        } else {
+            slot = nrecent < STRESS_RECENT ? nrecent++ : (r >> 8) % STRESS_RECENT;
+            recent_length[slot] = make_line(&state, recent[slot]);
+        }
+        fwrite(recent[slot], 1, recent_length[slot], out);
+        putc('\n', out);
+    }
+    input->size = ftell(out);
+    input->lines = lines;
+    if (fclose(out) != 0 || input->size < 0) {
+        perror(input->path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Load a baseline written by --save. A missing file is not an error,
+ * there is just nothing to compare with.
+ *
+ * @param path The baseline file
+ */
+static void load_baseline(const char *path) {
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        return;
+    }
+    char line[256];
+    while (nbaseline < STRESS_MODES && fgets(line, sizeof(line), in)) {
+        struct stress_result *entry = &baseline[nbaseline];
+        if (line[0] != '#' && sscanf(line, "%63s %lf %ld", entry->name, &entry->lines_per_sec, &entry->peak_rss_kb) == 3) {
+            nbaseline++;
+        }
+    }
+    fclose(in);
+}
+
+/**
+ * @brief Write the results of this run as the new baseline.
+ *
+ * @param path The baseline file
+ * @return 0 on success, 1 if the file could not be written
+ */
+static int save_baseline(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        perror(path);
+        return 1;
+    }
+    fprintf(out, "# name lines/s peak-rss-kB, written by make stress-baseline\n");
+    for (size_t i = 0; i < nresults; i++) {
+        fprintf(out, "%s %.0f %ld\n", results[i].name, results[i].lines_per_sec, results[i].peak_rss_kb);
+    }
+    fclose(out);
+    return 0;
+}
+
+/**
+ * @brief Helper function to copy the script file into the pipe to the
+ * shell. The file is read only after the shell is launched: posix_spawn
+ * shares the memory of the harness until the exec, and its peak RSS would
+ * otherwise be counted as the shell's.
+ *
+ * @param path The script file
+ * @param fd The write end of the pipe, closed
+ */
+static void feed_pipe(const char *path, int fd) {
+    static char buffer[1 << 16];
+    int in = open(path, O_RDONLY);
+    if (in < 0) {
+        perror(path);
+        close(fd);
+        return;
+    }
+    ssize_t n;
+    while ((n = read(in, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t at = 0; at < n;) {
+            ssize_t written = write(fd, buffer + at, (size_t)(n - at));
+            if (written < 0 && errno != EINTR) {
+                perror("stress-lab: write");
+                close(in);
+                close(fd);
+                return;
+            }
+            at += written > 0 ? written : 0;
+        }
+    }
+    close(in);
+    close(fd);
+}
+
+/**
+ * @brief Run the shell once on the input and wait for it.
+ *
+ * @param shell The shell to run
+ * @param input The input
+ * @param pipe_input False to pass the script file to the shell, true to
+ * write it to the shell's stdin through a pipe
+ * @param usage Receives the resource usage of the shell
+ * @return The wall time in nanoseconds, or -1 if the shell failed
+ */
+static long long run_once(const char *shell, const struct stress_input *input, bool pipe_input, struct rusage *usage) {
+    int fds[2] = {-1, -1};
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    if (!pipe_input) {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    } else if (pipe(fds) == 0) {
+        posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&actions, fds[0]);
+        posix_spawn_file_actions_addclose(&actions, fds[1]);
+    } else {
+        perror("stress-lab: pipe");
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+    char *argv[] = {(char *)shell, pipe_input ? NULL : (char *)input->path, NULL};
+    long long start = now_ns();
+    pid_t pid;
+    int err = posix_spawn(&pid, shell, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (pipe_input) {
+        close(fds[0]);
+    }
+    if (err != 0) {
+        fprintf(stderr, "stress-lab: %s: %s\n", shell, strerror(err));
+        if (pipe_input) {
+            close(fds[1]);
+        }
+        return -1;
+    }
+    if (pipe_input) {
+        feed_pipe(input->path, fds[1]);
+    }
+    int status;
+    while (wait4(pid, &status, 0, usage) < 0) {
+        if (errno != EINTR) {
+            perror("stress-lab: wait4");
+            return -1;
+        }
+    }
+    long long elapsed = now_ns() - start;
+    if (WIFSIGNALED(status)) {
+        fprintf(stderr, "stress-lab: %s killed by signal %d\n", shell, WTERMSIG(status));
+        return -1;
+    }
+    return elapsed;
+}
+
+/**
+ * @brief Run one mode STRESS_REPS times, print the best throughput and
+ * the peak RSS and compare them with the baseline.
+ *
+ * @param name Name of the mode, without spaces
+ * @param shell The shell to run
+ * @param input The input
+ * @param pipe_input True to send the input through a pipe
+ * @return True if the mode regressed or the shell failed
+ */
+static bool stress_run(const char *name, const char *shell, const struct stress_input *input, bool pipe_input) {
+    struct stress_result *result = &results[nresults++];
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    for (int r = 0; r < STRESS_REPS; r++) {
+        struct rusage usage;
+        long long elapsed = run_once(shell, input, pipe_input, &usage);
+        if (elapsed <= 0) {
+            return true;
+        }
+        double lines_per_sec = (double)input->lines * 1e9 / (double)elapsed;
+        if (lines_per_sec > result->lines_per_sec) {
+            result->lines_per_sec = lines_per_sec;
+        }
+        if (r == 0 || usage.ru_maxrss < result->peak_rss_kb) {
+            result->peak_rss_kb = usage.ru_maxrss;
+        }
+    }
+
+    bool regressed = false;
+    printf("%-16s %14.0f %12ld", name, result->lines_per_sec, result->peak_rss_kb);
+    for (size_t i = 0; i < nbaseline; i++) {
+        if (strcmp(baseline[i].name, name) == 0 && baseline[i].lines_per_sec > 0 && baseline[i].peak_rss_kb > 0) {
+            double slower = (baseline[i].lines_per_sec - result->lines_per_sec) * 100.0 / baseline[i].lines_per_sec;
+            double growth = (double)(result->peak_rss_kb - baseline[i].peak_rss_kb) * 100.0 / (double)baseline[i].peak_rss_kb;
+            printf(" %+9.1f%% %+9.1f%%", -slower, growth);
+            if (slower > STRESS_SLOWER) {
+                printf("  slower");
+                regressed = true;
+            }
+            if (growth > STRESS_RSS_GROWTH) {
+                printf("  larger");
+                regressed = true;
+            }
+            break;
+        }
+    }
+    printf("\n");
+    return regressed;
+}
+
+int main(int argc, char **argv) {
+    bool save = argc > 1 && strcmp(argv[1], "--save") == 0;
+    const char *baseline_path = argc > 1 + save ? argv[1 + save] : NULL;
+    const char *shell = getenv("STRESS_SHELL");
+    if (!shell) {
+        fprintf(stderr, "stress-lab: usage: STRESS_SHELL=shell stress-lab [--save] [baseline]\n");
+        return 2;
+    }
+    if (baseline_path && !save) {
+        load_baseline(baseline_path);
+    }
+    long lines = getenv("STRESS_LINES") ? atol(getenv("STRESS_LINES")) : STRESS_LINES;
+    signal(SIGPIPE, SIG_IGN); // a shell that dies early shows up in its status
+
+    char script[] = "/tmp/stress-lab-XXXXXX";
+    int fd = mkstemp(script);
+    if (fd < 0) {
+        perror("stress-lab: mkstemp");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    struct stress_input input = {script, 0, 0};
+    if (generate(&input, lines > 0 ? lines : STRESS_LINES) != 0) {
+        unlink(script);
+        return EXIT_FAILURE;
+    }
+
+    printf("%ld lines, %lld bytes\n", input.lines, input.size);
+    printf("%-16s %14s %12s %10s %10s\n", "mode", "lines/s", "peak-rss-kB", "lines/s", "rss");
+    bool regressed = stress_run("batch/file", shell, &input, false);
+    regressed |= stress_run("batch/pipe", shell, &input, true);
+    unlink(script);
+
+    if (regressed) { // without a baseline only a failed run lands here
+        fprintf(stderr, "stress-lab: regressed against %s\n", baseline_path ? baseline_path : "nothing");
+        return 1;
+    }
+    return save && baseline_path ? save_baseline(baseline_path) : 0;
+}
@@ -1,4 +1,12 @@
 #include <string.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <signal.h>
 #include "harness/unity.h"
 #include "../src/lab.h"
 
@@ -11,6 +19,19 @@ void tearDown(void) {
     unsetenv("MY_PROMPT");
 }
 
+// Free whatever a test's shell set up, the parts it never used are left zeroed.
+static void shell_teardown(struct shell *sh)
+{
+     prompt_destroy(&sh->prompt);
+     dirs_destroy(&sh->dirs);
+     parse_ctx_destroy(&sh->parse);
+     path_cache_destroy(&sh->path_cache);
+     env_destroy(&sh->env);
+     line_cache_destroy(&sh->line_cache);
+     jobs_destroy(&sh->jobs);
+     limits_destroy(sh);
+}
+
 
 void test_cmd_parse2(void)
 {
@@ -35,6 +56,8 @@ void test_cmd_parse2(void)
      free(expected[0]);
      free(expected[1]);
      free(expected);
+     free(stng);
+     cmd_free(actual);
 }
 
 void test_cmd_parse(void)
@@ -49,6 +72,46 @@ void test_cmd_parse(void)
      cmd_free(rval);
 }
 
+void test_cmd_parse_mixed_separators(void)
+{
+     char **rval = cmd_parse(" \tgrep  -n\t\tfoo bar.c ");
+     TEST_ASSERT_TRUE(rval);
+     TEST_ASSERT_EQUAL_STRING("grep", rval[0]);
+     TEST_ASSERT_EQUAL_STRING("-n", rval[1]);
+     TEST_ASSERT_EQUAL_STRING("foo", rval[2]);
+     TEST_ASSERT_EQUAL_STRING("bar.c", rval[3]);
+     TEST_ASSERT_FALSE(rval[4]);
+     // The strings are packed in the same block right after the array.
+     TEST_ASSERT_EQUAL_PTR((char *)(rval + 5), rval[0]);
+     cmd_free(rval);
+}
+
+void test_cmd_parse_empty(void)
+{
+     char **rval = cmd_parse("   ");
+     TEST_ASSERT_TRUE(rval);
+     TEST_ASSERT_FALSE(rval[0]);
+     cmd_free(rval);
+}
+
+void test_cmd_parse_into_reuses_buffers(void)
+{
+     struct parse_ctx ctx;
+     parse_ctx_init(&ctx);
+     char **first = cmd_parse_into(&ctx, "make -j8 all check bench");
+     TEST_ASSERT_TRUE(first);
+     TEST_ASSERT_EQUAL_STRING("bench", first[4]);
+     char *store = ctx.store;
+     char **second = cmd_parse_into(&ctx, "ls -a");
+     // A shorter line fits in the buffers that are already there.
+     TEST_ASSERT_EQUAL_PTR(first, second);
+     TEST_ASSERT_EQUAL_PTR(store, ctx.store);
+     TEST_ASSERT_EQUAL_STRING("ls", second[0]);
+     TEST_ASSERT_EQUAL_STRING("-a", second[1]);
+     TEST_ASSERT_FALSE(second[2]);
+     parse_ctx_destroy(&ctx);
+}
+
 void test_trim_white_no_whitespace(void)
 {
      char *line = (char*) calloc(10, sizeof(char));
@@ -159,10 +222,1036 @@ void test_ch_dir_root(void)
      cmd_free(cmd);
 }
 
+static void check_spawn_status(enum spawn_engine engine)
+{
+     struct shell sh = {0};
+     sh.jobs.sigchld_fd = -1; // no job table, shell_teardown must not close stdin
+     sh.spawn_engine = engine;
+     char *argv[] = {"sh", "-c", "exit 3", NULL};
+     struct spawn_spec spec = {argv, 0, -1, -1, false, NULL, 0, NULL};
+     pid_t pid = sh_spawn(&sh, &spec);
+     TEST_ASSERT_TRUE(pid > 0);
+     int status;
+     TEST_ASSERT_EQUAL_INT(pid, waitpid(pid, &status, 0));
+     TEST_ASSERT_TRUE(WIFEXITED(status));
+     TEST_ASSERT_EQUAL_INT(3, WEXITSTATUS(status));
+     shell_teardown(&sh);
+}
+
+void test_sh_spawn_posix(void)
+{
+     check_spawn_status(SPAWN_POSIX);
+}
+
+void test_sh_spawn_fork(void)
+{
+     check_spawn_status(SPAWN_FORK);
+}
+
+void test_sh_spawn_missing_command(void)
+{
+     struct shell sh = {0};
+     sh.jobs.sigchld_fd = -1; // no job table, shell_teardown must not close stdin
+     char *argv[] = {"no-such-command-lab", NULL};
+     struct spawn_spec spec = {argv, 0, -1, -1, false, NULL, 0, NULL};
+     TEST_ASSERT_EQUAL_INT(-1, sh_spawn(&sh, &spec));
+     TEST_ASSERT_EQUAL_INT(ENOENT, errno);
+     shell_teardown(&sh);
+}
+
+void test_path_cache_lookup(void)
+{
+     struct path_cache cache;
+     path_cache_init(&cache);
+     const char *first = path_cache_lookup(&cache, "sh");
+     TEST_ASSERT_TRUE(first);
+     TEST_ASSERT_EQUAL_CHAR('/', first[0]);
+     // The second lookup is served from the table.
+     TEST_ASSERT_EQUAL_PTR(first, path_cache_lookup(&cache, "sh"));
+     TEST_ASSERT_EQUAL_UINT(1, cache.count);
+     TEST_ASSERT_EQUAL_STRING("./foo", path_cache_lookup(&cache, "./foo"));
+     TEST_ASSERT_NULL(path_cache_lookup(&cache, "no-such-command-lab"));
+     path_cache_clear(&cache);
+     TEST_ASSERT_EQUAL_UINT(0, cache.count);
+     path_cache_destroy(&cache);
+}
+
+void test_path_cache_path_change(void)
+{
+     struct path_cache cache;
+     path_cache_init(&cache);
+     char *saved = strdup(getenv("PATH"));
+     TEST_ASSERT_TRUE(path_cache_lookup(&cache, "sh"));
+     // A different PATH drops what was resolved against the old one.
+     setenv("PATH", "/nonexistent-lab-dir", 1);
+     TEST_ASSERT_NULL(path_cache_lookup(&cache, "sh"));
+     TEST_ASSERT_EQUAL_UINT(0, cache.count);
+     setenv("PATH", saved, 1);
+     // A fixed PATH is kept whatever the environment says, the way the read-ahead thread resolves.
+     path_cache_set_path(&cache, "/nonexistent-lab-dir");
+     TEST_ASSERT_NULL(path_cache_lookup(&cache, "sh"));
+     path_cache_set_path(&cache, saved);
+     const char *found = path_cache_lookup(&cache, "sh");
+     TEST_ASSERT_TRUE(found);
+     // What one cache found can be handed to another, which keeps what it has.
+     struct path_cache seeded;
+     path_cache_init(&seeded);
+     path_cache_seed(&seeded, "sh", found);
+     path_cache_seed(&seeded, "sh", "/elsewhere/sh");
+     TEST_ASSERT_EQUAL_UINT(1, seeded.count);
+     TEST_ASSERT_EQUAL_STRING(found, path_cache_lookup(&seeded, "sh"));
+     path_cache_destroy(&seeded);
+     free(saved);
+     path_cache_destroy(&cache);
+}
+
+static int spawn_and_wait(struct shell *sh, char **argv)
+{
+     struct spawn_spec spec = {argv, 0, -1, -1, false, NULL, 0, NULL};
+     pid_t pid = sh_spawn(sh, &spec);
+     int status = -1;
+     if (pid > 0) {
+          TEST_ASSERT_EQUAL_INT(pid, waitpid(pid, &status, 0));
+     }
+     return pid > 0 && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+void test_path_cache_stale_entry(void)
+{
+     char dir[] = "/tmp/test-lab-XXXXXX", path[128], line[256];
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     for (int engine = SPAWN_POSIX; engine <= SPAWN_FORK; engine++) {
+          // foo is in both directories of PATH, the first one is cached.
+          for (int i = 1; i <= 2; i++) {
+               snprintf(line, sizeof(line), "mkdir -p %s/p%d && printf '#!/bin/sh\\nexit %d\\n' > %s/p%d/foo && chmod +x %s/p%d/foo",
+                        dir, i, i, dir, i, dir, i);
+               TEST_ASSERT_EQUAL_INT(0, system(line));
+          }
+          struct shell sh = {0};
+          sh.jobs.sigchld_fd = -1;
+          sh.spawn_engine = engine;
+          snprintf(path, sizeof(path), "%s/p1:%s/p2", dir, dir);
+          path_cache_set_path(&sh.path_cache, path);
+          char *argv[] = {"foo", NULL};
+          TEST_ASSERT_EQUAL_INT(1, spawn_and_wait(&sh, argv));
+          // Once it is gone exec fails, whatever the engine the entry is dropped and the other one runs.
+          snprintf(path, sizeof(path), "%s/p1/foo", dir);
+          TEST_ASSERT_EQUAL_INT(0, unlink(path));
+          TEST_ASSERT_EQUAL_INT(2, spawn_and_wait(&sh, argv));
+          TEST_ASSERT_EQUAL_INT(2, spawn_and_wait(&sh, argv));
+          shell_teardown(&sh);
+     }
+     snprintf(line, sizeof(line), "rm -r %s", dir);
+     TEST_ASSERT_EQUAL_INT(0, system(line));
+}
+
+void test_builtin_find(void)
+{
+     const char *names[] = {"cd", "exit", "hash", "help", "history"};
+     for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+          const struct builtin *builtin = builtin_find(names[i]);
+          TEST_ASSERT_NOT_NULL(builtin);
+          TEST_ASSERT_EQUAL_STRING(names[i], builtin->name);
+     }
+     TEST_ASSERT_NULL(builtin_find("ls"));
+     TEST_ASSERT_NULL(builtin_find("c"));
+     TEST_ASSERT_NULL(builtin_find("hist"));
+     TEST_ASSERT_NULL(builtin_find("historyx"));
+     TEST_ASSERT_NULL(builtin_find(""));
+}
+
+void test_cmd_parse_operator_without_spaces(void)
+{
+     char **rval = cmd_parse("ls -a|wc -l");
+     TEST_ASSERT_TRUE(rval);
+     TEST_ASSERT_EQUAL_STRING("ls", rval[0]);
+     TEST_ASSERT_EQUAL_STRING("-a", rval[1]);
+     TEST_ASSERT_EQUAL_STRING("|", rval[2]);
+     TEST_ASSERT_EQUAL_STRING("wc", rval[3]);
+     TEST_ASSERT_EQUAL_STRING("-l", rval[4]);
+     TEST_ASSERT_FALSE(rval[5]);
+     cmd_free(rval);
+}
+
+void test_cmd_lex_quotes(void)
+{
+     struct parse_ctx ctx;
+     parse_ctx_init(&ctx);
+     char **argv = cmd_parse_into(&ctx, "echo \"a b\" 'c|d' e\\ f \"x\\\"y\\n\" 'it''s' ''");
+     TEST_ASSERT_TRUE(argv);
+     TEST_ASSERT_EQUAL_size_t(7, ctx.count);
+     TEST_ASSERT_EQUAL_STRING("echo", argv[0]);
+     TEST_ASSERT_EQUAL_STRING("a b", argv[1]);
+     TEST_ASSERT_EQUAL_STRING("c|d", argv[2]);
+     TEST_ASSERT_EQUAL_STRING("e f", argv[3]);
+     TEST_ASSERT_EQUAL_STRING("x\"y\\n", argv[4]);
+     TEST_ASSERT_EQUAL_STRING("its", argv[5]);
+     TEST_ASSERT_EQUAL_STRING("", argv[6]);
+     for (size_t i = 0; i < ctx.count; i++) {
+          TEST_ASSERT_EQUAL_INT(TOK_WORD, ctx.kinds[i]);
+     }
+     TEST_ASSERT_NULL(cmd_parse_into(&ctx, "echo 'unterminated"));
+     TEST_ASSERT_NULL(cmd_parse_into(&ctx, "echo \"unterminated"));
+     parse_ctx_destroy(&ctx);
+     // An unterminated quote is a syntax error like any other, with status 2.
+     struct shell sh = {0};
+     parse_ctx_init(&sh.parse);
+     jobs_init(&sh.jobs);
+     TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, "echo 'unterminated"));
+     TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, "echo \"unterminated"));
+     shell_teardown(&sh);
+}
+
+void test_cmd_lex_operators(void)
+{
+     struct parse_ctx ctx;
+     parse_ctx_init(&ctx);
+     char line[] = "a;b&c>>f 2>&1 <in|d 12x>g";
+     const char *text[] = {"a", ";", "b", "&", "c", ">>", "f", "2", ">&", "1", "<", "in", "|", "d", "12x", ">", "g"};
+     enum token_kind kinds[] = {TOK_WORD, TOK_SEMI, TOK_WORD, TOK_BACKGROUND, TOK_WORD, TOK_APPEND, TOK_WORD,
+                                TOK_IO_NUMBER, TOK_GREAT_AND, TOK_WORD, TOK_LESS, TOK_WORD, TOK_PIPE, TOK_WORD,
+                                TOK_WORD, TOK_GREAT, TOK_WORD};
+     // The same tokens whether they are copied to the context or split in place.
+     for (int inplace = 0; inplace < 2; inplace++) {
+          char **argv = inplace ? cmd_parse_inplace(&ctx, line) : cmd_parse_into(&ctx, line);
+          TEST_ASSERT_TRUE(argv);
+          TEST_ASSERT_EQUAL_size_t(17, ctx.count);
+          for (size_t i = 0; i < ctx.count; i++) {
+               TEST_ASSERT_EQUAL_STRING(text[i], argv[i]);
+               TEST_ASSERT_EQUAL_INT(kinds[i], ctx.kinds[i]);
+          }
+          TEST_ASSERT_NULL(argv[17]);
+     }
+     parse_ctx_destroy(&ctx);
+}
+
+void test_cmd_lex_long_words(void)
+{
+     struct parse_ctx ctx;
+     parse_ctx_init(&ctx);
+     // Words longer than a 16 byte block, with the special bytes at every offset.
+     char line[128];
+     char expected[64];
+     for (int offset = 0; offset < 40; offset++) {
+          memset(expected, 'x', 48);
+          expected[48] = '\0';
+          snprintf(line, sizeof(line), "%.*s'q'%s|%s", offset, expected, expected + offset, expected);
+          expected[offset] = 'q';
+          memset(expected + offset + 1, 'x', 48 - offset);
+          expected[49] = '\0';
+          char **argv = cmd_parse_inplace(&ctx, line);
+          TEST_ASSERT_TRUE(argv);
+          TEST_ASSERT_EQUAL_size_t(3, ctx.count);
+          TEST_ASSERT_EQUAL_STRING(expected, argv[0]);
+          TEST_ASSERT_EQUAL_INT(TOK_PIPE, ctx.kinds[1]);
+          TEST_ASSERT_EQUAL_size_t(48, strlen(argv[2]));
+     }
+     parse_ctx_destroy(&ctx);
+}
+
+void test_sh_run_line_list(void)
+{
+     struct shell sh = {0};
+     parse_ctx_init(&sh.parse);
+     jobs_init(&sh.jobs);
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, "true; false"));
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "false;true;"));
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, "true | false ; true | false"));
+     // Nothing runs once the line has a syntax error.
+     TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, "true ;; true"));
+     TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, "true | ; true"));
+     TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, "; true"));
+     shell_teardown(&sh);
+}
+
+/**
+ * @brief Helper function to read a small file into a buffer.
+ */
+static const char *read_file(const char *path, char *buffer, size_t size)
+{
+     FILE *in = fopen(path, "r");
+     size_t length = in ? fread(buffer, 1, size - 1, in) : 0;
+     if (in) {
+          fclose(in);
+     }
+     buffer[length] = '\0';
+     return buffer;
+}
+
+void test_redirections(void)
+{
+     char dir[] = "/tmp/test-lab-XXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     char out[64], copy[64], err[64], line[256], text[256];
+     snprintf(out, sizeof(out), "%s/out", dir);
+     snprintf(copy, sizeof(copy), "%s/copy", dir);
+     snprintf(err, sizeof(err), "%s/err", dir);
+     struct stat before, after;
+     fstat(STDOUT_FILENO, &before);
+     for (int engine = SPAWN_POSIX; engine <= SPAWN_FORK; engine++) {
+          struct shell sh = {0};
+          sh.spawn_engine = engine;
+          parse_ctx_init(&sh.parse);
+          jobs_init(&sh.jobs);
+          snprintf(line, sizeof(line), "echo one > %s; echo two >>%s", out, out);
+          TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+          TEST_ASSERT_EQUAL_STRING("one\ntwo\n", read_file(out, text, sizeof(text)));
+          snprintf(line, sizeof(line), "tr a-z A-Z <%s | cat >%s", out, copy);
+          TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+          TEST_ASSERT_EQUAL_STRING("ONE\nTWO\n", read_file(copy, text, sizeof(text)));
+          snprintf(line, sizeof(line), "ls /nonexistent 2>&1 >/dev/null | wc -l > %s", out);
+          TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+          TEST_ASSERT_EQUAL_STRING("1\n", read_file(out, text, sizeof(text)));
+          // A file that can't be opened fails the command with status 1.
+          snprintf(line, sizeof(line), "cat < %s/missing 2>%s", dir, err);
+          TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, line));
+          // Builtins are redirected in the shell and its descriptors put back.
+          snprintf(line, sizeof(line), "help > %s", out);
+          TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+          TEST_ASSERT_TRUE(strlen(read_file(out, text, sizeof(text))) > 0);
+          snprintf(line, sizeof(line), "> %s", out);
+          TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+          TEST_ASSERT_EQUAL_STRING("", read_file(out, text, sizeof(text)));
+          TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, "echo >"));
+          TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, "echo >&x"));
+          shell_teardown(&sh);
+     }
+     fstat(STDOUT_FILENO, &after);
+     TEST_ASSERT_TRUE(before.st_ino == after.st_ino && before.st_dev == after.st_dev);
+     unlink(out);
+     unlink(copy);
+     unlink(err);
+     rmdir(dir);
+}
+
+void test_copy_builtins(void)
+{
+     char dir[] = "/tmp/test-lab-XXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     char line[512], text[256], path[128];
+     struct shell sh = {0};
+     parse_ctx_init(&sh.parse);
+     jobs_init(&sh.jobs);
+     TEST_ASSERT_NULL(builtin_find("cat")); // optional, off until enabled
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "enable cat cp"));
+     TEST_ASSERT_NOT_NULL(builtin_find("cat"));
+     snprintf(line, sizeof(line), "echo abc > %s/a; cat %s/a %s/a > %s/b", dir, dir, dir, dir);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     snprintf(path, sizeof(path), "%s/b", dir);
+     TEST_ASSERT_EQUAL_STRING("abc\nabc\n", read_file(path, text, sizeof(text)));
+     // Through pipes, where the builtin runs in a child and splices.
+     snprintf(line, sizeof(line), "cat < %s/b | cat | cat >> %s/b", dir, dir);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     TEST_ASSERT_EQUAL_STRING("abc\nabc\nabc\nabc\n", read_file(path, text, sizeof(text)));
+     snprintf(line, sizeof(line), "mkdir %s/d; cp %s/a %s/b %s/d; cp %s/a %s/c", dir, dir, dir, dir, dir, dir);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     snprintf(path, sizeof(path), "%s/d/b", dir);
+     TEST_ASSERT_EQUAL_STRING("abc\nabc\nabc\nabc\n", read_file(path, text, sizeof(text)));
+     snprintf(path, sizeof(path), "%s/c", dir);
+     TEST_ASSERT_EQUAL_STRING("abc\n", read_file(path, text, sizeof(text)));
+     snprintf(line, sizeof(line), "cat %s/missing 2> /dev/null", dir);
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, line));
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "enable -n cat cp"));
+     TEST_ASSERT_NULL(builtin_find("cat"));
+     snprintf(line, sizeof(line), "rm -r %s", dir);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     shell_teardown(&sh);
+}
+
+void test_server(void)
+{
+     char path[] = "/tmp/test-lab-server-XXXXXX";
+     int tmp = mkstemp(path);
+     TEST_ASSERT_TRUE(tmp >= 0);
+     close(tmp);
+     unlink(path);
+     mode_t umask_was = umask(0002);
+     int listen_fd = server_listen(path);
+     umask(umask_was);
+     TEST_ASSERT_TRUE(listen_fd >= 0);
+     struct stat socket_info;
+     TEST_ASSERT_EQUAL_INT(0, stat(path, &socket_info));
+     TEST_ASSERT_EQUAL_INT(0600, socket_info.st_mode & 0777); // whatever the umask
+     pid_t server = fork();
+     if (server == 0) {
+          struct shell sh = {0};
+          parse_ctx_init(&sh.parse);
+          jobs_init(&sh.jobs);
+          _exit(sh_serve(&sh, listen_fd));
+     }
+     close(listen_fd);
+     // Everything is gathered before the checks so a failure does not leave the server running.
+     int slow = server_connect(path);
+     int fast = server_connect(path);
+     const char *line = "sleep 0.5; exit 3";
+     ssize_t sent = send(slow, line, strlen(line), 0);
+     int out[2];
+     TEST_ASSERT_EQUAL_INT(0, pipe(out));
+     int fds[] = {STDIN_FILENO, out[1]};
+     int fast_status = server_request(fast, "echo fast | tr a-z A-Z", fds, 2);
+     char reply[16] = {0};
+     ssize_t early = recv(slow, reply, sizeof(reply) - 1, MSG_DONTWAIT);
+     ssize_t late = recv(slow, reply, sizeof(reply) - 1, 0);
+     // A request runs in a copy of the server, its cd does not carry over.
+     int cd_status = server_request(slow, "cd /", NULL, 0);
+     int pwd_status = server_request(slow, "pwd", fds, 2);
+     int bad_status = server_request(slow, "ls |", NULL, 0);
+     // Another user is turned away even when the socket's mode would let them in.
+     int stranger_status = 0;
+     if (geteuid() == 0) {
+          chmod(path, 0666);
+          pid_t stranger = fork();
+          if (stranger == 0) {
+               int peer = setuid(65534) == 0 ? server_connect(path) : -1;
+               _exit(peer >= 0 && server_request(peer, "true", NULL, 0) == -1 ? 0 : 1);
+          }
+          waitpid(stranger, &stranger_status, 0);
+     }
+     close(out[1]);
+     char text[4096] = {0};
+     ssize_t length = read(out[0], text, sizeof(text) - 1);
+     close(out[0]);
+     close(slow);
+     close(fast);
+     kill(server, SIGTERM);
+     int wstatus;
+     TEST_ASSERT_EQUAL_INT(server, waitpid(server, &wstatus, 0));
+     TEST_ASSERT_EQUAL_INT((int)strlen(line), sent);
+     TEST_ASSERT_EQUAL_INT(0, fast_status);
+     TEST_ASSERT_EQUAL_INT(-1, early); // still sleeping when the fast one replied
+     TEST_ASSERT_EQUAL_INT(1, late);
+     TEST_ASSERT_EQUAL_STRING("3", reply);
+     TEST_ASSERT_EQUAL_INT(0, cd_status);
+     TEST_ASSERT_EQUAL_INT(0, pwd_status);
+     TEST_ASSERT_EQUAL_INT(2, bad_status);
+     TEST_ASSERT_EQUAL_INT(0, stranger_status);
+     char cwd[4096];
+     TEST_ASSERT_NOT_NULL(getcwd(cwd, sizeof(cwd)));
+     strcat(cwd, "\n");
+     TEST_ASSERT_TRUE(length > 0);
+     TEST_ASSERT_EQUAL_STRING_LEN("FAST\n", text, 5);
+     TEST_ASSERT_EQUAL_STRING(cwd, text + 5);
+     TEST_ASSERT_TRUE(WIFEXITED(wstatus));
+     TEST_ASSERT_EQUAL_INT(0, WEXITSTATUS(wstatus));
+     TEST_ASSERT_EQUAL_INT(-1, access(path, F_OK)); // removed on shutdown
+}
+
+static void count_ready(struct event_loop *loop, int fd, uint32_t events, void *data)
+{
+     UNUSED(loop);
+     char byte;
+     if ((events & EPOLLIN) && read(fd, &byte, 1) == 1) {
+          (*(int *)data)++;
+     }
+}
+
+static void count_timer(struct event_loop *loop, int fd, uint32_t events, void *data)
+{
+     UNUSED(loop);
+     UNUSED(fd);
+     UNUSED(events);
+     (*(int *)data) += 100;
+}
+
+void test_event_loop(void)
+{
+     for (int backend = EVENT_EPOLL; backend <= EVENT_URING; backend++) {
+          struct event_loop loop;
+          TEST_ASSERT_EQUAL_INT(0, event_loop_init(&loop, backend));
+          int fds[2];
+          TEST_ASSERT_EQUAL_INT(0, pipe(fds));
+          int count = 0;
+          TEST_ASSERT_EQUAL_INT(0, event_add(&loop, fds[0], EPOLLIN, count_ready, &count));
+          TEST_ASSERT_EQUAL_INT(0, event_wait(&loop, 0));
+          // Level triggered: two bytes are read one round at a time.
+          TEST_ASSERT_EQUAL_INT(2, write(fds[1], "ab", 2));
+          TEST_ASSERT_EQUAL_INT(1, event_wait(&loop, 1000));
+          TEST_ASSERT_EQUAL_INT(1, event_wait(&loop, 1000));
+          TEST_ASSERT_EQUAL_INT(2, count);
+          // A paused watch is not reported until it is resumed.
+          TEST_ASSERT_EQUAL_INT(0, event_modify(&loop, fds[0], 0));
+          TEST_ASSERT_EQUAL_INT(1, write(fds[1], "c", 1));
+          TEST_ASSERT_EQUAL_INT(0, event_wait(&loop, 20));
+          TEST_ASSERT_EQUAL_INT(0, event_modify(&loop, fds[0], EPOLLIN));
+          TEST_ASSERT_EQUAL_INT(1, event_wait(&loop, 1000));
+          TEST_ASSERT_EQUAL_INT(3, count);
+          event_remove(&loop, fds[0]);
+          TEST_ASSERT_EQUAL_INT(1, write(fds[1], "d", 1));
+          TEST_ASSERT_EQUAL_INT(0, event_wait(&loop, 20));
+          int timer = event_timer(&loop, 5000000, count_timer, &count);
+          TEST_ASSERT_TRUE(timer >= 0);
+          TEST_ASSERT_EQUAL_INT(1, event_wait(&loop, 1000));
+          TEST_ASSERT_EQUAL_INT(103, count);
+          event_remove(&loop, timer);
+          close(timer);
+          close(fds[0]);
+          close(fds[1]);
+          event_loop_destroy(&loop);
+     }
+}
+
+void test_prompt_render(void)
+{
+     char cwd[4096], dir[] = "/tmp/test-lab-XXXXXX", line[512];
+     TEST_ASSERT_NOT_NULL(getcwd(cwd, sizeof(cwd)));
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     struct shell sh = {0};
+     parse_ctx_init(&sh.parse);
+     jobs_init(&sh.jobs);
+     setenv("MY_PROMPT", "\\W \\?\\$ \\x\\\\", 1);
+     const char *sigil = geteuid() == 0 ? "#" : "$";
+     char expected[256];
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "cd /tmp"));
+     snprintf(expected, sizeof(expected), "tmp 0%s \\x\\", sigil);
+     const char *prompt = prompt_render(&sh, true);
+     TEST_ASSERT_EQUAL_STRING(expected, prompt);
+     // Nothing changed, the same text comes back without being put together again.
+     TEST_ASSERT_EQUAL_PTR(prompt, prompt_render(&sh, true));
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, "false"));
+     snprintf(expected, sizeof(expected), "tmp 1%s \\x\\", sigil);
+     TEST_ASSERT_EQUAL_STRING(expected, prompt_render(&sh, true));
+     prompt_destroy(&sh.prompt);
+     // The branch comes from the prompt's thread, which says when it found it.
+     snprintf(line, sizeof(line), "mkdir -p %s/.git %s/sub/deeper", dir, dir);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     snprintf(line, sizeof(line), "%s/.git/HEAD", dir);
+     FILE *head = fopen(line, "w");
+     TEST_ASSERT_NOT_NULL(head);
+     fputs("ref: refs/heads/feature\n", head);
+     fclose(head);
+     setenv("MY_PROMPT", "[\\g]", 1);
+     snprintf(line, sizeof(line), "cd %s/sub/deeper", dir);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     prompt_render(&sh, true);
+     TEST_ASSERT_TRUE(sh.prompt.vcs_started);
+     struct pollfd ready = {sh.prompt.vcs_notify, POLLIN, 0};
+     TEST_ASSERT_EQUAL_INT(1, poll(&ready, 1, 5000));
+     TEST_ASSERT_EQUAL_STRING("[feature]", prompt_render(&sh, false));
+     // A forked child, like a builtin stage running exit, has no thread to join.
+     pid_t child = fork();
+     if (child == 0) {
+          prompt_destroy(&sh.prompt);
+          _exit(0);
+     }
+     int wstatus = -1;
+     for (int tries = 0; tries < 500 && waitpid(child, &wstatus, WNOHANG) == 0; tries++) {
+          usleep(10000);
+     }
+     if (wstatus == -1) {
+          kill(child, SIGKILL);
+          waitpid(child, NULL, 0);
+     }
+     TEST_ASSERT_EQUAL_INT(0, wstatus);
+     TEST_ASSERT_EQUAL_INT(0, chdir(cwd));
+     snprintf(line, sizeof(line), "rm -r %s", dir);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     shell_teardown(&sh);
+}
+
+void test_dir_stack(void)
+{
+     char cwd[4096], dir[] = "/tmp/test-lab-XXXXXX", line[512], expected[512];
+     TEST_ASSERT_NOT_NULL(getcwd(cwd, sizeof(cwd)));
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     struct shell sh = {0};
+     parse_ctx_init(&sh.parse);
+     jobs_init(&sh.jobs);
+     snprintf(line, sizeof(line), "mkdir -p %s/a/b", dir);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     snprintf(line, sizeof(line), "%s/link", dir);
+     snprintf(expected, sizeof(expected), "%s/a/b", dir);
+     TEST_ASSERT_EQUAL_INT(0, symlink(expected, line));
+     // The cwd keeps the name it was reached by, ".." goes back up that name.
+     snprintf(line, sizeof(line), "cd %s/./link/", dir);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     snprintf(expected, sizeof(expected), "%s/link", dir);
+     TEST_ASSERT_EQUAL_STRING(expected, sh_cwd(&sh));
+     uint64_t generation = sh.cwd_generation;
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "cd .."));
+     TEST_ASSERT_EQUAL_STRING(dir, sh_cwd(&sh));
+     TEST_ASSERT_EQUAL_UINT64(generation + 1, sh.cwd_generation);
+     char *actual = getcwd(NULL, 0);
+     TEST_ASSERT_EQUAL_STRING(dir, actual);
+     free(actual);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "cd - > /dev/null"));
+     TEST_ASSERT_EQUAL_STRING(expected, sh_cwd(&sh));
+     // pushd saves where the shell was, popd goes back to it.
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "pushd / > /dev/null"));
+     TEST_ASSERT_EQUAL_STRING("/", sh_cwd(&sh));
+     TEST_ASSERT_EQUAL_INT(1, (int)sh.dirs.depth);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "pushd > /dev/null"));
+     TEST_ASSERT_EQUAL_STRING(expected, sh_cwd(&sh));
+     TEST_ASSERT_EQUAL_STRING("/", sh.dirs.stack[0]);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "popd > /dev/null"));
+     TEST_ASSERT_EQUAL_STRING("/", sh_cwd(&sh));
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, "popd"));
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, "cd /nonexistent-test-lab"));
+     TEST_ASSERT_EQUAL_STRING("/", sh_cwd(&sh));
+     // A relative cd finds a through CDPATH, a ./ path does not look there.
+     snprintf(line, sizeof(line), "CDPATH=%s", dir);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "cd a > /dev/null"));
+     snprintf(expected, sizeof(expected), "%s/a", dir);
+     TEST_ASSERT_EQUAL_STRING(expected, sh_cwd(&sh));
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "cd b"));
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, "cd ./a"));
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "unset CDPATH"));
+     snprintf(expected, sizeof(expected), "%s/a/b", dir);
+     TEST_ASSERT_EQUAL_STRING(expected, sh_cwd(&sh));
+     TEST_ASSERT_EQUAL_INT(0, chdir(cwd));
+     snprintf(line, sizeof(line), "rm -r %s", dir);
+     TEST_ASSERT_EQUAL_INT(0, system(line));
+     shell_teardown(&sh);
+}
+
+void test_env_table(void)
+{
+     struct shell sh = {0};
+     parse_ctx_init(&sh.parse);
+     jobs_init(&sh.jobs);
+     setenv("LAB_ENV_TEST", "one", 1);
+     TEST_ASSERT_EQUAL_STRING("one", sh_getenv(&sh, "LAB_ENV_TEST"));
+     char **envp = sh_envp(&sh);
+     TEST_ASSERT_EQUAL_PTR(envp, sh_envp(&sh)); // nothing changed, the same array
+     uint64_t generation = sh.env.generation;
+     // An exported variable stays exported and environ follows the table.
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "LAB_ENV_TEST=two"));
+     TEST_ASSERT_EQUAL_STRING("two", getenv("LAB_ENV_TEST"));
+     TEST_ASSERT_TRUE(sh.env.generation > generation);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "sh -c 'test \"$LAB_ENV_TEST\" = two'"));
+     // A shell variable reaches children only once it is exported.
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "LAB_ENV_LOCAL=x"));
+     TEST_ASSERT_EQUAL_STRING("x", sh_getenv(&sh, "LAB_ENV_LOCAL"));
+     TEST_ASSERT_NULL(getenv("LAB_ENV_LOCAL"));
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, "sh -c 'test -n \"$LAB_ENV_LOCAL\"'"));
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "export LAB_ENV_LOCAL"));
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "sh -c 'test \"$LAB_ENV_LOCAL\" = x'"));
+     // NAME=value before a command is for that command alone.
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "LAB_ENV_TEST=three sh -c 'test \"$LAB_ENV_TEST\" = three'"));
+     TEST_ASSERT_EQUAL_STRING("two", sh_getenv(&sh, "LAB_ENV_TEST"));
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "LAB_ENV_TEMP=1 true | LAB_ENV_TEMP=2 cat"));
+     TEST_ASSERT_NULL(sh_getenv(&sh, "LAB_ENV_TEMP"));
+     TEST_ASSERT_EQUAL_INT(0, (int)sh.env.nsaved);
+     // A PATH for one command is looked up with, then the old one is back.
+     TEST_ASSERT_NOT_EQUAL(0, sh_run_line(&sh, "PATH=/nonexistent-lab-dir sh -c true"));
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "sh -c true"));
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "unset LAB_ENV_TEST LAB_ENV_LOCAL"));
+     TEST_ASSERT_NULL(sh_getenv(&sh, "LAB_ENV_TEST"));
+     TEST_ASSERT_NULL(getenv("LAB_ENV_TEST"));
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, "export 1abc"));
+     // environ holds the table's own pairs, and copies of them once it is gone.
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "export LAB_ENV_KEPT=four"));
+     TEST_ASSERT_EQUAL_PTR(sh_getenv(&sh, "LAB_ENV_KEPT"), getenv("LAB_ENV_KEPT"));
+     shell_teardown(&sh);
+     TEST_ASSERT_EQUAL_STRING("four", getenv("LAB_ENV_KEPT"));
+     unsetenv("LAB_ENV_KEPT");
+}
+
+void test_line_cache(void)
+{
+     struct parse_ctx ctx, fresh;
+     parse_ctx_init(&ctx);
+     parse_ctx_init(&fresh);
+     struct line_cache cache = {0};
+     const char *line = "echo \"a | b\" 2>&1 | tr a b > out";
+     TEST_ASSERT_FALSE(line_cache_lookup(&cache, &ctx, line, false));
+     TEST_ASSERT_NOT_NULL(cmd_parse_into(&ctx, line));
+     line_cache_insert(&cache, &ctx);
+     // A line is kept once it is run a second time.
+     TEST_ASSERT_EQUAL_UINT(0, cache.count);
+     TEST_ASSERT_FALSE(line_cache_lookup(&cache, &ctx, line, false));
+     line_cache_insert(&cache, &ctx);
+     TEST_ASSERT_EQUAL_UINT(1, cache.count);
+     // A hit leaves the context as the lexer would, quoted "|" and all.
+     TEST_ASSERT_TRUE(line_cache_lookup(&cache, &ctx, line, false));
+     TEST_ASSERT_NOT_NULL(cmd_parse_into(&fresh, line));
+     TEST_ASSERT_EQUAL_UINT(fresh.count, ctx.count);
+     for (size_t i = 0; i <= fresh.count; i++) {
+          TEST_ASSERT_EQUAL_INT(fresh.kinds[i], ctx.kinds[i]);
+          if (fresh.argv[i]) {
+               TEST_ASSERT_EQUAL_STRING(fresh.argv[i], ctx.argv[i]);
+          }
+     }
+     TEST_ASSERT_NULL(ctx.argv[ctx.count]);
+     TEST_ASSERT_EQUAL_INT(2, cmd_pipeline(&ctx));
+     TEST_ASSERT_EQUAL_UINT64(1, cache.hits);
+     TEST_ASSERT_EQUAL_UINT64(2, cache.misses);
+     // Lines used since stay, the least recently used one goes.
+     char other[32];
+     for (int i = 0; i < 300; i++) {
+          snprintf(other, sizeof(other), "echo %d", i);
+          for (int run = 0; run < 2; run++) {
+               if (!line_cache_lookup(&cache, &ctx, other, false)) {
+                    cmd_parse_into(&ctx, other);
+                    line_cache_insert(&cache, &ctx);
+               }
+          }
+          TEST_ASSERT_TRUE(line_cache_lookup(&cache, &ctx, line, false));
+     }
+     TEST_ASSERT_EQUAL_UINT(256, cache.count);
+     TEST_ASSERT_TRUE(line_cache_lookup(&cache, &ctx, line, false));
+     TEST_ASSERT_FALSE(line_cache_lookup(&cache, &ctx, "echo 0", false));
+     TEST_ASSERT_TRUE(line_cache_lookup(&cache, &ctx, "echo 299", false));
+     TEST_ASSERT_EQUAL_STRING("299", ctx.argv[1]);
+     line_cache_destroy(&cache);
+     parse_ctx_destroy(&ctx);
+     parse_ctx_destroy(&fresh);
+}
+
+void test_cmd_pipeline(void)
+{
+     struct parse_ctx ctx;
+     parse_ctx_init(&ctx);
+     cmd_parse_into(&ctx, "cat foo | grep -v bar | wc -l");
+     TEST_ASSERT_EQUAL_INT(3, cmd_pipeline(&ctx));
+     TEST_ASSERT_EQUAL_STRING("cat", ctx.stages[0][0]);
+     TEST_ASSERT_EQUAL_STRING("foo", ctx.stages[0][1]);
+     TEST_ASSERT_FALSE(ctx.stages[0][2]);
+     TEST_ASSERT_EQUAL_STRING("grep", ctx.stages[1][0]);
+     TEST_ASSERT_EQUAL_STRING("bar", ctx.stages[1][2]);
+     TEST_ASSERT_FALSE(ctx.stages[1][3]);
+     TEST_ASSERT_EQUAL_STRING("wc", ctx.stages[2][0]);
+     TEST_ASSERT_FALSE(ctx.stages[2][2]);
+     cmd_parse_into(&ctx, "ls |");
+     TEST_ASSERT_EQUAL_INT(-1, cmd_pipeline(&ctx));
+     cmd_parse_into(&ctx, "ls || wc");
+     TEST_ASSERT_EQUAL_INT(-1, cmd_pipeline(&ctx));
+     parse_ctx_destroy(&ctx);
+}
+
+void test_sh_run_line_pipeline_status(void)
+{
+     struct shell sh = {0};
+     parse_ctx_init(&sh.parse);
+     jobs_init(&sh.jobs);
+     // The last stage decides the status of the pipeline.
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "printf a\\nb\\n | grep -q b"));
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, "printf a | grep -q b"));
+     TEST_ASSERT_EQUAL_INT(1, sh.last_status);
+     TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, "| grep b"));
+     TEST_ASSERT_EQUAL_INT(127, sh_run_line(&sh, "true | no-such-command-lab"));
+     shell_teardown(&sh);
+}
+
+void test_cmd_parse_inplace(void)
+{
+     struct parse_ctx ctx;
+     parse_ctx_init(&ctx);
+     char line[] = "ls -a|wc  -l";
+     char **rval = cmd_parse_inplace(&ctx, line);
+     TEST_ASSERT_TRUE(rval);
+     // Words point into the line itself, nothing was copied.
+     TEST_ASSERT_EQUAL_PTR(line, rval[0]);
+     TEST_ASSERT_EQUAL_STRING("ls", rval[0]);
+     TEST_ASSERT_EQUAL_STRING("-a", rval[1]);
+     TEST_ASSERT_EQUAL_STRING("|", rval[2]);
+     TEST_ASSERT_EQUAL_PTR(line + 6, rval[3]);
+     TEST_ASSERT_EQUAL_STRING("wc", rval[3]);
+     TEST_ASSERT_EQUAL_STRING("-l", rval[4]);
+     TEST_ASSERT_FALSE(rval[5]);
+     TEST_ASSERT_NULL(ctx.store);
+     parse_ctx_destroy(&ctx);
+}
+
+void test_sh_run_file_mapped(void)
+{
+     char path[] = "/tmp/test-lab-XXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     // The last line has no newline, it must still run.
+     const char *script = "# setup\ntrue\n\ntrue | false\nfalse";
+     TEST_ASSERT_EQUAL_INT((int)strlen(script), (int)write(fd, script, strlen(script)));
+     close(fd);
+     struct shell sh = {0};
+     parse_ctx_init(&sh.parse);
+     jobs_init(&sh.jobs);
+     TEST_ASSERT_EQUAL_INT(1, sh_run_file(&sh, path));
+     unlink(path);
+     shell_teardown(&sh);
+}
+
+void test_sh_run_file_ahead(void)
+{
+     char cwd[4096];
+     TEST_ASSERT_NOT_NULL(getcwd(cwd, sizeof(cwd)));
+     char path[] = "/tmp/test-lab-XXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     // cd and the assignments are fences, the lines after them must see what they changed.
+     FILE *script = fdopen(fd, "w");
+     TEST_ASSERT_NOT_NULL(script);
+     fputs("cd /tmp\nX=ahead\nexport X\nprintenv X > test-lab-ahead.out\necho 'open\n", script);
+     // More lines than the ring holds, so the reader has to wait for room.
+     for (int i = 0; i < 200; i++) {
+          fputs(i == 100 ? "hash -r\n" : "true | true\n", script);
+     }
+     fputs("test -s test-lab-ahead.out\n", script);
+     fclose(script);
+     struct shell sh = {0};
+     parse_ctx_init(&sh.parse);
+     jobs_init(&sh.jobs);
+     sh.read_ahead = READ_AHEAD_ON; // even with a single CPU
+     TEST_ASSERT_EQUAL_INT(0, sh_run_file(&sh, path));
+     char value[16] = "";
+     FILE *out = fopen("/tmp/test-lab-ahead.out", "r");
+     TEST_ASSERT_NOT_NULL(out);
+     TEST_ASSERT_NOT_NULL(fgets(value, sizeof(value), out));
+     fclose(out);
+     TEST_ASSERT_EQUAL_STRING("ahead\n", value);
+     // Without the reader the script runs the same.
+     sh.read_ahead = READ_AHEAD_OFF;
+     TEST_ASSERT_EQUAL_INT(0, sh_run_file(&sh, path));
+     unlink("/tmp/test-lab-ahead.out");
+     unlink(path);
+     TEST_ASSERT_EQUAL_INT(0, chdir(cwd));
+     shell_teardown(&sh);
+}
+
+void test_sh_run_stream(void)
+{
+     struct shell sh = {0};
+     parse_ctx_init(&sh.parse);
+     jobs_init(&sh.jobs);
+     char script[] = "#!/bin/myprogram\n\n  # comment\nfalse\ntrue | false\n";
+     FILE *in = fmemopen(script, strlen(script), "r");
+     TEST_ASSERT_NOT_NULL(in);
+     TEST_ASSERT_EQUAL_INT(1, sh_run_stream(&sh, in));
+     fclose(in);
+     TEST_ASSERT_EQUAL_INT(127, sh_run_file(&sh, "/nonexistent/script.lab"));
+     shell_teardown(&sh);
+}
+
+void test_background_job(void)
+{
+     struct shell sh = {0};
+     parse_ctx_init(&sh.parse);
+     jobs_init(&sh.jobs);
+     // A background job returns at once and stays in the table until reaped.
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "sleep 0.1 | false &"));
+     TEST_ASSERT_EQUAL_INT(JOB_RUNNING, sh.jobs.jobs[0].state);
+     TEST_ASSERT_EQUAL_STRING("sleep 0.1 | false", sh.jobs.jobs[0].command);
+     // The foreground job gets the next slot and gives it back when it is done.
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "true"));
+     TEST_ASSERT_EQUAL_INT(JOB_FREE, sh.jobs.jobs[1].state);
+     // fg waits for it, the status is the one of its last stage.
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, "fg %1"));
+     TEST_ASSERT_EQUAL_INT(JOB_FREE, sh.jobs.jobs[0].state);
+     TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, "& false"));
+     // "&" also separates the commands of a list.
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, "sleep 0.1 & false"));
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "fg"));
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, "fg")); // no job left
+     shell_teardown(&sh);
+}
+
+void test_parallel_builtin(void)
+{
+     struct shell sh = {0};
+     parse_ctx_init(&sh.parse);
+     jobs_init(&sh.jobs);
+     // Two slots for three commands, the status counts the failures.
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "parallel -j 2 -- true ::: sleep 0.05 ::: true"));
+     TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, "parallel -j 1 false ::: true ::: no-such-command-lab"));
+     TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, "parallel -j 2 true ::: ::: true"));
+     TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, "parallel -j 0 true"));
+     // Every slot went back to the table.
+     for (size_t i = 0; i < sh.jobs.cap; i++) {
+          TEST_ASSERT_EQUAL_INT(JOB_FREE, sh.jobs.jobs[i].state);
+     }
+     shell_teardown(&sh);
+}
+
+void test_job_limits(void)
+{
+     struct shell sh = {0};
+     parse_ctx_init(&sh.parse);
+     jobs_init(&sh.jobs);
+     struct rlimit before, after;
+     TEST_ASSERT_EQUAL_INT(0, getrlimit(RLIMIT_NOFILE, &before));
+     // In front of a command the limits are for its job alone, every stage of it.
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "limit -n 32 sh -c 'test \"$(ulimit -n)\" = 32'"));
+     TEST_ASSERT_FALSE(job_limits_set(&sh.limits));
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "limit -n 24 sh -c 'ulimit -n' | grep -qx 24"));
+     // Without a command they are for every job started afterwards, parallel ones too.
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "limit -t 100 -n 40"));
+     TEST_ASSERT_EQUAL_INT(40, (int)sh.limits.files);
+     TEST_ASSERT_EQUAL_INT(100, (int)sh.limits.cpu_seconds);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "sh -c 'test \"$(ulimit -n)\" = 40 && test \"$(ulimit -t)\" = 100'"));
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "parallel -j 2 -- sh -c 'test \"$(ulimit -n)\" = 40' ::: sh -c 'test \"$(ulimit -t)\" = 100'"));
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "limit -n 0"));
+     TEST_ASSERT_EQUAL_INT(100, (int)sh.limits.cpu_seconds);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "limit -r"));
+     TEST_ASSERT_FALSE(job_limits_set(&sh.limits));
+     // Memory is a cgroup's memory.max when there is one to use, RLIMIT_AS otherwise.
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "limit -m 256M sh -c true"));
+     TEST_ASSERT_TRUE(sh.cgroup.probed);
+     if (!sh.cgroup.memory) {
+          TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "limit -m 256M sh -c 'test \"$(ulimit -v)\" = 262144'"));
+     }
+     // The shell itself is never limited.
+     TEST_ASSERT_EQUAL_INT(0, getrlimit(RLIMIT_NOFILE, &after));
+     TEST_ASSERT_EQUAL_INT64(before.rlim_cur, after.rlim_cur);
+     // A bad option runs nothing.
+     TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, "limit -x"));
+     TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, "limit -m lots true"));
+     TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, "limit -n"));
+     TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, "true | limit -n 3 cat"));
+     if (!sh.cgroup.cpu) {
+          TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, "limit -c 50 true"));
+     }
+     for (size_t i = 0; i < sh.jobs.cap; i++) {
+          TEST_ASSERT_EQUAL_INT(JOB_FREE, sh.jobs.jobs[i].state);
+          TEST_ASSERT_EQUAL_INT(-1, sh.jobs.jobs[i].cgroup_fd);
+     }
+     shell_teardown(&sh);
+}
+
+void test_time_prefix(void)
+{
+     struct shell sh = {0};
+     parse_ctx_init(&sh.parse);
+     jobs_init(&sh.jobs);
+     // time is not part of the command and keeps its status.
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, "time true | false"));
+     TEST_ASSERT_FALSE(sh.timing.active);
+     TEST_ASSERT_TRUE(sh.timing.spawn_ns > 0);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "time cd ."));
+     sh.spawn_engine = SPAWN_FORK;
+     sh.time_all = true;
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, "true"));
+     TEST_ASSERT_TRUE(sh.timing.spawn_ns > 0);
+     shell_teardown(&sh);
+}
+
+void test_stat_histogram(void)
+{
+     struct shell sh = {0};
+     // 98 fast samples and two slow ones, p50 is fast and p99 is slow.
+     for (int i = 0; i < 98; i++) {
+          sh_stat_record(&sh, STAT_PARSE, 1000);
+     }
+     sh_stat_record(&sh, STAT_PARSE, 1000000);
+     sh_stat_record(&sh, STAT_PARSE, 1000000);
+     const struct sh_histogram *hist = &sh.stats[STAT_PARSE];
+     TEST_ASSERT_EQUAL_UINT64(100, hist->count);
+     TEST_ASSERT_EQUAL_UINT64(1000, hist->min);
+     TEST_ASSERT_EQUAL_UINT64(1000000, hist->max);
+     uint64_t p50 = sh_histogram_percentile(hist, 50);
+     uint64_t p99 = sh_histogram_percentile(hist, 99);
+     TEST_ASSERT_TRUE(p50 >= 1000 && p50 < 1250);
+     TEST_ASSERT_TRUE(p99 > 750000 && p99 <= 1000000);
+     TEST_ASSERT_EQUAL_UINT64(0, sh_histogram_percentile(&sh.stats[STAT_WAIT], 50));
+}
+
+void test_history_file(void)
+{
+     char path[] = "/tmp/test-lab-XXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     close(fd);
+     struct history history;
+     history_init(&history, path);
+     history.max_lines = 4;
+     char line[16];
+     for (int i = 0; i < 6; i++) {
+          snprintf(line, sizeof(line), "echo %d", i);
+          history_add(&history, line);
+     }
+     TEST_ASSERT_EQUAL_size_t(6, history.count);
+     TEST_ASSERT_EQUAL_STRING("echo 0", history.lines[0].text);
+     // The sixth line puts the file past its slack, the trim keeps the last four.
+     history_destroy(&history);
+     history_init(&history, path);
+     history_load(&history);
+     TEST_ASSERT_EQUAL_size_t(4, history.count);
+     TEST_ASSERT_EQUAL_STRING("echo 2", history.lines[0].text);
+     TEST_ASSERT_EQUAL_STRING("echo 5", history.lines[3].text);
+     history_add(&history, "echo 6");
+     history_destroy(&history);
+     history_init(&history, path);
+     history_load(&history);
+     TEST_ASSERT_EQUAL_size_t(5, history.count);
+     TEST_ASSERT_EQUAL_STRING("echo 6", history.lines[4].text);
+     history_destroy(&history);
+     // Another shell appending during a trim waits for it and writes to the trimmed file.
+     int locked = open(path, O_RDONLY | O_CLOEXEC);
+     TEST_ASSERT_EQUAL_INT(0, flock(locked, LOCK_EX));
+     pid_t child = fork();
+     if (child == 0) {
+          close(locked); // the lock belongs to the open file, a copy would hold it too
+          history_init(&history, path);
+          history_add(&history, "echo 7");
+          history_destroy(&history);
+          _exit(0);
+     }
+     usleep(100000);
+     char temp[sizeof(path) + 4];
+     snprintf(temp, sizeof(temp), "%s.new", path);
+     FILE *trimmed = fopen(temp, "w");
+     TEST_ASSERT_NOT_NULL(trimmed);
+     fputs("echo kept\n", trimmed);
+     fclose(trimmed);
+     TEST_ASSERT_EQUAL_INT(0, rename(temp, path));
+     close(locked);
+     int wstatus;
+     TEST_ASSERT_EQUAL_INT(child, waitpid(child, &wstatus, 0));
+     history_init(&history, path);
+     history_load(&history);
+     TEST_ASSERT_EQUAL_size_t(2, history.count);
+     TEST_ASSERT_EQUAL_STRING("echo kept", history.lines[0].text);
+     TEST_ASSERT_EQUAL_STRING("echo 7", history.lines[1].text);
+     // Lines held back by HISTFLUSH are written by the shell, not by a forked child tearing down its copy.
+     history.flush_interval_ns = 60000000000u;
+     history.last_flush_ns = sh_now_ns();
+     history_add(&history, "exit | cat");
+     child = fork();
+     if (child == 0) {
+          history_destroy(&history);
+          _exit(0);
+     }
+     TEST_ASSERT_EQUAL_INT(child, waitpid(child, &wstatus, 0));
+     TEST_ASSERT_EQUAL_INT(0, wstatus);
+     history_destroy(&history);
+     history_init(&history, path);
+     history_load(&history);
+     TEST_ASSERT_EQUAL_size_t(3, history.count);
+     TEST_ASSERT_EQUAL_STRING("exit | cat", history.lines[2].text);
+     history_destroy(&history);
+     unlink(path);
+}
+
+void test_history_search(void)
+{
+     struct history history;
+     history_init(&history, NULL);
+     history_add(&history, "make check");
+     history_add(&history, "ls -l");
+     size_t *matches = NULL;
+     size_t cap = 0;
+     // The first search builds the index, later lines are indexed as they are added.
+     TEST_ASSERT_EQUAL_size_t(1, history_search(&history, "check", &matches, &cap));
+     history_add(&history, "make clean");
+     history_add(&history, "checkcheck");
+     TEST_ASSERT_EQUAL_size_t(2, history_search(&history, "make", &matches, &cap));
+     TEST_ASSERT_EQUAL_size_t(0, matches[0]);
+     TEST_ASSERT_EQUAL_size_t(2, matches[1]);
+     TEST_ASSERT_EQUAL_size_t(2, history_search(&history, "check", &matches, &cap));
+     TEST_ASSERT_EQUAL_size_t(3, matches[1]);
+     TEST_ASSERT_EQUAL_size_t(0, history_search(&history, "make install", &matches, &cap));
+     TEST_ASSERT_EQUAL_size_t(0, history_search(&history, "xyz", &matches, &cap));
+     // Text shorter than a trigram is compared against every line.
+     TEST_ASSERT_EQUAL_size_t(1, history_search(&history, "-", &matches, &cap));
+     free(matches);
+     history_destroy(&history);
+}
+
 int main(void) {
   UNITY_BEGIN();
   RUN_TEST(test_cmd_parse);
   RUN_TEST(test_cmd_parse2);
+  RUN_TEST(test_cmd_parse_mixed_separators);
+  RUN_TEST(test_cmd_parse_empty);
+  RUN_TEST(test_cmd_parse_into_reuses_buffers);
   RUN_TEST(test_trim_white_no_whitespace);
   RUN_TEST(test_trim_white_start_whitespace);
   RUN_TEST(test_trim_white_end_whitespace);
@@ -173,6 +1262,39 @@ int main(void) {
   RUN_TEST(test_get_prompt_custom);
   RUN_TEST(test_ch_dir_home);
   RUN_TEST(test_ch_dir_root);
+  RUN_TEST(test_sh_spawn_posix);
+  RUN_TEST(test_sh_spawn_fork);
+  RUN_TEST(test_sh_spawn_missing_command);
+  RUN_TEST(test_path_cache_lookup);
+  RUN_TEST(test_path_cache_path_change);
+  RUN_TEST(test_path_cache_stale_entry);
+  RUN_TEST(test_builtin_find);
+  RUN_TEST(test_cmd_parse_operator_without_spaces);
+  RUN_TEST(test_cmd_lex_quotes);
+  RUN_TEST(test_cmd_lex_operators);
+  RUN_TEST(test_cmd_lex_long_words);
+  RUN_TEST(test_sh_run_line_list);
+  RUN_TEST(test_redirections);
+  RUN_TEST(test_copy_builtins);
+  RUN_TEST(test_server);
+  RUN_TEST(test_event_loop);
+  RUN_TEST(test_prompt_render);
+  RUN_TEST(test_dir_stack);
+  RUN_TEST(test_env_table);
+  RUN_TEST(test_line_cache);
+  RUN_TEST(test_cmd_pipeline);
+  RUN_TEST(test_sh_run_line_pipeline_status);
+  RUN_TEST(test_sh_run_stream);
+  RUN_TEST(test_background_job);
+  RUN_TEST(test_parallel_builtin);
+  RUN_TEST(test_job_limits);
+  RUN_TEST(test_time_prefix);
+  RUN_TEST(test_stat_histogram);
+  RUN_TEST(test_history_file);
+  RUN_TEST(test_history_search);
+  RUN_TEST(test_cmd_parse_inplace);
+  RUN_TEST(test_sh_run_file_mapped);
+  RUN_TEST(test_sh_run_file_ahead);
 
   return UNITY_END();
 }